@@ -13,13 +13,16 @@
 
 #include "libisofs.h"
 #include "util.h"
+#include "data_source.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 
 /* O_BINARY is needed for Cygwin but undefined elsewhere */
 #ifndef O_BINARY
@@ -102,6 +105,25 @@ int ds_close(IsoDataSource *src)
     return ret == 0 ? ISO_SUCCESS : ISO_FILE_ERROR;
 }
 
+/* Read exactly todo bytes from the given file offset
+*/
+static
+int ds_pread(int fd, off_t offset, size_t todo, uint8_t *buffer)
+{
+    ssize_t done;
+
+    while (todo > 0) {
+        done = pread(fd, buffer, todo, offset);
+        if (done <= 0) {
+            return ISO_FILE_READ_ERROR;
+        }
+        buffer += done;
+        todo -= done;
+        offset += done;
+    }
+    return ISO_SUCCESS;
+}
+
 static int ds_read_block(IsoDataSource *src, uint32_t lba, uint8_t *buffer)
 {
     struct file_data_src *data;
@@ -115,16 +137,48 @@ static int ds_read_block(IsoDataSource *src, uint32_t lba, uint8_t *buffer)
         return ISO_FILE_NOT_OPENED;
     }
 
-    /* goes to requested block */
-    if (lseek(data->fd, (off_t)lba * (off_t)2048, SEEK_SET) == (off_t) -1) {
-        return ISO_FILE_SEEK_ERROR;
+    /* Positional reading leaves the file offset untouched. So several
+       threads may read at the same time.
+    */
+    return ds_pread(data->fd, (off_t)lba * (off_t)2048, 2048, buffer);
+}
+
+static
+int ds_read_blocks(IsoDataSource *src, uint32_t lba, uint32_t count,
+                   uint8_t *buffer)
+{
+    struct file_data_src *data;
+
+    if (src == NULL || src->data == NULL || buffer == NULL) {
+        return ISO_NULL_POINTER;
     }
 
-    /* TODO #00008 : guard against partial reads. */
-    if (read(data->fd, buffer, 2048) != 2048) {
-        return ISO_FILE_READ_ERROR;
+    data = (struct file_data_src*) src->data;
+    if (data->fd == -1) {
+        return ISO_FILE_NOT_OPENED;
     }
 
+    return ds_pread(data->fd, (off_t)lba * (off_t)2048,
+                    ((size_t) count) * 2048, buffer);
+}
+
+/* API */
+int iso_data_source_read_blocks(IsoDataSource *src, uint32_t lba,
+                                uint32_t count, uint8_t *buffer)
+{
+    int ret;
+    uint32_t i;
+
+    if (src == NULL || buffer == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    if (src->version >= 1 && src->read_blocks != NULL)
+        return src->read_blocks(src, lba, count, buffer);
+    for (i = 0; i < count; i++) {
+        ret = src->read_block(src, lba + i, buffer + ((size_t) i) * 2048);
+        if (ret < 0)
+            return ret;
+    }
     return ISO_SUCCESS;
 }
 
@@ -191,7 +245,7 @@ int iso_data_source_new_from_file(const char *path, IsoDataSource **src)
     }
 
     data->fd = -1;
-    ds->version = 0;
+    ds->version = 1;
     ds->refcount = 1;
     ds->data = data;
 
@@ -199,7 +253,664 @@ int iso_data_source_new_from_file(const char *path, IsoDataSource **src)
     ds->close = ds_close;
     ds->read_block = ds_read_block;
     ds->free_data = ds_free_data;
+    ds->read_blocks = ds_read_blocks;
+
+    *src = ds;
+    return ISO_SUCCESS;
+}
+
+
+/* ------------------------ Memory mapped IsoDataSource ------------------- */
+
+/* Read ranges of at least this many blocks get announced to the kernel
+   by madvise(MADV_WILLNEED)
+*/
+#define ISO_MMAP_DS_WILLNEED_BLOCKS 16
+
+/**
+ * Private data for memory mapped IsoDataSource
+ */
+struct mmap_data_src
+{
+    char *path;
+    int fd;
+    uint8_t *map;
+    size_t map_size;
+    uint32_t num_blocks; /* number of complete blocks in the mapping */
+};
+
+
+static
+int mds_open(IsoDataSource *src)
+{
+    int fd;
+    off_t size;
+    struct stat stbuf;
+    void *map;
+    struct mmap_data_src *data;
+
+    if (src == NULL || src->data == NULL) {
+        return ISO_NULL_POINTER;
+    }
+
+    data = (struct mmap_data_src*) src->data;
+    if (data->fd != -1) {
+        return ISO_FILE_ALREADY_OPENED;
+    }
+
+    fd = open(data->path, O_RDONLY | O_BINARY);
+    if (fd == -1) {
+        return ISO_FILE_ERROR;
+    }
+    if (fstat(fd, &stbuf) == -1)
+        goto failure;
+    if (S_ISREG(stbuf.st_mode)) {
+        size = stbuf.st_size;
+    } else {
+        /* Block devices tell their size only by seeking */
+        size = lseek(fd, 0, SEEK_END);
+        if (size == (off_t) -1)
+            goto failure;
+    }
+    if (size < 2048 || (uint64_t) size != (uint64_t) (size_t) size)
+        goto failure;
+    map = mmap(NULL, (size_t) size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        goto failure;
+
+    data->fd = fd;
+    data->map = map;
+    data->map_size = size;
+    if (size / 2048 > 0xffffffff)
+        data->num_blocks = 0xffffffff;
+    else
+        data->num_blocks = size / 2048;
+    return ISO_SUCCESS;
+
+failure:;
+    close(fd);
+    return ISO_FILE_ERROR;
+}
+
+static
+int mds_close(IsoDataSource *src)
+{
+    int ret;
+    struct mmap_data_src *data;
+
+    if (src == NULL || src->data == NULL) {
+        return ISO_NULL_POINTER;
+    }
+
+    data = (struct mmap_data_src*) src->data;
+    if (data->fd == -1) {
+        return ISO_FILE_NOT_OPENED;
+    }
+    munmap((void *) data->map, data->map_size);
+    data->map = NULL;
+    data->map_size = 0;
+    data->num_blocks = 0;
+    ret = close(data->fd);
+    data->fd = -1;
+    return ret == 0 ? ISO_SUCCESS : ISO_FILE_ERROR;
+}
+
+static
+int mds_read_blocks(IsoDataSource *src, uint32_t lba, uint32_t count,
+                    uint8_t *buffer)
+{
+    struct mmap_data_src *data;
+    uint8_t *start;
+
+    if (src == NULL || src->data == NULL || buffer == NULL) {
+        return ISO_NULL_POINTER;
+    }
+
+    data = (struct mmap_data_src*) src->data;
+    if (data->fd == -1) {
+        return ISO_FILE_NOT_OPENED;
+    }
+    if (lba >= data->num_blocks || count > data->num_blocks - lba) {
+        return ISO_FILE_READ_ERROR;
+    }
+    start = data->map + ((size_t) lba) * 2048;
+
+#ifdef MADV_WILLNEED
+    if (count >= ISO_MMAP_DS_WILLNEED_BLOCKS) {
+        size_t page_size, offset;
+
+        page_size = sysconf(_SC_PAGESIZE);
+        offset = (start - data->map) % page_size;
+        madvise((void *) (start - offset), ((size_t) count) * 2048 + offset,
+                MADV_WILLNEED);
+    }
+#endif
+
+    memcpy(buffer, start, ((size_t) count) * 2048);
+    return ISO_SUCCESS;
+}
+
+static
+int mds_read_block(IsoDataSource *src, uint32_t lba, uint8_t *buffer)
+{
+    return mds_read_blocks(src, lba, 1, buffer);
+}
+
+static
+void mds_free_data(IsoDataSource *src)
+{
+    struct mmap_data_src *data;
+
+    data = (struct mmap_data_src*) src->data;
+    if (data->fd != -1) {
+        munmap((void *) data->map, data->map_size);
+        close(data->fd);
+    }
+    free(data->path);
+    free(data);
+}
+
+/* API */
+int iso_data_source_new_from_file_mmap(const char *path, IsoDataSource **src)
+{
+    int ret;
+    struct mmap_data_src *data = NULL;
+    IsoDataSource *ds = NULL;
+
+    if (path == NULL || src == NULL) {
+        return ISO_NULL_POINTER;
+    }
+
+    /* ensure we have read access to the file */
+    ret = iso_eaccess(path);
+    if (ret < 0) {
+        return ret;
+    }
+
+    LIBISO_ALLOC_MEM(data, struct mmap_data_src, 1);
+    data->path = strdup(path);
+    if (data->path == NULL) {
+        ret = ISO_OUT_OF_MEM; goto ex;
+    }
+    data->fd = -1;
+    data->map = NULL;
+    data->map_size = 0;
+    data->num_blocks = 0;
+
+    LIBISO_ALLOC_MEM(ds, IsoDataSource, 1);
+    ds->version = 1;
+    ds->refcount = 1;
+    ds->data = data;
+    ds->open = mds_open;
+    ds->close = mds_close;
+    ds->read_block = mds_read_block;
+    ds->free_data = mds_free_data;
+    ds->read_blocks = mds_read_blocks;
 
     *src = ds;
     return ISO_SUCCESS;
+ex:;
+    if (data != NULL) {
+        if (data->path != NULL)
+            free(data->path);
+        free(data);
+    }
+    return ret;
+}
+
+int iso_data_source_get_mapped(IsoDataSource *src, uint32_t lba,
+                               uint32_t count, uint8_t **data)
+{
+    struct mmap_data_src *mdata;
+
+    if (src == NULL || src->read_block != mds_read_block)
+        return 0;
+    mdata = (struct mmap_data_src*) src->data;
+    if (mdata->fd == -1 ||
+        lba >= mdata->num_blocks || count > mdata->num_blocks - lba)
+        return 0;
+    *data = mdata->map + ((size_t) lba) * 2048;
+    return 1;
+}
+
+
+int iso_data_source_advise(IsoDataSource *src, uint32_t lba, uint32_t count,
+                           int flag)
+{
+    struct mmap_data_src *mdata;
+    size_t page_size, offset;
+    uint8_t *start;
+
+    if (src == NULL || src->read_block != mds_read_block)
+        return 0;
+    mdata = (struct mmap_data_src*) src->data;
+    if (mdata->fd == -1 || lba >= mdata->num_blocks || count == 0)
+        return 0;
+    if (count > mdata->num_blocks - lba)
+        count = mdata->num_blocks - lba;
+    start = mdata->map + ((size_t) lba) * 2048;
+    page_size = sysconf(_SC_PAGESIZE);
+    offset = (start - mdata->map) % page_size;
+
+#ifdef MADV_WILLNEED
+    if (flag & 1) {
+        madvise((void *) (start - offset), ((size_t) count) * 2048 + offset,
+                MADV_WILLNEED);
+        return 1;
+    }
+#endif
+#ifdef MADV_SEQUENTIAL
+    if (!(flag & 1)) {
+        madvise((void *) (start - offset), ((size_t) count) * 2048 + offset,
+                MADV_SEQUENTIAL);
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+
+/* ------------------------- Caching IsoDataSource ------------------------- */
+
+/* Number of blocks in a cache chunk. Chunks are aligned to this size. */
+#define ISO_DS_CACHE_CHUNK_BLOCKS 16
+
+/* Cache size if 0 is given to iso_data_source_new_cached() */
+#define ISO_DS_CACHE_DEFAULT_BYTES (4 * 1024 * 1024)
+
+struct cached_ds_chunk
+{
+    uint32_t chunk_no;  /* lba / ISO_DS_CACHE_CHUNK_BLOCKS */
+    int valid;          /* number of valid blocks from the chunk start,
+                           -1 = slot unused */
+    uint8_t *buffer;
+
+    int hash_next;      /* next slot in the same hash bucket, or -1 */
+    int lru_prev;       /* neighbors in the list of recent use, or -1 */
+    int lru_next;
+};
+
+/**
+ * Private data for caching IsoDataSource
+ */
+struct cached_data_src
+{
+    IsoDataSource *src;
+
+    struct cached_ds_chunk *chunks;
+    int num_chunks;
+    int *hash;          /* num_chunks buckets of slot indice, -1 = empty */
+    int lru_first;      /* most recently used slot */
+    int lru_last;       /* least recently used slot */
+
+    /* Sequential read detection */
+    uint32_t next_lba;
+    int readahead_chunks;
+    uint8_t *readahead_buf;
+
+    /* Serializes the cache operations of concurrent readers */
+    pthread_mutex_t mutex;
+    int mutex_initialized;
+};
+
+
+/* Read count blocks from the data source. If this fails, read single blocks
+   to find the readable ones at the start of the range.
+   @return number of valid blocks in buffer, < 0 means error
+*/
+static
+int ds_read_multi(IsoDataSource *src, uint32_t lba, uint32_t count,
+                  uint8_t *buffer)
+{
+    int ret;
+    uint32_t i;
+
+    ret = iso_data_source_read_blocks(src, lba, count, buffer);
+    if (ret >= 0)
+        return (int) count;
+    for (i = 0; i < count; i++) {
+        ret = src->read_block(src, lba + i, buffer + ((size_t) i) * 2048);
+        if (ret < 0)
+            return (i > 0 ? (int) i : ret);
+    }
+    return (int) count;
+}
+
+
+static
+void cds_lru_unlink(struct cached_data_src *data, int idx)
+{
+    struct cached_ds_chunk *c;
+
+    c = data->chunks + idx;
+    if (c->lru_prev >= 0)
+        data->chunks[c->lru_prev].lru_next = c->lru_next;
+    else
+        data->lru_first = c->lru_next;
+    if (c->lru_next >= 0)
+        data->chunks[c->lru_next].lru_prev = c->lru_prev;
+    else
+        data->lru_last = c->lru_prev;
+    c->lru_prev = c->lru_next = -1;
+}
+
+
+static
+void cds_lru_push_front(struct cached_data_src *data, int idx)
+{
+    struct cached_ds_chunk *c;
+
+    c = data->chunks + idx;
+    c->lru_prev = -1;
+    c->lru_next = data->lru_first;
+    if (data->lru_first >= 0)
+        data->chunks[data->lru_first].lru_prev = idx;
+    data->lru_first = idx;
+    if (data->lru_last < 0)
+        data->lru_last = idx;
+}
+
+
+static
+int cds_find(struct cached_data_src *data, uint32_t chunk_no)
+{
+    int idx;
+
+    idx = data->hash[chunk_no % data->num_chunks];
+    while (idx >= 0) {
+        if (data->chunks[idx].chunk_no == chunk_no)
+            return idx;
+        idx = data->chunks[idx].hash_next;
+    }
+    return -1;
+}
+
+
+static
+void cds_hash_remove(struct cached_data_src *data, int idx)
+{
+    int *pt;
+
+    pt = &(data->hash[data->chunks[idx].chunk_no % data->num_chunks]);
+    while (*pt >= 0) {
+        if (*pt == idx) {
+            *pt = data->chunks[idx].hash_next;
+            break;
+        }
+        pt = &(data->chunks[*pt].hash_next);
+    }
+    data->chunks[idx].hash_next = -1;
+}
+
+
+/* Put the content of a chunk into the least recently used slot
+   and make it the most recently used one.
+*/
+static
+void cds_install(struct cached_data_src *data, uint32_t chunk_no,
+                 uint8_t *buffer, int valid)
+{
+    int idx, bucket;
+    struct cached_ds_chunk *c;
+
+    idx = data->lru_last;
+    c = data->chunks + idx;
+    if (c->valid >= 0)
+        cds_hash_remove(data, idx);
+    cds_lru_unlink(data, idx);
+
+    memcpy(c->buffer, buffer, valid * 2048);
+    c->chunk_no = chunk_no;
+    c->valid = valid;
+    bucket = chunk_no % data->num_chunks;
+    c->hash_next = data->hash[bucket];
+    data->hash[bucket] = idx;
+    cds_lru_push_front(data, idx);
+}
+
+
+static
+void cds_invalidate(struct cached_data_src *data)
+{
+    int i;
+
+    data->lru_first = data->lru_last = -1;
+    for (i = 0; i < data->num_chunks; i++) {
+        data->hash[i] = -1;
+        data->chunks[i].valid = -1;
+        data->chunks[i].hash_next = -1;
+        data->chunks[i].lru_prev = data->chunks[i].lru_next = -1;
+        cds_lru_push_front(data, i);
+    }
+    data->next_lba = 0xffffffff;
+}
+
+
+static
+int cds_open(IsoDataSource *src)
+{
+    struct cached_data_src *data;
+
+    if (src == NULL || src->data == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    data = (struct cached_data_src*) src->data;
+    cds_invalidate(data);
+    return data->src->open(data->src);
+}
+
+
+static
+int cds_close(IsoDataSource *src)
+{
+    struct cached_data_src *data;
+
+    if (src == NULL || src->data == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    data = (struct cached_data_src*) src->data;
+    cds_invalidate(data);
+    return data->src->close(data->src);
+}
+
+
+static
+int cds_read_block_unlocked(struct cached_data_src *data, uint32_t lba,
+                            uint8_t *buffer)
+{
+    int idx, ret, i, valid, sequential;
+    uint32_t chunk_no, offset, count;
+    struct cached_ds_chunk *c;
+
+    sequential = (lba == data->next_lba);
+    data->next_lba = lba + 1;
+    chunk_no = lba / ISO_DS_CACHE_CHUNK_BLOCKS;
+    offset = lba % ISO_DS_CACHE_CHUNK_BLOCKS;
+
+    idx = cds_find(data, chunk_no);
+    if (idx >= 0) {
+        c = data->chunks + idx;
+        if ((int) offset >= c->valid) {
+            /* Beyond the readable end of the medium at load time */
+            return data->src->read_block(data->src, lba, buffer);
+        }
+        if (idx != data->lru_first) {
+            cds_lru_unlink(data, idx);
+            cds_lru_push_front(data, idx);
+        }
+        memcpy(buffer, c->buffer + offset * 2048, 2048);
+        return ISO_SUCCESS;
+    }
+
+    /* Cache miss. Load the chunk, and with sequential reading also
+       the following chunks up to the readahead size.
+    */
+    count = 1;
+    if (sequential)
+        count += data->readahead_chunks;
+    if (((uint64_t) chunk_no + count) * ISO_DS_CACHE_CHUNK_BLOCKS >
+        ((uint64_t) 0xffffffff) + 1)
+        count = 1;
+    ret = ds_read_multi(data->src, chunk_no * ISO_DS_CACHE_CHUNK_BLOCKS,
+                        count * ISO_DS_CACHE_CHUNK_BLOCKS,
+                        data->readahead_buf);
+    if (ret <= (int) offset) {
+        /* Let the wrapped source report the problem with the block */
+        return data->src->read_block(data->src, lba, buffer);
+    }
+    memcpy(buffer, data->readahead_buf + offset * 2048, 2048);
+
+    /* Install readahead chunks first, so that the requested one becomes
+       the most recently used.
+    */
+    for (i = count - 1; i >= 0; i--) {
+        valid = ret - i * ISO_DS_CACHE_CHUNK_BLOCKS;
+        if (valid <= 0)
+    continue;
+        if (valid > ISO_DS_CACHE_CHUNK_BLOCKS)
+            valid = ISO_DS_CACHE_CHUNK_BLOCKS;
+        if (i > 0 && cds_find(data, chunk_no + i) >= 0)
+    continue;
+        cds_install(data, chunk_no + i,
+                    data->readahead_buf + i * ISO_DS_CACHE_CHUNK_BLOCKS * 2048,
+                    valid);
+    }
+    return ISO_SUCCESS;
+}
+
+
+static
+int cds_read_blocks(IsoDataSource *src, uint32_t lba, uint32_t count,
+                    uint8_t *buffer)
+{
+    int ret = ISO_SUCCESS;
+    uint32_t i;
+    struct cached_data_src *data;
+
+    if (src == NULL || src->data == NULL || buffer == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    data = (struct cached_data_src*) src->data;
+
+    pthread_mutex_lock(&data->mutex);
+    for (i = 0; i < count; i++) {
+        ret = cds_read_block_unlocked(data, lba + i,
+                                      buffer + ((size_t) i) * 2048);
+        if (ret < 0)
+    break;
+    }
+    pthread_mutex_unlock(&data->mutex);
+    return ret;
+}
+
+static
+int cds_read_block(IsoDataSource *src, uint32_t lba, uint8_t *buffer)
+{
+    return cds_read_blocks(src, lba, 1, buffer);
+}
+
+
+static
+void cds_destroy(struct cached_data_src *data)
+{
+    int i;
+
+    if (data->chunks != NULL) {
+        for (i = 0; i < data->num_chunks; i++)
+            if (data->chunks[i].buffer != NULL)
+                free(data->chunks[i].buffer);
+        free(data->chunks);
+    }
+    if (data->hash != NULL)
+        free(data->hash);
+    if (data->readahead_buf != NULL)
+        free(data->readahead_buf);
+    if (data->src != NULL)
+        iso_data_source_unref(data->src);
+    if (data->mutex_initialized)
+        pthread_mutex_destroy(&data->mutex);
+    free(data);
+}
+
+
+static
+void cds_free_data(IsoDataSource *src)
+{
+    cds_destroy((struct cached_data_src*) src->data);
+}
+
+
+/* API */
+int iso_data_source_new_cached(IsoDataSource *src, size_t cache_bytes,
+                               uint32_t readahead_blocks,
+                               IsoDataSource **cached)
+{
+    int ret, i;
+    size_t num_chunks;
+    struct cached_data_src *data = NULL;
+    IsoDataSource *ds = NULL;
+
+    if (src == NULL || cached == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    if (cache_bytes == 0)
+        cache_bytes = ISO_DS_CACHE_DEFAULT_BYTES;
+    num_chunks = cache_bytes / (ISO_DS_CACHE_CHUNK_BLOCKS * 2048);
+    if (num_chunks < 1)
+        num_chunks = 1;
+    if (num_chunks > 0x7fffffff / ISO_DS_CACHE_CHUNK_BLOCKS)
+        num_chunks = 0x7fffffff / ISO_DS_CACHE_CHUNK_BLOCKS;
+
+    LIBISO_ALLOC_MEM(data, struct cached_data_src, 1);
+    data->src = NULL;
+    data->num_chunks = num_chunks;
+    data->chunks = NULL;
+    data->hash = NULL;
+    data->readahead_buf = NULL;
+    data->mutex_initialized = 0;
+
+    /* Readahead may not occupy the whole cache */
+    data->readahead_chunks = (readahead_blocks + ISO_DS_CACHE_CHUNK_BLOCKS - 1)
+                             / ISO_DS_CACHE_CHUNK_BLOCKS;
+    if (data->readahead_chunks > data->num_chunks / 2)
+        data->readahead_chunks = data->num_chunks / 2;
+
+    data->chunks = calloc(num_chunks, sizeof(struct cached_ds_chunk));
+    data->hash = calloc(num_chunks, sizeof(int));
+    data->readahead_buf = calloc(data->readahead_chunks + 1,
+                                 ISO_DS_CACHE_CHUNK_BLOCKS * 2048);
+    if (data->chunks == NULL || data->hash == NULL ||
+        data->readahead_buf == NULL) {
+        ret = ISO_OUT_OF_MEM; goto ex;
+    }
+    for (i = 0; i < data->num_chunks; i++) {
+        data->chunks[i].buffer = malloc(ISO_DS_CACHE_CHUNK_BLOCKS * 2048);
+        if (data->chunks[i].buffer == NULL) {
+            ret = ISO_OUT_OF_MEM; goto ex;
+        }
+    }
+    cds_invalidate(data);
+    if (pthread_mutex_init(&data->mutex, NULL) != 0) {
+        ret = ISO_OUT_OF_MEM; goto ex;
+    }
+    data->mutex_initialized = 1;
+
+    LIBISO_ALLOC_MEM(ds, IsoDataSource, 1);
+    ds->version = 1;
+    ds->refcount = 1;
+    ds->data = data;
+    ds->open = cds_open;
+    ds->close = cds_close;
+    ds->read_block = cds_read_block;
+    ds->free_data = cds_free_data;
+    ds->read_blocks = cds_read_blocks;
+
+    iso_data_source_ref(src);
+    data->src = src;
+    *cached = ds;
+    return ISO_SUCCESS;
+ex:;
+    if (data != NULL)
+        cds_destroy(data);
+    return ret;
 }
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2007 Vreixo Formoso
+ * Copyright (c) 2026 Thomas Schmitt
+ *
+ * This file is part of the libisofs project; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * or later as published by the Free Software Foundation.
+ * See COPYING file for details.
+ */
+
+#ifndef LIBISO_DATA_SOURCE_H_
+#define LIBISO_DATA_SOURCE_H_
+
+
+/* The IsoDataSource API is in libisofs.h : iso_data_source_new_from_file()
+   et.al.
+*/
+
+
+/** Obtain a pointer to the content of consecutive blocks without copying.
+    This is possible with data sources from
+    iso_data_source_new_from_file_mmap().
+    The pointer is valid until the data source gets closed. The content
+    must not be altered.
+    @param src    The data source. It has to be opened.
+    @param lba    First block.
+    @param count  Number of blocks.
+    @param data   Will return the pointer to the content of block lba.
+    @return  1 = *data is valid, 0 = not possible with this data source
+             or the range exceeds the mapped size
+*/
+int iso_data_source_get_mapped(IsoDataSource *src, uint32_t lba,
+                               uint32_t count, uint8_t **data);
+
+/** Tell the kernel how a range of blocks is going to be read.
+    This has an effect only with data sources from
+    iso_data_source_new_from_file_mmap().
+    @param src    The data source. It has to be opened.
+    @param lba    First block.
+    @param count  Number of blocks. The range gets truncated at the end
+                  of the mapping.
+    @param flag   bit0= the range will be needed soon (MADV_WILLNEED),
+                        rather than be read sequentially (MADV_SEQUENTIAL)
+    @return  1 = advice given, 0 = not possible with this data source
+*/
+int iso_data_source_advise(IsoDataSource *src, uint32_t lba, uint32_t count,
+                           int flag);
+
+
+
+#endif /* ! LIBISO_DATA_SOURCE_H_ */
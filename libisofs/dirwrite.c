@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2007 Vreixo Formoso
+ * Copyright (c) 2009 - 2026 Thomas Schmitt
+ *
+ * This file is part of the libisofs project; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * or later as published by the Free Software Foundation.
+ * See COPYING file for details.
+ */
+
+/* Writing of the directory records which is shared by the ECMA-119, Joliet,
+   and ISO 9660:1999 trees.
+   The block addresses of all directories and Continuation Areas are known
+   when writing begins. So the bytes of each directory can be produced
+   independently of the others. With more than one tree thread, the worker
+   threads render the directories into memory in the order of the tree and
+   the calling thread submits them to iso_write() in the same order. The
+   calling thread renders too, if the next directory to write was not picked
+   up by a worker yet. Workers stay at most ISO_DIR_WRITE_WINDOW directories
+   ahead of the writing.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "../config.h"
+#endif
+
+#include "libisofs.h"
+#include "dirwrite.h"
+#include "messages.h"
+#include "writer.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+
+#define ISO_DIR_WRITE_QUEUED  0
+#define ISO_DIR_WRITE_RUNNING 1
+#define ISO_DIR_WRITE_DONE    2
+
+struct iso_dir_write_item {
+    void *dir;
+    void *parent;
+    int state;
+    int ret;
+    struct iso_dir_out out;
+};
+
+struct iso_dir_write_job {
+    Ecma119Image *t;
+    struct iso_dir_write_ops *ops;
+
+    struct iso_dir_write_item *items;
+    int num_items;
+    int items_size;
+
+    pthread_mutex_t mutex;
+
+    /* Signals that an item reached state ISO_DIR_WRITE_DONE */
+    pthread_cond_t done;
+
+    /* Signals that next_write increased or that abort was set */
+    pthread_cond_t room;
+
+    /* Index of the next item to be rendered */
+    int next_item;
+
+    /* Index of the next item to be written */
+    int next_write;
+
+    int abort;
+};
+
+
+int iso_dir_out_write(Ecma119Image *t, struct iso_dir_out *out,
+                      void *data, size_t count)
+{
+    size_t new_alloc;
+    uint8_t *new_buf;
+
+    if (out == NULL)
+        return iso_write(t, data, count);
+
+    if (out->size + count > out->alloc) {
+        new_alloc = out->alloc * 2;
+        if (new_alloc < out->size + count)
+            new_alloc = out->size + count;
+        if (new_alloc < BLOCK_SIZE)
+            new_alloc = BLOCK_SIZE;
+        new_buf = realloc(out->buf, new_alloc);
+        if (new_buf == NULL)
+            return ISO_OUT_OF_MEM;
+        out->buf = new_buf;
+        out->alloc = new_alloc;
+    }
+    memcpy(out->buf + out->size, data, count);
+    out->size += count;
+    return ISO_SUCCESS;
+}
+
+static
+int iso_dir_write_recurse(Ecma119Image *t, struct iso_dir_write_ops *ops,
+                          void *dir, void *parent)
+{
+    int ret, i, nchildren;
+    void **children;
+
+    /* write all directory entries for this dir */
+    ret = ops->write_one_dir(t, dir, parent, NULL);
+    if (ret < 0)
+        return ret;
+
+    /* recurse */
+    children = ops->get_children(dir, &nchildren);
+    for (i = 0; i < nchildren; i++) {
+        if (ops->is_dir(children[i])) {
+            ret = iso_dir_write_recurse(t, ops, children[i], dir);
+            if (ret < 0)
+                return ret;
+        }
+    }
+    return ISO_SUCCESS;
+}
+
+static
+int iso_dir_write_collect(struct iso_dir_write_job *job, void *dir,
+                          void *parent)
+{
+    int ret, i, nchildren;
+    void **children;
+    struct iso_dir_write_item *new_items, *item;
+
+    if (job->num_items >= job->items_size) {
+        job->items_size = job->items_size * 2 + 64;
+        new_items = realloc(job->items,
+                         job->items_size * sizeof(struct iso_dir_write_item));
+        if (new_items == NULL)
+            return ISO_OUT_OF_MEM;
+        job->items = new_items;
+    }
+    item = &(job->items[job->num_items++]);
+    memset(item, 0, sizeof(struct iso_dir_write_item));
+    item->dir = dir;
+    item->parent = parent;
+    item->state = ISO_DIR_WRITE_QUEUED;
+
+    children = job->ops->get_children(dir, &nchildren);
+    for (i = 0; i < nchildren; i++) {
+        if (job->ops->is_dir(children[i])) {
+            ret = iso_dir_write_collect(job, children[i], dir);
+            if (ret < 0)
+                return ret;
+        }
+    }
+    return ISO_SUCCESS;
+}
+
+/* To be called with job->mutex locked. Returns with job->mutex locked.
+*/
+static
+void iso_dir_write_render(struct iso_dir_write_job *job, int idx)
+{
+    int ret;
+    struct iso_dir_write_item *item;
+
+    item = &(job->items[idx]);
+    item->state = ISO_DIR_WRITE_RUNNING;
+    pthread_mutex_unlock(&job->mutex);
+
+    ret = job->ops->write_one_dir(job->t, item->dir, item->parent,
+                                  &(item->out));
+
+    pthread_mutex_lock(&job->mutex);
+    item->ret = ret;
+    item->state = ISO_DIR_WRITE_DONE;
+    pthread_cond_broadcast(&job->done);
+}
+
+static
+void *iso_dir_write_worker(void *arg)
+{
+    struct iso_dir_write_job *job = arg;
+
+    pthread_mutex_lock(&job->mutex);
+    while (1) {
+        while (!job->abort && job->next_item < job->num_items &&
+               job->next_item >= job->next_write + ISO_DIR_WRITE_WINDOW)
+            pthread_cond_wait(&job->room, &job->mutex);
+        if (job->abort || job->next_item >= job->num_items)
+    break;
+        iso_dir_write_render(job, job->next_item++);
+    }
+    pthread_mutex_unlock(&job->mutex);
+    return NULL;
+}
+
+int iso_write_dir_tree(Ecma119Image *t, struct iso_dir_write_ops *ops,
+                       void *root)
+{
+    int ret, i, num_threads = 0, threads;
+    pthread_t *thread_ids = NULL;
+    struct iso_dir_write_job job;
+    struct iso_dir_write_item *item;
+
+    if (t->opts->tree_threads < 2)
+        return iso_dir_write_recurse(t, ops, root, root);
+
+    memset(&job, 0, sizeof(job));
+    job.t = t;
+    job.ops = ops;
+    pthread_mutex_init(&job.mutex, NULL);
+    pthread_cond_init(&job.done, NULL);
+    pthread_cond_init(&job.room, NULL);
+
+    ret = iso_dir_write_collect(&job, root, root);
+    if (ret < 0)
+        goto ex;
+
+    threads = t->opts->tree_threads;
+    if (threads > job.num_items)
+        threads = job.num_items;
+    t->dirs_concurrent = 1;
+    if (threads > 1) {
+        LIBISO_ALLOC_MEM(thread_ids, pthread_t, threads - 1);
+        for (i = 0; i < threads - 1; i++) {
+            /* If thread creation fails, then fewer threads do the work */
+            if (pthread_create(&(thread_ids[i]), NULL, iso_dir_write_worker,
+                               &job) != 0)
+        break;
+            num_threads++;
+        }
+    }
+
+    for (i = 0; i < job.num_items; i++) {
+        item = &(job.items[i]);
+        pthread_mutex_lock(&job.mutex);
+        if (item->state == ISO_DIR_WRITE_QUEUED) {
+            /* No worker took it yet. So i is job.next_item. */
+            job.next_item++;
+            iso_dir_write_render(&job, i);
+        }
+        while (item->state != ISO_DIR_WRITE_DONE)
+            pthread_cond_wait(&job.done, &job.mutex);
+        pthread_mutex_unlock(&job.mutex);
+
+        ret = item->ret;
+        if (ret >= 0)
+            ret = iso_write(t, item->out.buf, item->out.size);
+        if (item->out.buf != NULL)
+            free(item->out.buf);
+        item->out.buf = NULL;
+        if (ret < 0)
+            goto ex;
+
+        pthread_mutex_lock(&job.mutex);
+        job.next_write++;
+        pthread_cond_broadcast(&job.room);
+        pthread_mutex_unlock(&job.mutex);
+    }
+    ret = ISO_SUCCESS;
+
+ex:;
+    pthread_mutex_lock(&job.mutex);
+    job.abort = 1;
+    pthread_cond_broadcast(&job.room);
+    pthread_mutex_unlock(&job.mutex);
+    for (i = 0; i < num_threads; i++)
+        pthread_join(thread_ids[i], NULL);
+    t->dirs_concurrent = 0;
+
+    for (i = 0; i < job.num_items; i++)
+        if (job.items[i].out.buf != NULL)
+            free(job.items[i].out.buf);
+    if (job.items != NULL)
+        free(job.items);
+    LIBISO_FREE_MEM(thread_ids);
+    pthread_cond_destroy(&job.room);
+    pthread_cond_destroy(&job.done);
+    pthread_mutex_destroy(&job.mutex);
+    return ret;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2007 Vreixo Formoso
+ * Copyright (c) 2009 - 2026 Thomas Schmitt
+ *
+ * This file is part of the libisofs project; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * or later as published by the Free Software Foundation.
+ * See COPYING file for details.
+ */
+
+/* Writing of the directory records which is shared by the ECMA-119, Joliet,
+   and ISO 9660:1999 trees. The records of each directory may be rendered by
+   several threads into memory and then get written in the order of the tree.
+*/
+
+#ifndef LIBISO_DIRWRITE_H_
+#define LIBISO_DIRWRITE_H_
+
+#include "ecma119.h"
+
+
+/* Maximum number of directories which may be rendered ahead of the one
+   which gets written next
+*/
+#define ISO_DIR_WRITE_WINDOW 256
+
+
+/**
+ * Destination of the bytes of a directory and its Continuation Area.
+ * NULL means to submit them to iso_write() directly.
+ */
+struct iso_dir_out {
+    uint8_t *buf;
+    size_t size;
+    size_t alloc;
+};
+
+/**
+ * Submit bytes to iso_write() if out is NULL, else append them to out.
+ *
+ * @return
+ *      ISO_SUCCESS or < 0 error
+ */
+int iso_dir_out_write(Ecma119Image *t, struct iso_dir_out *out,
+                      void *data, size_t count);
+
+
+/**
+ * Description of a tree type for iso_write_dir_tree().
+ */
+struct iso_dir_write_ops {
+
+    int (*is_dir)(void *node);
+
+    /* Returns the children array of a directory node */
+    void **(*get_children)(void *dir, int *nchildren);
+
+    /* Writes the records of dir and its Continuation Area, if any, by
+       iso_dir_out_write(). parent is the directory which is to be announced
+       by the ".." entry.
+       This may be called by several threads at the same time, each with
+       another directory.
+       @return ISO_SUCCESS or < 0 error
+    */
+    int (*write_one_dir)(Ecma119Image *t, void *dir, void *parent,
+                         struct iso_dir_out *out);
+};
+
+
+/**
+ * Write the directory records of the tree of root, depth first, each
+ * directory before its subdirectories.
+ * If t->opts->tree_threads is larger than 1, then the directories get
+ * rendered into memory by that many threads and the calling thread writes
+ * them in the same order as with a single thread.
+ *
+ * @param t
+ *      The image being written.
+ * @param ops
+ *      Description of the tree type.
+ * @param root
+ *      The directory where to start. It is its own parent.
+ * @return
+ *      ISO_SUCCESS or < 0 error
+ */
+int iso_write_dir_tree(Ecma119Image *t, struct iso_dir_write_ops *ops,
+                       void *root);
+
+#endif /* LIBISO_DIRWRITE_H_ */
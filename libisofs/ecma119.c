@@ -27,12 +27,14 @@
 #include "ecma119_tree.h"
 #include "filesrc.h"
 #include "image.h"
+#include "tree.h"
 #include "writer.h"
 #include "messages.h"
 #include "rockridge.h"
 #include "util.h"
 #include "system_area.h"
 #include "md5.h"
+#include "dirwrite.h"
 
 #include <ctype.h>
 #include <stdlib.h>
@@ -98,10 +100,19 @@ void ecma119_image_free(Ecma119Image *t)
         writer->free_data(writer);
         free(writer);
     }
+    for (i = 0; i < ISO_LOW_TREE_COUNT; i++) {
+        /* Trees which were built but not taken by their writer_create() */
+        IsoImageWriter *writer = t->tree_writers[i];
+        if (writer == NULL)
+            continue;
+        writer->free_data(writer);
+        free(writer);
+    }
     if (t->input_charset != NULL)
         free(t->input_charset);
     if (t->output_charset != NULL)
         free(t->output_charset);
+    pthread_mutex_destroy(&(t->charset_mutex));
     if (t->bootsrc != NULL)
         free(t->bootsrc);
     if (t->boot_appended_idx != NULL)
@@ -627,7 +638,8 @@ int ecma119_writer_write_vol_desc(IsoImageWriter *writer)
 }
 
 static
-int write_one_dir(Ecma119Image *t, Ecma119Node *dir, Ecma119Node *parent)
+int write_one_dir(Ecma119Image *t, Ecma119Node *dir, Ecma119Node *parent,
+                  struct iso_dir_out *out)
 {
     int ret;
     uint8_t *buffer = NULL;
@@ -700,7 +712,7 @@ int write_one_dir(Ecma119Image *t, Ecma119Node *dir, Ecma119Node *parent)
 
             if ( (buf + len - buffer) > BLOCK_SIZE) {
                 /* dir doesn't fit in current block */
-                ret = iso_write(t, buffer, BLOCK_SIZE);
+                ret = iso_dir_out_write(t, out, buffer, BLOCK_SIZE);
                 if (ret < 0) {
                     goto ex;
                 }
@@ -714,14 +726,14 @@ int write_one_dir(Ecma119Image *t, Ecma119Node *dir, Ecma119Node *parent)
     }
 
     /* write the last block */
-    ret = iso_write(t, buffer, BLOCK_SIZE);
+    ret = iso_dir_out_write(t, out, buffer, BLOCK_SIZE);
     if (ret < 0) {
         goto ex;
     }
 
     /* write the Continuation Area if needed */
     if (info.ce_len > 0) {
-        ret = rrip_write_ce_fields(t, &info);
+        ret = rrip_write_ce_fields(t, &info, out);
     }
 
 ex:;
@@ -730,30 +742,31 @@ ex:;
 }
 
 static
-int write_dirs(Ecma119Image *t, Ecma119Node *root, Ecma119Node *parent)
+int write_dir_is_dir(void *node)
 {
-    int ret;
-    size_t i;
+    return ((Ecma119Node *) node)->type == ECMA119_DIR;
+}
 
-    /* write all directory entries for this dir */
-    ret = write_one_dir(t, root, parent);
-    if (ret < 0) {
-        return ret;
-    }
+static
+void **write_dir_get_children(void *dir, int *nchildren)
+{
+    *nchildren = ((Ecma119Node *) dir)->info.dir->nchildren;
+    return (void **) ((Ecma119Node *) dir)->info.dir->children;
+}
 
-    /* recurse */
-    for (i = 0; i < root->info.dir->nchildren; i++) {
-        Ecma119Node *child = root->info.dir->children[i];
-        if (child->type == ECMA119_DIR) {
-            ret = write_dirs(t, child, root);
-            if (ret < 0) {
-                return ret;
-            }
-        }
-    }
-    return ISO_SUCCESS;
+static
+int write_dir_one(Ecma119Image *t, void *dir, void *parent,
+                  struct iso_dir_out *out)
+{
+    return write_one_dir(t, (Ecma119Node *) dir, (Ecma119Node *) parent, out);
 }
 
+static struct iso_dir_write_ops ecma119_dir_write_ops = {
+    write_dir_is_dir,
+    write_dir_get_children,
+    write_dir_one
+};
+
 static
 int write_path_table(Ecma119Image *t, Ecma119Node **pathlist, int l_type)
 {
@@ -897,7 +910,7 @@ int ecma119_writer_write_dirs(IsoImageWriter *writer)
     } else {
         root = t->root;
     }
-    ret = write_dirs(t, root, root);
+    ret = iso_write_dir_tree(t, &ecma119_dir_write_ops, root);
     if (ret < 0) {
         return ret;
     }
@@ -2175,6 +2188,29 @@ void issue_ucs2_warning_summary(size_t failures)
 }
 
 
+int ecma119_count_charset_failure(Ecma119Image *t)
+{
+    size_t failures;
+
+    pthread_mutex_lock(&(t->charset_mutex));
+    failures = ++(t->charset_failures);
+    pthread_mutex_unlock(&(t->charset_mutex));
+    return (failures <= ISO_CHARSET_WARN_MAX);
+}
+
+
+void issue_charset_warning_summary(size_t failures)
+{
+    if (failures > ISO_CHARSET_WARN_MAX) {
+        iso_msg_submit(-1, ISO_FILENAME_WRONG_CHARSET, 0,
+                   "More filenames found which failed charset conversion");
+        iso_msg_submit(-1, ISO_FILENAME_WRONG_CHARSET, 0,
+                       "Sum of filenames which failed charset conversion: %.f",
+                       (double) failures);
+    }
+}
+
+
 static
 void *write_function(void *arg)
 {
@@ -2247,6 +2283,7 @@ void *write_function(void *arg)
         goto write_error;
 
     issue_ucs2_warning_summary(target->joliet_ucs2_failures);
+    issue_charset_warning_summary(target->charset_failures);
 
     target->image->generator_is_running = 0;
 
@@ -2476,6 +2513,176 @@ int gpt_disk_guid_setup(Ecma119Image *target)
     return ISO_SUCCESS;
 }
 
+void ecma119_tree_lock(Ecma119Image *t, int flag)
+{
+    if (!t->trees_concurrent)
+        return;
+    if (flag & 1)
+        pthread_mutex_unlock(&(t->tree_mutex));
+    else
+        pthread_mutex_lock(&(t->tree_mutex));
+}
+
+/* A low level tree which gets built by a thread */
+struct ecma119_tree_job
+{
+    int tree; /* ISO_LOW_TREE_* */
+    int ret;
+};
+
+static
+void *ecma119_tree_worker(void *arg)
+{
+    Ecma119Image *t = arg;
+    struct ecma119_tree_job *job;
+    IsoImageWriter **writer;
+
+    while (1) {
+        ecma119_tree_lock(t, 0);
+        if (t->next_tree_job >= t->num_tree_jobs) {
+            ecma119_tree_lock(t, 1);
+    break;
+        }
+        job = t->tree_jobs + t->next_tree_job++;
+        ecma119_tree_lock(t, 1);
+
+        writer = &(t->tree_writers[job->tree]);
+        if (job->tree == ISO_LOW_TREE_JOLIET)
+            job->ret = joliet_writer_prepare(t, writer);
+        else if (job->tree == ISO_LOW_TREE_ISO1999)
+            job->ret = iso1999_writer_prepare(t, writer);
+        else
+            job->ret = hfsplus_writer_prepare(t, writer);
+    }
+    return NULL;
+}
+
+/* Some filter streams determine their size lazily by reading their content.
+   Let this happen before the tree builders may ask concurrently.
+*/
+static
+void ecma119_get_stream_sizes(IsoDir *dir)
+{
+    IsoNode *pos;
+    int all_hidden = LIBISO_HIDE_ON_RR | LIBISO_HIDE_ON_JOLIET |
+                     LIBISO_HIDE_ON_1999 | LIBISO_HIDE_ON_HFSPLUS;
+
+    for (pos = iso_tree_cow_child(dir, NULL); pos != NULL;
+         pos = iso_tree_cow_child(dir, pos)) {
+        if ((pos->hidden & all_hidden) == all_hidden &&
+            !(pos->hidden & LIBISO_HIDE_BUT_WRITE))
+    continue;
+        if (pos->type == LIBISO_FILE)
+            iso_stream_get_size(((IsoFile *) pos)->stream);
+        else if (pos->type == LIBISO_DIR)
+            ecma119_get_stream_sizes((IsoDir *) pos);
+    }
+}
+
+/* Start threads which build the Joliet, ISO 9660:1999, and HFS+ trees while
+   the calling thread builds the ECMA-119 tree.
+   This is not done if the trees have to be built twice for a partition
+   offset, or if MD5 indices have to be assigned in sequential order.
+   @return 1 = threads are started , 0 = build trees sequentially , <0 error
+*/
+static
+int ecma119_start_tree_jobs(Ecma119Image *t)
+{
+    int ret, i, trees[ISO_LOW_TREE_COUNT], num_trees = 0, threads;
+    IsoWriteOpts *opts = t->opts;
+    IsoFileSrc *src;
+
+    if (opts->tree_threads < 2 || opts->partition_offset > 0 ||
+        (opts->md5_file_checksums & 1))
+        return 0;
+    if (opts->joliet)
+        trees[num_trees++] = ISO_LOW_TREE_JOLIET;
+    if (opts->iso1999)
+        trees[num_trees++] = ISO_LOW_TREE_ISO1999;
+    if (opts->hfsplus || opts->fat)
+        trees[num_trees++] = ISO_LOW_TREE_HFSPLUS;
+    if (num_trees == 0)
+        return 0;
+
+    ecma119_get_stream_sizes(t->image->root);
+    if (t->eltorito) {
+        /* All trees share the file source of the boot catalog */
+        ret = el_torito_catalog_file_src_create(t, &src);
+        if (ret < 0)
+            goto ex;
+    }
+
+    LIBISO_ALLOC_MEM(t->tree_jobs, struct ecma119_tree_job, num_trees);
+    for (i = 0; i < num_trees; i++) {
+        t->tree_jobs[i].tree = trees[i];
+        t->tree_jobs[i].ret = ISO_SUCCESS;
+    }
+    t->num_tree_jobs = num_trees;
+    t->next_tree_job = 0;
+    threads = opts->tree_threads - 1;
+    if (threads > num_trees)
+        threads = num_trees;
+    LIBISO_ALLOC_MEM(t->tree_thread_ids, pthread_t, threads);
+
+    pthread_mutex_init(&(t->tree_mutex), NULL);
+    t->trees_concurrent = 1;
+    for (i = 0; i < threads; i++) {
+        /* If thread creation fails, then ecma119_join_tree_jobs() does the
+           remaining work */
+        if (pthread_create(&(t->tree_thread_ids[i]), NULL,
+                           ecma119_tree_worker, t) != 0)
+    break;
+        t->num_tree_threads++;
+    }
+    ret = 1;
+ex:;
+    if (ret < 0) {
+        LIBISO_FREE_MEM(t->tree_jobs);
+        t->tree_jobs = NULL;
+    }
+    return ret;
+}
+
+/* Build the trees which were not taken by a thread yet, wait for the
+   threads, and end concurrent tree building.
+   @param flag bit0= do not build the remaining trees
+   @return ISO_SUCCESS or the error of the first failed tree in sequential
+           order
+*/
+static
+int ecma119_join_tree_jobs(Ecma119Image *t, int flag)
+{
+    int ret = ISO_SUCCESS, i;
+
+    if (!t->trees_concurrent)
+        return ISO_SUCCESS;
+    if (flag & 1) {
+        ecma119_tree_lock(t, 0);
+        t->next_tree_job = t->num_tree_jobs;
+        ecma119_tree_lock(t, 1);
+    } else {
+        ecma119_tree_worker(t);
+    }
+    for (i = 0; i < t->num_tree_threads; i++)
+        pthread_join(t->tree_thread_ids[i], NULL);
+    t->num_tree_threads = 0;
+    t->trees_concurrent = 0;
+    pthread_mutex_destroy(&(t->tree_mutex));
+
+    for (i = 0; i < t->num_tree_jobs; i++) {
+        if (t->tree_jobs[i].ret < 0) {
+            ret = t->tree_jobs[i].ret;
+    break;
+        }
+    }
+    LIBISO_FREE_MEM(t->tree_jobs);
+    t->tree_jobs = NULL;
+    t->num_tree_jobs = 0;
+    LIBISO_FREE_MEM(t->tree_thread_ids);
+    t->tree_thread_ids = NULL;
+    return ret;
+}
+
 static
 int ecma119_image_new(IsoImage *src, IsoWriteOpts *in_opts, Ecma119Image **img)
 {
@@ -2505,6 +2712,7 @@ int ecma119_image_new(IsoImage *src, IsoWriteOpts *in_opts, Ecma119Image **img)
     */
     target->refcount = 1;
     target->opts = NULL;
+    pthread_mutex_init(&(target->charset_mutex), NULL);
 
     /* Record a copy of in_opts.
        It is a copy because in_opts is prone to manipulations from the
@@ -2525,6 +2733,17 @@ int ecma119_image_new(IsoImage *src, IsoWriteOpts *in_opts, Ecma119Image **img)
     target->image = src;
     iso_image_ref(src);
 
+    /* The writer traverses pending copy-on-write clones without cloning.
+       But recording MD5 attaches information to the nodes. In this case the
+       clones have to become real and must not share nodes with other trees.
+    */
+    if ((opts->md5_file_checksums & 1) || opts->md5_session_checksum)
+        ret = iso_tree_cow_load(src->root, 1 | 2);
+    else
+        ret = iso_tree_cow_load(src->root, 1);
+    if (ret < 0)
+        goto target_cleanup;
+
     target->rr_reloc_node = NULL;
 
     target->replace_uid = opts->replace_uid ? 1 : 0;
@@ -2738,6 +2957,7 @@ int ecma119_image_new(IsoImage *src, IsoWriteOpts *in_opts, Ecma119Image **img)
     target->filesrc_blocks = 0;
 
     target->joliet_ucs2_failures = 0;
+    target->charset_failures = 0;
 
     /* If partitions get appended, then the backup GPT cannot be part of
        the ISO filesystem.
@@ -2822,9 +3042,17 @@ int ecma119_image_new(IsoImage *src, IsoWriteOpts *in_opts, Ecma119Image **img)
         goto target_cleanup;
     }
 
+    /* Possibly build the Joliet, ISO 9660:1999, and HFS+ trees by own
+       threads while this thread builds the ECMA-119 tree
+    */
+    ret = ecma119_start_tree_jobs(target);
+    if (ret < 0)
+        goto target_cleanup;
+
     /* create writer for ECMA-119 structure */
     ret = ecma119_writer_create(target);
     if (ret < 0) {
+        ecma119_join_tree_jobs(target, 1);
         goto target_cleanup;
     }
 
@@ -2832,10 +3060,15 @@ int ecma119_image_new(IsoImage *src, IsoWriteOpts *in_opts, Ecma119Image **img)
     if (target->eltorito) {
         ret = eltorito_writer_create(target);
         if (ret < 0) {
+            ecma119_join_tree_jobs(target, 1);
             goto target_cleanup;
         }
     }
 
+    ret = ecma119_join_tree_jobs(target, 0);
+    if (ret < 0)
+        goto target_cleanup;
+
     /* create writer for Joliet structure */
     if (opts->joliet) {
         ret = joliet_writer_create(target);
@@ -3374,8 +3607,11 @@ int dive_to_depth_8(IsoDir *dir, int depth)
 
     if (depth >= 8)
         return 1;
-    pos = dir->children;
-    for (pos = dir->children; pos != NULL; pos = pos->next) {
+    ret = iso_tree_cow_load(dir, 0);
+    if (ret < 0)
+        return ret;
+    for (pos = iso_tree_cow_child(dir, NULL); pos != NULL;
+         pos = iso_tree_cow_child(dir, pos)) {
         if (pos->type != LIBISO_DIR)
     continue;
         ret = dive_to_depth_8((IsoDir *) pos, depth + 1);
@@ -4403,6 +4639,26 @@ int iso_write_opts_set_gpt_guid(IsoWriteOpts *opts, uint8_t guid[16], int mode)
     return ISO_SUCCESS;
 }
 
+int iso_write_opts_set_tree_threads(IsoWriteOpts *opts, int num_threads)
+{
+    if (opts == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    if (num_threads < 0 || num_threads > ISO_TREE_THREADS_MAX)
+        return 0;
+    opts->tree_threads = num_threads;
+    return ISO_SUCCESS;
+}
+
+int iso_write_opts_set_rr_cache(IsoWriteOpts *opts, size_t cache_bytes)
+{
+    if (opts == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    opts->rr_cache_size = cache_bytes;
+    return ISO_SUCCESS;
+}
+
 
 /*
  * @param flag
@@ -93,6 +93,32 @@
 #define ISO_JOLIET_UCS2_WARN_MAX 3
 
 
+/* How many warnings to issue about file names which cannot be converted
+   from the input charset to the output charset of Rock Ridge or
+   ISO 9660:1999.
+*/
+#define ISO_CHARSET_WARN_MAX 3
+
+
+/* How many name collisions to report individually by DEBUG messages while
+   names get mangled for writing. The rest is only counted and summarized.
+*/
+#define ISO_COLLISION_MSG_MAX 10
+
+
+/* Upper limit for iso_write_opts_set_tree_threads() */
+#define ISO_TREE_THREADS_MAX 64
+
+/* The low level trees which may get built concurrently by
+   ecma119_image_new(). Their numbers give the order of sequential building.
+*/
+#define ISO_LOW_TREE_ECMA119 0
+#define ISO_LOW_TREE_JOLIET  1
+#define ISO_LOW_TREE_ISO1999 2
+#define ISO_LOW_TREE_HFSPLUS 3
+#define ISO_LOW_TREE_COUNT   4
+
+
 /**
  * Holds the options for the image generation.
  */
@@ -543,6 +569,17 @@ struct iso_write_opts {
      */
     uint8_t gpt_disk_guid[16];
     int gpt_disk_guid_mode;
+
+    /* Number of threads which prepare the directory trees.
+       See API call iso_write_opts_set_tree_threads().
+     */
+    int tree_threads;
+
+    /* Number of bytes which may be used for remembering Rock Ridge results
+       of the size computation. 0 disables the cache.
+       See API call iso_write_opts_set_rr_cache().
+     */
+    size_t rr_cache_size;
 };
 
 typedef struct ecma119_image Ecma119Image;
@@ -669,6 +706,7 @@ struct ecma119_image
     uint32_t hfsp_nnodes;
     uint32_t hfsp_bless_id[ISO_HFSPLUS_BLESS_MAX];
     uint32_t hfsp_collision_count;
+    struct hfsplus_link_walk *hfsp_link_walk;
 
     /*
      * ISO 9660:1999 related information
@@ -913,6 +951,41 @@ struct ecma119_image
     uint32_t filesrc_start;
     uint32_t filesrc_blocks;
 
+    /* Concurrent building of the low level trees by ecma119_image_new().
+       While trees_concurrent is 1, tree_mutex protects .files and the
+       reference counters of the IsoNode objects. See ecma119_tree_lock().
+    */
+    int trees_concurrent;
+    pthread_mutex_t tree_mutex;
+    uint32_t tree_seq[ISO_LOW_TREE_COUNT];
+    struct ecma119_tree_job *tree_jobs;
+    int num_tree_jobs;
+    int next_tree_job;
+    pthread_t *tree_thread_ids;
+    int num_tree_threads;
+
+    /* Writers with readily built trees, which were prepared by the tree
+       threads and still have to be added to .writers
+    */
+    IsoImageWriter *tree_writers[ISO_LOW_TREE_COUNT];
+
+    /* Number of bytes used by the struct rrip_node_cache objects of the
+       Ecma119Node tree. Caching stops when opts->rr_cache_size is reached.
+    */
+    size_t rr_cache_used;
+
+    /* 1 while several threads render directory records by
+       iso_write_dir_tree(). rr_cache_used must not be changed then.
+    */
+    int dirs_concurrent;
+
+    /* Number of file names which failed charset conversion.
+       Protected by charset_mutex because names get converted by the tree
+       threads and by the directory rendering threads.
+    */
+    size_t charset_failures;
+    pthread_mutex_t charset_mutex;
+
 };
 
 #define BP(a,b) [(b) - (a) + 1]
@@ -1052,6 +1125,19 @@ int iso_write_partition_file(Ecma119Image *target, char *path,
 
 void issue_ucs2_warning_summary(size_t failures);
 
+/* Count a file name which failed charset conversion.
+   @return 1 = the failure shall be reported by a message, 0 = only counted
+*/
+int ecma119_count_charset_failure(Ecma119Image *t);
+
+void issue_charset_warning_summary(size_t failures);
+
+/* Serializes the access to objects which are shared by the low level tree
+   builders while they run concurrently. Does nothing else.
+   @param flag bit0= unlock rather than lock
+*/
+void ecma119_tree_lock(Ecma119Image *t, int flag);
+
 /* Tells whether ivr is a reader from imported_iso in a multi-session
    add-on situation, and thus to be kept in place.
 */
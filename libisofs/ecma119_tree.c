@@ -24,6 +24,9 @@
 #include "image.h"
 #include "stream.h"
 #include "eltorito.h"
+#include "mangle.h"
+#include "rockridge.h"
+#include "tree.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -187,7 +190,9 @@ int create_ecma119_node(Ecma119Image *img, IsoNode *iso, Ecma119Node **node)
     }
 
     ecma->node = iso;
+    ecma119_tree_lock(img, 0);
     iso_node_ref(iso);
+    ecma119_tree_lock(img, 1);
     ecma->nlink = 1;
     *node = ecma;
     return ISO_SUCCESS;
@@ -201,11 +206,13 @@ static
 int create_dir(Ecma119Image *img, IsoDir *iso, Ecma119Node **node)
 {
     int ret;
+    size_t nchildren;
     Ecma119Node **children = NULL;
     struct ecma119_dir_info *dir_info;
 
-    if (iso->nchildren > 0) {
-        children = calloc(1, sizeof(void*) * iso->nchildren);
+    nchildren = iso_tree_cow_count(iso);
+    if (nchildren > 0) {
+        children = calloc(1, sizeof(void*) * nchildren);
         if (children == NULL)
             return ISO_OUT_OF_MEM;
     }
@@ -232,15 +239,20 @@ int create_dir(Ecma119Image *img, IsoDir *iso, Ecma119Node **node)
 }
 
 
+/**
+ * @param up  The directory by which iso was reached. See
+ *            iso_tree_get_walk_path().
+ */
 static
-int create_file_src(Ecma119Image *img, IsoFile *iso, IsoFileSrc **src)
+int create_file_src(Ecma119Image *img, IsoFile *iso,
+                    struct iso_tree_walk_dir *up, IsoFileSrc **src)
 {
     int ret;
     off_t size;
 
     size = iso_stream_get_size(iso->stream);
     if (size > (off_t)MAX_ISO_FILE_SECTION_SIZE && img->opts->iso_level != 3) {
-        char *ipath = iso_tree_get_node_path(ISO_NODE(iso));
+        char *ipath = iso_tree_get_walk_path(up, ISO_NODE(iso));
         iso_msg_submit(img->image->id, ISO_FILE_TOO_BIG, 0,
                               "File \"%s\" cannot be added to image because "
                               "its size is 4 GiB or larger", ipath);
@@ -260,12 +272,13 @@ int create_file_src(Ecma119Image *img, IsoFile *iso, IsoFileSrc **src)
  * node.
  */
 static
-int create_file(Ecma119Image *img, IsoFile *iso, Ecma119Node **node)
+int create_file(Ecma119Image *img, IsoFile *iso, struct iso_tree_walk_dir *up,
+                Ecma119Node **node)
 {
     int ret;
     IsoFileSrc *src;
 
-    ret = create_file_src(img, iso, &src);
+    ret = create_file_src(img, iso, up, &src);
     if (ret < 0) {
         return ret;
     }
@@ -361,6 +374,7 @@ void ecma119_node_free(Ecma119Node *node)
         free(node->info.dir);
     }
     free(node->iso_name);
+    rrip_node_cache_free(node->rr_cache);
     iso_node_unref(node->node);
     free(node);
 }
@@ -395,6 +409,10 @@ int iso_filesrc_list_destroy(struct iso_filesrc_list_item **start_item)
  
 
 /**
+ * @param up
+ *      The directory by which iso was reached, NULL for the root.
+ *      Nodes of pending copy-on-write clones have their parent pointers in
+ *      the origin tree. So messages get the path from this chain.
  * @param flag
  *      bit0= iso is in a hidden directory. Thus hide it.
  * @return
@@ -402,7 +420,8 @@ int iso_filesrc_list_destroy(struct iso_filesrc_list_item **start_item)
  *
  */
 static
-int create_tree(Ecma119Image *image, IsoNode *iso, Ecma119Node **tree,
+int create_tree(Ecma119Image *image, IsoNode *iso,
+                struct iso_tree_walk_dir *up, Ecma119Node **tree,
                 int depth, int pathlen, int flag)
 {
     int ret, hidden;
@@ -439,14 +458,14 @@ int create_tree(Ecma119Image *image, IsoNode *iso, Ecma119Node **tree,
         if (!opts->rockridge) {
             if ((iso->type == LIBISO_DIR && depth > 8) &&
                 !opts->allow_deep_paths) {
-                ipath = iso_tree_get_node_path(iso);
+                ipath = iso_tree_get_walk_path(up, iso);
                 ret = iso_msg_submit(image->image->id, ISO_FILE_IMGPATH_WRONG,
                                      0, "File \"%s\" can't be added, "
                                      "because directory depth "
                                      "is greater than 8.", ipath);
                 goto ex;
             } else if (max_path > 255 && !opts->allow_longer_paths) {
-                ipath = iso_tree_get_node_path(iso);
+                ipath = iso_tree_get_walk_path(up, iso);
                 ret = iso_msg_submit(image->image->id, ISO_FILE_IMGPATH_WRONG,
                                      0, "File \"%s\" can't be added, "
                                      "because path length "
@@ -459,12 +478,12 @@ int create_tree(Ecma119Image *image, IsoNode *iso, Ecma119Node **tree,
     switch (iso->type) {
     case LIBISO_FILE:
         if (hidden) {
-            ret = create_file_src(image, (IsoFile *) iso, &src);
+            ret = create_file_src(image, (IsoFile *) iso, up, &src);
             if (ret <= 0)
                 goto ex;
             ret = add_to_hidden_list(image, src); 
         } else {
-            ret = create_file(image, (IsoFile*)iso, &node);
+            ret = create_file(image, (IsoFile*)iso, up, &node);
         }
         break;
     case LIBISO_SYMLINK:
@@ -476,7 +495,7 @@ int create_tree(Ecma119Image *image, IsoNode *iso, Ecma119Node **tree,
             ret = create_symlink(image, (IsoSymlink*)iso, &node);
         } else {
             /* symlinks are only supported when RR is enabled */
-            char *ipath = iso_tree_get_node_path(iso);
+            char *ipath = iso_tree_get_walk_path(up, iso);
             ret = iso_msg_submit(image->image->id, ISO_FILE_IGNORED, 0,
                 "File \"%s\" ignored. Symlinks need RockRidge extensions.",
                 ipath);
@@ -492,7 +511,7 @@ int create_tree(Ecma119Image *image, IsoNode *iso, Ecma119Node **tree,
             ret = create_special(image, (IsoSpecial*)iso, &node);
         } else {
             /* special files are only supported when RR is enabled */
-            char *ipath = iso_tree_get_node_path(iso);
+            char *ipath = iso_tree_get_walk_path(up, iso);
             ret = iso_msg_submit(image->image->id, ISO_FILE_IGNORED, 0,
                 "File \"%s\" ignored. Special files need RockRidge extensions.",
                 ipath);
@@ -519,6 +538,7 @@ int create_tree(Ecma119Image *image, IsoNode *iso, Ecma119Node **tree,
         {
             IsoNode *pos;
             IsoDir *dir = (IsoDir*)iso;
+            struct iso_tree_walk_dir walk;
 
             if (!hidden) {
                 ret = create_dir(image, dir, &node);
@@ -536,12 +556,14 @@ int create_tree(Ecma119Image *image, IsoNode *iso, Ecma119Node **tree,
                 }
             }
             ret = ISO_SUCCESS;
-            pos = dir->children;
+            walk.node = iso;
+            walk.up = up;
+            pos = iso_tree_cow_child(dir, NULL);
             while (pos) {
                 int cret;
                 Ecma119Node *child;
-                cret = create_tree(image, pos, &child, depth + 1, max_path,
-                                   !!hidden);
+                cret = create_tree(image, pos, &walk, &child, depth + 1,
+                                   max_path, !!hidden);
                 if (cret < 0) {
                     /* error */
                     ret = cret;
@@ -552,7 +574,7 @@ int create_tree(Ecma119Image *image, IsoNode *iso, Ecma119Node **tree,
                     node->info.dir->children[nchildren] = child;
                     child->parent = node;
                 }
-                pos = pos->next;
+                pos = iso_tree_cow_child(dir, pos);
             }
         }
         break;
@@ -576,8 +598,11 @@ ex:
         free(iso_name);
     if (ipath != NULL)
         free(ipath);
-    if (node != NULL)
+    if (node != NULL) {
+        ecma119_tree_lock(image, 0);
         ecma119_node_free(node);
+        ecma119_tree_lock(image, 1);
+    }
     if (hidden && ret == ISO_SUCCESS)
         ret = 0;
     /* The sources of hidden files are now owned by the rb-tree */
@@ -614,267 +639,169 @@ void sort_tree(Ecma119Node *root)
     }
 }
 
-/**
- * Ensures that the ISO name of each children of the given dir is unique,
- * changing some of them if needed.
- * It also ensures that resulting filename is always <= than given
- * max_name_len, including extension. If needed, the extension will be reduced,
- * but never under 3 characters.
- */
+/* Limits for mangle_split() */
+struct ecma119_mangle_limits {
+    Ecma119Image *img;
+    int max_file_len;
+    int max_dir_len;
+};
+
 static
-int mangle_single_dir(Ecma119Image *img, Ecma119Node *dir, int max_file_len,
-                      int max_dir_len)
+int mangle_is_dir(void *node)
 {
-    int ret;
-    int i, nchildren;
-    Ecma119Node **children;
-    IsoHTable *table;
-    int need_sort = 0;
+    return ((Ecma119Node *) node)->type == ECMA119_DIR;
+}
 
-    nchildren = dir->info.dir->nchildren;
-    children = dir->info.dir->children;
+static
+void **mangle_get_children(void *dir, int *nchildren)
+{
+    *nchildren = ((Ecma119Node *) dir)->info.dir->nchildren;
+    return (void **) ((Ecma119Node *) dir)->info.dir->children;
+}
 
-    if (nchildren <= 0)
-        return ISO_SUCCESS; /* nothing to do */
+static
+void *mangle_get_name(void *node)
+{
+    return ((Ecma119Node *) node)->iso_name;
+}
 
-    /* a hash table will temporary hold the names, for fast searching */
-    ret = iso_htable_create((nchildren * 100) / 80, iso_str_hash,
-                            (compare_function_t)strcmp, &table);
-    if (ret < 0) {
-        return ret;
-    }
-    for (i = 0; i < nchildren; ++i) {
-        char *name = children[i]->iso_name;
-        ret = iso_htable_add(table, name, name);
-        if (ret < 0) {
-            goto mangle_cleanup;
-        }
-    }
+static
+void mangle_set_name(void *node, void *name)
+{
+    free(((Ecma119Node *) node)->iso_name);
+    ((Ecma119Node *) node)->iso_name = name;
+}
 
-    for (i = 0; i < nchildren; ++i) {
-        char *name, *ext;
-        char full_name[40];
-        const int full_max_len = 40 - 1;
-        int max; /* computed max len for name, without extension */
-        int j = i;
-        int digits = 1; /* characters to change per name */
-
-        /* first, find all child with same name */
-        while (j + 1 < nchildren && !cmp_node_name(children + i, children + j
-                + 1)) {
-            ++j;
-        }
-        if (j == i) {
-            /* name is unique */
-            continue;
-        }
+static
+int mangle_collision(void *handle, void *node)
+{
+    Ecma119Image *img = ((struct ecma119_mangle_limits *) handle)->img;
 
-        if (img->opts->untranslated_name_len) {
-            /* This should not happen because no two IsoNode names should be
-               identical and only unaltered IsoNode names should be seen here.
-               Thus the Ema119Node names should be unique.
-            */
-            iso_msg_submit(img->image->id, ISO_NAME_NEEDS_TRANSL, 0,
-                           "ECMA-119 file name collision: '%s'",
-                           children[i]->iso_name);
-            ret = ISO_NAME_NEEDS_TRANSL;
-            goto mangle_cleanup;
-        }
+    if (img->opts->untranslated_name_len) {
+        /* This should not happen because no two IsoNode names should be
+           identical and only unaltered IsoNode names should be seen here.
+           Thus the Ema119Node names should be unique.
+        */
+        iso_msg_submit(img->image->id, ISO_NAME_NEEDS_TRANSL, 0,
+                       "ECMA-119 file name collision: '%s'",
+                       ((Ecma119Node *) node)->iso_name);
+        return ISO_NAME_NEEDS_TRANSL;
+    }
+    return ISO_SUCCESS;
+}
 
+/**
+ * Determine the parts of a mangled name.
+ * It ensures that resulting filename is always <= than given
+ * max_name_len, including extension. If needed, the extension will be reduced,
+ * but never under 3 characters.
+ */
+static
+int mangle_split(void *handle, void *node, int digits,
+                 struct iso_mangle_parts *parts)
+{
+    struct ecma119_mangle_limits *limits = handle;
+    Ecma119Node *n = node;
+    char *full_name, *dot;
+    int i, max, len, extlen;
+    int max_file_len = limits->max_file_len;
+    const int full_max_len = 40 - 1;
+
+    full_name = n->iso_name;
+    len = strlen(full_name);
+    if (len > full_max_len)
+        len = full_max_len;
+    dot = NULL;
+    for (i = 0; i < len; i++)
+        if (full_name[i] == '.')
+            dot = full_name + i;
+
+    if (dot != NULL &&
+        (n->type != ECMA119_DIR || limits->img->opts->allow_dir_id_ext)) {
         /*
-         * A max of 7 characters is good enough, it allows handling up to
-         * 9,999,999 files with same name. We can increment this to
-         * max_name_len, but the int_pow() function must then be modified
-         * to return a bigger integer.
+         * File (normally not dir) with extension
+         * Note that we don't need to check for placeholders, as
+         * tree reparent happens later, so no placeholders can be
+         * here at this time.
          */
-        while (digits < 8) {
-            int ok, k;
-            char *dot;
-            int change = 0; /* number to be written */
-
-            /* copy name to buffer */
-            strncpy(full_name, children[i]->iso_name, full_max_len);
-            full_name[full_max_len] = 0;
-
-            /* compute name and extension */
-            dot = strrchr(full_name, '.');
-            if (dot != NULL &&
-                (children[i]->type != ECMA119_DIR ||
-                 img->opts->allow_dir_id_ext)) {
-
-                /*
-                 * File (normally not dir) with extension
-                 * Note that we don't need to check for placeholders, as
-                 * tree reparent happens later, so no placeholders can be
-                 * here at this time.
-                 */
-                int extlen;
-                full_name[dot - full_name] = '\0';
-                name = full_name;
-                ext = dot + 1;
+        parts->has_dot = 1;
+        parts->ext_start = dot - full_name + 1;
+        parts->ext_len = len - parts->ext_start;
 
+        /*
+         * For iso level 1 we force ext len to be 3, as name
+         * can't grow on the extension space
+         */
+        extlen = (max_file_len == 12) ? 3 : parts->ext_len;
+        max = max_file_len - extlen - 1 - digits;
+        if (max <= 0) {
+            /* this can happen if extension is too long */
+            if (extlen + max > 3) {
                 /*
-                 * For iso level 1 we force ext len to be 3, as name
-                 * can't grow on the extension space
+                 * reduce extension len, to give name an extra char
+                 * note that max is negative or 0
                  */
-                extlen = (max_file_len == 12) ? 3 : strlen(ext);
+                extlen = extlen + max - 1;
+                if (extlen < parts->ext_len)
+                    parts->ext_len = extlen;
                 max = max_file_len - extlen - 1 - digits;
-                if (max <= 0) {
-                    /* this can happen if extension is too long */
-                    if (extlen + max > 3) {
-                        /*
-                         * reduce extension len, to give name an extra char
-                         * note that max is negative or 0
-                         */
-                        extlen = extlen + max - 1;
-                        ext[extlen] = '\0';
-                        max = max_file_len - extlen - 1 - digits;
-                    } else {
-                        /*
-                         * error, we don't support extensions < 3
-                         * This can't happen with current limit of digits.
-                         */
-                        ret = ISO_ERROR;
-                        goto mangle_cleanup;
-                    }
-                }
-                /* ok, reduce name by digits */
-                if (name + max < dot) {
-                    name[max] = '\0';
-                }
-            } else {
-                /* Directory (normally), or file without extension */
-                if (children[i]->type == ECMA119_DIR) {
-                    max = max_dir_len - digits;
-                    dot = NULL; /* dots (normally) have no meaning in dirs */
-                } else {
-                    max = max_file_len - digits;
-                }
-                name = full_name;
-                if ((size_t) max < strlen(name)) {
-                    name[max] = '\0';
-                }
-                /* let ext be an empty string */
-                ext = name + strlen(name);
-            }
-
-            ok = 1;
-            /* change name of each file */
-            for (k = i; k <= j; ++k) {
-                char tmp[40];
-                char fmt[16];
-                if (dot != NULL) {
-                    sprintf(fmt, "%%s%%0%dd.%%s", digits);
-                } else {
-                    sprintf(fmt, "%%s%%0%dd%%s", digits);
-                }
-                while (1) {
-                    sprintf(tmp, fmt, name, change, ext);
-                    ++change;
-                    if (change > int_pow(10, digits)) {
-                        ok = 0;
-                        break;
-                    }
-                    if (!iso_htable_get(table, tmp, NULL)) {
-                        /* the name is unique, so it can be used */
-                        break;
-                    }
-                }
-                if (ok) {
-                    char *new = strdup(tmp);
-                    if (new == NULL) {
-                        ret = ISO_OUT_OF_MEM;
-                        goto mangle_cleanup;
-                    }
-
-#ifdef Libisofs_extra_verbose_debuG
-                    iso_msg_debug(img->image->id, "\"%s\" renamed to \"%s\"",
-                                  children[k]->iso_name, new);
-#endif
-
-                    iso_htable_remove_ptr(table, children[k]->iso_name, NULL);
-                    free(children[k]->iso_name);
-                    children[k]->iso_name = new;
-                    iso_htable_add(table, new, new);
-
-                    /*
-                     * if we change a name we need to sort again children
-                     * at the end
-                     */
-                    need_sort = 1;
-                } else {
-                    /* we need to increment digits */
-                    break;
-                }
-            }
-            if (ok) {
-                break;
             } else {
-                ++digits;
+                /*
+                 * error, we don't support extensions < 3
+                 * This can't happen with current limit of digits.
+                 */
+                return ISO_ERROR;
             }
         }
-        if (digits == 8) {
-            ret = ISO_MANGLE_TOO_MUCH_FILES;
-            goto mangle_cleanup;
+        /* ok, reduce name by digits */
+        parts->stem_len = dot - full_name;
+        if (max < parts->stem_len)
+            parts->stem_len = max;
+    } else {
+        /* Directory (normally), or file without extension */
+        if (n->type == ECMA119_DIR) {
+            max = limits->max_dir_len - digits;
+        } else {
+            max = max_file_len - digits;
         }
-        i = j;
+        parts->stem_len = len;
+        if (max < len)
+            parts->stem_len = max;
+        parts->has_dot = 0;
+        parts->ext_start = 0;
+        parts->ext_len = 0;
     }
-
-    /*
-     * If needed, sort again the files inside dir
-     */
-    if (need_sort) {
-        qsort(children, nchildren, sizeof(void*), cmp_node_name);
-    }
-
-    ret = ISO_SUCCESS;
-
-mangle_cleanup : ;
-    iso_htable_destroy(table, NULL);
-    return ret;
+    return 1;
 }
 
-static
-int mangle_dir(Ecma119Image *img, Ecma119Node *dir, int max_file_len,
-               int max_dir_len)
-{
-    int ret;
-    size_t i;
-
-    ret = mangle_single_dir(img, dir, max_file_len, max_dir_len);
-    if (ret < 0) {
-        return ret;
-    }
-
-    /* recurse */
-    for (i = 0; i < dir->info.dir->nchildren; ++i) {
-        if (dir->info.dir->children[i]->type == ECMA119_DIR) {
-            ret = mangle_dir(img, dir->info.dir->children[i], max_file_len,
-                             max_dir_len);
-            if (ret < 0) {
-                /* error */
-                return ret;
-            }
-        }
-    }
-    return ISO_SUCCESS;
-}
+static struct iso_mangle_ops ecma119_mangle_ops = {
+    1, 39, 0,
+    mangle_is_dir,
+    mangle_get_children,
+    mangle_get_name,
+    mangle_set_name,
+    cmp_node_name,
+    mangle_split,
+    mangle_collision
+};
 
 static
 int mangle_tree(Ecma119Image *img, Ecma119Node *dir, int recurse)
 {
-    int max_file, max_dir;
+    struct ecma119_mangle_limits limits;
     Ecma119Node *root;
 
+    limits.img = img;
     if (img->opts->untranslated_name_len > 0) {
-        max_file = max_dir = img->opts->untranslated_name_len;
+        limits.max_file_len = limits.max_dir_len =
+                                             img->opts->untranslated_name_len;
     } else if (img->opts->max_37_char_filenames) {
-        max_file = max_dir = 37;
+        limits.max_file_len = limits.max_dir_len = 37;
     } else if (img->opts->iso_level == 1) {
-        max_file = 12; /* 8 + 3 + 1 */
-        max_dir = 8;
+        limits.max_file_len = 12; /* 8 + 3 + 1 */
+        limits.max_dir_len = 8;
     } else {
-        max_file = max_dir = 31;
+        limits.max_file_len = limits.max_dir_len = 31;
     }
     if (dir != NULL) {
         root = dir;
@@ -883,11 +810,7 @@ int mangle_tree(Ecma119Image *img, Ecma119Node *dir, int recurse)
     } else {
         root = img->root;
     }
-    if (recurse) {
-        return mangle_dir(img, root, max_file, max_dir);
-    } else {
-        return mangle_single_dir(img, root, max_file, max_dir);
-    }
+    return iso_mangle_tree(img, &ecma119_mangle_ops, &limits, root, recurse);
 }
 
 /**
@@ -897,8 +820,8 @@ int mangle_tree(Ecma119Image *img, Ecma119Node *dir, int recurse)
  * See IEEE P1282, section 4.1.5 for details
  */
 static
-int create_placeholder(Ecma119Node *parent, Ecma119Node *real,
-                       Ecma119Node **node)
+int create_placeholder(Ecma119Image *img, Ecma119Node *parent,
+                       Ecma119Node *real, Ecma119Node **node)
 {
     Ecma119Node *ret;
 
@@ -920,7 +843,9 @@ int create_placeholder(Ecma119Node *parent, Ecma119Node *real,
 
     /* take a ref to the IsoNode */
     ret->node = real->node;
+    ecma119_tree_lock(img, 0);
     iso_node_ref(real->node);
+    ecma119_tree_lock(img, 1);
     ret->parent = parent;
     ret->type = ECMA119_PLACEHOLDER;
     ret->info.real_me = real;
@@ -949,7 +874,7 @@ size_t max_child_name_len(Ecma119Node *dir)
  * than 255 characters, as specified in ECMA-119, section 6.8.2.1
  */
 static
-int reparent(Ecma119Node *child, Ecma119Node *parent)
+int reparent(Ecma119Image *img, Ecma119Node *child, Ecma119Node *parent)
 {
     int ret;
     size_t i;
@@ -958,7 +883,8 @@ int reparent(Ecma119Node *child, Ecma119Node *parent)
     /* replace the child in the original parent with a placeholder */
     for (i = 0; i < child->parent->info.dir->nchildren; i++) {
         if (child->parent->info.dir->children[i] == child) {
-            ret = create_placeholder(child->parent, child, &placeholder);
+            ret = create_placeholder(img, child->parent, child,
+                                     &placeholder);
             if (ret < 0) {
                 return ret;
             }
@@ -1022,7 +948,7 @@ int reorder_tree(Ecma119Image *img, Ecma119Node *dir,
                 reloc = img->root;
             }
         }
-        ret = reparent(dir, reloc);
+        ret = reparent(img, dir, reloc);
         if (ret < 0) {
             return ret;
         }
@@ -1060,6 +986,15 @@ int reorder_tree(Ecma119Image *img, Ecma119Node *dir,
     return ISO_SUCCESS;
 }
 
+/* An element of the array which gets sorted by match_hardlinks().
+   The cache keeps the results of the inode and xinfo lookups of the node
+   so that each of them is done only once rather than on each comparison.
+*/
+struct ecma119_hard_entry {
+    Ecma119Node *node;
+    struct iso_node_cmp_cache cache;
+};
+
 /*
  * @param flag
  *     bit0= recursion
@@ -1071,8 +1006,8 @@ int reorder_tree(Ecma119Image *img, Ecma119Node *dir,
  */
 static
 int make_node_array(Ecma119Image *img, Ecma119Node *dir,
-                    Ecma119Node **nodes, size_t nodes_size, size_t *node_count,
-                    int flag)
+                    struct ecma119_hard_entry *nodes, size_t nodes_size,
+                    size_t *node_count, int flag)
 {
     int ret, result = 0;
     size_t i;
@@ -1087,7 +1022,8 @@ int make_node_array(Ecma119Image *img, Ecma119Node *dir,
                          "Programming error: Overflow of hardlink sort array");
                 return ISO_ASSERT_FAILURE;
             }
-            nodes[*node_count] = dir;
+            nodes[*node_count].node = dir;
+            nodes[*node_count].cache.valid = 0;
         }
         result|= (dir->ino == 0 ? 1 : 2);
         (*node_count)++;
@@ -1101,7 +1037,8 @@ int make_node_array(Ecma119Image *img, Ecma119Node *dir,
                          "Programming error: Overflow of hardlink sort array");
                 return ISO_ASSERT_FAILURE;
             }
-            nodes[*node_count] = child;
+            nodes[*node_count].node = child;
+            nodes[*node_count].cache.valid = 0;
         }
         result|= (child->ino == 0 ? 1 : 2);
         (*node_count)++;
@@ -1125,14 +1062,15 @@ static
 int ecma119_node_cmp_flag(const void *v1, const void *v2, int flag)
 {
     int ret;
-    Ecma119Node *n1, *n2;
+    struct ecma119_hard_entry *e1, *e2;
 
-    n1 = *((Ecma119Node **) v1);
-    n2 = *((Ecma119Node **) v2);
-    if (n1 == n2)
+    e1 = (struct ecma119_hard_entry *) v1;
+    e2 = (struct ecma119_hard_entry *) v2;
+    if (e1->node == e2->node)
         return 0;
 
-    ret = iso_node_cmp_flag(n1->node, n2->node, flag & (1 | 2));
+    ret = iso_node_cmp_cached(e1->node->node, &(e1->cache),
+                              e2->node->node, &(e2->cache), flag & (1 | 2));
     return ret;
 }
 
@@ -1149,8 +1087,9 @@ int ecma119_node_cmp_nohard(const void *v1, const void *v2)
 }   
 
 static
-int family_set_ino(Ecma119Image *img, Ecma119Node **nodes, size_t family_start,
-                   size_t next_family, ino_t img_ino, ino_t prev_ino, int flag)
+int family_set_ino(Ecma119Image *img, struct ecma119_hard_entry *nodes,
+                   size_t family_start, size_t next_family,
+                   ino_t img_ino, ino_t prev_ino, int flag)
 {
     size_t i;
 
@@ -1170,27 +1109,41 @@ int family_set_ino(Ecma119Image *img, Ecma119Node **nodes, size_t family_start,
         img_ino = img_give_ino_number(img->image, 0);
     }
     for (i = family_start; i < next_family; i++) {
-        nodes[i]->ino = img_ino;
-        nodes[i]->nlink = next_family - family_start;
+        nodes[i].node->ino = img_ino;
+        nodes[i].node->nlink = next_family - family_start;
     }
     return 1;
 }
 
+/* Get the image inode number of a node, or 0 if it has none.
+*/
+static
+ino_t ecma119_hard_entry_ino(struct ecma119_hard_entry *entry)
+{
+    unsigned int fs_id;
+    dev_t dev_id;
+    ino_t img_ino = 0;
+
+    if (entry->cache.valid & 1)
+        return entry->cache.img_id ? entry->cache.img_ino : 0;
+    iso_node_get_id(entry->node->node, &fs_id, &dev_id, &img_ino, 1);
+    return img_ino;
+}
+
 static
 int match_hardlinks(Ecma119Image *img, Ecma119Node *dir, int flag)
 {
     int ret;
     size_t nodes_size = 0, node_count = 0, i, family_start;
-    Ecma119Node **nodes = NULL;
-    unsigned int fs_id;
-    dev_t dev_id;
+    struct ecma119_hard_entry *nodes = NULL;
     ino_t img_ino = 0, prev_ino = 0;
 
     ret = make_node_array(img, dir, nodes, nodes_size, &node_count, 2);
     if (ret < 0)
         return ret;
     nodes_size = node_count;
-    nodes = (Ecma119Node **) calloc(sizeof(Ecma119Node *), nodes_size);
+    nodes = (struct ecma119_hard_entry *)
+                       calloc(sizeof(struct ecma119_hard_entry), nodes_size);
     if (nodes == NULL)
         return ISO_OUT_OF_MEM;
     ret = make_node_array(img, dir, nodes, nodes_size, &node_count, 0);
@@ -1199,9 +1152,10 @@ int match_hardlinks(Ecma119Image *img, Ecma119Node *dir, int flag)
 
     /* Sort according to id tuples, IsoFileSrc identity, properties, xattr. */
     if (img->opts->hardlinks)
-        qsort(nodes, node_count, sizeof(Ecma119Node *), ecma119_node_cmp_hard);
+        qsort(nodes, node_count, sizeof(struct ecma119_hard_entry),
+              ecma119_node_cmp_hard);
     else
-        qsort(nodes, node_count, sizeof(Ecma119Node *),
+        qsort(nodes, node_count, sizeof(struct ecma119_hard_entry),
               ecma119_node_cmp_nohard);
 
     /* Hand out image inode numbers to all Ecma119Node.ino == 0 .
@@ -1209,20 +1163,20 @@ int match_hardlinks(Ecma119Image *img, Ecma119Node *dir, int flag)
        Split those image inode number families where the sort criterion
        differs.
     */
-    iso_node_get_id(nodes[0]->node, &fs_id, &dev_id, &img_ino, 1);
+    img_ino = ecma119_hard_entry_ino(nodes);
     family_start = 0;
     for (i = 1; i < node_count; i++) {
-        if (nodes[i]->type != ECMA119_DIR &&
+        if (nodes[i].node->type != ECMA119_DIR &&
             ecma119_node_cmp_hard(nodes + (i - 1), nodes + i) == 0) {
             /* Still in same ino family */
             if (img_ino == 0) { /* Just in case any member knows its img_ino */
-                iso_node_get_id(nodes[0]->node, &fs_id, &dev_id, &img_ino, 1);
+                img_ino = ecma119_hard_entry_ino(nodes + i);
             }
     continue;
         }
         family_set_ino(img, nodes, family_start, i, img_ino, prev_ino, 0);
         prev_ino = img_ino;
-        iso_node_get_id(nodes[i]->node, &fs_id, &dev_id, &img_ino, 1);
+        img_ino = ecma119_hard_entry_ino(nodes + i);
         family_start = i;
     }
     family_set_ino(img, nodes, family_start, i, img_ino, prev_ino, 0);
@@ -1239,7 +1193,7 @@ int ecma119_tree_create(Ecma119Image *img)
     int ret;
     Ecma119Node *root;
 
-    ret = create_tree(img, (IsoNode*)img->image->root, &root, 1, 0, 0);
+    ret = create_tree(img, (IsoNode*)img->image->root, NULL, &root, 1, 0, 0);
     if (ret <= 0) {
         if (ret == 0) {
             /* unexpected error, root ignored!! This can't happen */
@@ -77,6 +77,11 @@ struct ecma119_node
         /** this field points to the relocated directory. */
         Ecma119Node *real_me;
     } info;
+
+    /* Rock Ridge results of the size computation for re-use when writing.
+       NULL if not cached. See iso_write_opts_set_rr_cache().
+     */
+    struct rrip_node_cache *rr_cache;
 };
 
 
@@ -20,6 +20,7 @@
 #include "messages.h"
 #include "writer.h"
 #include "ecma119.h"
+#include "tree.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -280,6 +281,10 @@ int iso_tree_add_boot_node(IsoDir *parent, const char *name, IsoBoot **boot)
         return ret;
 
     /* find place where to insert */
+    ret = iso_tree_cow_materialize(parent, 0);
+    if (ret < 0)
+        return ret;
+    iso_tree_cow_detach((IsoNode *) parent);
     pos = &(parent->children);
     while (*pos != NULL && strcmp((*pos)->name, name) < 0) {
         pos = &((*pos)->next);
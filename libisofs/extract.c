@@ -0,0 +1,683 @@
+/*
+ * Copyright (c) 2026 Thomas Schmitt
+ *
+ * This file is part of the libisofs project; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * or later as published by the Free Software Foundation.
+ * See COPYING file for details.
+ */
+
+/* Extraction of IsoImage trees into the local filesystem.
+   The content of files which still refer to the imported ISO image gets
+   read in the order of block addresses by large reads from the kept
+   IsoDataSource and written to disk by a pool of threads.
+   Other files get copied from their IsoStream by the calling thread.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "../config.h"
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#else
+#ifdef HAVE_INTTYPES_H
+#include <inttypes.h>
+#endif
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "libisofs.h"
+#include "node.h"
+#include "tree.h"
+#include "image.h"
+#include "stream.h"
+#include "messages.h"
+#include "util.h"
+#include "ecma119.h"
+#include "read_pool.h"
+
+
+/* Buffer size for copying files which are not read from the imported ISO */
+#define ISO_EXTRACT_STREAM_BUF (64 * 1024)
+
+
+struct iso_extract_file {
+    IsoNode *node;
+    char *path;
+
+    /* 1 = content gets read from the blocks of the imported ISO image */
+    int direct;
+
+    /* -1 = not opened yet */
+    int fd;
+
+    /* 1 = a writer thread is creating the disk file */
+    int opening;
+
+    /* Number of bytes not yet written */
+    off_t pending;
+
+    /* 0 = ok, > 0 = errno of failed system call, < 0 = libisofs error */
+    int failed;
+};
+
+struct iso_extract {
+    IsoImage *image;
+    int flag;
+
+    /* The data source of the imported ISO image. NULL if not available. */
+    IsoDataSource *src;
+
+    struct iso_extract_file *files;
+    int num_files;
+    int files_size;
+
+    /* Directories in the order of their creation */
+    struct iso_extract_file *dirs;
+    int num_dirs;
+    int dirs_size;
+
+    /* Reads the content from src and lets it be written by its threads */
+    struct iso_rpool *pool;
+
+    /* The mutex protects the fd, opening, pending, and failed members of
+       the files, and the counters below.
+    */
+    pthread_mutex_t mutex;
+    pthread_cond_t opened;
+
+    int failures;
+    int aborted;
+};
+
+
+/* Issue a message about a file which could not be properly extracted.
+   @param err  > 0 = errno , < 0 = libisofs error code
+*/
+static
+void iso_extract_report(struct iso_extract *x, char *path, char *what,
+                        int err)
+{
+    int ret;
+
+    if (err < 0)
+        ret = iso_msg_submit(x->image->id, ISO_EXTRACT_FILE_FAIL, err,
+                             "Cannot %s '%s'", what, path);
+    else
+        ret = iso_msg_submit(x->image->id, ISO_EXTRACT_FILE_FAIL, 0,
+                             "Cannot %s '%s' : %s", what, path,
+                             strerror(err));
+    pthread_mutex_lock(&x->mutex);
+    x->failures++;
+    if (ret < 0)
+        x->aborted = 1;
+    pthread_mutex_unlock(&x->mutex);
+}
+
+
+/* Apply ownership, permissions, ACL, xattr, and timestamps of node to path.
+   @param flag bit0= path is a symbolic link
+   @return 1 = ok , 0 = failure was reported
+*/
+static
+int iso_extract_set_attrs(struct iso_extract *x, IsoNode *node, char *path,
+                          int flag)
+{
+    int ret, ok = 1;
+    size_t num_attrs = 0, *value_lengths = NULL;
+    char **names = NULL, **values = NULL;
+    struct timespec times[2];
+
+    if (x->flag & 2) {
+        if (lchown(path, node->uid, node->gid) == -1) {
+            iso_extract_report(x, path, "set owner of", errno);
+            ok = 0;
+        }
+    }
+    if (!(flag & 1)) {
+        if (chmod(path, node->mode & 07777) == -1) {
+            iso_extract_report(x, path, "set permissions of", errno);
+            ok = 0;
+        }
+    }
+    if (!(flag & 1) && !(x->flag & 1)) {
+        ret = iso_node_get_attrs(node, &num_attrs, &names, &value_lengths,
+                                 &values, 1);
+        if (ret < 0) {
+            iso_extract_report(x, path, "obtain ACL and xattr for", ret);
+            ok = 0;
+        } else if (num_attrs > 0) {
+            ret = iso_local_set_attrs(path, num_attrs, names, value_lengths,
+                                      values, (x->flag & 8) | 64);
+            if (ret < 0) {
+                iso_extract_report(x, path, "set ACL and xattr of", ret);
+                ok = 0;
+            }
+            iso_node_get_attrs(node, &num_attrs, &names, &value_lengths,
+                               &values, 1 << 15);
+        }
+    }
+    times[0].tv_sec = node->atime;
+    times[0].tv_nsec = 0;
+    times[1].tv_sec = node->mtime;
+    times[1].tv_nsec = 0;
+    if (utimensat(AT_FDCWD, path, times,
+                  (flag & 1) ? AT_SYMLINK_NOFOLLOW : 0) == -1) {
+        iso_extract_report(x, path, "set timestamps of", errno);
+        ok = 0;
+    }
+    return ok;
+}
+
+
+/* Remove an existing non-directory if overwriting is enabled.
+   @return 0 = ok , > 0 = errno
+*/
+static
+int iso_extract_make_room(struct iso_extract *x, char *path)
+{
+    struct stat stbuf;
+
+    if (!(x->flag & 4))
+        return 0;
+    if (lstat(path, &stbuf) == -1)
+        return 0;
+    if (S_ISDIR(stbuf.st_mode))
+        return 0; /* Creating the new file will fail with EEXIST */
+    if (unlink(path) == -1)
+        return errno;
+    return 0;
+}
+
+
+/* Create a disk file.
+   @param fd  Returns the file descriptor or -1
+   @return 0 = ok , > 0 = errno
+*/
+static
+int iso_extract_create(struct iso_extract *x, char *path, int *fd)
+{
+    int err;
+
+    *fd = -1;
+    err = iso_extract_make_room(x, path);
+    if (err != 0)
+        return err;
+    *fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (*fd == -1)
+        return errno;
+    return 0;
+}
+
+
+/* Create the disk file of f by the calling thread while no writer thread
+   can access f. A failure gets recorded in f but not reported.
+   @return 0 = ok , > 0 = errno
+*/
+static
+int iso_extract_open_file(struct iso_extract *x, struct iso_extract_file *f)
+{
+    f->failed = iso_extract_create(x, f->path, &f->fd);
+    return f->failed;
+}
+
+
+/* To be called when the last byte of a file was written or failed.
+   No other thread will access f any more.
+*/
+static
+void iso_extract_finish_file(struct iso_extract *x, struct iso_extract_file *f)
+{
+    if (f->fd != -1) {
+        if (close(f->fd) == -1 && f->failed == 0) {
+            f->failed = errno;
+            iso_extract_report(x, f->path, "write", f->failed);
+        }
+        f->fd = -1;
+    }
+    if (f->failed == 0)
+        iso_extract_set_attrs(x, f->node, f->path, 0);
+}
+
+
+/* Account for len bytes of file idx being written or having failed.
+   @param err  0 = ok , > 0 = errno , < 0 = libisofs error
+*/
+static
+void iso_extract_piece_done(struct iso_extract *x, int idx, size_t len,
+                            int err)
+{
+    int last, report = 0;
+    struct iso_extract_file *f;
+
+    f = x->files + idx;
+    pthread_mutex_lock(&x->mutex);
+    if (err != 0 && f->failed == 0) {
+        f->failed = err;
+        report = 1;
+    }
+    f->pending -= len;
+    last = (f->pending <= 0);
+    pthread_mutex_unlock(&x->mutex);
+    if (report)
+        iso_extract_report(x, f->path, err < 0 ? "read content of" : "write",
+                           err);
+    if (last)
+        iso_extract_finish_file(x, f);
+}
+
+
+/* Write a piece of file content. Called by the threads of x->pool. */
+static
+void iso_extract_write_piece(void *handle, struct iso_rpool_extent *e,
+                             uint8_t *data)
+{
+    int fd, err = 0, open_err = 0;
+    ssize_t w;
+    size_t done = 0;
+    struct iso_extract *x = handle;
+    struct iso_extract_file *f;
+
+    if (e->err != 0) {
+        iso_extract_piece_done(x, e->owner, e->size, e->err);
+        return;
+    }
+    f = x->files + e->owner;
+    pthread_mutex_lock(&x->mutex);
+    while (f->opening)
+        pthread_cond_wait(&x->opened, &x->mutex);
+    if (f->fd == -1 && f->failed == 0) {
+        /* Create the file without blocking the other writers */
+        f->opening = 1;
+        pthread_mutex_unlock(&x->mutex);
+        open_err = iso_extract_create(x, f->path, &fd);
+        pthread_mutex_lock(&x->mutex);
+        f->fd = fd;
+        if (open_err != 0 && f->failed == 0)
+            f->failed = open_err;
+        else
+            open_err = 0;
+        f->opening = 0;
+        pthread_cond_broadcast(&x->opened);
+    }
+    fd = f->failed ? -1 : f->fd;
+    pthread_mutex_unlock(&x->mutex);
+    if (open_err != 0)
+        iso_extract_report(x, f->path, "create", open_err);
+
+    while (fd != -1 && done < e->size) {
+        w = pwrite(fd, data + done, e->size - done, e->offset + done);
+        if (w == -1) {
+            if (errno == EINTR)
+    continue;
+            err = errno;
+    break;
+        }
+        if (w == 0) {
+            err = EIO;
+    break;
+        }
+        done += w;
+    }
+    iso_extract_piece_done(x, e->owner, e->size, err);
+}
+
+
+static
+int iso_extract_is_aborted(struct iso_extract *x)
+{
+    int ret;
+
+    pthread_mutex_lock(&x->mutex);
+    ret = x->aborted;
+    pthread_mutex_unlock(&x->mutex);
+    return ret;
+}
+
+
+/* Called by x->pool before each read operation */
+static
+int iso_extract_progress(void *handle)
+{
+    if (iso_extract_is_aborted((struct iso_extract *) handle))
+        return ISO_CANCELED;
+    return ISO_SUCCESS;
+}
+
+
+/* Copy the content of a file from its IsoStream.
+*/
+static
+int iso_extract_copy_stream(struct iso_extract *x, struct iso_extract_file *f,
+                            char *buf)
+{
+    int ret, err = 0;
+    ssize_t w;
+    size_t done;
+    IsoStream *stream;
+
+    stream = ((IsoFile *) f->node)->stream;
+    if (iso_extract_open_file(x, f) != 0) {
+        iso_extract_report(x, f->path, "create", f->failed);
+        return ISO_SUCCESS;
+    }
+    ret = iso_stream_open(stream);
+    if (ret < 0) {
+        err = ret;
+        goto ex;
+    }
+    while (1) {
+        ret = iso_stream_read(stream, buf, ISO_EXTRACT_STREAM_BUF);
+        if (ret < 0) {
+            err = ret;
+    break;
+        }
+        if (ret == 0)
+    break;
+        for (done = 0; done < (size_t) ret; done += w) {
+            w = write(f->fd, buf + done, ret - done);
+            if (w == -1 && errno == EINTR) {
+                w = 0;
+        continue;
+            }
+            if (w <= 0) {
+                err = (w == 0 ? EIO : errno);
+        break;
+            }
+        }
+        if (err != 0)
+    break;
+    }
+    iso_stream_close(stream);
+ex:;
+    if (err != 0) {
+        f->failed = err;
+        iso_extract_report(x, f->path,
+                           err < 0 ? "read content of" : "write", err);
+    }
+    iso_extract_finish_file(x, f);
+    return ISO_SUCCESS;
+}
+
+
+/* Obtain a new entry in x->files or x->dirs.
+   @param flag bit0= directory
+*/
+static
+int iso_extract_new_entry(struct iso_extract *x, IsoNode *node, char *path,
+                          struct iso_extract_file **entry, int flag)
+{
+    int ret, *num, *size;
+    struct iso_extract_file **list, *l;
+
+    if (flag & 1) {
+        list = &x->dirs;
+        num = &x->num_dirs;
+        size = &x->dirs_size;
+    } else {
+        list = &x->files;
+        num = &x->num_files;
+        size = &x->files_size;
+    }
+    ret = iso_rpool_grow_list((void **) list, *num, size,
+                              sizeof(struct iso_extract_file));
+    if (ret < 0)
+        return ret;
+    l = *list + *num;
+    l->node = node;
+    l->path = strdup(path);
+    if (l->path == NULL)
+        return ISO_OUT_OF_MEM;
+    l->direct = 0;
+    l->fd = -1;
+    l->opening = 0;
+    l->pending = 0;
+    l->failed = 0;
+    (*num)++;
+    *entry = l;
+    return ISO_SUCCESS;
+}
+
+
+static
+int iso_extract_add_file(struct iso_extract *x, IsoFile *file, char *path)
+{
+    int ret, i, idx, section_count = 0;
+    off_t offset = 0;
+    struct iso_file_section *sections = NULL;
+    struct iso_extract_file *f;
+    IsoStream *stream;
+
+    ret = iso_extract_new_entry(x, (IsoNode *) file, path, &f, 0);
+    if (ret < 0)
+        return ret;
+    idx = f - x->files;
+
+    /* Unfiltered content from the imported ISO can be read directly */
+    stream = file->stream;
+    if (x->src != NULL && file->from_old_session &&
+        iso_stream_get_input_stream(stream, 0) == NULL &&
+        strncmp(stream->class->type, "fsrc", 4) == 0) {
+        ret = iso_file_get_old_image_sections(file, &section_count,
+                                              &sections, 0);
+        if (ret == 1)
+            f->direct = 1;
+    }
+    if (!f->direct)
+        {ret = ISO_SUCCESS; goto ex;}
+
+    for (i = 0; i < section_count; i++)
+        f->pending += sections[i].size;
+    if (f->pending == 0) {
+        if (iso_extract_open_file(x, f) != 0)
+            iso_extract_report(x, f->path, "create", f->failed);
+        else
+            iso_extract_finish_file(x, f);
+        {ret = ISO_SUCCESS; goto ex;}
+    }
+    for (i = 0; i < section_count; i++) {
+        ret = iso_rpool_add_extent(x->pool, sections[i].block,
+                                   DIV_UP(sections[i].size, BLOCK_SIZE),
+                                   sections[i].size, offset, idx);
+        if (ret < 0)
+            goto ex;
+        offset += sections[i].size;
+    }
+    ret = ISO_SUCCESS;
+ex:;
+    if (sections != NULL)
+        free(sections);
+    return ret;
+}
+
+
+/* Create the node in the local filesystem. Directories get descended.
+   Data files get registered for copying their content.
+*/
+static
+int iso_extract_node(struct iso_extract *x, IsoNode *node, char *path)
+{
+    int ret, err;
+    char *child_path = NULL;
+    struct stat stbuf;
+    struct iso_extract_file *entry;
+    IsoNode *pos;
+
+    if (iso_extract_is_aborted(x))
+        return ISO_CANCELED;
+
+    switch (node->type) {
+    case LIBISO_DIR:
+        if (mkdir(path, 0700) == -1) {
+            err = errno;
+            if (err != EEXIST || stat(path, &stbuf) == -1 ||
+                !S_ISDIR(stbuf.st_mode)) {
+                iso_extract_report(x, path, "create directory", err);
+                return ISO_SUCCESS;
+            }
+        }
+        ret = iso_extract_new_entry(x, node, path, &entry, 1);
+        if (ret < 0)
+            return ret;
+        ret = iso_tree_cow_load((IsoDir *) node, 0);
+        if (ret < 0)
+            return ret;
+        for (pos = iso_tree_cow_child((IsoDir *) node, NULL); pos != NULL;
+             pos = iso_tree_cow_child((IsoDir *) node, pos)) {
+            LIBISO_ALLOC_MEM(child_path, char,
+                             strlen(path) + strlen(pos->name) + 2);
+            sprintf(child_path, "%s/%s", path, pos->name);
+            ret = iso_extract_node(x, pos, child_path);
+            LIBISO_FREE_MEM(child_path);
+            child_path = NULL;
+            if (ret < 0)
+                return ret;
+        }
+        break;
+    case LIBISO_FILE:
+        return iso_extract_add_file(x, (IsoFile *) node, path);
+    case LIBISO_SYMLINK:
+        err = iso_extract_make_room(x, path);
+        if (err == 0 && symlink(((IsoSymlink *) node)->dest, path) == -1)
+            err = errno;
+        if (err != 0) {
+            iso_extract_report(x, path, "create symbolic link", err);
+            break;
+        }
+        iso_extract_set_attrs(x, node, path, 1);
+        break;
+    case LIBISO_SPECIAL:
+        err = iso_extract_make_room(x, path);
+        if (err == 0 && mknod(path, (node->mode & S_IFMT) | 0600,
+                              ((IsoSpecial *) node)->dev) == -1)
+            err = errno;
+        if (err != 0) {
+            iso_extract_report(x, path, "create special file", err);
+            break;
+        }
+        iso_extract_set_attrs(x, node, path, 0);
+        break;
+    case LIBISO_BOOT:
+        /* El Torito boot catalogs have no counterpart on disk */
+        break;
+    }
+    ret = ISO_SUCCESS;
+ex:;
+    return ret;
+}
+
+
+/* API */
+int iso_image_extract_tree(IsoImage *image, char *iso_path, char *disk_path,
+                           int threads, int flag)
+{
+    int ret, i, src_is_open = 0;
+    char *buf = NULL;
+    IsoNode *node;
+    struct iso_extract xd, *x = &xd;
+
+    if (image == NULL || iso_path == NULL || disk_path == NULL)
+        return ISO_NULL_POINTER;
+    if (threads < 0)
+        return ISO_WRONG_ARG_VALUE;
+    if (threads > ISO_RPOOL_MAX_THREADS)
+        threads = ISO_RPOOL_MAX_THREADS;
+
+    memset(x, 0, sizeof(struct iso_extract));
+    x->image = image;
+    x->flag = flag;
+    pthread_mutex_init(&x->mutex, NULL);
+    pthread_cond_init(&x->opened, NULL);
+    ret = iso_rpool_new(&x->pool, iso_extract_write_piece,
+                        iso_extract_progress, x, 0);
+    if (ret < 0)
+        goto ex;
+
+    ret = iso_image_path_to_node(image, iso_path, &node);
+    if (ret < 0)
+        goto ex;
+    if (ret != 1)
+        {ret = ISO_FILE_DOESNT_EXIST; goto ex;}
+
+    /* Create the tree and learn about the file content */
+    x->src = image->import_src;
+    ret = iso_extract_node(x, node, disk_path);
+    if (ret < 0)
+        goto ex;
+
+    /* The data source gets opened only now, because the IsoFilesystem of
+       the imported image opens it too when the tree walk loads directories
+       or when IsoStream of the image get read.
+    */
+    if (x->pool->num_extents > 0) {
+        ret = x->src->open(x->src);
+        if (ret >= 0) {
+            src_is_open = 1;
+        } else if (ret != (int) ISO_FILE_ALREADY_OPENED) {
+            /* Read the content via the IsoStream of the files */
+            for (i = 0; i < x->num_files; i++)
+                if (x->files[i].pending > 0)
+                    x->files[i].direct = 0;
+            x->pool->num_extents = 0;
+        }
+    }
+
+    /* Returns only after all read content is written */
+    ret = iso_rpool_run(x->pool, x->src, threads);
+    if (src_is_open)
+        x->src->close(x->src);
+    src_is_open = 0;
+    if (ret < 0)
+        goto ex;
+
+    LIBISO_ALLOC_MEM(buf, char, ISO_EXTRACT_STREAM_BUF);
+    for (i = 0; i < x->num_files; i++) {
+        if (x->files[i].direct)
+    continue;
+        if (iso_extract_is_aborted(x))
+            {ret = ISO_CANCELED; goto ex;}
+        ret = iso_extract_copy_stream(x, x->files + i, buf);
+        if (ret < 0)
+            goto ex;
+    }
+    ret = ISO_SUCCESS;
+ex:;
+    /* Directory attributes last, and those of the deepest first, so that
+       the permissions do not hamper the creation of their content and the
+       timestamps do not get changed by it.
+    */
+    if (ret >= 0)
+        for (i = x->num_dirs - 1; i >= 0; i--)
+            iso_extract_set_attrs(x, x->dirs[i].node, x->dirs[i].path, 0);
+
+    if (src_is_open)
+        x->src->close(x->src);
+    for (i = 0; i < x->num_files; i++) {
+        if (x->files[i].fd != -1)
+            close(x->files[i].fd);
+        free(x->files[i].path);
+    }
+    for (i = 0; i < x->num_dirs; i++)
+        free(x->dirs[i].path);
+    LIBISO_FREE_MEM(x->files);
+    LIBISO_FREE_MEM(x->dirs);
+    iso_rpool_destroy(&x->pool);
+    LIBISO_FREE_MEM(buf);
+    pthread_mutex_destroy(&x->mutex);
+    pthread_cond_destroy(&x->opened);
+    if (ret < 0)
+        return ret;
+    if (x->aborted)
+        return ISO_CANCELED;
+    return x->failures == 0;
+}
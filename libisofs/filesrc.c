@@ -66,7 +66,41 @@ int iso_file_src_cmp(const void *n1, const void *n2)
     return ret;
 }
 
+/* Let the attributes of the newly created fsrc replace those of the equal
+   IsoFileSrc old, if fsrc comes first in the sequential order of tree
+   building.
+*/
+static
+void iso_file_src_take_first(IsoFileSrc *old, IsoFileSrc *fsrc)
+{
+    IsoFileSrc swap;
+
+    if (fsrc->creator_tree > old->creator_tree ||
+        (fsrc->creator_tree == old->creator_tree &&
+         fsrc->creator_seq >= old->creator_seq))
+        return;
+    iso_stream_ref(fsrc->stream);
+    swap = *old;
+    old->no_write = fsrc->no_write;
+    old->sections = fsrc->sections;
+    old->nsections = fsrc->nsections;
+    old->sort_weight = fsrc->sort_weight;
+    old->stream = fsrc->stream;
+    old->creator_tree = fsrc->creator_tree;
+    old->creator_seq = fsrc->creator_seq;
+
+    /* The caller will dispose the sections of fsrc */
+    fsrc->sections = swap.sections;
+    iso_stream_unref(swap.stream);
+}
+
 int iso_file_src_create(Ecma119Image *img, IsoFile *file, IsoFileSrc **src)
+{
+    return iso_file_src_create_in_tree(img, file, src, ISO_LOW_TREE_ECMA119);
+}
+
+int iso_file_src_create_in_tree(Ecma119Image *img, IsoFile *file,
+                                IsoFileSrc **src, int tree)
 {
     int ret, i;
     IsoFileSrc *fsrc;
@@ -125,7 +159,21 @@ int iso_file_src_create(Ecma119Image *img, IsoFile *file, IsoFileSrc **src)
     fsrc->stream = file->stream;
 
     /* insert the filesrc in the tree */
-    ret = iso_rbtree_insert(img->files, fsrc, (void**)src);
+    if (img->trees_concurrent) {
+        fsrc->creator_tree = tree;
+        fsrc->creator_seq = img->tree_seq[tree]++;
+        ecma119_tree_lock(img, 0);
+        ret = iso_rbtree_insert(img->files, fsrc, (void**)src);
+        if (ret == 0)
+            iso_file_src_take_first(*src, fsrc);
+        else if (ret > 0)
+            iso_stream_ref(fsrc->stream);
+        ecma119_tree_lock(img, 1);
+    } else {
+        ret = iso_rbtree_insert(img->files, fsrc, (void**)src);
+        if (ret > 0)
+            iso_stream_ref(fsrc->stream);
+    }
     if (ret <= 0) {
         if (ret == 0 && (*src)->checksum_index > 0 &&
             !img->opts->will_cancel) {
@@ -139,7 +187,6 @@ int iso_file_src_create(Ecma119Image *img, IsoFile *file, IsoFileSrc **src)
         free(fsrc);
         return ret;
     }
-    iso_stream_ref(fsrc->stream);
 
     if ((img->opts->md5_file_checksums & 1) &&
         file->from_old_session && img->opts->appendable) {
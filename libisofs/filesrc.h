@@ -58,6 +58,13 @@ struct Iso_File_Src
 
     int sort_weight;
     IsoStream *stream;
+
+    /* The position of the creating call in the sequential order of tree
+       building. Valid only while the low level trees get built
+       concurrently. See iso_file_src_create_in_tree().
+    */
+    int creator_tree;
+    uint32_t creator_seq;
 };
 
 int iso_file_src_cmp(const void *n1, const void *n2);
@@ -81,6 +88,19 @@ int iso_file_src_cmp(const void *n1, const void *n2);
  */
 int iso_file_src_create(Ecma119Image *img, IsoFile *file, IsoFileSrc **src);
 
+/**
+ * Like iso_file_src_create(), but to be used by the builders of the low level
+ * trees, which may run concurrently in ecma119_image_new().
+ * If several IsoFile objects map to the same IsoFileSrc, then the one which
+ * would have been the first in sequential building determines the
+ * attributes of the IsoFileSrc.
+ *
+ * @param tree
+ *      The calling tree builder. One of ISO_LOW_TREE_*.
+ */
+int iso_file_src_create_in_tree(Ecma119Image *img, IsoFile *file,
+                                IsoFileSrc **src, int tree);
+
 /**
  * Add a given IsoFileSrc to the given image target.
  *
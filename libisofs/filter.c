@@ -15,6 +15,7 @@
 #include "libisofs.h"
 #include "filter.h"
 #include "node.h"
+#include "tree.h"
 
 
 void iso_filter_ref(FilterContext *filter)
@@ -49,6 +50,7 @@ int iso_file_add_filter(IsoFile *file, FilterContext *filter, int flag)
     if (ret < 0) {
         return ret;
     }
+    iso_tree_cow_detach((IsoNode *) file);
     iso_stream_unref(original);
     file->stream = filtered;
     return ISO_SUCCESS;
@@ -63,6 +65,7 @@ int iso_file_remove_filter(IsoFile *file, int flag)
     input_stream = iso_stream_get_input_stream(file_stream, 0);
     if (input_stream == NULL)
         return 0;
+    iso_tree_cow_detach((IsoNode *) file);
     file->stream = input_stream;
     iso_stream_ref(input_stream); /* Protect against _unref(file_stream) */
     iso_stream_unref(file_stream);
@@ -32,6 +32,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
 
 #ifdef Libisofs_with_zliB
 #include <zlib.h>
@@ -89,6 +90,16 @@ static uint64_t ziso_block_pointer_mgt(uint64_t num, int mode);
  */
 #define ISO_ZISOFS_KBF_RATIO  -1.0 
 
+/* Default number of zisofs blocks which get read by a single input read and
+ * then uncompressed in parallel, if uncompression threads are enabled.
+ * The uncompressed size of such a batch is limited by
+ * ISO_ZISOFS_BATCH_MAX_BYTES.
+ */
+#define ISO_ZISOFS_BATCH_BLOCKS 16
+#define ISO_ZISOFS_BATCH_MAX_BYTES (8 * 1024 * 1024)
+
+#define ISO_ZISOFS_MAX_THREADS 64
+
 
 /* --------------------------- Runtime parameters ------------------------- */
 
@@ -106,6 +117,12 @@ static int64_t ziso_max_file_blocks = ISO_ZISOFS_MAX_BLOCKS_F;
 static int64_t ziso_many_block_limit = ISO_ZISOFS_MANY_BLOCKS;
 static double ziso_keep_blocks_free_ratio = ISO_ZISOFS_KBF_RATIO;
 
+/* Threads for uncompressing batches of blocks during sequential reading.
+ * 0 disables batch reading.
+ */
+static int ziso_uncompress_threads = 0;
+static int ziso_uncompress_batch = ISO_ZISOFS_BATCH_BLOCKS;
+
 /* Discard block pointers on last stream close even if the size constraints
  * are not met. To be set to 1 at block pointer overflow. To be set to 0
  * when all compression filters are deleted.
@@ -156,6 +173,53 @@ int ziso_decide_bs_log2(off_t orig_size)
 /* --------------------------- ZisofsFilterRuntime ------------------------- */
 
 
+/* Number of uncompressed blocks which an uncompression stream keeps after
+   iso_stream_zisofs_lseek() was used. Jumping back and forth within a few
+   blocks then does not uncompress them again.
+*/
+#define ISO_ZISOFS_LRU_BLOCKS 8
+
+struct ziso_lru_block
+{
+    int64_t block_pointer_idx; /* -1 = slot is empty */
+    int fill;
+    char *data;
+    uint64_t last_use;
+};
+
+/* Blocks which were read by a single input read and uncompressed by the
+   calling thread together with the worker threads of the batch.
+*/
+struct ziso_batch
+{
+    int capacity; /* Maximum number of blocks */
+
+    /* Copies of the runtime properties which the workers need */
+    uint64_t *block_pointers;
+    int64_t block_pointer_fill;
+    int block_size;
+    off_t size;
+
+    int64_t first; /* block pointer index of the end of the first block */
+    int count;
+    char *in;
+    size_t in_size;
+    size_t in_fill;
+    char *out;     /* capacity * block_size bytes */
+    int *fill;
+    int *ret;      /* 1= block is ready, 0= input ended, <0= error */
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_t *threads;
+    int num_threads;
+    int next_job;
+    int finished;
+    int shutdown;
+};
+
+
 /* Individual runtime properties exist only as long as the stream is opened.
  */
 typedef struct
@@ -182,14 +246,37 @@ typedef struct
     off_t in_counter;
     off_t out_counter;
 
+    /* Uncompression: read position in the input stream, counted in the
+       coordinates of block_pointers.
+    */
+    off_t orig_pos;
+
+    /* Uncompressed blocks for random access. NULL until the first call of
+       iso_stream_zisofs_lseek().
+    */
+    struct ziso_lru_block *lru;
+    uint64_t lru_counter;
+
+    /* Parallel uncompression of sequentially read blocks. NULL until the
+       first batch gets read. batch_failed is set if a batch read failed, so
+       that each block gets read separately and errors show up at the same
+       block as without batches.
+    */
+    struct ziso_batch *batch;
+    int batch_failed;
+
     int error_ret;
 
 } ZisofsFilterRuntime;
 
 
+static
+void ziso_batch_destroy(struct ziso_batch **batch);
+
 static
 int ziso_running_destroy(ZisofsFilterRuntime **running, int flag)
 {
+    int i;
     ZisofsFilterRuntime *o= *running;
     if (o == NULL)
         return 0;
@@ -201,6 +288,14 @@ int ziso_running_destroy(ZisofsFilterRuntime **running, int flag)
         free(o->read_buffer);
     if (o->block_buffer != NULL)
         free(o->block_buffer);
+    if (o->lru != NULL) {
+        for (i = 0; i < ISO_ZISOFS_LRU_BLOCKS; i++)
+            if (o->lru[i].data != NULL)
+                free(o->lru[i].data);
+        free((char *) o->lru);
+    }
+    if (o->batch != NULL)
+        ziso_batch_destroy(&(o->batch));
     free((char *) o);
     *running = NULL;
     return 1;
@@ -233,6 +328,11 @@ int ziso_running_new(ZisofsFilterRuntime **running, off_t orig_size,
     o->block_counter = 0;
     o->in_counter = 0;
     o->out_counter = 0;
+    o->orig_pos = 0;
+    o->lru = NULL;
+    o->lru_counter = 0;
+    o->batch = NULL;
+    o->batch_failed = 0;
     o->error_ret = 0;
 
     if (flag & 1)
@@ -937,6 +1037,458 @@ int ziso_parse_zisofs_head(IsoStream *stream, uint8_t *ziso_algo_num,
 }
 
 
+#ifdef Libisofs_with_zliB
+
+/* Read the file header and the block pointers of an uncompression stream.
+   @param flag bit0= only read the header and set data->size
+   @return     1= block pointers are read, 0= only the header was read,
+               <0= error
+*/
+static
+int ziso_uncompress_head(IsoStream *stream, int flag)
+{
+    int ret, header_size, bs_log2, block_max = 1, blpt_size;
+    ZisofsFilterStreamData *data;
+    ZisofsFilterRuntime *rng;
+    ZisofsUncomprStreamData *nstd;
+    uint64_t uncompressed_size;
+    int64_t i;
+    uint8_t algo_num, *rpt, *wpt;
+
+    data = stream->data;
+    nstd = stream->data;
+    rng= data->running;
+
+    /* Reading file header */
+    ret = ziso_parse_zisofs_head(data->orig, &algo_num, &header_size,
+                                 &bs_log2, &uncompressed_size, 2);
+    if (ret < 0)
+        return (rng->error_ret = ret);
+    if (algo_num == 0)
+        blpt_size = 4;
+    else
+        blpt_size = 8;
+    nstd->header_size_div4 = header_size;
+    header_size *= 4;
+    data->size = uncompressed_size;
+    nstd->block_size_log2 = bs_log2;
+    rng->block_size = 1 << bs_log2;
+
+    if (flag & 1)
+        return 0;
+
+    /* Create and read pointer array */
+    rng->block_pointer_rpos = 0;
+    rng->block_pointer_fill = data->size / rng->block_size
+                             + 1 + !!(data->size % rng->block_size);
+    if (rng->block_pointer_fill > ziso_max_file_blocks) {
+        rng->block_pointer_fill = 0;
+        return (rng->error_ret = ISO_ZISOFS_TOO_LARGE);
+    }
+    if (ziso_block_pointer_mgt((uint64_t) rng->block_pointer_fill, 1)
+        == 0)
+        return ISO_ZISOFS_TOO_MANY_PTR;
+    rng->block_pointers = calloc(rng->block_pointer_fill, 8);
+    if (rng->block_pointers == NULL) {
+        ziso_block_pointer_mgt((uint64_t) rng->block_pointer_fill, 2);
+        rng->block_pointer_fill = 0;
+        return (rng->error_ret = ISO_OUT_OF_MEM);
+    }
+    ret = iso_stream_read(data->orig, rng->block_pointers,
+                          rng->block_pointer_fill * blpt_size);
+    if (ret < 0)
+        return (rng->error_ret = ret);
+    if (algo_num == 0) {
+        /* Spread 4 byte little-endian pointer values over 8 byte */
+        rpt = ((uint8_t *) rng->block_pointers)
+              + rng->block_pointer_fill * 4;
+        wpt = ((uint8_t *) rng->block_pointers)
+              + rng->block_pointer_fill * 8;
+        while (rpt > ((uint8_t *) rng->block_pointers) + 4) {
+            rpt -= 4;
+            wpt -= 8;
+            memcpy(wpt, rpt, 4);
+            memset(wpt + 4, 0, 4);
+        }
+        memset(((uint8_t *) rng->block_pointers) + 4, 0, 4);
+    }
+    if (ret != rng->block_pointer_fill * blpt_size)
+       return (rng->error_ret = ISO_ZISOFS_WRONG_INPUT);
+    for (i = 0; i < rng->block_pointer_fill; i++) {
+         rng->block_pointers[i] =
+                 iso_read_lsb64((uint8_t *) (rng->block_pointers + i));
+         if (i > 0)
+             if ((int) (rng->block_pointers[i] -
+                        rng->block_pointers[i - 1])
+                 > block_max)
+                 block_max = rng->block_pointers[i]
+                             - rng->block_pointers[i - 1];
+    }
+    /* The first data block follows the pointers */
+    rng->orig_pos = rng->block_pointers[0];
+
+    rng->read_buffer = calloc(block_max, 1);
+    rng->block_buffer = calloc(rng->block_size, 1);
+    if (rng->read_buffer == NULL || rng->block_buffer == NULL)
+        return (rng->error_ret = ISO_OUT_OF_MEM);
+    rng->state = 2; /* block pointers are read */
+    rng->buffer_fill = rng->buffer_rpos = 0;
+    return 1;
+}
+
+
+/* Look up or store the content of rng->block_buffer in rng->lru.
+   @param flag bit0= store rather than look up
+   @return     1= found resp. stored, 0= not found
+*/
+static
+int ziso_lru_block(ZisofsFilterRuntime *rng, int64_t i, int flag)
+{
+    int j, victim = 0;
+    struct ziso_lru_block *slot;
+
+    if (rng->lru == NULL)
+        return 0;
+    for (j = 0; j < ISO_ZISOFS_LRU_BLOCKS; j++) {
+        slot = rng->lru + j;
+        if (slot->block_pointer_idx == i) {
+            if (!(flag & 1)) {
+                memcpy(rng->block_buffer, slot->data, slot->fill);
+                rng->buffer_fill = slot->fill;
+            }
+            slot->last_use = ++(rng->lru_counter);
+            return 1;
+        }
+        if (slot->last_use < rng->lru[victim].last_use)
+            victim = j;
+    }
+    if (!(flag & 1))
+        return 0;
+    slot = rng->lru + victim;
+    if (slot->data == NULL) {
+        slot->data = calloc(rng->block_size, 1);
+        if (slot->data == NULL)
+            return 0; /* The cache is only an optimization */
+    }
+    memcpy(slot->data, rng->block_buffer, rng->buffer_fill);
+    slot->fill = rng->buffer_fill;
+    slot->block_pointer_idx = i;
+    slot->last_use = ++(rng->lru_counter);
+    return 1;
+}
+
+
+/* Uncompress block j of a batch. This is done by the calling thread and the
+   worker threads at the same time.
+*/
+static
+void ziso_batch_inflate(struct ziso_batch *b, int j)
+{
+    int ret;
+    int64_t i;
+    uint64_t todo, off;
+    off_t pos;
+    uLongf buf_len;
+    char *out;
+
+    i = b->first + j;
+    out = b->out + ((size_t) j) * b->block_size;
+    todo = b->block_pointers[i] - b->block_pointers[i - 1];
+    if (todo == 0) {
+        memset(out, 0, b->block_size);
+        b->fill[j] = b->block_size;
+        pos = ((off_t) (i - 1)) * b->block_size;
+        if (pos + b->fill[j] > b->size && i == b->block_pointer_fill - 1)
+            b->fill[j] = b->size - pos;
+        b->ret[j] = 1;
+        return;
+    }
+    off = b->block_pointers[i - 1] - b->block_pointers[b->first - 1];
+    if (off >= b->in_fill) {
+        /* The input stream ended before this block */
+        b->ret[j] = 0;
+        return;
+    }
+    if (off + todo > b->in_fill)
+        todo = b->in_fill - off;
+    buf_len = b->block_size;
+    ret = uncompress((Bytef *) out, &buf_len, (Bytef *) b->in + off,
+                     (uLong) todo);
+    if (ret != Z_OK) {
+        b->ret[j] = ISO_ZLIB_COMPR_ERR;
+        return;
+    }
+    b->fill[j] = buf_len;
+    if ((int) buf_len < b->block_size && i != b->block_pointer_fill - 1) {
+        b->ret[j] = ISO_ZISOFS_WRONG_INPUT;
+        return;
+    }
+    b->ret[j] = 1;
+}
+
+
+static
+void *ziso_batch_worker(void *arg)
+{
+    int j;
+    struct ziso_batch *b = arg;
+
+    pthread_mutex_lock(&b->mutex);
+    while (1) {
+        while (!b->shutdown && b->next_job >= b->count)
+            pthread_cond_wait(&b->work, &b->mutex);
+        if (b->shutdown)
+    break;
+        j = b->next_job++;
+        pthread_mutex_unlock(&b->mutex);
+        ziso_batch_inflate(b, j);
+        pthread_mutex_lock(&b->mutex);
+        if (++(b->finished) == b->count)
+            pthread_cond_signal(&b->done);
+    }
+    pthread_mutex_unlock(&b->mutex);
+    return NULL;
+}
+
+
+static
+void ziso_batch_destroy(struct ziso_batch **batch)
+{
+    int i;
+    struct ziso_batch *b = *batch;
+
+    if (b == NULL)
+        return;
+    pthread_mutex_lock(&b->mutex);
+    b->shutdown = 1;
+    pthread_cond_broadcast(&b->work);
+    pthread_mutex_unlock(&b->mutex);
+    for (i = 0; i < b->num_threads; i++)
+        pthread_join(b->threads[i], NULL);
+    pthread_mutex_destroy(&b->mutex);
+    pthread_cond_destroy(&b->work);
+    pthread_cond_destroy(&b->done);
+    LIBISO_FREE_MEM(b->threads);
+    LIBISO_FREE_MEM(b->in);
+    LIBISO_FREE_MEM(b->out);
+    LIBISO_FREE_MEM(b->fill);
+    LIBISO_FREE_MEM(b->ret);
+    free((char *) b);
+    *batch = NULL;
+}
+
+
+static
+int ziso_batch_new(ZisofsFilterRuntime *rng, int capacity)
+{
+    int ret, i;
+    struct ziso_batch *b = NULL;
+
+    LIBISO_ALLOC_MEM(b, struct ziso_batch, 1);
+    b->capacity = capacity;
+    b->count = 0;
+    b->in = NULL;
+    b->in_size = 0;
+    b->out = NULL;
+    b->fill = NULL;
+    b->ret = NULL;
+    b->threads = NULL;
+    b->num_threads = 0;
+    b->next_job = 0;
+    b->finished = 0;
+    b->shutdown = 0;
+    pthread_mutex_init(&b->mutex, NULL);
+    pthread_cond_init(&b->work, NULL);
+    pthread_cond_init(&b->done, NULL);
+    rng->batch = b;
+
+    LIBISO_ALLOC_MEM(b->out, char, ((size_t) capacity) * rng->block_size);
+    LIBISO_ALLOC_MEM(b->fill, int, capacity);
+    LIBISO_ALLOC_MEM(b->ret, int, capacity);
+    LIBISO_ALLOC_MEM(b->threads, pthread_t, ziso_uncompress_threads);
+    for (i = 0; i < ziso_uncompress_threads; i++) {
+        /* If thread creation fails, then the calling thread does more work */
+        if (pthread_create(&(b->threads[i]), NULL, ziso_batch_worker, b) != 0)
+    break;
+        b->num_threads++;
+    }
+    ret = ISO_SUCCESS;
+ex:;
+    if (ret < 0 && rng->batch != NULL)
+        ziso_batch_destroy(&(rng->batch));
+    return ret;
+}
+
+
+/* Read the compressed data of several blocks by a single input read and
+   uncompress them by the calling thread and the worker threads.
+   @return 1= batch starting at block pointer i is ready,
+           0= no batch was read, <0= error
+*/
+static
+int ziso_batch_fill(IsoStream *stream, int64_t i)
+{
+    int ret, n, j;
+    off_t pos;
+    size_t need, got = 0;
+    char *new_in;
+    ZisofsFilterStreamData *data;
+    ZisofsFilterRuntime *rng;
+    struct ziso_batch *b;
+
+    data = stream->data;
+    rng= data->running;
+
+    n = ziso_uncompress_batch;
+    if (n > ISO_ZISOFS_BATCH_MAX_BYTES / rng->block_size)
+        n = ISO_ZISOFS_BATCH_MAX_BYTES / rng->block_size;
+    if (rng->batch != NULL && n > rng->batch->capacity)
+        n = rng->batch->capacity;
+    if (n > rng->block_pointer_fill - i)
+        n = rng->block_pointer_fill - i;
+    if (n < 2)
+        return 0;
+    if (rng->batch == NULL) {
+        ret = ziso_batch_new(rng, n);
+        if (ret < 0)
+            return ret;
+    }
+    b = rng->batch;
+
+    need = rng->block_pointers[i - 1 + n] - rng->block_pointers[i - 1];
+    if (need > b->in_size) {
+        new_in = realloc(b->in, need);
+        if (new_in == NULL)
+            return ISO_OUT_OF_MEM;
+        b->in = new_in;
+        b->in_size = need;
+    }
+    if (need > 0) {
+        pos = rng->block_pointers[i - 1];
+        if (rng->orig_pos != pos) {
+            pos = iso_stream_set_read_pos(data->orig, pos, rng->orig_pos, 0);
+            if (pos < 0)
+                return (int) pos;
+            rng->orig_pos = pos;
+        }
+        ret = iso_stream_read_buffer(data->orig, b->in, need, &got);
+        if (ret < 0) {
+            /* Let the reading of single blocks meet the error */
+            rng->batch_failed = 1;
+            rng->orig_pos = -1;
+            return 0;
+        }
+        rng->orig_pos += got;
+        rng->in_counter += got;
+    }
+
+    b->block_pointers = rng->block_pointers;
+    b->block_pointer_fill = rng->block_pointer_fill;
+    b->block_size = rng->block_size;
+    b->size = data->size;
+    b->first = i;
+    b->in_fill = got;
+
+    pthread_mutex_lock(&b->mutex);
+    b->count = n;
+    b->next_job = 0;
+    b->finished = 0;
+    pthread_cond_broadcast(&b->work);
+    while (b->next_job < b->count) {
+        j = b->next_job++;
+        pthread_mutex_unlock(&b->mutex);
+        ziso_batch_inflate(b, j);
+        pthread_mutex_lock(&b->mutex);
+        b->finished++;
+    }
+    while (b->finished < b->count)
+        pthread_cond_wait(&b->done, &b->mutex);
+    pthread_mutex_unlock(&b->mutex);
+    return 1;
+}
+
+
+/* Uncompress the data block which ends at block pointer i into
+   rng->block_buffer and set rng->buffer_fill.
+   @param flag bit0= sequential reading: read and uncompress a batch of
+                     blocks if uncompression threads are enabled
+   @return 1= block is ready, 0= input stream ended, <0= error
+*/
+static
+int ziso_uncompress_block(IsoStream *stream, int64_t i, int flag)
+{
+    int ret, todo, j;
+    off_t pos;
+    struct ziso_batch *b;
+    ZisofsFilterStreamData *data;
+    ZisofsFilterRuntime *rng;
+    uLongf buf_len;
+
+    data = stream->data;
+    rng= data->running;
+
+    if (ziso_lru_block(rng, i, 0))
+        return 1;
+    b = rng->batch;
+    if ((b == NULL || i < b->first || i >= b->first + b->count) &&
+        (flag & 1) && ziso_uncompress_threads > 0 && !rng->batch_failed) {
+        ret = ziso_batch_fill(stream, i);
+        if (ret < 0)
+            return ret;
+        b = rng->batch;
+    }
+    if (b != NULL && i >= b->first && i < b->first + b->count) {
+        j = i - b->first;
+        if (b->ret[j] != 1)
+            return b->ret[j];
+        memcpy(rng->block_buffer, b->out + ((size_t) j) * b->block_size,
+               b->fill[j]);
+        rng->buffer_fill = b->fill[j];
+        ziso_lru_block(rng, i, 1);
+        return 1;
+    }
+
+    todo = rng->block_pointers[i] - rng->block_pointers[i- 1];
+    if (todo == 0) {
+        memset(rng->block_buffer, 0, rng->block_size);
+        rng->buffer_fill = rng->block_size;
+        pos = ((off_t) (i - 1)) * rng->block_size;
+        if (pos + rng->buffer_fill > data->size &&
+            i == rng->block_pointer_fill - 1)
+            rng->buffer_fill = data->size - pos;
+    } else {
+        pos = rng->block_pointers[i - 1];
+        if (rng->orig_pos != pos) {
+            /* Not the block after the previous one */
+            pos = iso_stream_set_read_pos(data->orig, pos, rng->orig_pos, 0);
+            if (pos < 0)
+                return (int) pos;
+            rng->orig_pos = pos;
+        }
+        ret = iso_stream_read(data->orig, rng->read_buffer, todo);
+        if (ret == 0)
+            return 0;
+        if (ret < 0)
+            return ret;
+        rng->orig_pos += ret;
+        rng->in_counter += ret;
+        buf_len = rng->block_size;
+        ret = uncompress((Bytef *) rng->block_buffer, &buf_len,
+                         (Bytef *) rng->read_buffer, (uLong) ret);
+        if (ret != Z_OK)
+            return ISO_ZLIB_COMPR_ERR;
+        rng->buffer_fill = buf_len;
+        if ((int) buf_len < rng->block_size &&
+            i != rng->block_pointer_fill - 1)
+            return ISO_ZISOFS_WRONG_INPUT;
+    }
+    ziso_lru_block(rng, i, 1);
+    return 1;
+}
+
+#endif /* Libisofs_with_zliB */
+
+
 /* Note: A call with desired==0 directly after .open() only checks the file
          head and loads the uncompressed size from that head.
 */
@@ -946,22 +1498,17 @@ int ziso_stream_uncompress(IsoStream *stream, void *buf, size_t desired)
 
 #ifdef Libisofs_with_zliB
 
-    int ret, todo, header_size, bs_log2, block_max = 1, blpt_size;
+    int ret, todo;
     ZisofsFilterStreamData *data;
     ZisofsFilterRuntime *rng;
-    ZisofsUncomprStreamData *nstd;
     size_t fill = 0;
     char *cbuf = buf;
-    uLongf buf_len;
-    uint64_t uncompressed_size;
     int64_t i;
-    uint8_t algo_num, *rpt, *wpt;
 
     if (stream == NULL) {
         return ISO_NULL_POINTER;
     }
     data = stream->data;
-    nstd = stream->data;
     rng= data->running;
     if (rng == NULL) {
         return ISO_FILE_NOT_OPENED;
@@ -972,78 +1519,9 @@ int ziso_stream_uncompress(IsoStream *stream, void *buf, size_t desired)
 
     while (1) {
         if (rng->state == 0) {
-            /* Reading file header */
-            ret = ziso_parse_zisofs_head(data->orig, &algo_num, &header_size,
-                                         &bs_log2, &uncompressed_size, 2);
-            if (ret < 0)
-                return (rng->error_ret = ret);
-            if (algo_num == 0)
-                blpt_size = 4;
-            else
-                blpt_size = 8;
-            nstd->header_size_div4 = header_size;
-            header_size *= 4;
-            data->size = uncompressed_size;
-            nstd->block_size_log2 = bs_log2;
-            rng->block_size = 1 << bs_log2;
-
-            if (desired == 0)
-                return 0;
-
-            /* Create and read pointer array */
-            rng->block_pointer_rpos = 0;
-            rng->block_pointer_fill = data->size / rng->block_size
-                                     + 1 + !!(data->size % rng->block_size);
-            if (rng->block_pointer_fill > ziso_max_file_blocks) {
-                rng->block_pointer_fill = 0;
-                return (rng->error_ret = ISO_ZISOFS_TOO_LARGE);
-            }
-            if (ziso_block_pointer_mgt((uint64_t) rng->block_pointer_fill, 1)
-                == 0)
-                return ISO_ZISOFS_TOO_MANY_PTR;
-            rng->block_pointers = calloc(rng->block_pointer_fill, 8);
-            if (rng->block_pointers == NULL) {
-                ziso_block_pointer_mgt((uint64_t) rng->block_pointer_fill, 2);
-                rng->block_pointer_fill = 0;
-                return (rng->error_ret = ISO_OUT_OF_MEM);
-            }
-            ret = iso_stream_read(data->orig, rng->block_pointers,
-                                  rng->block_pointer_fill * blpt_size);
-            if (ret < 0)
-                return (rng->error_ret = ret);
-            if (algo_num == 0) {
-                /* Spread 4 byte little-endian pointer values over 8 byte */
-                rpt = ((uint8_t *) rng->block_pointers)
-                      + rng->block_pointer_fill * 4;
-                wpt = ((uint8_t *) rng->block_pointers)
-                      + rng->block_pointer_fill * 8;
-		while (rpt > ((uint8_t *) rng->block_pointers) + 4) {
-                    rpt -= 4;
-                    wpt -= 8;
-                    memcpy(wpt, rpt, 4);
-                    memset(wpt + 4, 0, 4);
-                }
-                memset(((uint8_t *) rng->block_pointers) + 4, 0, 4);
-            }
-            if (ret != rng->block_pointer_fill * blpt_size)
-               return (rng->error_ret = ISO_ZISOFS_WRONG_INPUT);
-            for (i = 0; i < rng->block_pointer_fill; i++) {
-                 rng->block_pointers[i] =
-                         iso_read_lsb64((uint8_t *) (rng->block_pointers + i));
-                 if (i > 0)
-                     if ((int) (rng->block_pointers[i] -
-                                rng->block_pointers[i - 1])
-                         > block_max)
-                         block_max = rng->block_pointers[i]
-                                     - rng->block_pointers[i - 1];
-            }
-
-            rng->read_buffer = calloc(block_max, 1);
-            rng->block_buffer = calloc(rng->block_size, 1);
-            if (rng->read_buffer == NULL || rng->block_buffer == NULL)
-                return (rng->error_ret = ISO_OUT_OF_MEM);
-            rng->state = 2; /* block pointers are read */
-            rng->buffer_fill = rng->buffer_rpos = 0;
+            ret = ziso_uncompress_head(stream, desired == 0);
+            if (ret <= 0)
+                return ret;
         }
 
         if (rng->state == 2 && rng->buffer_rpos >= rng->buffer_fill) {
@@ -1058,35 +1536,16 @@ int ziso_stream_uncompress(IsoStream *stream, void *buf, size_t desired)
                 /* More data blocks needed than announced */
                 return (rng->error_ret = ISO_FILTER_WRONG_INPUT);
             }
-            todo = rng->block_pointers[i] - rng->block_pointers[i- 1];
-            if (todo == 0) {
-                memset(rng->block_buffer, 0, rng->block_size);
-                rng->buffer_fill = rng->block_size;
-                if (rng->out_counter + rng->buffer_fill > data->size &&
-                    i == rng->block_pointer_fill - 1)
-                    rng->buffer_fill = data->size - rng->out_counter;
-            } else {
-                ret = iso_stream_read(data->orig, rng->read_buffer, todo);
-                if (ret > 0) {
-                    rng->in_counter += ret;
-                    buf_len = rng->block_size;
-                    ret = uncompress((Bytef *) rng->block_buffer, &buf_len,
-                                     (Bytef *) rng->read_buffer, (uLong) ret);
-                    if (ret != Z_OK)
-                        return (rng->error_ret = ISO_ZLIB_COMPR_ERR);
-                    rng->buffer_fill = buf_len;
-                    if ((int) buf_len < rng->block_size &&
-                        i != rng->block_pointer_fill - 1)
-                        return (rng->error_ret = ISO_ZISOFS_WRONG_INPUT);
-                } else if(ret == 0) {
-                    rng->state = 3;
-                    if (rng->out_counter != data->size) {
-                        /* Input size shrunk */
-                        return (rng->error_ret = ISO_FILTER_WRONG_INPUT);
-                    }
-                    return fill;
-                } else
-                    return (rng->error_ret = ret);
+            ret = ziso_uncompress_block(stream, i, 1);
+            if (ret == 0) {
+                rng->state = 3;
+                if (rng->out_counter != data->size) {
+                    /* Input size shrunk */
+                    return (rng->error_ret = ISO_FILTER_WRONG_INPUT);
+                }
+                return fill;
+            } else if (ret < 0) {
+                return (rng->error_ret = ret);
             }
             rng->buffer_rpos = 0;
 
@@ -1671,7 +2130,7 @@ int iso_zisofs_set_params(struct iso_zisofs_ctrl *params, int flag)
 
 #ifdef Libisofs_with_zliB
 
-    if (params->version < 0 || params->version > 1)
+    if (params->version < 0 || params->version > 2)
        return ISO_WRONG_ARG_VALUE;
 
     if (params->compression_level < 0 || params->compression_level > 9 ||
@@ -1708,6 +2167,20 @@ int iso_zisofs_set_params(struct iso_zisofs_ctrl *params, int flag)
     if (params->bpt_discard_free_ratio != 0.0)
         ziso_keep_blocks_free_ratio = params->bpt_discard_free_ratio;
 
+    if (params->version == 1)
+        return 1;
+
+    if (params->uncompress_threads > ISO_ZISOFS_MAX_THREADS)
+        ziso_uncompress_threads = ISO_ZISOFS_MAX_THREADS;
+    else if (params->uncompress_threads > 0)
+        ziso_uncompress_threads = params->uncompress_threads;
+    else if (params->uncompress_threads < 0)
+        ziso_uncompress_threads = 0;
+    if (params->uncompress_batch_blocks > 0)
+        ziso_uncompress_batch = params->uncompress_batch_blocks;
+    else if (params->uncompress_batch_blocks < 0)
+        ziso_uncompress_batch = ISO_ZISOFS_BATCH_BLOCKS;
+
     return 1;
     
 #else
@@ -1725,12 +2198,12 @@ int iso_zisofs_get_params(struct iso_zisofs_ctrl *params, int flag)
 
 #ifdef Libisofs_with_zliB
 
-    if (params->version < 0 || params->version > 1)
+    if (params->version < 0 || params->version > 2)
        return ISO_WRONG_ARG_VALUE;
 
     params->compression_level = ziso_compression_level;
     params->block_size_log2 = ziso_block_size_log2;
-    if (params->version == 1) {
+    if (params->version >= 1) {
         params->v2_enabled = ziso_v2_enabled;
         params->v2_block_size_log2 = ziso_v2_block_size_log2;
         params->max_total_blocks = ziso_max_total_blocks;
@@ -1740,6 +2213,10 @@ int iso_zisofs_get_params(struct iso_zisofs_ctrl *params, int flag)
         params->bpt_discard_file_blocks = ziso_many_block_limit;
         params->bpt_discard_free_ratio = ziso_keep_blocks_free_ratio;
     }
+    if (params->version >= 2) {
+        params->uncompress_threads = ziso_uncompress_threads;
+        params->uncompress_batch_blocks = ziso_uncompress_batch;
+    }
     return 1;
 
 #else
@@ -1803,6 +2280,101 @@ int iso_stream_zisofs_discard_bpt(IsoStream *stream, int flag)
 }
 
 
+/* API */
+off_t iso_stream_zisofs_lseek(IsoStream *stream, off_t offset, int flag)
+{
+
+#ifdef Libisofs_with_zliB
+
+    int ret, j;
+    off_t pos, start;
+    int64_t i;
+    ZisofsFilterStreamData *data;
+    ZisofsFilterRuntime *rng;
+
+    if (stream == NULL)
+        return ISO_NULL_POINTER;
+    if (stream->class->read != &ziso_stream_uncompress)
+        return ISO_WRONG_ARG_VALUE;
+    data = stream->data;
+    rng = data->running;
+    if (rng == NULL)
+        return ISO_FILE_NOT_OPENED;
+    if (rng->error_ret < 0)
+        return rng->error_ret;
+    if (rng->state == 0) {
+        ret = ziso_uncompress_head(stream, 0);
+        if (ret < 0)
+            return ret;
+    }
+
+    switch (flag) {
+    case 0: /* SEEK_SET */
+        pos = offset;
+        break;
+    case 1: /* SEEK_CUR */
+        pos = rng->out_counter + offset;
+        break;
+    case 2: /* SEEK_END */
+        pos = data->size + offset;
+        break;
+    default:
+        return ISO_WRONG_ARG_VALUE;
+    }
+    if (pos < 0 || pos > data->size)
+        return ISO_FILE_SEEK_ERROR;
+
+    if (rng->lru == NULL) {
+        rng->lru = calloc(ISO_ZISOFS_LRU_BLOCKS,
+                          sizeof(struct ziso_lru_block));
+        if (rng->lru == NULL)
+            return ISO_OUT_OF_MEM;
+        for (j = 0; j < ISO_ZISOFS_LRU_BLOCKS; j++)
+            rng->lru[j].block_pointer_idx = -1;
+    }
+
+    /* Stay in the current block if it contains pos */
+    start = rng->out_counter - rng->buffer_rpos;
+    if (rng->block_pointer_rpos > 0 && pos >= start &&
+        pos < start + rng->buffer_fill) {
+        rng->buffer_rpos = pos - start;
+        rng->out_counter = pos;
+        rng->state = 2;
+        return pos;
+    }
+
+    i = pos / rng->block_size + 1;
+    if (pos == data->size || i >= rng->block_pointer_fill) {
+        /* The next read will report EOF */
+        rng->block_pointer_rpos = rng->block_pointer_fill - 1;
+        rng->buffer_fill = rng->buffer_rpos = 0;
+        rng->out_counter = pos;
+        rng->state = 2;
+        return pos;
+    }
+    ret = ziso_uncompress_block(stream, i, 0);
+    if (ret == 0)
+        ret = ISO_FILTER_WRONG_INPUT;
+    if (ret < 0)
+        return (rng->error_ret = ret);
+    start = ((off_t) (i - 1)) * rng->block_size;
+    if (pos - start > rng->buffer_fill)
+        return (rng->error_ret = ISO_ZISOFS_WRONG_INPUT);
+    rng->block_pointer_rpos = i;
+    rng->buffer_rpos = pos - start;
+    rng->out_counter = pos;
+    rng->state = 2;
+    return pos;
+
+#else
+
+    return ISO_ZLIB_NOT_ENABLED;
+
+#endif /* ! Libisofs_with_zliB */
+
+}
+
+
 /* API */
 int iso_zisofs_ctrl_susp_z2(int enable)
 {
@@ -27,6 +27,7 @@
 #include "node.h"
 #include "aaip_0_2.h"
 #include "system_area.h"
+#include "data_source.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -35,6 +36,16 @@
 #include <limits.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* O_BINARY is needed for Cygwin but undefined elsewhere */
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
 
 
 /* Enable this and write the correct absolute path into the include statement
@@ -53,6 +64,20 @@
 #endif /* Libisofs_syslinux_tesT */
 
 
+/* Number of directory blocks which read_dir() reads by a single call of
+   iso_data_source_read_blocks()
+*/
+#define ISO_READ_DIR_BATCH 16
+
+/* Upper limit for iso_read_opts_set_import_threads() */
+#define ISO_IMPORT_THREADS_MAX 64
+
+/* Number of leading blocks of an opened file which get announced as needed
+   soon, if the image is read from a memory mapped data source
+*/
+#define ISO_FILE_WILLNEED_BLOCKS 256
+
+
 /**
  * Options for image reading.
  * There are four kind of options:
@@ -158,6 +183,22 @@ struct iso_read_opts
     int truncate_mode;
     int truncate_length;
 
+    /**
+     * Number of threads which read directories in advance while the tree
+     * gets imported. 0 or 1 means to read directories only on demand.
+     */
+    int import_threads;
+
+    /**
+     * Load the children of directories only on first access.
+     */
+    unsigned int lazy_tree : 1;
+
+    /**
+     * Path of a sidecar index file. See iso_read_opts_set_index_file().
+     */
+    char *index_path;
+
 };
 
 /**
@@ -203,7 +244,7 @@ static int ifs_fs_open(IsoImageFilesystem *fs);
 static int ifs_fs_close(IsoImageFilesystem *fs);
 static int iso_file_source_new_ifs(IsoImageFilesystem *fs,
            IsoFileSource *parent, struct ecma119_dir_record *record,
-           IsoFileSource **src, int flag);
+           SuspIterator *iter, IsoFileSource **src, int flag);
 
 /** unique identifier for each image */
 unsigned int fs_dev_id = 0;
@@ -246,6 +287,15 @@ typedef struct
     char *input_charset; /**< Input charset for RR names */
     char *local_charset; /**< For RR names, will be set to the locale one */
 
+    /**
+     * Whether names in 7-bit ASCII may be used without charset conversion.
+     * Set by ifs_set_ascii_compat() whenever input_charset changes.
+     *
+     * bit0= ASCII text is the same in input_charset and local_charset
+     * bit1= ASCII text is the same in ASCII and local_charset
+     */
+    int ascii_compat;
+
     /**
      * Enable or disable methods to automatically choose an input charset.
      * This eventually overrides input_charset.
@@ -415,6 +465,36 @@ typedef struct
 
     size_t joliet_ucs2_failures;
 
+    /* Worker threads which read directories in advance while the tree gets
+       imported. NULL if directories are read only on demand.
+     */
+    struct ifs_dir_pool *dir_pool;
+
+    /* The El Torito catalog which was created by the import */
+    struct el_torito_boot_catalog *bootcat;
+
+    /* Boot images and catalog which are represented by hidden nodes
+       because the lazy import did not find them in the tree yet.
+       The node from the tree replaces the hidden one when it gets loaded.
+     */
+    unsigned char provisional_boot[Libisofs_max_boot_imageS];
+    int provisional_cat;
+
+    /* Content of the sidecar index which matches this filesystem, read into
+       memory and verified by ifs_index_attach().
+       NULL if directories are read from the ISO filesystem.
+       See iso_image_save_index().
+     */
+    uint8_t *index_data;
+    size_t index_size;
+    uint32_t index_dir_count;
+    uint8_t *index_table;
+
+    /* Blocks of SUSP Continuation Areas. Cleared when the filesystem gets
+       closed. NULL if Rock Ridge is not read.
+     */
+    SuspCECache *ce_cache;
+
 } _ImageFsData;
 
 typedef struct image_fs_data ImageFileSourceData;
@@ -568,47 +648,131 @@ int ifs_access(IsoFileSource *src)
     return ISO_SUCCESS;
 }
 
+/* Dispose a file source which was created with flag bit2 of
+   iso_file_source_new_ifs() and thus holds no reference to its filesystem.
+*/
+static
+void ifs_free_unreferenced(IsoFileSource *src)
+{
+    ImageFileSourceData *data;
+
+    data = src->data;
+    if (S_ISLNK(data->info.st_mode))
+        free(data->data.content);
+    free(data->sections);
+    free(data->name);
+    if (data->aa_string != NULL)
+        free(data->aa_string);
+    free(data);
+    free(src);
+}
+
+static
+int ifs_index_read_dir(IsoImageFilesystem *fs, uint32_t block,
+                       struct child_list **list, int flag);
+
+/* Check whether the directory record at pos ends in the block where it
+   begins, as demanded by ECMA-119 6.8.1.1. The block may be memory mapped,
+   so nothing beyond its end may be read.
+   @return 1 = ok , 0 = damaged record
+*/
+static
+int ifs_dir_record_fits(uint8_t *buffer, uint32_t pos)
+{
+    struct ecma119_dir_record *record;
+
+    if (pos + 34 > BLOCK_SIZE)
+        return 0;
+    record = (struct ecma119_dir_record *) (buffer + pos);
+    if (record->len_dr[0] < 34 || pos + record->len_dr[0] > BLOCK_SIZE ||
+        ((uint32_t) record->len_fi[0]) + 33 > record->len_dr[0])
+        return 0;
+    return 1;
+}
+
 /**
- * Read all directory records in a directory, and creates an IsoFileSource for
- * each of them, storing them in the data field of the IsoFileSource for the
- * given dir.
+ * Read all directory records in the directory extent which starts at the
+ * given block, and create an IsoFileSource for each of them. They get
+ * prepended to *list.
+ *
+ * @param flag
+ *      bit0= the directory is the root directory
+ *      bit1= called by a thread of the directory prefetch pool.
+ *            Create the file sources without reference to fs.
  */
 static
-int read_dir(ImageFileSourceData *data)
+int read_dir_extent(IsoImageFilesystem *fs, uint32_t block,
+                    struct child_list **list, int flag)
 {
     int ret;
     uint32_t size;
-    uint32_t block;
-    IsoImageFilesystem *fs;
     _ImageFsData *fsdata;
     struct ecma119_dir_record *record;
-    uint8_t *buffer = NULL;
+    uint8_t *buffer = NULL, *dirbuf = NULL, *mapped = NULL;
     IsoFileSource *child = NULL;
     uint32_t pos = 0;
     uint32_t tlen = 0;
+    uint32_t batch_start, batch_count, end_block, first_block;
+    int in_place = 0;
+    SuspIterator *iter = NULL;
 
-    if (data == NULL) {
-        ret = ISO_NULL_POINTER; goto ex;
-    }
-
-    LIBISO_ALLOC_MEM(buffer, uint8_t, BLOCK_SIZE);
-    fs = data->fs;
     fsdata = fs->data;
+    if (fsdata->index_data != NULL) {
+        ret = ifs_index_read_dir(fs, block, list, flag & 2);
+        if (ret != 0)
+            return ret;
+    }
+    LIBISO_ALLOC_MEM(dirbuf, uint8_t, ISO_READ_DIR_BATCH * BLOCK_SIZE);
 
-    /* a dir has always a single extent */
-    block = data->sections[0].block;
-    ret = fsdata->src->read_block(fsdata->src, block, buffer);
-    if (ret < 0) {
-        goto ex;
+    first_block = block;
+    batch_start = block;
+    batch_count = 1;
+    if (iso_data_source_get_mapped(fsdata->src, block, 1, &mapped)) {
+        /* Parse directory records in place */
+        buffer = mapped;
+        batch_count = 0;
+    } else {
+        ret = fsdata->src->read_block(fsdata->src, block, dirbuf);
+        if (ret < 0) {
+            goto ex;
+        }
+        buffer = dirbuf;
+        ret = susp_ce_cache_prefetch(fsdata->ce_cache, dirbuf, 1,
+                                     fsdata->len_skp, 0);
+        if (ret < 0)
+            goto ex;
     }
 
     /* "." entry, get size of the dir and skip */
+    if (!ifs_dir_record_fits(buffer, pos)) {
+        ret = ISO_WRONG_ECMA119; goto ex;
+    }
     record = (struct ecma119_dir_record *)(buffer + pos);
     size = iso_read_bb(record->length, 4, NULL);
+    if (fsdata->rr) {
+        /* One iterator for the SUSP fields of all records */
+        iter = susp_iter_new(fsdata->src, record,
+                             fsdata->session_lba + fsdata->nblocks,
+                             fsdata->len_skp, fsdata->msgid,
+                             fsdata->ce_cache);
+        if (iter == NULL) {
+            ret = ISO_OUT_OF_MEM; goto ex;
+        }
+    }
+    if (((uint64_t) block) + size / BLOCK_SIZE + 1 > 0xffffffff)
+        end_block = 0xffffffff;
+    else
+        end_block = block + size / BLOCK_SIZE + !!(size % BLOCK_SIZE);
+    if (mapped != NULL)
+        in_place = iso_data_source_get_mapped(fsdata->src, block,
+                                              end_block - block, &mapped);
     tlen += record->len_dr[0];
     pos += record->len_dr[0];
 
     /* skip ".." */
+    if (!ifs_dir_record_fits(buffer, pos)) {
+        ret = ISO_WRONG_ECMA119; goto ex;
+    }
     record = (struct ecma119_dir_record *)(buffer + pos);
     tlen += record->len_dr[0];
     pos += record->len_dr[0];
@@ -619,16 +783,44 @@ int read_dir(ImageFileSourceData *data)
         if (pos == 2048 || record->len_dr[0] == 0) {
             /*
              * The directory entries are split in several blocks
-             * read next block
+             * read next block. Blocks are read in batches.
              */
-            ret = fsdata->src->read_block(fsdata->src, ++block, buffer);
-            if (ret < 0) {
-                goto ex;
+            ++block;
+            if (block >= end_block) {
+                /* The rest of the last block is unused */
+                break;
+            }
+            if (in_place && block < end_block) {
+                buffer = mapped + (block - first_block) * BLOCK_SIZE;
+                tlen += 2048 - pos;
+                pos = 0;
+                continue;
+            }
+            if (block < batch_start || block >= batch_start + batch_count) {
+                batch_count = ISO_READ_DIR_BATCH;
+                if (end_block > block && end_block - block < batch_count)
+                    batch_count = end_block - block;
+                else if (end_block <= block)
+                    batch_count = 1;
+                ret = iso_data_source_read_blocks(fsdata->src, block,
+                                                  batch_count, dirbuf);
+                if (ret < 0) {
+                    goto ex;
+                }
+                batch_start = block;
+                ret = susp_ce_cache_prefetch(fsdata->ce_cache, dirbuf,
+                                             batch_count, fsdata->len_skp, 0);
+                if (ret < 0)
+                    goto ex;
             }
+            buffer = dirbuf + (block - batch_start) * BLOCK_SIZE;
             tlen += 2048 - pos;
             pos = 0;
             continue;
         }
+        if (!ifs_dir_record_fits(buffer, pos)) {
+            ret = ISO_WRONG_ECMA119; goto ex;
+        }
 
         /* (Vreixo:)
          * What about ignoring files with existence flag?
@@ -654,7 +846,7 @@ int read_dir(ImageFileSourceData *data)
          * generating a new image with libisofs, that don't uses it.
          */
 
-        if (data->parent == NULL && record->len_fi[0] == 8
+        if ((flag & 1) && record->len_fi[0] == 8
             && !strncmp((char*)record->file_id, "RR_MOVED", 8)) {
 
             iso_msg_debug(fsdata->msgid, "Skipping RR_MOVE entry.");
@@ -670,7 +862,8 @@ int read_dir(ImageFileSourceData *data)
          * We pass a NULL parent instead of dir, to prevent the circular
          * reference from child to parent.
          */
-        ret = iso_file_source_new_ifs(fs, NULL, record, &child, 0);
+        ret = iso_file_source_new_ifs(fs, NULL, record, iter, &child,
+                                      (flag & 2) << 1);
         if (ret < 0) {
             if (child) {
                 /*
@@ -690,7 +883,10 @@ int read_dir(ImageFileSourceData *data)
             struct child_list *node;
             node = malloc(sizeof(struct child_list));
             if (node == NULL) {
-                iso_file_source_unref(child);
+                if (flag & 2)
+                    ifs_free_unreferenced(child);
+                else
+                    iso_file_source_unref(child);
                 {ret = ISO_OUT_OF_MEM; goto ex;}
             }
             /*
@@ -698,9 +894,9 @@ int read_dir(ImageFileSourceData *data)
              * addition here, but also when adding to the tree, as insertion
              * will be done, sorted, in the first position of the list.
              */
-            node->next = data->data.content;
+            node->next = *list;
             node->file = child;
-            data->data.content = node;
+            *list = node;
             child = NULL;
         }
 
@@ -710,15 +906,370 @@ int read_dir(ImageFileSourceData *data)
 
     ret = ISO_SUCCESS;
 ex:;
-    LIBISO_FREE_MEM(buffer);
+    if (iter != NULL)
+        susp_iter_free(iter);
+    LIBISO_FREE_MEM(dirbuf);
+    return ret;
+}
+
+
+/* Directory prefetching.
+   While iso_image_import() builds the tree in depth-first order, a pool of
+   worker threads reads the directory records of subdirectories in advance.
+   The results are handed over when the tree builder opens the directory.
+   So the tree and the name collision handling stay the same as with serial
+   reading. Only the order of messages may differ.
+   See iso_read_opts_set_import_threads().
+*/
+
+/* Limit for the number of prefetched directories which are not yet taken */
+#define ISO_DIR_POOL_MAX_JOBS 1024
+#define ISO_DIR_POOL_HASH_SIZE 256
+
+#define ISO_DIR_JOB_QUEUED  0
+#define ISO_DIR_JOB_RUNNING 1
+#define ISO_DIR_JOB_DONE    2
+
+struct ifs_dir_job
+{
+    uint32_t block;
+    int state;
+    int ret;
+    struct child_list *list;
+
+    struct ifs_dir_job *hash_next;
+    struct ifs_dir_job *queue_prev;
+    struct ifs_dir_job *queue_next;
+};
+
+struct ifs_dir_pool
+{
+    IsoImageFilesystem *fs;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t job_queued;
+    pthread_cond_t job_done;
+
+    /* Protects the mutable members of _ImageFsData, see ifs_lock() */
+    pthread_mutex_t state_mutex;
+
+    pthread_t *threads;
+    int num_threads;
+    int shutdown;
+
+    int num_jobs;
+    struct ifs_dir_job *hash[ISO_DIR_POOL_HASH_SIZE];
+
+    /* Stack of jobs in state ISO_DIR_JOB_QUEUED */
+    struct ifs_dir_job *queue;
+};
+
+
+static
+void ifs_lock(_ImageFsData *fsdata)
+{
+    if (fsdata->dir_pool != NULL)
+        pthread_mutex_lock(&fsdata->dir_pool->state_mutex);
+}
+
+static
+void ifs_unlock(_ImageFsData *fsdata)
+{
+    if (fsdata->dir_pool != NULL)
+        pthread_mutex_unlock(&fsdata->dir_pool->state_mutex);
+}
+
+/* Give the file sources of a prefetched directory the filesystem references
+   which the worker thread did not take. iso_file_source_new_ifs() takes one
+   reference per extent.
+*/
+static
+void ifs_dir_pool_ref_list(IsoImageFilesystem *fs, struct child_list *list)
+{
+    int i;
+    ImageFileSourceData *ifsdata;
+
+    for (; list != NULL; list = list->next) {
+        ifsdata = (ImageFileSourceData *) list->file->data;
+        for (i = 0; i < ifsdata->nsections; i++)
+            iso_filesystem_ref(fs);
+    }
+}
+
+static
+struct ifs_dir_job **ifs_dir_pool_find(struct ifs_dir_pool *pool,
+                                       uint32_t block)
+{
+    struct ifs_dir_job **pt;
+
+    pt = &(pool->hash[block % ISO_DIR_POOL_HASH_SIZE]);
+    while (*pt != NULL && (*pt)->block != block)
+        pt = &((*pt)->hash_next);
+    return pt;
+}
+
+static
+void ifs_dir_pool_unqueue(struct ifs_dir_pool *pool, struct ifs_dir_job *job)
+{
+    if (job->queue_prev != NULL)
+        job->queue_prev->queue_next = job->queue_next;
+    else
+        pool->queue = job->queue_next;
+    if (job->queue_next != NULL)
+        job->queue_next->queue_prev = job->queue_prev;
+    job->queue_prev = job->queue_next = NULL;
+}
+
+static
+void *ifs_dir_pool_worker(void *arg)
+{
+    int ret;
+    struct ifs_dir_pool *pool;
+    struct ifs_dir_job *job;
+    struct child_list *list;
+
+    pool = (struct ifs_dir_pool *) arg;
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+        while (!pool->shutdown && pool->queue == NULL)
+            pthread_cond_wait(&pool->job_queued, &pool->mutex);
+        if (pool->shutdown)
+    break;
+        job = pool->queue;
+        ifs_dir_pool_unqueue(pool, job);
+        job->state = ISO_DIR_JOB_RUNNING;
+        pthread_mutex_unlock(&pool->mutex);
+
+        list = NULL;
+        ret = read_dir_extent(pool->fs, job->block, &list, 2);
+
+        pthread_mutex_lock(&pool->mutex);
+        job->ret = ret;
+        job->list = list;
+        job->state = ISO_DIR_JOB_DONE;
+        pthread_cond_broadcast(&pool->job_done);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+/* Queue the subdirectories in the given list for prefetching. They get
+   stacked in reverse order, so that the workers pick them in the order in
+   which the tree builder will open them.
+*/
+static
+void ifs_dir_pool_prefetch(struct ifs_dir_pool *pool, struct child_list *list)
+{
+    struct ifs_dir_job *job, **pt, *first = NULL, *last = NULL;
+    ImageFileSourceData *ifsdata;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (; list != NULL; list = list->next) {
+        if (pool->num_jobs >= ISO_DIR_POOL_MAX_JOBS)
+    break;
+        ifsdata = (ImageFileSourceData *) list->file->data;
+        if (!S_ISDIR(ifsdata->info.st_mode) || ifsdata->nsections < 1)
+    continue;
+        pt = ifs_dir_pool_find(pool, ifsdata->sections[0].block);
+        if (*pt != NULL)
+    continue; /* same directory extent is already known */
+        job = calloc(1, sizeof(struct ifs_dir_job));
+        if (job == NULL)
+    break; /* the tree builder will read the directory itself */
+        job->block = ifsdata->sections[0].block;
+        job->state = ISO_DIR_JOB_QUEUED;
+        *pt = job;
+        pool->num_jobs++;
+        if (last == NULL)
+            first = job;
+        else
+            last->queue_next = job;
+        job->queue_prev = last;
+        last = job;
+    }
+    if (first != NULL) {
+        last->queue_next = pool->queue;
+        if (pool->queue != NULL)
+            pool->queue->queue_prev = last;
+        pool->queue = first;
+        pthread_cond_broadcast(&pool->job_queued);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Take over the result of a prefetched directory.
+   @return 1 = *list and *dir_ret are valid
+           0 = the directory was not prefetched. Read it.
+*/
+static
+int ifs_dir_pool_take(struct ifs_dir_pool *pool, uint32_t block,
+                      struct child_list **list, int *dir_ret)
+{
+    struct ifs_dir_job **pt, *job;
+    int taken = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    pt = ifs_dir_pool_find(pool, block);
+    job = *pt;
+    if (job == NULL)
+        goto ex;
+    if (job->state == ISO_DIR_JOB_QUEUED) {
+        /* Cheaper to read it now than to wait for a worker */
+        ifs_dir_pool_unqueue(pool, job);
+    } else {
+        while (job->state != ISO_DIR_JOB_DONE)
+            pthread_cond_wait(&pool->job_done, &pool->mutex);
+        /* The hash chain may have changed while waiting */
+        pt = ifs_dir_pool_find(pool, block);
+        *list = job->list;
+        *dir_ret = job->ret;
+        taken = 1;
+    }
+    *pt = job->hash_next;
+    pool->num_jobs--;
+    free(job);
+ex:;
+    pthread_mutex_unlock(&pool->mutex);
+    if (taken)
+        ifs_dir_pool_ref_list(pool->fs, *list);
+    return taken;
+}
+
+static
+void ifs_dir_pool_destroy(struct ifs_dir_pool *pool)
+{
+    int i;
+    struct ifs_dir_job *job, *next;
+
+    for (i = 0; i < ISO_DIR_POOL_HASH_SIZE; i++) {
+        for (job = pool->hash[i]; job != NULL; job = next) {
+            next = job->hash_next;
+            ifs_dir_pool_ref_list(pool->fs, job->list);
+            child_list_free(job->list);
+            free(job);
+        }
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->job_queued);
+    pthread_cond_destroy(&pool->job_done);
+    pthread_mutex_destroy(&pool->state_mutex);
+    if (pool->threads != NULL)
+        free(pool->threads);
+    free(pool);
+}
+
+/* Start the worker threads. The filesystem stays open until
+   ifs_dir_pool_stop().
+*/
+static
+int ifs_dir_pool_start(IsoImageFilesystem *fs, int num_threads)
+{
+    int ret, i;
+    struct ifs_dir_pool *pool = NULL;
+    _ImageFsData *fsdata;
+
+    fsdata = (_ImageFsData *) fs->data;
+    if (fsdata->dir_pool != NULL)
+        return ISO_SUCCESS;
+
+    pool = calloc(1, sizeof(struct ifs_dir_pool));
+    if (pool == NULL)
+        return ISO_OUT_OF_MEM;
+    pool->fs = fs;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->job_queued, NULL);
+    pthread_cond_init(&pool->job_done, NULL);
+    pthread_mutex_init(&pool->state_mutex, NULL);
+    pool->threads = calloc(num_threads, sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        ret = ISO_OUT_OF_MEM; goto ex;
+    }
+    ret = fs->open(fs);
+    if (ret < 0)
+        goto ex;
+    fsdata->dir_pool = pool;
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&(pool->threads[i]), NULL,
+                           ifs_dir_pool_worker, pool) != 0)
+    break;
+        pool->num_threads++;
+    }
+    if (pool->num_threads == 0) {
+        /* Not fatal. Go on with serial reading. */
+        fsdata->dir_pool = NULL;
+        fs->close(fs);
+        iso_msg_debug(fsdata->msgid,
+                      "Cannot start threads for reading directories");
+        ret = ISO_SUCCESS; goto ex;
+    }
+    return ISO_SUCCESS;
+ex:;
+    ifs_dir_pool_destroy(pool);
     return ret;
 }
 
 static
-int ifs_open(IsoFileSource *src)
+void ifs_dir_pool_stop(IsoImageFilesystem *fs)
+{
+    int i;
+    struct ifs_dir_pool *pool;
+    _ImageFsData *fsdata;
+
+    fsdata = (_ImageFsData *) fs->data;
+    pool = fsdata->dir_pool;
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->job_queued);
+    pthread_mutex_unlock(&pool->mutex);
+    for (i = 0; i < pool->num_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    fsdata->dir_pool = NULL;
+    ifs_dir_pool_destroy(pool);
+    fs->close(fs);
+}
+
+
+/**
+ * Read all directory records in a directory, and creates an IsoFileSource for
+ * each of them, storing them in the data field of the IsoFileSource for the
+ * given dir.
+ */
+static
+int read_dir(ImageFileSourceData *data)
 {
     int ret;
+    uint32_t block;
+    _ImageFsData *fsdata;
+    struct ifs_dir_pool *pool;
+    struct child_list *list = NULL;
+
+    if (data == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    fsdata = data->fs->data;
+    pool = fsdata->dir_pool;
+
+    /* a dir has always a single extent */
+    block = data->sections[0].block;
+    if (pool == NULL || !ifs_dir_pool_take(pool, block, &list, &ret))
+        ret = read_dir_extent(data->fs, block, &list, data->parent == NULL);
+    data->data.content = list;
+    if (pool != NULL && ret >= 0)
+        ifs_dir_pool_prefetch(pool, list);
+    return ret;
+}
+
+static
+int ifs_open(IsoFileSource *src)
+{
+    int ret, i;
+    uint32_t nblocks;
     ImageFileSourceData *data;
+    _ImageFsData *fsdata;
 
     if (src == NULL || src->data == NULL) {
         return ISO_NULL_POINTER;
@@ -764,6 +1315,20 @@ int ifs_open(IsoFileSource *src)
         }
         data->data.offset = 0;
         data->opened = 1;
+
+        /* The content gets read block by block from start to end.
+           Let a memory mapped image read ahead within the file extents.
+        */
+        fsdata = data->fs->data;
+        for (i = 0; i < data->nsections; i++) {
+            nblocks = DIV_UP(data->sections[i].size, BLOCK_SIZE);
+            iso_data_source_advise(fsdata->src, data->sections[i].block,
+                                   nblocks, 0);
+            if (i == 0) {
+                iso_data_source_advise(fsdata->src, data->sections[0].block,
+                                MIN(nblocks, ISO_FILE_WILLNEED_BLOCKS), 1);
+            }
+        }
     } else {
         /* symlinks and special files inside image can't be opened */
         return ISO_FILE_ERROR;
@@ -856,19 +1421,18 @@ uint32_t size_available(int nsections, struct iso_file_section *sections,
 }
 
 /**
- * Get the block offset for reading the given file offset
+ * Get the number of bytes from the given offset up to the end of its section
  */
 static
-uint32_t block_offset(int nsections, struct iso_file_section *sections,
+uint32_t section_left(int nsections, struct iso_file_section *sections,
                       off_t offset)
 {
     int section = 0;
     off_t bytes = 0;
 
-
     do {
         if ( (offset - bytes) < (off_t) sections[section].size ) {
-            return (uint32_t)(offset - bytes) % BLOCK_SIZE;
+            return sections[section].size - (uint32_t)(offset - bytes);
         } else {
             bytes += (off_t) sections[section].size;
             section++;
@@ -879,9 +1443,32 @@ uint32_t block_offset(int nsections, struct iso_file_section *sections,
 }
 
 /**
- * Attempts to read up to count bytes from the given source into
- * the buffer starting at buf.
- *
+ * Get the block offset for reading the given file offset
+ */
+static
+uint32_t block_offset(int nsections, struct iso_file_section *sections,
+                      off_t offset)
+{
+    int section = 0;
+    off_t bytes = 0;
+
+
+    do {
+        if ( (offset - bytes) < (off_t) sections[section].size ) {
+            return (uint32_t)(offset - bytes) % BLOCK_SIZE;
+        } else {
+            bytes += (off_t) sections[section].size;
+            section++;
+        }
+
+    } while(section < nsections);
+    return 0; /* should never happen */
+}
+
+/**
+ * Attempts to read up to count bytes from the given source into
+ * the buffer starting at buf.
+ *
  * The file src must be open() before calling this, and close() when no
  * more needed. Not valid for dirs. On symlinks it reads the destination
  * file.
@@ -921,6 +1508,35 @@ int ifs_read(IsoFileSource *src, void *buf, size_t count)
         size_t bytes;
         uint8_t *orig;
 
+        if (block_offset(data->nsections, data->sections, data->data.offset) == 0
+            && count - read >= BLOCK_SIZE) {
+            /* Read whole blocks of the section directly into buf */
+            uint32_t block, nblocks;
+            _ImageFsData *fsdata;
+
+            bytes = MIN(section_left(data->nsections, data->sections,
+                                     data->data.offset),
+                        count - read);
+            if (data->data.offset + (off_t)bytes > data->info.st_size) {
+                 bytes = data->info.st_size - data->data.offset;
+            }
+            nblocks = bytes / BLOCK_SIZE;
+            if (nblocks > 0) {
+                fsdata = data->fs->data;
+                block = block_from_offset(data->nsections, data->sections,
+                                          data->data.offset);
+                ret = iso_data_source_read_blocks(fsdata->src, block, nblocks,
+                                                  (uint8_t*)buf + read);
+                if (ret < 0) {
+                    return ret;
+                }
+                bytes = ((size_t) nblocks) * BLOCK_SIZE;
+                read += bytes;
+                data->data.offset += (off_t)bytes;
+                continue;
+            }
+        }
+
         if (block_offset(data->nsections, data->sections, data->data.offset) == 0) {
             /* we need to buffer next block */
             uint32_t block;
@@ -1350,6 +1966,66 @@ ex:
 }
 
 
+/**
+ * Find out whether names in 7-bit ASCII may be copied without conversion
+ * from input_charset to local_charset. Each iconv conversion costs much more
+ * than the few bytes of a typical file name.
+ */
+static
+void ifs_set_ascii_compat(_ImageFsData *fsdata)
+{
+    int ret, i;
+    char test[128], *conv = NULL;
+
+    for (i = 1; i < 128; i++)
+        test[i - 1] = i;
+    test[127] = 0;
+
+    fsdata->ascii_compat = 0;
+    if (strcmp(fsdata->local_charset, fsdata->input_charset) == 0) {
+        fsdata->ascii_compat |= 1;
+    } else {
+        ret = strconv(test, fsdata->input_charset, fsdata->local_charset,
+                      &conv);
+        if (ret == ISO_SUCCESS && strcmp(conv, test) == 0)
+            fsdata->ascii_compat |= 1;
+        if (conv != NULL)
+            free(conv);
+        conv = NULL;
+    }
+    ret = strconv(test, "ASCII", fsdata->local_charset, &conv);
+    if (ret == ISO_SUCCESS && strcmp(conv, test) == 0)
+        fsdata->ascii_compat |= 2;
+    if (conv != NULL)
+        free(conv);
+}
+
+/**
+ * @param flag
+ *      bit0= str is UTF-16BE. Check for code units 0x0001 to 0x007f.
+ * @return
+ *      1 if str consists of 7-bit ASCII characters, 0 if not
+ */
+static
+int ifs_is_ascii(char *str, size_t len, int flag)
+{
+    size_t i;
+    unsigned char *u = (unsigned char *) str;
+
+    if (flag & 1) {
+        if (len % 2)
+            return 0;
+        for (i = 0; i < len; i += 2)
+            if (u[i] != 0 || u[i + 1] == 0 || u[i + 1] >= 0x80)
+                return 0;
+        return 1;
+    }
+    for (i = 0; i < len; i++)
+        if (u[i] == 0 || u[i] >= 0x80)
+            return 0;
+    return 1;
+}
+
 /**
  * Read a file name from a directory record, doing the needed charset
  * conversion
@@ -1358,9 +2034,22 @@ static
 char *get_name(_ImageFsData *fsdata, char *str, size_t len)
 {
     int ret;
+    size_t i;
     char *name = NULL, *from_ucs = NULL;
 
-    if (strcmp(fsdata->local_charset, fsdata->input_charset)) {
+    if (fsdata->iso_root_block == fsdata->svd_root_block &&
+        (fsdata->ascii_compat & 2) && ifs_is_ascii(str, len, 1)) {
+        /* Joliet name in the ASCII range of UCS-2 */
+        name = malloc(len / 2 + 1);
+        if (name == NULL)
+            return NULL;
+        for (i = 0; i < len / 2; i++)
+            name[i] = str[2 * i + 1];
+        name[len / 2] = '\0';
+        return name;
+    }
+    if (strcmp(fsdata->local_charset, fsdata->input_charset) &&
+        !((fsdata->ascii_compat & 1) && ifs_is_ascii(str, len, 0))) {
         /* charset conversion needed */
         ret = strnconv(str, fsdata->input_charset, fsdata->local_charset, len,
                        &name);
@@ -1372,9 +2061,12 @@ char *get_name(_ImageFsData *fsdata, char *str, size_t len)
                 if (ret == 1)
                     ret = (strcmp(name, from_ucs) == 0);
                 if (ret != 1) {
+                    ifs_lock(fsdata);
                     fsdata->joliet_ucs2_failures++;
-                    if (fsdata->joliet_ucs2_failures <=
-                                                     ISO_JOLIET_UCS2_WARN_MAX)
+                    ret = (fsdata->joliet_ucs2_failures <=
+                                                     ISO_JOLIET_UCS2_WARN_MAX);
+                    ifs_unlock(fsdata);
+                    if (ret)
                         iso_msg_submit(-1, ISO_NAME_NOT_UCS2, 0,
                "Joliet filename valid only with character set UTF-16 : \"%s\"",
                                        name);
@@ -1415,21 +2107,27 @@ static
 int iso_rr_msg_submit(_ImageFsData *fsdata, int rr_err_bit,
                       int errcode, int causedby, const char *msg)
 {
-    int ret;
+    int ret, reported, repeated;
+
+    ifs_lock(fsdata);
+    reported = fsdata->rr_err_reported & (1 << rr_err_bit);
+    repeated = fsdata->rr_err_repeated & (1 << rr_err_bit);
+    if (reported)
+        fsdata->rr_err_repeated |= (1 << rr_err_bit);
+    else
+        fsdata->rr_err_reported |= (1 << rr_err_bit);
+    ifs_unlock(fsdata);
 
-    if ((fsdata->rr_err_reported & (1 << rr_err_bit)) &&
-        (fsdata->rr_err_repeated & (1 << rr_err_bit))) {
+    if (reported && repeated) {
         if (iso_msg_is_abort(errcode))
             return ISO_CANCELED;
         return 0;
     }
-    if (fsdata->rr_err_reported & (1 << rr_err_bit)) {
+    if (reported) {
         ret = iso_msg_submit(fsdata->msgid, errcode, causedby,
                              "MORE THAN ONCE : %s", msg);
-        fsdata->rr_err_repeated |= (1 << rr_err_bit);
     } else {
         ret = iso_msg_submit(fsdata->msgid, errcode, causedby, "%s", msg);
-        fsdata->rr_err_reported |= (1 << rr_err_bit);
     }
     return ret;
 }
@@ -1437,6 +2135,9 @@ int iso_rr_msg_submit(_ImageFsData *fsdata, int rr_err_bit,
 
 /**
  *
+ * @param iter
+ *      if not-NULL, an iterator which gets reused for the SUSP entries of
+ *      record. Else a new one gets created and freed.
  * @param src
  *      if not-NULL, it points to a multi-extent file returned by a previous
  *      call to this function.
@@ -1444,6 +2145,9 @@ int iso_rr_msg_submit(_ImageFsData *fsdata, int rr_err_bit,
  *      bit0= this is the root node attribute load call
  *            (parameter parent is not reliable for this)
  *      bit1= this is a call caused by CL. Do not obey CL again.
+ *      bit2= called by a thread of the directory prefetch pool.
+ *            Do not take a reference to fs. The tree builder takes it
+ *            when it gets the new file source. See ifs_dir_pool_ref_list().
  * @return
  *      2 node is still incomplete (multi-extent)
  *      1 success, 0 record ignored (not an error, can be a relocated dir),
@@ -1452,7 +2156,7 @@ int iso_rr_msg_submit(_ImageFsData *fsdata, int rr_err_bit,
 static
 int iso_file_source_new_ifs(IsoImageFilesystem *fs, IsoFileSource *parent,
                             struct ecma119_dir_record *record,
-                            IsoFileSource **src, int flag)
+                            SuspIterator *iter, IsoFileSource **src, int flag)
 {
     int ret, ecma119_map, skip_nm = 0;
     struct stat atts;
@@ -1602,14 +2306,19 @@ int iso_file_source_new_ifs(IsoImageFilesystem *fs, IsoFileSource *parent,
 
     if (fsdata->rr) {
         struct susp_sys_user_entry *sue;
-        SuspIterator *iter;
-
+        SuspIterator *own_iter = NULL;
 
-        iter = susp_iter_new(fsdata->src, record,
-                             fsdata->session_lba + fsdata->nblocks,
-                             fsdata->len_skp, fsdata->msgid);
-        if (iter == NULL) {
-            {ret = ISO_OUT_OF_MEM; goto ex;}
+        if (iter != NULL) {
+            susp_iter_reuse(iter, record, fsdata->len_skp);
+        } else {
+            own_iter = susp_iter_new(fsdata->src, record,
+                                     fsdata->session_lba + fsdata->nblocks,
+                                     fsdata->len_skp, fsdata->msgid,
+                                     fsdata->ce_cache);
+            if (own_iter == NULL) {
+                {ret = ISO_OUT_OF_MEM; goto ex;}
+            }
+            iter = own_iter;
         }
 
         while ((ret = susp_iter_next(iter, &sue, 0)) > 0) {
@@ -1626,14 +2335,20 @@ int iso_file_source_new_ifs(IsoImageFilesystem *fs, IsoFileSource *parent,
                     /* notify and continue */
                     ret = iso_rr_msg_submit(fsdata, 0, ISO_WRONG_RR_WARN, ret,
                                             "Invalid PX entry");
+                    ifs_lock(fsdata);
                     fsdata->px_ino_status |= 8;
+                    ifs_unlock(fsdata);
                 } if (ret == 2) {
+                    ifs_lock(fsdata);
                     if (fsdata->inode_counter < atts.st_ino) 
                         fsdata->inode_counter = atts.st_ino;
                     fsdata->px_ino_status |= 1;
+                    ifs_unlock(fsdata);
 
                 } else {
+                    ifs_lock(fsdata);
                     fsdata->px_ino_status |= 2;
+                    ifs_unlock(fsdata);
                 }
 
             } else if (SUSP_SIG(sue, 'T', 'F')) {
@@ -1728,7 +2443,8 @@ if (name != NULL && !namecont) {
                  * We simply ignore it, as it will be correctly handled
                  * when found the CL
                  */
-                susp_iter_free(iter);
+                if (own_iter != NULL)
+                    susp_iter_free(own_iter);
                 free(name);
                 if (flag & 1) {
                     ret = iso_rr_msg_submit(fsdata, 3, ISO_NO_ROOT_DIR, 0,
@@ -1860,7 +2576,10 @@ invalid_zf:
             }
         }
 
-        susp_iter_free(iter);
+        if (own_iter != NULL) {
+            susp_iter_free(own_iter);
+            iter = NULL;
+        }
 
         /* check for RR problems */
 
@@ -1889,7 +2608,9 @@ invalid_zf:
         }
 
         /* convert name to needed charset */
-        if (strcmp(fsdata->input_charset, fsdata->local_charset) && name) {
+        if (strcmp(fsdata->input_charset, fsdata->local_charset) && name &&
+            !((fsdata->ascii_compat & 1) &&
+              ifs_is_ascii(name, strlen(name), 0))) {
             /* we need to convert name charset */
             char *newname = NULL;
             ret = strconv(name, fsdata->input_charset, fsdata->local_charset,
@@ -1915,7 +2636,9 @@ invalid_zf:
         }
 
         /* convert link destination to needed charset */
-        if (strcmp(fsdata->input_charset, fsdata->local_charset) && linkdest) {
+        if (strcmp(fsdata->input_charset, fsdata->local_charset) &&
+            linkdest && !((fsdata->ascii_compat & 1) &&
+                          ifs_is_ascii(linkdest, strlen(linkdest), 0))) {
             /* we need to convert name charset */
             char *newlinkdest = NULL;
             ret = strconv(linkdest, fsdata->input_charset,
@@ -1951,7 +2674,9 @@ invalid_zf:
     }
 
     if (!has_px) {
+        ifs_lock(fsdata);
         fsdata->px_ino_status |= 4;
+        ifs_unlock(fsdata);
     }
 
     /*
@@ -2036,7 +2761,7 @@ invalid_zf:
 
         /* Call with flag bit1 to prevent further CL relocation */
         ret = iso_file_source_new_ifs(fs, parent, (struct ecma119_dir_record*)
-                                      buffer, src, flag | 2);
+                                      buffer, iter, src, flag | 2);
         if (ret <= 0) {
             goto ex;
         }
@@ -2066,110 +2791,947 @@ invalid_zf:
     if (atts.st_ctime == (time_t) 0) {
         atts.st_ctime = recorded;
     }
-    if (atts.st_mtime == (time_t) 0) {
-        atts.st_mtime = recorded;
+    if (atts.st_mtime == (time_t) 0) {
+        atts.st_mtime = recorded;
+    }
+
+    /* the size is read from iso directory record */
+    atts.st_size = iso_read_bb(record->length, 4, NULL);
+
+    /* Fill last entries */
+    atts.st_dev = fsdata->id;
+    atts.st_blksize = BLOCK_SIZE;
+    atts.st_blocks = DIV_UP(atts.st_size, BLOCK_SIZE);
+
+    /* TODO #00014 : more sanity checks to ensure dir record info is valid */
+    if (S_ISLNK(atts.st_mode) && (linkdest == NULL)) {
+        ret = iso_rr_msg_submit(fsdata, 18, ISO_WRONG_RR, 0,
+                                "Link without destination.");
+        free(name);
+        goto ex;
+    }
+
+    /* ok, we can now create the file source */
+    if (*src == NULL) {
+        ifsdata = calloc(1, sizeof(ImageFileSourceData));
+        if (ifsdata == NULL) {
+            ret = ISO_OUT_OF_MEM;
+            goto ifs_cleanup;
+        }
+        ifsrc = calloc(1, sizeof(IsoFileSource));
+        if (ifsrc == NULL) {
+            ret = ISO_OUT_OF_MEM;
+            goto ifs_cleanup;
+        }
+    } else {
+        ifsdata = (*src)->data;
+        ifsrc = (*src);
+        free(ifsdata->name); /* we will assign a new one */
+        ifsdata->name = NULL;
+        atts.st_size += (off_t)ifsdata->info.st_size;
+        if (ifsdata->aa_string != NULL)
+            free(ifsdata->aa_string);
+        ifsdata->aa_string = NULL;
+    }
+
+    /* fill data */
+    ifsdata->fs = fs;
+    if (!(flag & 4))
+        iso_filesystem_ref(fs);
+    if (parent != NULL) {
+        ifsdata->parent = parent;
+        iso_file_source_ref(parent);
+    }
+    ifsdata->info = atts;
+    ifsdata->name = name;
+    ifsdata->aa_string = aa_string;
+
+#ifdef Libisofs_with_zliB
+    if (zisofs_hs4 > 0) {
+        ifsdata->zisofs_algo[0] = zisofs_alg[0];
+        ifsdata->zisofs_algo[1] = zisofs_alg[1];
+        ifsdata->header_size_div4 = zisofs_hs4;
+        ifsdata->block_size_log2 = zisofs_bsl2;
+        ifsdata->uncompressed_size = zisofs_usize;
+    } else {
+        ifsdata->header_size_div4 = 0;
+    }
+#endif
+
+    /* save extents */
+    ifsdata->sections = realloc(ifsdata->sections,
+                (1 + ifsdata->nsections) * sizeof(struct iso_file_section));
+    if (ifsdata->sections == NULL) {
+        free(ifsdata->name);
+        ret = ISO_OUT_OF_MEM;
+        goto ifs_cleanup;
+    }
+    ifsdata->sections[ifsdata->nsections].block =
+                       iso_read_bb(record->block, 4, NULL) + record->len_xa[0];
+    ifsdata->sections[ifsdata->nsections].size = iso_read_bb(record->length, 4, NULL);
+    ifsdata->nsections++;
+
+    if (S_ISLNK(atts.st_mode)) {
+        ifsdata->data.content = linkdest;
+    } else if (linkdest != NULL) {
+        ret = iso_rr_msg_submit(fsdata, 19, ISO_WRONG_RR_WARN, 0,
+                     "RRIP SL link destination with file that is not a link.");
+        free(linkdest);
+        linkdest = NULL;
+    }
+
+    ifsrc->class = &ifs_class;
+    ifsrc->data = ifsdata;
+    ifsrc->refcount = 1;
+
+    *src = ifsrc;
+    {ret = ISO_SUCCESS; goto ex;}
+
+ifs_cleanup: ;
+    free(name);
+    free(linkdest);
+    free(ifsdata);
+    free(ifsrc);
+
+ex:;
+    LIBISO_FREE_MEM(msg);
+    LIBISO_FREE_MEM(buffer);
+    return ret;
+}
+
+/* Sidecar index of an imported ISO filesystem.
+   It records the file sources of all directories as they get created by
+   read_dir_extent(), so that a later import of the same session can create
+   them without reading and parsing directory records and SUSP entries.
+   All numbers are little-endian.
+
+   Header of ISO_INDEX_HEADER_SIZE bytes:
+      0 : magic ISO_INDEX_MAGIC (16 bytes)
+     16 : identity MD5, see ifs_index_identity() (16 bytes)
+     32 : px_ino_status (4), inode_counter (4)
+     40 : number of directories (4), checksum_idx_count (4)
+     48 : checksum_end_lba (4), reserved (4)
+     56 : offset of the directory table (8)
+     64 : offset of the checksum array (8)
+     72 : size of the index file (8)
+     80 : MD5 of the file content after the header (16)
+   Directory table, sorted by block:
+      extent block (4), offset of the record list (8)
+   Record list of a directory:
+      number of records (4), then per record its length (4) and
+       0 : st_mode (4), st_uid (4), st_gid (4), st_nlink (4)
+      16 : st_ino (8), st_size (8), st_rdev (8)
+      40 : st_atime (8), st_mtime (8), st_ctime (8)
+      64 : zisofs algorithm (2), header size div 4 (1), block size log2 (1),
+           uncompressed size (8)
+      76 : number of sections (4), then per section block (4) and size (4)
+           name length (4) and name, link target length (4) and link target,
+           AAIP string length (4) and AAIP string
+   The records are stored in the order of the list made by
+   read_dir_extent().
+   The index gets read into memory and its content MD5 gets verified before
+   it is used. Nevertheless each record gets checked before it is used.
+*/
+#define ISO_INDEX_MAGIC "LIBISOFS_INDEX_1"
+#define ISO_INDEX_HEADER_SIZE 128
+#define ISO_INDEX_REC_FIXED 80
+#define ISO_INDEX_TABLE_ENTRY 12
+
+/* Limit for the number of volume descriptors which count for the identity */
+#define ISO_INDEX_MAX_VD 64
+
+/**
+ * Compute the MD5 which identifies the imported session and the reading
+ * settings: the volume descriptor set with volume size, time stamps, and
+ * root directory records, and all settings which influence the file sources.
+ * The filesystem has to be open.
+ */
+static
+int ifs_index_identity(_ImageFsData *fsdata, char md5[16])
+{
+    int ret, i;
+    void *ctx = NULL;
+    uint8_t *buffer = NULL;
+    char *settings = NULL;
+
+    LIBISO_ALLOC_MEM(buffer, uint8_t, BLOCK_SIZE);
+    LIBISO_ALLOC_MEM(settings, char, 400);
+
+    ret = iso_md5_start(&ctx);
+    if (ret < 0)
+        goto ex;
+    for (i = 0; i < ISO_INDEX_MAX_VD; i++) {
+        ret = fsdata->src->read_block(fsdata->src,
+                                      fsdata->session_lba + 16 + i, buffer);
+        if (ret < 0)
+            goto ex;
+        iso_md5_compute(ctx, (char *) buffer, BLOCK_SIZE);
+        if (buffer[0] == 255)
+    break;
+    }
+    sprintf(settings,
+            "%lu %lu %lu %d %d %d %lu %lu %lo %lo %d %d %d %d %d %.80s %.80s",
+            (unsigned long) fsdata->session_lba,
+            (unsigned long) fsdata->nblocks,
+            (unsigned long) fsdata->iso_root_block,
+            (int) fsdata->rr, (int) fsdata->len_skp, fsdata->aaip_load,
+            (unsigned long) fsdata->uid, (unsigned long) fsdata->gid,
+            (unsigned long) fsdata->dir_mode,
+            (unsigned long) fsdata->file_mode,
+            (int) fsdata->ecma119_map, (int) fsdata->joliet_map,
+            fsdata->truncate_mode, fsdata->truncate_length,
+            (int) fsdata->make_new_ino,
+            fsdata->input_charset, fsdata->local_charset);
+    iso_md5_compute(ctx, settings, strlen(settings));
+    ret = ISO_SUCCESS;
+ex:;
+    if (ctx != NULL)
+        iso_md5_end(&ctx, md5);
+    LIBISO_FREE_MEM(settings);
+    LIBISO_FREE_MEM(buffer);
+    return ret;
+}
+
+/* Check whether the AAIP string of an index record consists of complete
+   AAIP fields and ends with the last one exactly at its end.
+*/
+static
+int ifs_index_aa_string_ok(uint8_t *aa, uint32_t len)
+{
+    uint32_t pos = 0;
+
+    while (pos + 5 <= len) {
+        if (aa[pos + 2] < 5 || aa[pos + 2] > len - pos)
+            return 0;
+        if (!(aa[pos + 4] & 1))
+            return (pos + aa[pos + 2] == len);
+        pos += aa[pos + 2];
+    }
+    return 0;
+}
+
+/**
+ * Read the index file into memory and keep it if it is intact and matches
+ * the filesystem. The filesystem has to be open.
+ *
+ * @return
+ *     1 index will be used, 0 index not usable, < 0 error
+ */
+static
+int ifs_index_attach(IsoImageFilesystem *fs, char *path)
+{
+    int ret, fd = -1;
+    _ImageFsData *fsdata;
+    struct stat stbuf;
+    uint8_t *data = NULL;
+    size_t size = 0, done;
+    ssize_t count;
+    uint64_t table_offset, checksum_offset;
+    uint32_t dir_count, checksum_count, i, prev_block, block;
+    char identity[16], content_md5[16], *reason = "";
+    void *ctx = NULL;
+
+    fsdata = fs->data;
+    fd = open(path, O_RDONLY | O_BINARY);
+    if (fd == -1) {
+        reason = "cannot open file";
+        ret = 0; goto ex;
+    }
+    if (fstat(fd, &stbuf) == -1 || stbuf.st_size < ISO_INDEX_HEADER_SIZE ||
+        (off_t) (size_t) stbuf.st_size != stbuf.st_size) {
+        reason = "unsuitable file size";
+        ret = 0; goto ex;
+    }
+    size = stbuf.st_size;
+
+    /* A private copy cannot change or vanish while it is in use */
+    data = malloc(size);
+    if (data == NULL) {
+        reason = "not enough memory";
+        ret = 0; goto ex;
+    }
+    for (done = 0; done < size; done += count) {
+        count = read(fd, data + done, size - done);
+        if (count <= 0) {
+            reason = "cannot read file";
+            ret = 0; goto ex;
+        }
+    }
+    if (memcmp(data, ISO_INDEX_MAGIC, 16) != 0 ||
+        iso_read_lsb64(data + 72) != (uint64_t) size) {
+        reason = "not a complete index file";
+        ret = 0; goto ex;
+    }
+    ret = iso_md5_start(&ctx);
+    if (ret < 0)
+        goto ex;
+    for (done = ISO_INDEX_HEADER_SIZE; done < size; done += count) {
+        count = size - done;
+        if (count > 1024 * 1024)
+            count = 1024 * 1024;
+        iso_md5_compute(ctx, (char *) data + done, (int) count);
+    }
+    iso_md5_end(&ctx, content_md5);
+    if (memcmp(data + 80, content_md5, 16) != 0) {
+        reason = "content checksum mismatch";
+        ret = 0; goto ex;
+    }
+    dir_count = iso_read_lsb(data + 40, 4);
+    checksum_count = iso_read_lsb(data + 44, 4);
+    table_offset = iso_read_lsb64(data + 56);
+    checksum_offset = iso_read_lsb64(data + 64);
+    if (table_offset < ISO_INDEX_HEADER_SIZE || table_offset > size ||
+        (size - table_offset) / ISO_INDEX_TABLE_ENTRY < dir_count ||
+        checksum_offset < ISO_INDEX_HEADER_SIZE || checksum_offset > size ||
+        (size - checksum_offset) / 16 < checksum_count) {
+        reason = "damaged index file";
+        ret = 0; goto ex;
+    }
+
+    /* ifs_index_read_dir() does a binary search in the directory table */
+    prev_block = 0;
+    for (i = 0; i < dir_count; i++) {
+        block = iso_read_lsb(data + table_offset + i * ISO_INDEX_TABLE_ENTRY,
+                             4);
+        if (i > 0 && block <= prev_block) {
+            reason = "damaged index file";
+            ret = 0; goto ex;
+        }
+        prev_block = block;
+    }
+
+    ret = ifs_index_identity(fsdata, identity);
+    if (ret < 0)
+        goto ex;
+    if (memcmp(data + 16, identity, 16) != 0) {
+        reason = "recorded for a different session or with other settings";
+        ret = 0; goto ex;
+    }
+
+    fsdata->index_data = data;
+    fsdata->index_size = size;
+    fsdata->index_dir_count = dir_count;
+    fsdata->index_table = data + table_offset;
+    data = NULL;
+
+    /* The inode number status of the directories which will not be read */
+    fsdata->px_ino_status |= iso_read_lsb(fsdata->index_data + 32, 4);
+    if (fsdata->inode_counter < iso_read_lsb(fsdata->index_data + 36, 4))
+        fsdata->inode_counter = iso_read_lsb(fsdata->index_data + 36, 4);
+    iso_msg_debug(fsdata->msgid, "Using index file '%.80s'", path);
+    ret = 1;
+ex:;
+    if (ret == 0)
+        iso_msg_submit(fsdata->msgid, ISO_IMPORT_INDEX_IGNORED, 0,
+                       "Ignored index file '%.80s': %s", path, reason);
+    if (ctx != NULL)
+        iso_md5_end(&ctx, content_md5);
+    if (data != NULL)
+        free(data);
+    if (fd != -1)
+        close(fd);
+    return ret;
+}
+
+/**
+ * Create a file source from an index record.
+ *
+ * @param flag
+ *      bit1= create the file source without reference to fs
+ * @return
+ *      1 success, 0 damaged record, < 0 error
+ */
+static
+int ifs_index_new_src(IsoImageFilesystem *fs, uint8_t *rec, uint32_t len,
+                      IsoFileSource **src, int flag)
+{
+    int ret, i;
+    _ImageFsData *fsdata;
+    IsoFileSource *ifsrc = NULL;
+    ImageFileSourceData *ifsdata = NULL;
+    uint32_t pos, nsections, name_len, link_len, aa_len, mode;
+    uint8_t *name;
+    char *linkdest = NULL;
+
+    fsdata = fs->data;
+    if (len < ISO_INDEX_REC_FIXED + 12)
+        return 0;
+    nsections = iso_read_lsb(rec + 76, 4);
+    if (nsections == 0 ||
+        nsections > (len - ISO_INDEX_REC_FIXED - 12) / 8)
+        return 0;
+    pos = ISO_INDEX_REC_FIXED + nsections * 8;
+    name_len = iso_read_lsb(rec + pos, 4);
+    if (name_len > len - pos - 12)
+        return 0;
+    pos += 4 + name_len;
+    link_len = iso_read_lsb(rec + pos, 4);
+    if (link_len > len - pos - 8)
+        return 0;
+    pos += 4 + link_len;
+    aa_len = iso_read_lsb(rec + pos, 4);
+    if (aa_len != len - pos - 4)
+        return 0;
+
+    /* The content of the record gets used as file source attributes */
+    mode = iso_read_lsb(rec, 4);
+    if (!(S_ISDIR(mode) || S_ISREG(mode) || S_ISLNK(mode) || S_ISCHR(mode) ||
+          S_ISBLK(mode) || S_ISFIFO(mode) || S_ISSOCK(mode)))
+        return 0;
+    name = rec + ISO_INDEX_REC_FIXED + nsections * 8 + 4;
+    if (name_len == 0 || memchr(name, '/', name_len) != NULL ||
+        memchr(name, 0, name_len) != NULL)
+        return 0;
+    if (S_ISLNK(mode) && memchr(name + name_len + 4, 0, link_len) != NULL)
+        return 0;
+    if (aa_len > 0 && !ifs_index_aa_string_ok(rec + pos + 4, aa_len))
+        return 0;
+
+    ifsdata = calloc(1, sizeof(ImageFileSourceData));
+    ifsrc = calloc(1, sizeof(IsoFileSource));
+    if (ifsdata == NULL || ifsrc == NULL)
+        goto no_mem;
+    ifsdata->info.st_mode = mode;
+    ifsdata->info.st_uid = iso_read_lsb(rec + 4, 4);
+    ifsdata->info.st_gid = iso_read_lsb(rec + 8, 4);
+    ifsdata->info.st_nlink = iso_read_lsb(rec + 12, 4);
+    ifsdata->info.st_ino = iso_read_lsb64(rec + 16);
+    ifsdata->info.st_size = (off_t) iso_read_lsb64(rec + 24);
+    ifsdata->info.st_rdev = iso_read_lsb64(rec + 32);
+    ifsdata->info.st_atime = (time_t) iso_read_lsb64(rec + 40);
+    ifsdata->info.st_mtime = (time_t) iso_read_lsb64(rec + 48);
+    ifsdata->info.st_ctime = (time_t) iso_read_lsb64(rec + 56);
+    ifsdata->info.st_dev = fsdata->id;
+    ifsdata->info.st_blksize = BLOCK_SIZE;
+    ifsdata->info.st_blocks = DIV_UP(ifsdata->info.st_size, BLOCK_SIZE);
+
+#ifdef Libisofs_with_zliB
+    ifsdata->zisofs_algo[0] = rec[64];
+    ifsdata->zisofs_algo[1] = rec[65];
+    ifsdata->header_size_div4 = rec[66];
+    ifsdata->block_size_log2 = rec[67];
+    ifsdata->uncompressed_size = iso_read_lsb64(rec + 68);
+#endif
+
+    ifsdata->sections = calloc(nsections, sizeof(struct iso_file_section));
+    if (ifsdata->sections == NULL)
+        goto no_mem;
+    for (i = 0; i < (int) nsections; i++) {
+        ifsdata->sections[i].block = iso_read_lsb(rec + 80 + i * 8, 4);
+        ifsdata->sections[i].size = iso_read_lsb(rec + 84 + i * 8, 4);
+    }
+    ifsdata->nsections = nsections;
+
+    pos = ISO_INDEX_REC_FIXED + nsections * 8 + 4;
+    ifsdata->name = calloc(1, name_len + 1);
+    if (ifsdata->name == NULL)
+        goto no_mem;
+    memcpy(ifsdata->name, rec + pos, name_len);
+    pos += name_len + 4;
+    if (S_ISLNK(ifsdata->info.st_mode)) {
+        linkdest = calloc(1, link_len + 1);
+        if (linkdest == NULL)
+            goto no_mem;
+        memcpy(linkdest, rec + pos, link_len);
+        ifsdata->data.content = linkdest;
+    }
+    pos += link_len + 4;
+    if (aa_len > 0) {
+        ifsdata->aa_string = calloc(1, aa_len);
+        if (ifsdata->aa_string == NULL)
+            goto no_mem;
+        memcpy(ifsdata->aa_string, rec + pos, aa_len);
+    }
+
+    ifsdata->fs = fs;
+    if (!(flag & 2))
+        iso_filesystem_ref(fs);
+    ifsrc->class = &ifs_class;
+    ifsrc->data = ifsdata;
+    ifsrc->refcount = 1;
+    *src = ifsrc;
+    return 1;
+
+no_mem:;
+    ret = ISO_OUT_OF_MEM;
+    if (ifsdata != NULL) {
+        if (ifsdata->sections != NULL)
+            free(ifsdata->sections);
+        if (ifsdata->name != NULL)
+            free(ifsdata->name);
+        if (linkdest != NULL)
+            free(linkdest);
+        free(ifsdata);
+    }
+    if (ifsrc != NULL)
+        free(ifsrc);
+    return ret;
+}
+
+/**
+ * Create the file sources of a directory from the index, as
+ * read_dir_extent() would do from the directory records.
+ *
+ * @param flag
+ *      bit1= create the file sources without reference to fs
+ * @return
+ *      1 success, 0 directory not in index or index damaged, < 0 error
+ */
+static
+int ifs_index_read_dir(IsoImageFilesystem *fs, uint32_t block,
+                       struct child_list **list, int flag)
+{
+    int ret;
+    _ImageFsData *fsdata;
+    uint8_t *entry;
+    uint32_t low, high, mid, entry_block, count, i, len;
+    uint64_t offset;
+    IsoFileSource *child = NULL;
+    struct child_list *first = NULL, *last = NULL, *node;
+
+    fsdata = fs->data;
+
+    /* Binary search in the directory table */
+    low = 0;
+    high = fsdata->index_dir_count;
+    entry = NULL;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        entry_block = iso_read_lsb(fsdata->index_table +
+                                   mid * ISO_INDEX_TABLE_ENTRY, 4);
+        if (entry_block == block) {
+            entry = fsdata->index_table + mid * ISO_INDEX_TABLE_ENTRY;
+    break;
+        }
+        if (entry_block < block)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (entry == NULL)
+        return 0;
+
+    offset = iso_read_lsb64(entry + 4);
+    if (offset > fsdata->index_size || fsdata->index_size - offset < 4)
+        {ret = 0; goto ex;}
+    count = iso_read_lsb(fsdata->index_data + offset, 4);
+    offset += 4;
+    for (i = 0; i < count; i++) {
+        if (fsdata->index_size - offset < 4)
+            {ret = 0; goto ex;}
+        len = iso_read_lsb(fsdata->index_data + offset, 4);
+        offset += 4;
+        if (fsdata->index_size - offset < len)
+            {ret = 0; goto ex;}
+        ret = ifs_index_new_src(fs, fsdata->index_data + offset, len, &child,
+                                flag & 2);
+        if (ret <= 0)
+            goto ex;
+        offset += len;
+
+        node = malloc(sizeof(struct child_list));
+        if (node == NULL) {
+            if (flag & 2)
+                ifs_free_unreferenced(child);
+            else
+                iso_file_source_unref(child);
+            {ret = ISO_OUT_OF_MEM; goto ex;}
+        }
+        node->file = child;
+        node->next = NULL;
+        if (last == NULL)
+            first = node;
+        else
+            last->next = node;
+        last = node;
+    }
+    if (last != NULL) {
+        last->next = *list;
+        *list = first;
+        first = NULL;
+    }
+    ret = 1;
+ex:;
+    if (ret == 0)
+        iso_msg_submit(fsdata->msgid, ISO_IMPORT_INDEX_IGNORED, 0,
+                "Ignored damaged index file entry for directory at block %lu",
+                       (unsigned long) block);
+    while (first != NULL) {
+        node = first->next;
+        if (flag & 2)
+            ifs_free_unreferenced(first->file);
+        else
+            iso_file_source_unref(first->file);
+        free(first);
+        first = node;
+    }
+    return ret;
+}
+
+/* Append the index record of a file source to *buf */
+static
+int ifs_index_add_rec(IsoFileSource *src, uint8_t **buf, size_t *buf_size,
+                      size_t *buf_used)
+{
+    ImageFileSourceData *data;
+    size_t len, name_len, link_len = 0, aa_len = 0, new_size;
+    uint8_t *rec, *new_buf;
+    int i;
+
+    data = src->data;
+    name_len = strlen(data->name);
+    if (S_ISLNK(data->info.st_mode) && data->data.content != NULL)
+        link_len = strlen(data->data.content);
+    if (data->aa_string != NULL)
+        aa_len = aaip_count_bytes(data->aa_string, 0);
+    len = ISO_INDEX_REC_FIXED + data->nsections * 8 + 12 +
+          name_len + link_len + aa_len;
+    if (*buf_used + 4 + len > *buf_size) {
+        new_size = 2 * *buf_size + 4 + len;
+        new_buf = realloc(*buf, new_size);
+        if (new_buf == NULL)
+            return ISO_OUT_OF_MEM;
+        *buf = new_buf;
+        *buf_size = new_size;
+    }
+    rec = *buf + *buf_used;
+    memset(rec, 0, 4 + len);
+    iso_lsb(rec, len, 4);
+    rec += 4;
+    iso_lsb(rec, data->info.st_mode, 4);
+    iso_lsb(rec + 4, data->info.st_uid, 4);
+    iso_lsb(rec + 8, data->info.st_gid, 4);
+    iso_lsb(rec + 12, data->info.st_nlink, 4);
+    iso_lsb64(rec + 16, (uint64_t) data->info.st_ino);
+    iso_lsb64(rec + 24, (uint64_t) data->info.st_size);
+    iso_lsb64(rec + 32, (uint64_t) data->info.st_rdev);
+    iso_lsb64(rec + 40, (uint64_t) data->info.st_atime);
+    iso_lsb64(rec + 48, (uint64_t) data->info.st_mtime);
+    iso_lsb64(rec + 56, (uint64_t) data->info.st_ctime);
+
+#ifdef Libisofs_with_zliB
+    if (data->header_size_div4 > 0) {
+        rec[64] = data->zisofs_algo[0];
+        rec[65] = data->zisofs_algo[1];
+        rec[66] = data->header_size_div4;
+        rec[67] = data->block_size_log2;
+        iso_lsb64(rec + 68, data->uncompressed_size);
+    }
+#endif
+
+    iso_lsb(rec + 76, data->nsections, 4);
+    for (i = 0; i < data->nsections; i++) {
+        iso_lsb(rec + 80 + i * 8, data->sections[i].block, 4);
+        iso_lsb(rec + 84 + i * 8, data->sections[i].size, 4);
+    }
+    rec += ISO_INDEX_REC_FIXED + data->nsections * 8;
+    iso_lsb(rec, name_len, 4);
+    memcpy(rec + 4, data->name, name_len);
+    rec += 4 + name_len;
+    iso_lsb(rec, link_len, 4);
+    if (link_len > 0)
+        memcpy(rec + 4, data->data.content, link_len);
+    rec += 4 + link_len;
+    iso_lsb(rec, aa_len, 4);
+    if (aa_len > 0)
+        memcpy(rec + 4, data->aa_string, aa_len);
+    *buf_used += 4 + len;
+    return ISO_SUCCESS;
+}
+
+struct ifs_index_dir
+{
+    uint32_t block;
+    uint64_t offset;
+};
+
+static
+int ifs_index_dir_cmp(const void *a, const void *b)
+{
+    uint32_t block_a, block_b;
+
+    block_a = ((struct ifs_index_dir *) a)->block;
+    block_b = ((struct ifs_index_dir *) b)->block;
+    if (block_a < block_b)
+        return -1;
+    if (block_a > block_b)
+        return 1;
+    return 0;
+}
+
+/* Register a directory in dirs and push it onto the stack if it is new */
+static
+int ifs_index_push_dir(IsoRBTree *dirs, uint32_t block,
+                       struct ifs_index_dir ***stack, size_t *stack_count,
+                       size_t *stack_size)
+{
+    int ret;
+    struct ifs_index_dir *dir, **new_stack;
+
+    dir = calloc(1, sizeof(struct ifs_index_dir));
+    if (dir == NULL)
+        return ISO_OUT_OF_MEM;
+    dir->block = block;
+    ret = iso_rbtree_insert(dirs, dir, NULL);
+    if (ret <= 0) {
+        /* Already registered, e.g. because of a faulty CL entry */
+        free(dir);
+        return ret;
+    }
+    if (*stack_count >= *stack_size) {
+        new_stack = realloc(*stack, (2 * *stack_size + 64) *
+                                    sizeof(struct ifs_index_dir *));
+        if (new_stack == NULL)
+            return ISO_OUT_OF_MEM;
+        *stack = new_stack;
+        *stack_size = 2 * *stack_size + 64;
     }
+    (*stack)[(*stack_count)++] = dir;
+    return ISO_SUCCESS;
+}
 
-    /* the size is read from iso directory record */
-    atts.st_size = iso_read_bb(record->length, 4, NULL);
+/* Write to the index file and add the bytes to its content MD5 */
+static
+int ifs_index_fwrite(FILE *fp, void *md5_ctx, void *buf, size_t len)
+{
+    size_t done, count;
 
-    /* Fill last entries */
-    atts.st_dev = fsdata->id;
-    atts.st_blksize = BLOCK_SIZE;
-    atts.st_blocks = DIV_UP(atts.st_size, BLOCK_SIZE);
+    if (fwrite(buf, 1, len, fp) != len)
+        return ISO_FILE_CANT_WRITE;
+    for (done = 0; done < len; done += count) {
+        count = len - done;
+        if (count > 1024 * 1024)
+            count = 1024 * 1024;
+        iso_md5_compute(md5_ctx, ((char *) buf) + done, (int) count);
+    }
+    return ISO_SUCCESS;
+}
 
-    /* TODO #00014 : more sanity checks to ensure dir record info is valid */
-    if (S_ISLNK(atts.st_mode) && (linkdest == NULL)) {
-        ret = iso_rr_msg_submit(fsdata, 18, ISO_WRONG_RR, 0,
-                                "Link without destination.");
-        free(name);
+/**
+ * Write the record lists of all directories of the filesystem to fp,
+ * beginning at *offset. Register the directories in dirs.
+ */
+static
+int ifs_index_write_dirs(IsoImageFilesystem *fs, FILE *fp, void *md5_ctx,
+                         IsoRBTree *dirs, uint64_t *offset)
+{
+    int ret, is_dir;
+    _ImageFsData *fsdata;
+    struct ifs_index_dir *dir, **stack = NULL;
+    size_t stack_count = 0, stack_size = 0;
+    uint8_t *buf = NULL;
+    size_t buf_size = 0, buf_used;
+    struct child_list *list = NULL, *l;
+    ImageFileSourceData *data;
+    uint32_t count, block = 0;
+
+    fsdata = fs->data;
+    buf_size = 64 * 1024;
+    buf = malloc(buf_size);
+    if (buf == NULL)
+        {ret = ISO_OUT_OF_MEM; goto ex;}
+    ret = ifs_index_push_dir(dirs, fsdata->iso_root_block,
+                             &stack, &stack_count, &stack_size);
+    if (ret < 0)
         goto ex;
-    }
 
-    /* ok, we can now create the file source */
-    if (*src == NULL) {
-        ifsdata = calloc(1, sizeof(ImageFileSourceData));
-        if (ifsdata == NULL) {
-            ret = ISO_OUT_OF_MEM;
-            goto ifs_cleanup;
+    while (stack_count > 0) {
+        dir = stack[--stack_count];
+        ret = read_dir_extent(fs, dir->block, &list, 2);
+        if (ret < 0)
+            goto ex;
+        count = 0;
+        buf_used = 4;
+        for (l = list; l != NULL; l = l->next) {
+            ret = ifs_index_add_rec(l->file, &buf, &buf_size, &buf_used);
+            if (ret < 0)
+                goto ex;
+            count++;
         }
-        ifsrc = calloc(1, sizeof(IsoFileSource));
-        if (ifsrc == NULL) {
-            ret = ISO_OUT_OF_MEM;
-            goto ifs_cleanup;
+        iso_lsb(buf, count, 4);
+        ret = ifs_index_fwrite(fp, md5_ctx, buf, buf_used);
+        if (ret < 0)
+            goto ex;
+        dir->offset = *offset;
+        *offset += buf_used;
+
+        /* Register the subdirectories */
+        while (list != NULL) {
+            l = list;
+            list = l->next;
+            data = l->file->data;
+            is_dir = S_ISDIR(data->info.st_mode);
+            if (is_dir)
+                block = data->sections[0].block;
+            ifs_free_unreferenced(l->file);
+            free(l);
+            if (is_dir) {
+                ret = ifs_index_push_dir(dirs, block,
+                                         &stack, &stack_count, &stack_size);
+                if (ret < 0)
+                    goto ex;
+            }
         }
-    } else {
-        ifsdata = (*src)->data;
-        ifsrc = (*src);
-        free(ifsdata->name); /* we will assign a new one */
-        ifsdata->name = NULL;
-        atts.st_size += (off_t)ifsdata->info.st_size;
-        if (ifsdata->aa_string != NULL)
-            free(ifsdata->aa_string);
-        ifsdata->aa_string = NULL;
     }
+    ret = ISO_SUCCESS;
+ex:;
+    while (list != NULL) {
+        l = list;
+        list = l->next;
+        ifs_free_unreferenced(l->file);
+        free(l);
+    }
+    if (stack != NULL)
+        free(stack);
+    if (buf != NULL)
+        free(buf);
+    return ret;
+}
 
-    /* fill data */
-    ifsdata->fs = fs;
-    iso_filesystem_ref(fs);
-    if (parent != NULL) {
-        ifsdata->parent = parent;
-        iso_file_source_ref(parent);
-    }
-    ifsdata->info = atts;
-    ifsdata->name = name;
-    ifsdata->aa_string = aa_string;
+/**
+ * Copy the checksum array from the index if it was recorded for the
+ * same checksum area.
+ *
+ * @return
+ *      1 copied, 0 not available
+ */
+static
+int ifs_index_get_checksums(IsoImageFilesystem *fs, IsoImage *image,
+                            size_t size)
+{
+    _ImageFsData *fsdata;
+    uint8_t *map;
 
-#ifdef Libisofs_with_zliB
-    if (zisofs_hs4 > 0) {
-        ifsdata->zisofs_algo[0] = zisofs_alg[0];
-        ifsdata->zisofs_algo[1] = zisofs_alg[1];
-        ifsdata->header_size_div4 = zisofs_hs4;
-        ifsdata->block_size_log2 = zisofs_bsl2;
-        ifsdata->uncompressed_size = zisofs_usize;
-    } else {
-        ifsdata->header_size_div4 = 0;
-    }
-#endif
+    fsdata = fs->data;
+    map = fsdata->index_data;
+    if (map == NULL)
+        return 0;
+    if (iso_read_lsb(map + 44, 4) != image->checksum_idx_count ||
+        iso_read_lsb(map + 48, 4) != image->checksum_end_lba)
+        return 0;
+    if (size * 2048 < image->checksum_idx_count * 16)
+        return 0;
+    memcpy(image->checksum_array, map + iso_read_lsb64(map + 64),
+           image->checksum_idx_count * 16);
+    return 1;
+}
 
-    /* save extents */
-    ifsdata->sections = realloc(ifsdata->sections,
-                (1 + ifsdata->nsections) * sizeof(struct iso_file_section));
-    if (ifsdata->sections == NULL) {
-        free(ifsdata->name);
-        ret = ISO_OUT_OF_MEM;
-        goto ifs_cleanup;
-    }
-    ifsdata->sections[ifsdata->nsections].block =
-                       iso_read_bb(record->block, 4, NULL) + record->len_xa[0];
-    ifsdata->sections[ifsdata->nsections].size = iso_read_bb(record->length, 4, NULL);
-    ifsdata->nsections++;
+/* API */
+int iso_image_save_index(IsoImage *image, char *path, int flag)
+{
+    int ret, fs_opened = 0;
+    IsoImageFilesystem *fs;
+    _ImageFsData *fsdata;
+    char *tmp_path = NULL, identity[16];
+    void *md5_ctx = NULL;
+    FILE *fp = NULL;
+    IsoRBTree *dirs = NULL;
+    struct ifs_index_dir **table = NULL;
+    size_t i, dir_count;
+    uint8_t *head = NULL, entry[ISO_INDEX_TABLE_ENTRY];
+    uint64_t offset, table_offset, checksum_offset;
+    uint32_t checksum_count = 0;
+
+    if (image == NULL || path == NULL)
+        return ISO_NULL_POINTER;
+    fs = image->import_fs;
+    if (fs == NULL)
+        return ISO_INDEX_NO_IMPORT;
+    fsdata = fs->data;
+    if ((flag & 1) && fsdata->index_data != NULL)
+        return 2;
 
-    if (S_ISLNK(atts.st_mode)) {
-        ifsdata->data.content = linkdest;
-    } else if (linkdest != NULL) {
-        ret = iso_rr_msg_submit(fsdata, 19, ISO_WRONG_RR_WARN, 0,
-                     "RRIP SL link destination with file that is not a link.");
-        free(linkdest);
-        linkdest = NULL;
-    }
+    LIBISO_ALLOC_MEM(head, uint8_t, ISO_INDEX_HEADER_SIZE);
+    LIBISO_ALLOC_MEM(tmp_path, char, strlen(path) + 5);
+    sprintf(tmp_path, "%s.tmp", path);
 
-    ifsrc->class = &ifs_class;
-    ifsrc->data = ifsdata;
-    ifsrc->refcount = 1;
+    ret = fs->open(fs);
+    if (ret < 0)
+        goto ex;
+    fs_opened = 1;
+    ret = ifs_index_identity(fsdata, identity);
+    if (ret < 0)
+        goto ex;
+    ret = iso_rbtree_new(ifs_index_dir_cmp, &dirs);
+    if (ret < 0)
+        goto ex;
+    ret = iso_md5_start(&md5_ctx);
+    if (ret < 0)
+        goto ex;
 
-    *src = ifsrc;
-    {ret = ISO_SUCCESS; goto ex;}
+    /* Write to a temporary file which replaces the old index when complete.
+       The old one might be in use by the import.
+     */
+    fp = fopen(tmp_path, "wb");
+    if (fp == NULL)
+        {ret = ISO_FILE_CANT_WRITE; goto ex;}
+    memset(head, 0, ISO_INDEX_HEADER_SIZE);
+    if (fwrite(head, 1, ISO_INDEX_HEADER_SIZE, fp) != ISO_INDEX_HEADER_SIZE)
+        {ret = ISO_FILE_CANT_WRITE; goto ex;}
+    offset = ISO_INDEX_HEADER_SIZE;
+
+    ret = ifs_index_write_dirs(fs, fp, md5_ctx, dirs, &offset);
+    if (ret < 0)
+        goto ex;
 
-ifs_cleanup: ;
-    free(name);
-    free(linkdest);
-    free(ifsdata);
-    free(ifsrc);
+    table = (struct ifs_index_dir **) iso_rbtree_to_array(dirs, NULL,
+                                                          &dir_count);
+    if (table == NULL)
+        {ret = ISO_OUT_OF_MEM; goto ex;}
+    table_offset = offset;
+    for (i = 0; i < dir_count; i++) {
+        iso_lsb(entry, table[i]->block, 4);
+        iso_lsb64(entry + 4, table[i]->offset);
+        ret = ifs_index_fwrite(fp, md5_ctx, entry, ISO_INDEX_TABLE_ENTRY);
+        if (ret < 0)
+            goto ex;
+        offset += ISO_INDEX_TABLE_ENTRY;
+    }
 
+    checksum_offset = offset;
+    if (image->checksum_array != NULL && image->checksum_idx_count > 1) {
+        checksum_count = image->checksum_idx_count;
+        ret = ifs_index_fwrite(fp, md5_ctx, image->checksum_array,
+                               ((size_t) checksum_count) * 16);
+        if (ret < 0)
+            goto ex;
+        offset += ((uint64_t) checksum_count) * 16;
+    }
+
+    memcpy(head, ISO_INDEX_MAGIC, 16);
+    memcpy(head + 16, identity, 16);
+    iso_lsb(head + 32, fsdata->px_ino_status, 4);
+    iso_lsb(head + 36, fsdata->inode_counter, 4);
+    iso_lsb(head + 40, (uint32_t) dir_count, 4);
+    iso_lsb(head + 44, checksum_count, 4);
+    iso_lsb(head + 48, checksum_count > 0 ? image->checksum_end_lba : 0, 4);
+    iso_lsb64(head + 56, table_offset);
+    iso_lsb64(head + 64, checksum_offset);
+    iso_lsb64(head + 72, offset);
+    iso_md5_end(&md5_ctx, (char *) head + 80);
+    if (fseeko(fp, (off_t) 0, SEEK_SET) == -1 ||
+        fwrite(head, 1, ISO_INDEX_HEADER_SIZE, fp) != ISO_INDEX_HEADER_SIZE)
+        {ret = ISO_FILE_CANT_WRITE; goto ex;}
+    ret = fclose(fp);
+    fp = NULL;
+    if (ret != 0 || rename(tmp_path, path) == -1)
+        {ret = ISO_FILE_CANT_WRITE; goto ex;}
+    ret = ISO_SUCCESS;
 ex:;
-    LIBISO_FREE_MEM(msg);
-    LIBISO_FREE_MEM(buffer);
+    if (fp != NULL)
+        fclose(fp);
+    if (md5_ctx != NULL)
+        iso_md5_end(&md5_ctx, identity);
+    if (ret < 0 && tmp_path != NULL)
+        unlink(tmp_path);
+    if (table != NULL)
+        free(table);
+    if (dirs != NULL)
+        iso_rbtree_destroy(dirs, free);
+    if (fs_opened)
+        fs->close(fs);
+    LIBISO_FREE_MEM(tmp_path);
+    LIBISO_FREE_MEM(head);
     return ret;
 }
 
@@ -2203,7 +3765,8 @@ int ifs_get_root(IsoFilesystem *fs, IsoFileSource **root)
     /* get root attributes from "." entry */
     *root = NULL;
     ret = iso_file_source_new_ifs((IsoImageFilesystem*)fs, NULL,
-                                 (struct ecma119_dir_record*) buffer, root, 1);
+                                 (struct ecma119_dir_record*) buffer, NULL,
+                                 root, 1);
 
     ifs_fs_close((IsoImageFilesystem*)fs);
 ex:;
@@ -2361,6 +3924,7 @@ int ifs_fs_close(IsoImageFilesystem *fs)
 
     if (--data->open_count == 0) {
         /* we need to actually close the data source */
+        susp_ce_cache_clear(data->ce_cache);
         return data->src->close(data->src);
     }
     return ISO_SUCCESS;
@@ -2400,6 +3964,9 @@ void ifs_fs_free(IsoFilesystem *fs)
 
     if(data->catcontent != NULL)
         free(data->catcontent);
+    if (data->index_data != NULL)
+        free(data->index_data);
+    susp_ce_cache_free(data->ce_cache);
 
     free(data);
 }
@@ -2458,7 +4025,7 @@ int read_root_susp_entries(_ImageFsData *data, uint32_t block)
      */
 
     iter = susp_iter_new(data->src, record, data->session_lba + data->nblocks,
-                         data->len_skp, data->msgid);
+                         data->len_skp, data->msgid, NULL);
     if (iter == NULL) {
         ret = ISO_OUT_OF_MEM; goto ex;
     }
@@ -2689,7 +4256,7 @@ int read_el_torito_boot_catalog(_ImageFsData *data, uint32_t block)
     struct el_torito_validation_entry *ve;
     struct el_torito_section_header *sh;
     struct el_torito_section_entry *entry; /* also usable as default_entry */
-    unsigned char *buffer = NULL, *rpt;
+    unsigned char *buffer = NULL;
 
     LIBISO_ALLOC_MEM(buffer, unsigned char, BLOCK_SIZE);
     data->num_bootimgs = 0;
@@ -2786,12 +4353,11 @@ after_bootblocks:;
          ret = ISO_OUT_OF_MEM;
          goto ex; 
       }
-      for(rx = 0; rx < bufsize; rx += BLOCK_SIZE) {
-        rpt = (unsigned char *) (data->catcontent + rx);
-        ret = data->src->read_block(data->src, block + rx / BLOCK_SIZE, rpt);
-        if (ret < 0)
-           goto ex;
-      }
+      ret = iso_data_source_read_blocks(data->src, block,
+                                        (uint32_t) (bufsize / BLOCK_SIZE),
+                                        (uint8_t *) data->catcontent);
+      if (ret < 0)
+         goto ex;
     }
     ret = ISO_SUCCESS;
 ex:;
@@ -2810,10 +4376,10 @@ static
 int iso_src_check_sb_tree(IsoDataSource *src, uint32_t start_lba, int flag)
 {
     int tag_type, ret;
-    char *block = NULL, md5[16];
+    char *block = NULL, md5[16], *batch = NULL;
     int desired = (1 << 2);
     void *ctx = NULL;
-    uint32_t next_tag = 0, i;
+    uint32_t next_tag = 0, i, j, n;
 
     LIBISO_ALLOC_MEM(block, char, 2048);    
     ret = iso_md5_start(&ctx);
@@ -2860,12 +4426,19 @@ int iso_src_check_sb_tree(IsoDataSource *src, uint32_t start_lba, int flag)
     }
 
     /* Go on with tree */
-    for (i++; start_lba + i <= next_tag; i++) {
-        ret = src->read_block(src, start_lba + i, (uint8_t *) block);
+    LIBISO_ALLOC_MEM(batch, char, ISO_READ_DIR_BATCH * 2048);
+    for (i++; start_lba + i <= next_tag; i += n) {
+        n = next_tag - (start_lba + i) + 1;
+        if (n > ISO_READ_DIR_BATCH)
+            n = ISO_READ_DIR_BATCH;
+        ret = iso_data_source_read_blocks(src, start_lba + i, n,
+                                          (uint8_t *) batch);
         if (ret < 0)
             goto ex;
-        if (start_lba + i < next_tag)
-            iso_md5_compute(ctx, block, 2048);
+        for (j = 0; j < n; j++)
+            if (start_lba + i + j < next_tag)
+                iso_md5_compute(ctx, batch + j * 2048, 2048);
+        memcpy(block, batch + (n - 1) * 2048, 2048);
     }
     ret = iso_util_eval_md5_tag(block, (1 << 3), start_lba + i - 1,
                                 ctx, start_lba, &tag_type, &next_tag, 0);
@@ -2880,6 +4453,7 @@ ex:
     if (ctx != NULL)
         iso_md5_end(&ctx, md5);
     LIBISO_FREE_MEM(block);
+    LIBISO_FREE_MEM(batch);
     return ret;
 }
 
@@ -2943,6 +4517,11 @@ int iso_image_filesystem_new(IsoDataSource *src, struct iso_read_opts *opts,
     data->rr_err_reported = 0;
     data->rr_err_repeated = 0;
     data->joliet_ucs2_failures = 0;
+    data->dir_pool = NULL;
+    data->bootcat = NULL;
+    for (i = 0; i < Libisofs_max_boot_imageS; i++)
+        data->provisional_boot[i] = 0;
+    data->provisional_cat = 0;
 
 
     data->local_charset = strdup(iso_get_local_charset(0));
@@ -3120,6 +4699,12 @@ int iso_image_filesystem_new(IsoDataSource *src, struct iso_read_opts *opts,
             data->input_charset = strdup("ASCII");
         }
     }
+    if (data->rr) {
+        ret = susp_ce_cache_new(src, data->session_lba + data->nblocks,
+                                &data->ce_cache);
+        if (ret < 0)
+            goto fs_cleanup;
+    }
     data->truncate_mode = opts->truncate_mode;
     data->truncate_length = opts->truncate_length;
     data->ecma119_map = opts->ecma119_map;
@@ -3137,6 +4722,7 @@ int iso_image_filesystem_new(IsoDataSource *src, struct iso_read_opts *opts,
         goto fs_cleanup;
     }
     data->auto_input_charset = opts->auto_input_charset;
+    ifs_set_ascii_compat(data);
 
     /* and finally return. Note that we keep the DataSource opened */
 
@@ -3192,12 +4778,23 @@ int src_aa_to_node(IsoFileSource *src, IsoNode *node, int flag)
 }
 
 
+/* Whether the El Torito catalog of the import is still attached to the
+   image. With lazy import, nodes get created after the application had
+   the opportunity to change the boot setup.
+*/
+static
+int ifs_bootcat_is_imported(IsoImage *image, _ImageFsData *fsdata)
+{
+    return fsdata->eltorito && image->bootcat != NULL &&
+           image->bootcat == fsdata->bootcat;
+}
+
 static
 int image_builder_create_node(IsoNodeBuilder *builder, IsoImage *image,
                               IsoFileSource *src, char *in_name,
                               IsoNode **node)
 {
-    int ret, idx, to_copy;
+    int ret, idx, to_copy, boot_ok;
     struct stat info;
     IsoNode *new = NULL;
     IsoBoot *bootcat;
@@ -3242,9 +4839,14 @@ int image_builder_create_node(IsoNodeBuilder *builder, IsoImage *image,
             /* source is a regular file */
 
             /* El-Torito images have only one section */
-            if (fsdata->eltorito && data->sections[0].block == fsdata->catblock) {
+            boot_ok = ifs_bootcat_is_imported(image, fsdata);
+            if (boot_ok && data->sections[0].block == fsdata->catblock) {
 
-                if (image->bootcat->node != NULL) {
+                if (image->bootcat->node != NULL && fsdata->provisional_cat) {
+                    /* Replace the hidden node of lazy import */
+                    fsdata->provisional_cat = 0;
+                    iso_node_unref((IsoNode*)image->bootcat->node);
+                } else if (image->bootcat->node != NULL) {
                     ret = iso_msg_submit(image->id, ISO_EL_TORITO_WARN, 0,
                                  "More than one catalog node has been found. "
                                  "We can continue, but that could lead to "
@@ -3341,7 +4943,7 @@ int image_builder_create_node(IsoNodeBuilder *builder, IsoImage *image,
 
                 if (data->sections[0].size > 0) {
                     for (idx = 0; idx < fsdata->num_bootimgs; idx++)
-                        if (fsdata->eltorito && data->sections[0].block ==
+                        if (boot_ok && data->sections[0].block ==
                             fsdata->bootblocks[idx])
                     break;
                 } else {
@@ -3351,12 +4953,14 @@ int image_builder_create_node(IsoNodeBuilder *builder, IsoImage *image,
                     /* it is boot image node */
                     if (image->bootcat->bootimages[idx]->image != NULL) {
                         /* idx is already occupied, try to find unoccupied one
-                           which has the same block address.
+                           which has the same block address. A hidden node
+                           of lazy import counts as unoccupied.
                         */
                         for (; idx < fsdata->num_bootimgs; idx++)
-                            if (fsdata->eltorito && data->sections[0].block ==
+                            if (data->sections[0].block ==
                                 fsdata->bootblocks[idx] &&
-                                image->bootcat->bootimages[idx]->image == NULL)
+                                (image->bootcat->bootimages[idx]->image == NULL
+                                 || fsdata->provisional_boot[idx]))
                         break;
                     }
                     if (idx >= fsdata->num_bootimgs) {
@@ -3367,6 +4971,11 @@ int image_builder_create_node(IsoNodeBuilder *builder, IsoImage *image,
                             goto ex;
                         }
                     } else {
+                        if (fsdata->provisional_boot[idx]) {
+                            fsdata->provisional_boot[idx] = 0;
+                            iso_node_unref((IsoNode *)
+                                       image->bootcat->bootimages[idx]->image);
+                        }
                         /* and set the image node */
                         image->bootcat->bootimages[idx]->image = file;
                         new->refcount++;
@@ -4218,14 +5827,14 @@ int iso_analyze_gpt_backup(IsoImage *image, IsoDataSource *src, int flag)
                 (double) part_start);
     iso_block = part_start / 4;
     num_iso_blocks = (part_start + (entry_count + 3) / 4) / 4 - iso_block + 1;
-    for (i = 0; i < num_iso_blocks; i++) {
-        ret = src->read_block(src, iso_block + (uint32_t) i, buf + i * 2048);
-        if (ret < 0) {
-            sprintf(comments + strlen(comments),
-                    "Cannot read array block at 2k LBA %.f, ",
-                    (double) iso_block);
-            ret = 0; goto ex;
-        }
+    ret = iso_data_source_read_blocks(src, iso_block,
+                                      (uint32_t) num_iso_blocks,
+                                      (uint8_t *) buf);
+    if (ret < 0) {
+        sprintf(comments + strlen(comments),
+                "Cannot read array block at 2k LBA %.f, ",
+                (double) iso_block);
+        ret = 0; goto ex;
     }
     part_array = buf + (part_start % 4) * 512;
 
@@ -5767,6 +7376,30 @@ int iso_image_report_el_torito(IsoImage *image,
 }
 
 
+/* Called by iso_tree_lazy_load() after a directory got its children */
+static
+int ifs_lazy_loaded(struct iso_lazy_import *lazy, IsoDir *dir)
+{
+    int hflag;
+    _ImageFsData *data;
+    IsoImage *image;
+
+    data = (_ImageFsData *) lazy->fs->data;
+    image = lazy->image;
+
+    /* The new children may bear higher PX inode numbers */
+    if (image->inode_counter < data->inode_counter)
+        image->inode_counter = data->inode_counter;
+
+    if (!((data->px_ino_status & (2 | 4 | 8)) || data->make_new_ino))
+        return ISO_SUCCESS;
+    if (data->make_new_ino)
+        hflag = 1;
+    else
+        hflag = 2 | 4;
+    return img_make_inos(image, dir, hflag | 16);
+}
+
 int iso_image_import(IsoImage *image, IsoDataSource *src,
                      struct iso_read_opts *opts,
                      IsoReadImageFeatures **features)
@@ -5779,7 +7412,6 @@ int iso_image_import(IsoImage *image, IsoDataSource *src,
     IsoFileSource *newroot;
     _ImageFsData *data;
     struct el_torito_boot_catalog *oldbootcat;
-    uint8_t *rpt;
     IsoFileSource *boot_src;
     IsoNode *node;
     char *old_checksum_array = NULL;
@@ -5792,6 +7424,7 @@ int iso_image_import(IsoImage *image, IsoDataSource *src,
     char md5[16];
     struct el_torito_boot_catalog *catalog = NULL;
     ElToritoBootImage *boot_image = NULL;
+    struct iso_lazy_import *lazy = NULL;
 
     if (image == NULL || src == NULL || opts == NULL) {
         return ISO_NULL_POINTER;
@@ -5820,13 +7453,11 @@ int iso_image_import(IsoImage *image, IsoDataSource *src,
         }
         image->system_area_options = 0;
         /* Read 32768 bytes */
-        for (i = 0; i < 16; i++) {
-            rpt = (uint8_t *) (image->system_area_data + i * 2048);
-            ret = src->read_block(src, opts->block + i, rpt);
-            if (ret < 0) {
-                iso_filesystem_unref(fs);
-                return ret;
-            }
+        ret = iso_data_source_read_blocks(src, opts->block, 16,
+                                       (uint8_t *) image->system_area_data);
+        if (ret < 0) {
+            iso_filesystem_unref(fs);
+            return ret;
         }
     }
 
@@ -5855,6 +7486,7 @@ int iso_image_import(IsoImage *image, IsoDataSource *src,
             if (data->input_charset != NULL)
                 free(data->input_charset);
             data->input_charset = attr_value;
+            ifs_set_ascii_compat(data);
             iso_msg_submit(image->id, ISO_GENERAL_NOTE, 0,
                          "Learned from ISO image: input character set '%.80s'",
                           attr_value);
@@ -5972,11 +7604,39 @@ int iso_image_import(IsoImage *image, IsoDataSource *src,
         for ( ; idx < Libisofs_max_boot_imageS; idx++)
             catalog->bootimages[idx] = NULL;
         image->bootcat = catalog;
+        data->bootcat = catalog;
         catalog = NULL; /* So it does not get freed */
     }
 
+    if (opts->index_path != NULL) {
+        ret = ifs_index_attach(fs, opts->index_path);
+        if (ret < 0) {
+            iso_node_builder_unref(image->builder);
+            goto import_revert;
+        }
+    }
+
     /* recursively add image */
-    ret = iso_add_dir_src_rec(image, image->root, newroot);
+    if (opts->lazy_tree) {
+        /* Only the root directory gets loaded now */
+        ret = iso_lazy_import_new(image, image->builder, fs, &lazy);
+        if (ret < 0) {
+            iso_node_builder_unref(image->builder);
+            goto import_revert;
+        }
+        lazy->loaded = ifs_lazy_loaded;
+        ret = iso_add_dir_src_lazy(image, image->root, newroot, lazy);
+    } else {
+        if (opts->import_threads > 1) {
+            ret = ifs_dir_pool_start(fs, opts->import_threads);
+            if (ret < 0) {
+                iso_node_builder_unref(image->builder);
+                goto import_revert;
+            }
+        }
+        ret = iso_add_dir_src_rec(image, image->root, newroot);
+        ifs_dir_pool_stop(fs);
+    }
     if (ret < 0) {
         /* error during recursive image addition */
         iso_node_builder_unref(image->builder);
@@ -5998,6 +7658,8 @@ int iso_image_import(IsoImage *image, IsoDataSource *src,
             hflag = 1; /* Equip all data files with new unique inos */
         else
             hflag = 2 | 4 | 8; /* Equip any file type if it has ino == 0 */
+        if (opts->lazy_tree)
+            hflag |= 16; /* The others get equipped by ifs_lazy_loaded() */
         ret = img_make_inos(image, image->root, hflag);
         if (ret < 0) {
             iso_node_builder_unref(image->builder);
@@ -6032,6 +7694,11 @@ int iso_image_import(IsoImage *image, IsoDataSource *src,
             } else {
                 image->bootcat->bootimages[idx]->image = (IsoFile*)node;
             }
+            if (opts->lazy_tree) {
+                /* The image might be found in a directory not loaded yet */
+                data->provisional_boot[idx] = 1;
+        continue;
+            }
             
 
             /* warn about hidden images */
@@ -6076,6 +7743,8 @@ int iso_image_import(IsoImage *image, IsoDataSource *src,
             node->mode = S_IFREG;
             node->refcount = 1;
             image->bootcat->node = (IsoBoot*)node;
+            if (opts->lazy_tree)
+                data->provisional_cat = 1;
         }
     }
 
@@ -6134,13 +7803,15 @@ int iso_image_import(IsoImage *image, IsoDataSource *src,
                 goto import_revert;
             }
 
-            /* Load from image->checksum_end_lba */;
-            for (i = 0; i < (int) size; i++) {
-                rpt = (uint8_t *) (image->checksum_array + i * 2048);
-                ret = src->read_block(src, image->checksum_end_lba + i, rpt);
-                if (ret <= 0)
-                    goto import_cleanup;
-            }
+            /* Load from index or from image->checksum_end_lba */;
+            ret = ifs_index_get_checksums(fs, image, size);
+            if (ret == 0)
+                ret = iso_data_source_read_blocks(src,
+                                                  image->checksum_end_lba,
+                                                  (uint32_t) size,
+                                        (uint8_t *) image->checksum_array);
+            if (ret <= 0)
+                goto import_cleanup;
 
             /* Compute MD5 and compare with recorded MD5 */
             ret = iso_md5_start(&ctx);
@@ -6180,6 +7851,22 @@ int iso_image_import(IsoImage *image, IsoDataSource *src,
         }
     }
 
+    if (lazy != NULL) {
+        if (image->lazy_import != NULL) {
+            image->lazy_import->image = NULL;
+            iso_lazy_import_unref(image->lazy_import);
+        }
+        image->lazy_import = lazy;
+        lazy = NULL;
+    }
+    if (opts->index_path != NULL) {
+        /* Keep the filesystem for iso_image_save_index() */
+        if (image->import_fs != NULL)
+            iso_filesystem_unref(image->import_fs);
+        image->import_fs = fs;
+        iso_filesystem_ref(fs);
+    }
+
     ret = ISO_SUCCESS;
     goto import_cleanup;
 
@@ -6196,6 +7883,11 @@ int iso_image_import(IsoImage *image, IsoDataSource *src,
 
     import_cleanup:;
 
+    if (lazy != NULL) {
+        lazy->image = NULL;
+        iso_lazy_import_unref(lazy);
+    }
+
     /* recover backed fs and builder */
     image->fs = fsback;
     image->builder = blback;
@@ -6303,6 +7995,8 @@ int iso_read_opts_new(IsoReadOpts **opts, int profile)
     ropts->keep_import_src = 0;
     ropts->truncate_mode = 1;
     ropts->truncate_length = LIBISOFS_NODE_NAME_MAX;
+    ropts->import_threads = 0;
+    ropts->lazy_tree = 0;
 
     *opts = ropts;
     return ISO_SUCCESS;
@@ -6315,6 +8009,8 @@ void iso_read_opts_free(IsoReadOpts *opts)
     }
 
     free(opts->input_charset);
+    if (opts->index_path != NULL)
+        free(opts->index_path);
     free(opts);
 }
 
@@ -6477,6 +8173,45 @@ int iso_read_opts_keep_import_src(IsoReadOpts *opts, int mode)
     return ISO_SUCCESS;
 }
 
+/* API */
+int iso_read_opts_set_import_threads(IsoReadOpts *opts, int num_threads)
+{
+    if (opts == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    if (num_threads < 0 || num_threads > ISO_IMPORT_THREADS_MAX)
+        return 0;
+    opts->import_threads = num_threads;
+    return ISO_SUCCESS;
+}
+
+/* API */
+int iso_read_opts_set_lazy_tree(IsoReadOpts *opts, int mode)
+{
+    if (opts == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    opts->lazy_tree = mode & 1;
+    return ISO_SUCCESS;
+}
+
+/* API */
+int iso_read_opts_set_index_file(IsoReadOpts *opts, char *path, int flag)
+{
+    if (opts == NULL) {
+        return ISO_NULL_POINTER;
+    }
+    if (opts->index_path != NULL)
+        free(opts->index_path);
+    opts->index_path = NULL;
+    if (path != NULL) {
+        opts->index_path = strdup(path);
+        if (opts->index_path == NULL)
+            return ISO_OUT_OF_MEM;
+    }
+    return ISO_SUCCESS;
+}
+
 /**
  * Destroy an IsoReadImageFeatures object obtained with iso_image_import.
  */
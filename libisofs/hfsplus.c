@@ -34,11 +34,13 @@
 #include "util.h"
 #include "ecma119.h"
 #include "system_area.h"
+#include "tree.h"
 
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 
 /* To be used if Ecma119.hfsplus_block_size == 0 in hfsplus_writer_create().
    It cannot be larger than 2048 because filesrc_writer aligns data file
@@ -115,13 +117,62 @@ uint8_t get_class (uint16_t v)
   return hfsplus_class_pages[high][low];
 }
 
+static pthread_once_t hfsplus_tables_once = PTHREAD_ONCE_INIT;
+
+static
+void make_hfsplus_tables(void)
+{
+    make_hfsplus_decompose_pages();
+    make_hfsplus_class_pages();
+    make_hfsplus_case_pages();
+}
+
+/* Decompose a character which is not ASCII.
+   @param c    The UTF-16BE character
+   @param out  Gets the UTF-16BE characters of the decomposition,
+               HFSPLUS_MAX_DECOMPOSE_LEN at most
+   @return     Number of characters in out
+*/
+static
+int hfsplus_decompose(uint16_t c, uint16_t *out)
+{
+    const uint16_t *dptr;
+    uint16_t val = iso_ntohs(c);
+    uint8_t high = val >> 8;
+    uint8_t low = val & 0xff;
+    int n = 0;
+
+    if (val >= 0xac00 && val <= 0xd7a3) {
+        /* Hangul syllable */
+        uint16_t s, l, v, t;
+        s = val - 0xac00;
+        l = s / (21 * 28);
+        v = (s % (21 * 28)) / 28;
+        t = s % 28;
+        out[n++] = iso_htons(l + 0x1100);
+        out[n++] = iso_htons(v + 0x1161);
+        if (t)
+            out[n++] = iso_htons(t + 0x11a7);
+        return n;
+    }
+    if (hfsplus_decompose_pages[high] != NULL) {
+        dptr = hfsplus_decompose_pages[high][low];
+        for (; *dptr; dptr++)
+            out[n++] = iso_htons(*dptr);
+    }
+    if (n == 0)
+        out[n++] = c;
+    return n;
+}
+
 int iso_get_hfsplus_name(char *input_charset, int imgid, char *name,
                   uint16_t **result, uint32_t *result_len, uint16_t **cmp_name)
 {
-    int ret;
-    uint16_t *ucs_name, *iptr, *optr;
+    int ret, n, i, ascii = 1;
+    uint16_t *ucs_name, *iptr, *optr, *cptr, val;
+    uint16_t dec[HFSPLUS_MAX_DECOMPOSE_LEN];
     uint32_t curlen;
-    int done;
+    uint8_t last_class, new_class;
 
     if (name == NULL) {
         /* it is not necessarily an error, it can be the root */
@@ -133,104 +184,115 @@ int iso_get_hfsplus_name(char *input_charset, int imgid, char *name,
         iso_msg_debug(imgid, "Cannot convert '%s'", name);
         return ret;
     }
-
-    curlen = ucslen (ucs_name);
-    *result = calloc ((curlen * HFSPLUS_MAX_DECOMPOSE_LEN + 1),
-                     sizeof (uint16_t));
-    if (*result == NULL) {
+    pthread_once(&hfsplus_tables_once, make_hfsplus_tables);
+
+    /* Determine the length after decomposition. ASCII characters do not
+       get decomposed or reordered.
+    */
+    curlen = 0;
+    for (iptr = ucs_name; *iptr; iptr++) {
+        if (iso_ntohs(*iptr) < 0x80) {
+            curlen++;
+        } else {
+            ascii = 0;
+            curlen += hfsplus_decompose(*iptr, dec);
+        }
+    }
+    *result = calloc(curlen + 1, sizeof(uint16_t));
+    *cmp_name = calloc(curlen + 1, sizeof(uint16_t));
+    if (*result == NULL || *cmp_name == NULL) {
         free(ucs_name);
+        if (*result != NULL)
+            free(*result);
+        if (*cmp_name != NULL)
+            free(*cmp_name);
+        *result = *cmp_name = NULL;
         return ISO_OUT_OF_MEM;
     }
 
-    for (iptr = ucs_name, optr = *result; *iptr; iptr++)
-      {
-	const uint16_t *dptr;
-	uint16_t val = iso_ntohs (*iptr);
-	uint8_t high = val >> 8;
-	uint8_t low = val & 0xff;
-
-	if (val == ':')
-	  {
-	    *optr++ = iso_htons ('/');
-	    continue;
-	  }
-
-	if (val >= 0xac00 && val <= 0xd7a3)
-	  {
-	    uint16_t s, l, v, t;
-	    s = val - 0xac00;
-	    l = s / (21 * 28);
-	    v = (s % (21 * 28)) / 28;
-	    t = s % 28;
-	    *optr++ = iso_htons (l + 0x1100);
-	    *optr++ = iso_htons (v + 0x1161);
-	    if (t)
-	      *optr++ = iso_htons (t + 0x11a7);
-	    continue;
-	  }
-	if (!hfsplus_decompose_pages[high])
-	  {
-	    *optr++ = *iptr;
-	    continue;
-	  }
-	dptr = hfsplus_decompose_pages[high][low];
-	if (!dptr[0])
-	  {
-	    *optr++ = *iptr;
-	    continue;
-	  }
-	for (; *dptr; dptr++)
-	  *optr++ = iso_htons (*dptr);
-      }
-    *optr = 0;
-
-    do
-      {
-	uint8_t last_class;
-	done = 0;
-	if (!ucs_name[0])
-	  break;
-	last_class = get_class (ucs_name[0]);
-	for (optr = *result + 1; *optr; optr++)
-	  {
-	    uint8_t new_class = get_class (*optr);
-
-	    if (last_class == 0 || new_class == 0
-		|| last_class <= new_class)
-	      last_class = new_class;
-	    else
-	      {
-		uint16_t t;
-		t = *(optr - 1);
-		*(optr - 1) = *optr;
-		*optr = t;
-	      }
-	  }
-      }
-    while (done);
-
-    *cmp_name = calloc ((ucslen (*result) + 1), sizeof (uint16_t));
-    if (*cmp_name == NULL) {
-        free(ucs_name);
-        free(*result);
-        *result = NULL;
-        return ISO_OUT_OF_MEM;
+    if (ascii) {
+        /* Display name and comparison name in one pass */
+        for (iptr = ucs_name, optr = *result, cptr = *cmp_name; *iptr;
+             iptr++, optr++) {
+            if (*iptr == iso_htons(':'))
+                *optr = iso_htons('/');
+            else
+                *optr = *iptr;
+            *cptr = iso_hfsplus_cichar(*optr);
+            if (*cptr != 0)
+                cptr++;
+        }
+        *optr = 0;
+        *cptr = 0;
+        goto ex;
     }
 
-    for (iptr = *result, optr = *cmp_name; *iptr; iptr++)
-      {
-	*optr = iso_hfsplus_cichar(*iptr);
-	if (*optr != 0)
-	    optr++;
-      }
+    for (iptr = ucs_name, optr = *result; *iptr; iptr++) {
+        val = iso_ntohs(*iptr);
+        if (val == ':') {
+            *optr++ = iso_htons('/');
+        } else if (val < 0x80) {
+            *optr++ = *iptr;
+        } else {
+            n = hfsplus_decompose(*iptr, dec);
+            for (i = 0; i < n; i++)
+                *optr++ = dec[i];
+        }
+    }
     *optr = 0;
 
-    free (ucs_name);
+    /* One pass of canonical reordering. A character is final as soon as its
+       successor was inspected. So the comparison name gets produced along.
+    */
+    cptr = *cmp_name;
+    if ((*result)[0]) {
+        last_class = get_class(ucs_name[0]);
+        for (optr = *result + 1; *optr; optr++) {
+            new_class = get_class(*optr);
+            if (last_class == 0 || new_class == 0 || last_class <= new_class) {
+                last_class = new_class;
+            } else {
+                val = *(optr - 1);
+                *(optr - 1) = *optr;
+                *optr = val;
+            }
+            *cptr = iso_hfsplus_cichar(*(optr - 1));
+            if (*cptr != 0)
+                cptr++;
+        }
+        *cptr = iso_hfsplus_cichar(*(optr - 1));
+        if (*cptr != 0)
+            cptr++;
+    }
+    *cptr = 0;
 
-    *result_len = ucslen (*result);
+ex:;
+    free(ucs_name);
+    *result_len = ucslen(*result);
     return ISO_SUCCESS;
 }
 
+/* Compute .cmp_key and .cmp_len from .parent_id and .cmp_name.
+   This has to be done whenever one of both changes.
+*/
+static
+void hfsplus_set_cmp_key(HFSPlusNode *node)
+{
+    uint8_t *name;
+    uint32_t prefix = 0;
+
+    node->cmp_len = 0;
+    if (node->cmp_name != NULL) {
+        node->cmp_len = ucslen(node->cmp_name);
+        name = (uint8_t *) node->cmp_name;
+        if (node->cmp_len >= 1)
+            prefix = (name[0] << 24) | (name[1] << 16);
+        if (node->cmp_len >= 2)
+            prefix |= (name[2] << 8) | name[3];
+    }
+    node->cmp_key = (((uint64_t) node->parent_id) << 32) | prefix;
+}
+
 static
 int set_hfsplus_name(Ecma119Image *t, char *name, HFSPlusNode *node)
 {
@@ -238,6 +300,7 @@ int set_hfsplus_name(Ecma119Image *t, char *name, HFSPlusNode *node)
 
     ret = iso_get_hfsplus_name(t->input_charset, t->image->id, name,
                             &(node->name), &(node->strlen), &(node->cmp_name));
+    hfsplus_set_cmp_key(node);
     return ret;
 }
 
@@ -269,7 +332,7 @@ int hfsplus_count_tree(Ecma119Image *t, IsoNode *iso)
       {
 	IsoNode *pos;
 	IsoDir *dir = (IsoDir*)iso;
-	pos = dir->children;
+	pos = iso_tree_cow_child(dir, NULL);
 	while (pos) {
 	  int cret;
 	  cret = hfsplus_count_tree(t, pos);
@@ -277,7 +340,7 @@ int hfsplus_count_tree(Ecma119Image *t, IsoNode *iso)
 	    /* error */
 	    return cret;
 	  }
-	  pos = pos->next;
+	  pos = iso_tree_cow_child(dir, pos);
 	}
       }
       return ISO_SUCCESS;
@@ -360,7 +423,9 @@ int create_tree(Ecma119Image *t, IsoNode *iso, uint32_t parent_id)
 	{
 	  IsoFile *file = (IsoFile*) iso;
 	  t->hfsp_leafs[t->hfsp_curleaf].type = HFSPLUS_FILE;
-	  ret = iso_file_src_create(t, file, &t->hfsp_leafs[t->hfsp_curleaf].file);
+	  ret = iso_file_src_create_in_tree(t, file,
+	                                    &t->hfsp_leafs[t->hfsp_curleaf].file,
+	                                    ISO_LOW_TREE_HFSPLUS);
 	  if (ret < 0) {
             return ret;
 	  }
@@ -397,14 +462,14 @@ int create_tree(Ecma119Image *t, IsoNode *iso, uint32_t parent_id)
 	IsoNode *pos;
 	IsoDir *dir = (IsoDir*)iso;
 
-	pos = dir->children;
+	pos = iso_tree_cow_child(dir, NULL);
 	while (pos)
 	  {
 	    int cret;
 	    cret = create_tree(t, pos, cat_id);
 	    if (cret < 0)
 	      return cret;
-	    pos = pos->next;
+	    pos = iso_tree_cow_child(dir, pos);
 	    if (cret > 0)
 	      t->hfsp_leafs[cleaf].nchildren++;
 	  }
@@ -412,25 +477,31 @@ int create_tree(Ecma119Image *t, IsoNode *iso, uint32_t parent_id)
     return ISO_SUCCESS;
 }
 
+/* Order by parent_id and then by cmp_name like ucscmp() does. The keys
+   of hfsplus_set_cmp_key() decide most comparisons without looking at the
+   names.
+*/
 static int
 cmp_node(const void *f1, const void *f2)
 {
   HFSPlusNode *f = (HFSPlusNode*) f1;
   HFSPlusNode *g = (HFSPlusNode*) f2;
-  const uint16_t empty[1] = {0};
-  const uint16_t *a, *b; 
-  if (f->parent_id > g->parent_id)
+  uint32_t len;
+  int ret;
+
+  if (f->cmp_key != g->cmp_key)
+    return (f->cmp_key > g->cmp_key) ? +1 : -1;
+  len = MIN(f->cmp_len, g->cmp_len);
+  if (len > 2) {
+    ret = memcmp(f->cmp_name, g->cmp_name, len * 2);
+    if (ret != 0)
+      return (ret > 0) ? +1 : -1;
+  }
+  if (f->cmp_len > g->cmp_len)
     return +1;
-  if (f->parent_id < g->parent_id)
+  if (f->cmp_len < g->cmp_len)
     return -1;
-  a = f->cmp_name;
-  b = g->cmp_name;
-  if (!a)
-    a = empty;
-  if (!b)
-    b = empty;
-
-  return ucscmp(a, b);
+  return 0;
 }
 
 
@@ -1103,6 +1174,18 @@ int hfsplus_tail_writer_write_data(IsoImageWriter *writer)
     return ret;
 }
 
+static
+void hfsplus_link_walk_destroy(struct hfsplus_link_walk **walk)
+{
+    if (*walk == NULL)
+        return;
+    LIBISO_FREE_MEM((*walk)->dirs);
+    LIBISO_FREE_MEM((*walk)->parent_ids);
+    LIBISO_FREE_MEM((*walk)->path);
+    free(*walk);
+    *walk = NULL;
+}
+
 static
 int hfsplus_writer_free_data(IsoImageWriter *writer)
 {
@@ -1119,6 +1202,7 @@ int hfsplus_writer_free_data(IsoImageWriter *writer)
 	      free (t->hfsp_leafs[i].symlink_dest);
 	}
     free(t->hfsp_leafs);
+    hfsplus_link_walk_destroy(&(t->hfsp_link_walk));
     for (i = 0; i < t->hfsp_nlevels; i++)
       free (t->hfsp_levels[i].nodes);
     free(t->hfsp_levels);
@@ -1224,6 +1308,164 @@ int subst_symlink_dest_comp(Ecma119Image *target, uint32_t idx,
     return ISO_SUCCESS;
 }
 
+/* The directories of the HFS+ tree by catalog id. Nodes which are seen
+   through a pending copy-on-write clone have the parent pointers of their
+   origin tree. So the path walks of update_symlink() take the parent
+   directories from the HFS+ tree and keep them in .path.
+*/
+static
+int hfsplus_link_walk_new(Ecma119Image *target)
+{
+    struct hfsplus_link_walk *walk;
+    HFSPlusNode *leaf;
+    uint32_t i;
+
+    if (target->hfsp_link_walk != NULL)
+        return ISO_SUCCESS;
+    walk = calloc(1, sizeof(struct hfsplus_link_walk));
+    if (walk == NULL)
+        return ISO_OUT_OF_MEM;
+    target->hfsp_link_walk = walk;
+    walk->dirs = calloc(target->hfsp_cat_id, sizeof(IsoDir *));
+    walk->parent_ids = calloc(target->hfsp_cat_id, sizeof(uint32_t));
+    if (walk->dirs == NULL || walk->parent_ids == NULL)
+        return ISO_OUT_OF_MEM;
+    for (i = 0; i < target->hfsp_nleafs; i++) {
+        leaf = &(target->hfsp_leafs[i]);
+        if (leaf->type != HFSPLUS_DIR || leaf->cat_id >= target->hfsp_cat_id)
+    continue;
+        walk->dirs[leaf->cat_id] = (IsoDir *) leaf->node;
+        walk->parent_ids[leaf->cat_id] = leaf->parent_id;
+    }
+    return ISO_SUCCESS;
+}
+
+static
+int hfsplus_link_walk_push(struct hfsplus_link_walk *walk, IsoDir *dir)
+{
+    IsoDir **new_path;
+    size_t new_size;
+
+    if (walk->path_len >= walk->path_size) {
+        new_size = 2 * walk->path_size + 16;
+        new_path = realloc(walk->path, new_size * sizeof(IsoDir *));
+        if (new_path == NULL)
+            return ISO_OUT_OF_MEM;
+        walk->path = new_path;
+        walk->path_size = new_size;
+    }
+    walk->path[walk->path_len++] = dir;
+    return ISO_SUCCESS;
+}
+
+/* Set .path to the root directory (cat_id 2) and the directories down to
+   the directory with the given catalog id.
+*/
+static
+int hfsplus_link_walk_start(struct hfsplus_link_walk *walk, uint32_t cat_id)
+{
+    int ret;
+    uint32_t id;
+    size_t n;
+    IsoDir *dir;
+
+    walk->path_len = 0;
+    for (id = cat_id; id >= 2; id = walk->parent_ids[id]) {
+        if (walk->dirs[id] == NULL)
+            return ISO_ASSERT_FAILURE;
+        ret = hfsplus_link_walk_push(walk, walk->dirs[id]);
+        if (ret < 0)
+            return ret;
+        if (id == 2)
+    break;
+    }
+    for (n = 0; n < walk->path_len / 2; n++) {
+        dir = walk->path[n];
+        walk->path[n] = walk->path[walk->path_len - 1 - n];
+        walk->path[walk->path_len - 1 - n] = dir;
+    }
+    return ISO_SUCCESS;
+}
+
+/* Search a child by the first comp_len bytes of name */
+static
+IsoNode *hfsplus_link_walk_find(IsoDir *dir, char *name,
+                                unsigned int comp_len)
+{
+    IsoNode *n;
+
+    for (n = iso_tree_cow_child(dir, NULL); n != NULL;
+         n = iso_tree_cow_child(dir, n))
+        if (strncmp(name, n->name, comp_len) == 0 &&
+            strlen(n->name) == comp_len)
+    break;
+    return n;
+}
+
+/* Like iso_tree_resolve_symlink(), but for a link in the directory at the
+   end of the .path of walk. The .path gets changed to end at the
+   directory to which the link leads.
+   @return 1= .path ends at the resolved directory ,
+           0= link does not lead to a directory ,
+           ISO_DEAD_SYMLINK , ISO_DEEP_SYMLINK , <0 = other error
+*/
+static
+int hfsplus_link_walk_resolve(Ecma119Image *target, IsoSymlink *sym,
+                              int *depth)
+{
+    struct hfsplus_link_walk *walk;
+    IsoNode *n;
+    char *dest, *dest_start, *dest_end;
+    int ret;
+    unsigned int comp_len, dest_len;
+
+    walk = target->hfsp_link_walk;
+    dest = sym->dest;
+    dest_len = strlen(dest);
+    if (dest[0] == '/') {
+        walk->path_len = 1;
+        dest_end = dest;
+    } else {
+        dest_end = dest - 1;
+    }
+
+    while (dest_end < dest + dest_len) {
+        dest_start = dest_end + 1;
+        dest_end = strchr(dest_start, '/');
+        if (dest_end == NULL)
+            dest_end = dest_start + strlen(dest_start);
+        comp_len = dest_end - dest_start;
+        if (comp_len == 0 || (comp_len == 1 && dest_start[0] == '.'))
+    continue;
+        if (comp_len == 2 && dest_start[0] == '.' && dest_start[1] == '.') {
+            /* Like with IsoNode.parent, the root is its own parent */
+            if (walk->path_len > 1)
+                walk->path_len--;
+    continue;
+        }
+        n = hfsplus_link_walk_find(walk->path[walk->path_len - 1],
+                                   dest_start, comp_len);
+        if (n == NULL)
+            return ISO_DEAD_SYMLINK;
+
+        if (n->type == LIBISO_DIR) {
+            ret = hfsplus_link_walk_push(walk, (IsoDir *) n);
+            if (ret < 0)
+                return ret;
+        } else if (n->type == LIBISO_SYMLINK) {
+            if (*depth >= LIBISO_MAX_LINK_DEPTH)
+                return ISO_DEEP_SYMLINK;
+            (*depth)++;
+            ret = hfsplus_link_walk_resolve(target, (IsoSymlink *) n, depth);
+            if (ret <= 0)
+                return ret;
+        } else {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 /* A specialized version of API call iso_tree_resolve_symlink().
    It updates symlink destination components which lead to the
    HFS+ node [changed_idx] in sync with resolution of the IsoImage
@@ -1239,8 +1481,8 @@ int update_symlink(Ecma119Image *target, uint32_t changed_idx, char *new_name,
                    uint32_t link_idx, int *depth, int flag)
 {
     IsoSymlink *sym;
-    IsoDir *cur_dir = NULL;
-    IsoNode *n, *resolved_node;
+    IsoNode *n;
+    struct hfsplus_link_walk *walk;
     char *orig_dest, *orig_start, *orig_end;
     char *hfsp_dest, *hfsp_start, *hfsp_end;
     int ret = 0;
@@ -1254,6 +1496,11 @@ int update_symlink(Ecma119Image *target, uint32_t changed_idx, char *new_name,
     hfsp_dest = target->hfsp_leafs[link_idx].symlink_dest;
     hfsp_len = strlen(hfsp_dest);
 
+    ret = hfsplus_link_walk_new(target);
+    if (ret < 0)
+        return ret;
+    walk = target->hfsp_link_walk;
+
     if (orig_dest[0] == '/') {
 
         /* >>> ??? How to salvage absolute links without knowing the
@@ -1263,14 +1510,15 @@ int update_symlink(Ecma119Image *target, uint32_t changed_idx, char *new_name,
            of booting.
         */;
 
-        cur_dir = target->image->root;
+        ret = hfsplus_link_walk_start(walk, 2);
         orig_end = orig_dest;
     } else {
-        cur_dir = sym->node.parent;
-        if (cur_dir == NULL)
-            cur_dir = target->image->root;
+        ret = hfsplus_link_walk_start(walk,
+                                      target->hfsp_leafs[link_idx].parent_id);
         orig_end = orig_dest - 1;
     }
+    if (ret < 0)
+        return ret;
 
     if (hfsp_dest[0] == '/')
         hfsp_end = hfsp_dest;
@@ -1292,17 +1540,15 @@ int update_symlink(Ecma119Image *target, uint32_t changed_idx, char *new_name,
         if (comp_len == 0 || (comp_len == 1 && orig_start[0] == '.'))
    continue;
         if (comp_len == 2 && orig_start[0] == '.' && orig_start[1] == '.') {
-            cur_dir = cur_dir->node.parent;
-            if (cur_dir == NULL) /* link shoots over root */
-                return ISO_SUCCESS;
+            /* Like with IsoNode.parent, the root is its own parent */
+            if (walk->path_len > 1)
+                walk->path_len--;
    continue;
         }
 
-        /* Search node in cur_dir */
-        for (n = cur_dir->children; n != NULL; n = n->next)
-            if (strncmp(orig_start, n->name, comp_len) == 0 &&
-                strlen(n->name) == comp_len)
-        break;
+        /* Search node in current directory */
+        n = hfsplus_link_walk_find(walk->path[walk->path_len - 1],
+                                   orig_start, comp_len);
         if (n == NULL) /* dead link */
             return ISO_SUCCESS;
 
@@ -1321,21 +1567,21 @@ int update_symlink(Ecma119Image *target, uint32_t changed_idx, char *new_name,
         }
 
         if (n->type == LIBISO_DIR) {
-            cur_dir = (IsoDir *) n;
+            ret = hfsplus_link_walk_push(walk, (IsoDir *) n);
+            if (ret < 0)
+                return ret;
         } else if (n->type == LIBISO_SYMLINK) {
             /* Resolve link and check whether it is a directory */
             if (*depth >= LIBISO_MAX_LINK_DEPTH)
                 return ISO_SUCCESS;
             (*depth)++;
-            ret = iso_tree_resolve_symlink(target->image, (IsoSymlink *) n,
-                                           &resolved_node, depth, 0);
+            ret = hfsplus_link_walk_resolve(target, (IsoSymlink *) n, depth);
             if (ret == (int) ISO_DEAD_SYMLINK || ret == (int) ISO_DEEP_SYMLINK)
                 return ISO_SUCCESS;
             if (ret < 0)
                 return ret;
-            if (resolved_node->type != LIBISO_DIR)
+            if (ret == 0)
                 return ISO_SUCCESS;
-            cur_dir = (IsoDir *) resolved_node;
         } else {
     break;
         }
@@ -1366,8 +1612,10 @@ int update_name_followers(Ecma119Image *target, uint32_t idx, char *new_name,
     continue;
         target->hfsp_leafs[i].name = target->hfsp_leafs[idx].name;
         target->hfsp_leafs[i].strlen = target->hfsp_leafs[idx].strlen;
-        if (target->hfsp_leafs[i].cmp_name == old_cmp_name)
+        if (target->hfsp_leafs[i].cmp_name == old_cmp_name) {
             target->hfsp_leafs[i].cmp_name = target->hfsp_leafs[idx].cmp_name;
+            hfsplus_set_cmp_key(&(target->hfsp_leafs[i]));
+        }
         if (target->hfsp_leafs[i].strlen > old_strlen)
             target->hfsp_leafs[i].used_size += (target->hfsp_leafs[i].strlen -
                                                 old_strlen) * 2;
@@ -1435,7 +1683,9 @@ int try_mangle(Ecma119Image *target, uint32_t idx, uint32_t prev_idx,
         /* >>> Get full ISO-RR paths of colliding nodes */;
         /* >>> iso_tree_get_node_path(node); */
 
-        iso_msg_debug(target->image->id,
+        /* The sum gets reported when mangling is done */
+        if (target->hfsp_collision_count <= ISO_COLLISION_MSG_MAX)
+            iso_msg_debug(target->image->id,
                   "HFS+ name collision with \"%s\" : \"%s\" renamed to \"%s\"",
                   target->hfsp_leafs[prev_idx].node->name,
                   target->hfsp_leafs[*new_idx].node->name, new_name);
@@ -1460,6 +1710,7 @@ no_success:;
     target->hfsp_leafs[idx].name = old_name;
     target->hfsp_leafs[idx].cmp_name = old_cmp_name;
     target->hfsp_leafs[idx].strlen = old_strlen;
+    hfsplus_set_cmp_key(&(target->hfsp_leafs[idx]));
     return ret;
 }
 
@@ -1587,7 +1838,7 @@ void iso_setup_hfsplus_block_size(Ecma119Image *target)
     target->hfsp_iso_block_fac = 2048 / target->opts->hfsp_block_size;
 }
 
-int hfsplus_writer_create(Ecma119Image *target)
+int hfsplus_writer_prepare(Ecma119Image *target, IsoImageWriter **writer_ret)
 {
     int ret;
     IsoImageWriter *writer = NULL;
@@ -1604,9 +1855,6 @@ int hfsplus_writer_create(Ecma119Image *target)
         goto ex;
     }
 
-    make_hfsplus_decompose_pages();
-    make_hfsplus_class_pages();
-
     iso_setup_hfsplus_block_size(target);
     cat_node_size = target->hfsp_cat_node_size;
 
@@ -1665,7 +1913,7 @@ int hfsplus_writer_create(Ecma119Image *target)
 
     dir = (IsoDir*)target->image->root;
 
-    pos = dir->children;
+    pos = iso_tree_cow_child(dir, NULL);
     while (pos)
       {
 	int cret;
@@ -1674,11 +1922,14 @@ int hfsplus_writer_create(Ecma119Image *target)
 	    ret = cret;
 	    goto ex;
 	}
-	pos = pos->next;
+	pos = iso_tree_cow_child(dir, pos);
 	if (cret > 0)
 	    target->hfsp_leafs[0].nchildren++;
       }
 
+    /* The parent_id of some leafs was set after their names */
+    for (i = 0; i < (int) target->hfsp_nleafs; i++)
+        hfsplus_set_cmp_key(&(target->hfsp_leafs[i]));
     qsort(target->hfsp_leafs, target->hfsp_nleafs,
           sizeof(*target->hfsp_leafs), cmp_node);
 
@@ -1803,8 +2054,7 @@ int hfsplus_writer_create(Ecma119Image *target)
 	goto ex;
       }
 
-    /* add this writer to image */
-    target->writers[target->nwriters++] = writer;
+    *writer_ret = writer;
     writer = NULL;
 
     ret = ISO_SUCCESS;
@@ -1814,6 +2064,26 @@ ex:;
     return ret;
 }
 
+int hfsplus_writer_create(Ecma119Image *target)
+{
+    int ret;
+    IsoImageWriter *writer;
+
+    writer = target->tree_writers[ISO_LOW_TREE_HFSPLUS];
+    if (writer != NULL) {
+        /* The tree was built by a thread of ecma119_image_new() */
+        target->tree_writers[ISO_LOW_TREE_HFSPLUS] = NULL;
+    } else {
+        ret = hfsplus_writer_prepare(target, &writer);
+        if (ret < 0)
+            return ret;
+    }
+
+    /* add this writer to image */
+    target->writers[target->nwriters++] = writer;
+    return ISO_SUCCESS;
+}
+
 int hfsplus_tail_writer_create(Ecma119Image *target)
 {
     IsoImageWriter *writer;
@@ -64,9 +64,34 @@ struct hfsplus_node
 
   uint32_t strlen;
   uint32_t used_size;
+
+  /* Sort key for cmp_node(), set by hfsplus_set_cmp_key():
+     .parent_id in the upper 32 bits, the first two UTF-16BE characters of
+     .cmp_name in the lower 32 bits. Number of characters in .cmp_name.
+  */
+  uint64_t cmp_key;
+  uint32_t cmp_len;
+};
+
+/* Directory paths for updating symbolic links after HFS+ name mangling.
+   See hfsplus.c, update_symlink().
+*/
+struct hfsplus_link_walk
+{
+  IsoDir **dirs;        /* The directories of the HFS+ tree by cat_id */
+  uint32_t *parent_ids; /* Their parent_id by cat_id */
+
+  IsoDir **path;        /* The directories from root to the current one */
+  size_t path_len;
+  size_t path_size;
 };
 
 int hfsplus_writer_create(Ecma119Image *target);
+
+/* Create the IsoWriter for HFS+ and the HFS+ tree, but do not add the writer
+   to target. See joliet_writer_prepare().
+*/
+int hfsplus_writer_prepare(Ecma119Image *target, IsoImageWriter **writer);
 int hfsplus_tail_writer_create(Ecma119Image *target);
 
 struct hfsplus_extent
@@ -192,6 +217,9 @@ void make_hfsplus_decompose_pages();
 extern uint16_t *hfsplus_class_pages[256];
 void make_hfsplus_class_pages();
 
+/* In libisofs/hfsplus_case.c */
+void make_hfsplus_case_pages();
+
 extern const uint16_t hfsplus_casefold[];
 
 int iso_get_hfsplus_name(char *input_charset, int imgid, char *name,
@@ -435,13 +435,10 @@ static uint16_t cmp_name_page0(uint16_t x)
 }
 
 
-/* Converts a character into the representative of its HFS+ equivalence
-   class.
-   @param x The UTF-16BE character to be converted. 
-   @return  0 = ignore character with comparisons
-            else the case-insensitive character.
+/* Looks up a character in utf16be_transl[].
+   See iso_hfsplus_cichar() for parameter and return value.
 */
-uint16_t iso_hfsplus_cichar(uint16_t x)
+static uint16_t hfsplus_cichar_search(uint16_t x)
 {
     int page, i;
     uint16_t ret;
@@ -470,3 +467,50 @@ uint16_t iso_hfsplus_cichar(uint16_t x)
 }
 
 
+/* Two-level lookup table which gets filled by make_hfsplus_case_pages()
+   with the results of hfsplus_cichar_search() for the 10 pages which have
+   translations. Indices are the first and second byte of the UTF-16BE
+   character.
+*/
+static uint16_t case_pages[10][256];
+
+static uint16_t *hfsplus_case_pages[256];
+
+
+void make_hfsplus_case_pages()
+{
+    int page, i, count = 0;
+    uint16_t x;
+
+    for (page = 0; page < 256; page++) {
+        hfsplus_case_pages[page] = NULL;
+        ((uint8_t *) &x)[0] = page;
+        ((uint8_t *) &x)[1] = 0;
+        if (what_page(x) < 0)
+    continue;
+        for (i = 0; i < 256; i++) {
+            ((uint8_t *) &x)[1] = i;
+            case_pages[count][i] = hfsplus_cichar_search(x);
+        }
+        hfsplus_case_pages[page] = case_pages[count];
+        count++;
+    }
+}
+
+
+/* Converts a character into the representative of its HFS+ equivalence
+   class.
+   make_hfsplus_case_pages() has to be called before.
+   @param x The UTF-16BE character to be converted. 
+   @return  0 = ignore character with comparisons
+            else the case-insensitive character.
+*/
+uint16_t iso_hfsplus_cichar(uint16_t x)
+{
+    uint16_t *page;
+
+    page = hfsplus_case_pages[((uint8_t *) &x)[0]];
+    if (page == NULL)
+        return x; /* No translation needed */
+    return page[((uint8_t *) &x)[1]];
+}
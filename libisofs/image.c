@@ -17,6 +17,7 @@
 #include "node.h"
 #include "messages.h"
 #include "eltorito.h"
+#include "tree.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -186,14 +187,16 @@ int iso_image_new(const char *name, IsoImage **image)
     img->hppa_ramdisk = NULL;
     img->alpha_boot_image = NULL;
     img->import_src = NULL;
+    img->import_fs = NULL;
     img->builder_ignore_acl = 1;
     img->builder_ignore_ea = 1;
     img->truncate_mode = 1;
     img->truncate_length = LIBISOFS_NODE_NAME_MAX;
     img->truncate_buffer[0] = 0;
     img->inode_counter = 0;
-    img->used_inodes = NULL;
-    img->used_inodes_start = 0;
+    img->used_ino_ranges = NULL;
+    img->used_ino_range_count = 0;
+    img->used_ino_idx = 0;
     img->checksum_start_lba = 0;
     img->checksum_end_lba = 0;
     img->checksum_idx_count = 0;
@@ -240,6 +243,10 @@ void iso_image_unref(IsoImage *image)
         for (i = 0; i < ISO_HFSPLUS_BLESS_MAX; i++)
             if (image->hfsplus_blessed[i] != NULL)
                 iso_node_unref(image->hfsplus_blessed[i]);
+        if (image->lazy_import != NULL) {
+            image->lazy_import->image = NULL;
+            iso_lazy_import_unref(image->lazy_import);
+        }
         iso_node_unref((IsoNode*)image->root);
         iso_node_builder_unref(image->builder);
         iso_filesystem_unref(image->fs);
@@ -252,6 +259,8 @@ void iso_image_unref(IsoImage *image)
             free(image->alpha_boot_image);
         if (image->import_src != NULL)
             iso_data_source_unref(image->import_src);
+        if (image->import_fs != NULL)
+            iso_filesystem_unref(image->import_fs);
         free(image->volset_id);
         free(image->volume_id);
         free(image->publisher_id);
@@ -265,8 +274,8 @@ void iso_image_unref(IsoImage *image)
         free(image->modification_time);
         free(image->expiration_time);
         free(image->effective_time);
-        if (image->used_inodes != NULL)
-            free(image->used_inodes);
+        if (image->used_ino_ranges != NULL)
+            free(image->used_ino_ranges);
         if (image->system_area_data != NULL)
             free(image->system_area_data);
         iso_image_free_checksums(image, 0);
@@ -533,6 +542,12 @@ int dir_update_size(IsoImage *image, IsoDir *dir)
     uint32_t lba;
 #endif
 
+    /* The streams get changed. So pending copy-on-write clones have to get
+       their own nodes.
+    */
+    ret = iso_tree_cow_materialize(dir, 0);
+    if (ret < 0)
+        return ret;
     pos = dir->children;
     while (pos) {
         if (pos->type == LIBISO_FILE) {
@@ -540,12 +555,8 @@ int dir_update_size(IsoImage *image, IsoDir *dir)
         } else if (pos->type == LIBISO_DIR) {
             /* recurse */
             ret = dir_update_size(image, ISO_DIR(pos));
-
-#ifdef Libisofs_update_sizes_abortablE
-            if (ret == ISO_CANCELED)
-                return ret; /* Message already issued by dir_update_size */
-#endif
-
+            if (ret < 0)
+                return ret; /* Materializing failed or canceled */
         } else {
             ret = 1;
         }
@@ -623,74 +634,140 @@ int iso_image_get_ignore_aclea(IsoImage *image)
 }
 
 
+/* A growing array of used inode numbers, filled by img_collect_inos()
+*/
+struct iso_ino_collector {
+    uint32_t *inos;
+    size_t count;
+    size_t size;
+};
+
+
 static
-int img_register_ino(IsoImage *image, IsoNode *node, int flag)
+int img_register_ino(struct iso_ino_collector *coll, IsoNode *node, int flag)
 {
     int ret;
     ino_t ino;
     unsigned int fs_id;
     dev_t dev_id;
+    uint32_t *new_inos;
 
     ret = iso_node_get_id(node, &fs_id, &dev_id, &ino, 1);
     if (ret < 0)
        return ret;
-    if (ret > 0 && ino >= image->used_inodes_start &&
-        ino <= image->used_inodes_start + (ISO_USED_INODE_RANGE - 1)) {
-                                   /* without -1 : rollover hazard on 32 bit */
-        image->used_inodes[(ino - image->used_inodes_start) / 8]
-                                                           |= (1 << (ino % 8));
+    if (ret == 0 || ino == 0 || ((uint64_t) ino) > 0xffffffff)
+       return 1;
+    if (coll->count >= coll->size) {
+        new_inos = realloc(coll->inos, 2 * coll->size * sizeof(uint32_t));
+        if (new_inos == NULL)
+            return ISO_OUT_OF_MEM;
+        coll->inos = new_inos;
+        coll->size *= 2;
     }
+    coll->inos[coll->count++] = ino;
     return 1;
 }
 
 
-/* Collect the bitmap of used inode numbers in the range of
-   _ImageFsData.used_inodes_start + ISO_USED_INODE_RANGE
-   @param flag bit0= recursion is active
-*/
-int img_collect_inos(IsoImage *image, IsoDir *dir, int flag)
+static
+int img_collect_inos_rec(struct iso_ino_collector *coll, IsoDir *dir,
+                         int flag)
 {
-    int ret, register_dir = 1;
-    IsoDirIter *iter = NULL;
+    int ret;
     IsoNode *node;
-    IsoDir *subdir;
 
-    if (dir == NULL)
-        dir = image->root;
-    if (image->used_inodes == NULL) {
-        image->used_inodes = calloc(ISO_USED_INODE_RANGE / 8, 1);
-        if (image->used_inodes == NULL)
-            return ISO_OUT_OF_MEM;
-    } else if(!(flag & 1)) {
-        memset(image->used_inodes, 0, ISO_USED_INODE_RANGE / 8);
-    } else {
-        register_dir = 0;
-    }
-    if (register_dir) {
-        node = (IsoNode *) dir;
-        ret = img_register_ino(image, node, 0);
-        if (ret < 0)
-            return ret;
-    }
-
-    ret = iso_dir_get_children(dir, &iter);
+    ret = iso_tree_cow_load(dir, 0);
     if (ret < 0)
         return ret;
-    while (iso_dir_iter_next(iter, &node) == 1 ) {
-        ret = img_register_ino(image, node, 0);
+    for (node = iso_tree_cow_child(dir, NULL); node != NULL;
+         node = iso_tree_cow_child(dir, node)) {
+        ret = img_register_ino(coll, node, 0);
         if (ret < 0)
-            goto ex;
+            return ret;
         if (iso_node_get_type(node) == LIBISO_DIR) {
-            subdir = (IsoDir *) node;
-            ret = img_collect_inos(image, subdir, flag | 1);
+            ret = img_collect_inos_rec(coll, (IsoDir *) node, 0);
             if (ret < 0)
-                goto ex;
+                return ret;
         }
     }
+    return 1;
+}
+
+
+static
+int img_cmp_ino(const void *a, const void *b)
+{
+    uint32_t ia, ib;
+
+    ia = *((uint32_t *) a);
+    ib = *((uint32_t *) b);
+    if (ia < ib)
+        return -1;
+    if (ia > ib)
+        return 1;
+    return 0;
+}
+
+
+/* Collect the used inode numbers of the tree under dir (NULL = root) into
+   IsoImage.used_ino_ranges by a single traversal.
+   @param flag unused yet, submit 0
+*/
+int img_collect_inos(IsoImage *image, IsoDir *dir, int flag)
+{
+    int ret;
+    size_t i, count;
+    struct iso_ino_collector coll;
+    struct iso_ino_range *ranges = NULL, *new_ranges;
+
+    coll.count = 0;
+    coll.size = ISO_USED_INODE_ALLOC;
+    coll.inos = calloc(coll.size, sizeof(uint32_t));
+    if (coll.inos == NULL)
+        return ISO_OUT_OF_MEM;
+
+    if (dir == NULL)
+        dir = image->root;
+    ret = img_register_ino(&coll, (IsoNode *) dir, 0);
+    if (ret < 0)
+        goto ex;
+    ret = img_collect_inos_rec(&coll, dir, 0);
+    if (ret < 0)
+        goto ex;
+
+    /* Sort and merge adjacent numbers into intervals */
+    qsort(coll.inos, coll.count, sizeof(uint32_t), img_cmp_ino);
+    ranges = calloc(coll.count + 1, sizeof(struct iso_ino_range));
+    if (ranges == NULL) {
+        ret = ISO_OUT_OF_MEM; goto ex;
+    }
+    count = 0;
+    for (i = 0; i < coll.count; i++) {
+        if (count > 0 &&
+            ((uint64_t) ranges[count - 1].end) + 1 >= coll.inos[i]) {
+            ranges[count - 1].end = coll.inos[i];
+            continue;
+        }
+        ranges[count].start = ranges[count].end = coll.inos[i];
+        count++;
+    }
+    if (count > 0) {
+        new_ranges = realloc(ranges, count * sizeof(struct iso_ino_range));
+        if (new_ranges != NULL)
+            ranges = new_ranges;
+    }
+
+    if (image->used_ino_ranges != NULL)
+        free(image->used_ino_ranges);
+    image->used_ino_ranges = ranges;
+    image->used_ino_range_count = count;
+    image->used_ino_idx = 0;
+    ranges = NULL;
     ret = 1;
 ex:;
-    if (iter != NULL)
-        iso_dir_iter_free(iter);
+    free(coll.inos);
+    if (ranges != NULL)
+        free(ranges);
     return ret;
 }
 
@@ -700,10 +777,10 @@ ex:;
  *
  * On image import it gets maxed by the eventual inode numbers from PX
  * entries. Up to the first 32 bit rollover it simply increments the counter.
- * After the first rollover it uses a look ahead bitmap which gets filled
- * by a full tree traversal. It covers the next inode numbers to come
- * (somewhere between 1 and ISO_USED_INODE_RANGE which is quite many)
- * and advances when being exhausted.
+ * After the first rollover it skips the intervals of used inode numbers
+ * which get collected by a full tree traversal. The cursor in the interval
+ * array only advances, so each number costs amortized O(1). A new traversal
+ * happens only if the counter rolls over again.
  * @param image The image where the number shall be used
  * @param flag  bit0= reset count (Caution: image must get new inos then)
  * @return
@@ -712,19 +789,22 @@ ex:;
  */
 uint32_t img_give_ino_number(IsoImage *image, int flag)
 {
-    int ret;
-    uint64_t new_ino, ino_idx;
+    int ret, collected = 0;
+    uint64_t new_ino;
+    size_t idx;
+    struct iso_ino_range *ranges;
     static uint64_t limit = 0xffffffff;
 
     if (flag & 1) {
         image->inode_counter = 0;
-        if (image->used_inodes != NULL)
-            free(image->used_inodes);
-        image->used_inodes = NULL;
-        image->used_inodes_start = 0;
+        if (image->used_ino_ranges != NULL)
+            free(image->used_ino_ranges);
+        image->used_ino_ranges = NULL;
+        image->used_ino_range_count = 0;
+        image->used_ino_idx = 0;
     }
     new_ino = ((uint64_t) image->inode_counter) + 1;
-    if (image->used_inodes == NULL) {
+    if (image->used_ino_ranges == NULL) {
         if (new_ino > 0 && new_ino <= limit) {
             image->inode_counter = (uint32_t) new_ino;
             return image->inode_counter;
@@ -732,29 +812,33 @@ uint32_t img_give_ino_number(IsoImage *image, int flag)
     }
     /* Look for free number in used territory */
     while (1) {
-        if (new_ino <= 0 || new_ino > limit ||
-            new_ino >= image->used_inodes_start + ISO_USED_INODE_RANGE ) {
+        if (new_ino > limit || image->used_ino_ranges == NULL) {
+            if (collected) {
+                /* All 32 bit numbers are in use */
+                return 0;
+            }
 
-            /* Collect a bitmap of used inode numbers ahead */
+            /* Collect the intervals of used inode numbers */
 
-            image->used_inodes_start += ISO_USED_INODE_RANGE;
-            if (image->used_inodes_start > 0xffffffff ||
-                image->used_inodes_start <= 0) 
-                image->used_inodes_start = 0;
             ret = img_collect_inos(image, NULL, 0);
             if (ret < 0)
-                goto return_result; /* >>> need error return value */
-
-            new_ino = image->used_inodes_start + !image->used_inodes_start;
+                return 0;
+            collected = 1;
+            new_ino = 1;
         }
-        ino_idx = (new_ino - image->used_inodes_start) / 8;
-        if (!(image->used_inodes[ino_idx] & (1 << (new_ino % 8)))) {
-            image->used_inodes[ino_idx] |= (1 << (new_ino % 8));
-    break;
+        ranges = image->used_ino_ranges;
+        idx = image->used_ino_idx;
+        while (idx < image->used_ino_range_count &&
+               ranges[idx].end < new_ino)
+            idx++;
+        image->used_ino_idx = idx;
+        if (idx < image->used_ino_range_count &&
+            ranges[idx].start <= new_ino) {
+            new_ino = ((uint64_t) ranges[idx].end) + 1;
+    continue;
         }
-        new_ino++;
+    break;
     }
-return_result:;
     image->inode_counter = new_ino;
     return image->inode_counter;
 }
@@ -792,6 +876,7 @@ int img_update_ino(IsoImage *image, IsoNode *node, int flag)
                bit1= install inode with non-data, non-directory files
                bit2= install inode with directories
                bit3= with bit2: install inode on parameter dir
+               bit4= do not descend into subdirectories
 */
 int img_make_inos(IsoImage *image, IsoDir *dir, int flag)
 {
@@ -813,7 +898,7 @@ int img_make_inos(IsoImage *image, IsoDir *dir, int flag)
         ret = img_update_ino(image, node, flag & 7);
         if (ret < 0)
             goto ex;
-        if (iso_node_get_type(node) == LIBISO_DIR) {
+        if (iso_node_get_type(node) == LIBISO_DIR && !(flag & 16)) {
             subdir = (IsoDir *) node;
             ret = img_make_inos(image, subdir, flag & ~8);
             if (ret < 0)
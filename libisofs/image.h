@@ -15,12 +15,18 @@
 #include "fsource.h"
 #include "builder.h"
 
-/* Size of a inode recycling window. Each new window causes a tree traversal.
-   Window memory consumption is ISO_USED_INODE_RANGE / 8.
-   This must be a power of 2 smaller than 30 bit and larger than 8 bit.
-   Here: 32 kB memory for 256k inodes.
+/* Initial number of entries in the array of used inode numbers which
+   img_collect_inos() fills after the first 32 bit rollover of the inode
+   counter. The array grows by doubling.
 */
-#define ISO_USED_INODE_RANGE (1 << 18)
+#define ISO_USED_INODE_ALLOC (1 << 12)
+
+/* An interval of used inode numbers. Both limits are occupied.
+*/
+struct iso_ino_range {
+    uint32_t start;
+    uint32_t end;
+};
 
 /* How many warnings to issue about name collisions during iso_image_import()
 */
@@ -106,6 +112,12 @@ struct Iso_Image
      */
     IsoDataSource *import_src;
 
+    /**
+     * Filesystem of the most recent import if an index file was set by
+     * iso_read_opts_set_index_file(). See iso_image_save_index().
+     */
+    IsoFilesystem *import_fs;
+
     /*
      * Default builder to use when adding files to the image tree.
      */
@@ -205,16 +217,25 @@ struct Iso_Image
     */
     uint32_t inode_counter;
     /*
-     * A bitmap of used inode numbers in an interval beginning at
-     * used_inodes_start and holding ISO_USED_INODE_RANGE bits.
-     * If a bit is set, then the corresponding inode number is occupied.
-     * This interval is kept around inode_counter and eventually gets
-     * advanced by ISO_USED_INODE_RANGE numbers in a tree traversal
-     * done by img_collect_inos(). The value will stay in the 32 bit range,
-     * although used_inodes_start is 64 bit to better handle rollovers.
+     * The used inode numbers of the tree as sorted array of disjoint
+     * intervals. It gets filled by a single tree traversal done by
+     * img_collect_inos() when inode_counter rolls over the 32 bit range
+     * for the first time, and again when the search for free numbers
+     * wraps around once more. used_ino_idx is the index of the first
+     * interval which does not end below inode_counter. Since inode_counter
+     * only grows between two traversals, the search for a free number
+     * never has to step back.
+     * Is NULL as long as inode_counter did not roll over.
+     */
+    struct iso_ino_range *used_ino_ranges;
+    size_t used_ino_range_count;
+    size_t used_ino_idx;
+
+    /**
+     * The state of the most recent lazy import. NULL if the tree was
+     * imported completely. A reference is held.
      */
-    uint8_t *used_inodes;
-    uint64_t used_inodes_start;
+    struct iso_lazy_import *lazy_import;
 
     /**
      * Array of MD5 checksums as announced by xattr "isofs.ca" of the 
@@ -264,9 +285,9 @@ int iso_image_truncate_name(IsoImage *image, const char *name, char **namept,
                             int flag);
 
     
-/* Collect the bitmap of used inode numbers in the range of
-   _ImageFsData.used_inodes_start + ISO_USED_INODE_RANGE
-   @param flag bit0= recursion is active
+/* Collect the used inode numbers of the tree under dir (NULL = root) into
+   IsoImage.used_ino_ranges by a single traversal.
+   @param flag unused yet, submit 0
 */
 int img_collect_inos(IsoImage *image, IsoDir *dir, int flag);
 
@@ -274,10 +295,10 @@ int img_collect_inos(IsoImage *image, IsoDir *dir, int flag);
  * A global counter for inode numbers for the ISO image filesystem.
  * On image import it gets maxed by the eventual inode numbers from PX
  * entries. Up to the first 32 bit rollover it simply increments the counter.
- * After the first rollover it uses a look ahead bitmap which gets filled
- * by a full tree traversal. It covers the next inode numbers to come
- * (somewhere between 1 and ISO_USED_INODE_RANGE which is quite many)
- * and advances when being exhausted.
+ * After the first rollover it skips the intervals of used inode numbers
+ * which get collected by a full tree traversal. The cursor in the interval
+ * array only advances, so each number costs amortized O(1). A new traversal
+ * happens only if the counter rolls over again.
  * @param image The image where the number shall be used
  * @param flag  bit0= reset count (Caution: image must get new inos then)
  * @return
@@ -290,6 +311,7 @@ uint32_t img_give_ino_number(IsoImage *image, int flag);
                bit1= install inode with non-data, non-directory files
                bit2= install inode with directories
                bit3= with bit2: install inode on parameter dir
+               bit4= do not descend into subdirectories
 */
 int img_make_inos(IsoImage *image, IsoDir *dir, int flag);
 
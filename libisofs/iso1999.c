@@ -20,6 +20,9 @@
 #include "eltorito.h"
 #include "util.h"
 #include "ecma119.h"
+#include "mangle.h"
+#include "dirwrite.h"
+#include "tree.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -47,9 +50,15 @@ int get_iso1999_name(Ecma119Image *t, const char *str, char **fname)
     } else {
         ret = strconv(str, t->input_charset, t->output_charset, &name);
         if (ret < 0) {
-            ret = iso_msg_submit(t->image->id, ISO_FILENAME_WRONG_CHARSET, ret,
-                "Charset conversion error. Can't convert %s from %s to %s",
-                str, t->input_charset, t->output_charset);
+            if (ecma119_count_charset_failure(t))
+                ret = iso_msg_submit(t->image->id, ISO_FILENAME_WRONG_CHARSET,
+                     ret,
+                     "Charset conversion error. Can't convert %s from %s to %s",
+                     str, t->input_charset, t->output_charset);
+            else if (iso_msg_is_abort(ISO_FILENAME_WRONG_CHARSET))
+                ret = ISO_CANCELED;
+            else
+                ret = 0;
             if (ret < 0) {
                 return ret; /* aborted */
             }
@@ -95,7 +104,8 @@ void iso1999_node_free(Iso1999Node *node)
  *      1 success, 0 ignored, < 0 error
  */
 static
-int create_node(Ecma119Image *t, IsoNode *iso, Iso1999Node **node)
+int create_node(Ecma119Image *t, IsoNode *iso, struct iso_tree_walk_dir *up,
+                Iso1999Node **node)
 {
     int ret;
     Iso1999Node *n;
@@ -107,14 +117,17 @@ int create_node(Ecma119Image *t, IsoNode *iso, Iso1999Node **node)
 
     if (iso->type == LIBISO_DIR) {
         IsoDir *dir = (IsoDir*) iso;
+        size_t nchildren;
+
         n->info.dir = calloc(1, sizeof(struct iso1999_dir_info));
         if (n->info.dir == NULL) {
             free(n);
             return ISO_OUT_OF_MEM;
         }
         n->info.dir->children = NULL;
-        if (dir->nchildren > 0) {
-            n->info.dir->children = calloc(sizeof(void*), dir->nchildren);
+        nchildren = iso_tree_cow_count(dir);
+        if (nchildren > 0) {
+            n->info.dir->children = calloc(sizeof(void*), nchildren);
             if (n->info.dir->children == NULL) {
                 free(n->info.dir);
                 free(n);
@@ -130,7 +143,7 @@ int create_node(Ecma119Image *t, IsoNode *iso, Iso1999Node **node)
 
         size = iso_stream_get_size(file->stream);
         if (size > (off_t)MAX_ISO_FILE_SECTION_SIZE && t->opts->iso_level != 3) {
-            char *ipath = iso_tree_get_node_path(iso);
+            char *ipath = iso_tree_get_walk_path(up, iso);
             ret = iso_msg_submit(t->image->id, ISO_FILE_TOO_BIG, 0,
                          "File \"%s\" can't be added to image because is "
                          "greater than 4GB", ipath);
@@ -139,7 +152,8 @@ int create_node(Ecma119Image *t, IsoNode *iso, Iso1999Node **node)
             return ret;
         }
 
-        ret = iso_file_src_create(t, file, &src);
+        ret = iso_file_src_create_in_tree(t, file, &src,
+                                          ISO_LOW_TREE_ISO1999);
         if (ret < 0) {
             free(n);
             return ret;
@@ -165,7 +179,9 @@ int create_node(Ecma119Image *t, IsoNode *iso, Iso1999Node **node)
 
     /* take a ref to the IsoNode */
     n->node = iso;
+    ecma119_tree_lock(t, 0);
     iso_node_ref(iso);
+    ecma119_tree_lock(t, 1);
 
     *node = n;
     return ISO_SUCCESS;
@@ -174,11 +190,15 @@ int create_node(Ecma119Image *t, IsoNode *iso, Iso1999Node **node)
 /**
  * Create the low level ISO 9660:1999 tree from the high level ISO tree.
  *
+ * @param up
+ *      The directory by which iso was reached, NULL for the root.
+ *      See iso_tree_get_walk_path().
  * @return
  *      1 success, 0 file ignored, < 0 error
  */
 static
-int create_tree(Ecma119Image *t, IsoNode *iso, Iso1999Node **tree, int pathlen)
+int create_tree(Ecma119Image *t, IsoNode *iso, struct iso_tree_walk_dir *up,
+                Iso1999Node **tree, int pathlen)
 {
     int ret, max_path;
     Iso1999Node *node = NULL;
@@ -199,7 +219,7 @@ int create_tree(Ecma119Image *t, IsoNode *iso, Iso1999Node **tree, int pathlen)
 
     max_path = pathlen + 1 + (iso_name ? strlen(iso_name): 0);
     if (!t->opts->allow_longer_paths && max_path > 255) {
-        char *ipath = iso_tree_get_node_path(iso);
+        char *ipath = iso_tree_get_walk_path(up, iso);
         ret = iso_msg_submit(t->image->id, ISO_FILE_IMGPATH_WRONG, 0,
                      "File \"%s\" can't be added to ISO 9660:1999 tree, "
                      "because its path length is larger than 255", ipath);
@@ -210,25 +230,31 @@ int create_tree(Ecma119Image *t, IsoNode *iso, Iso1999Node **tree, int pathlen)
 
     switch (iso->type) {
     case LIBISO_FILE:
-        ret = create_node(t, iso, &node);
+        ret = create_node(t, iso, up, &node);
         break;
     case LIBISO_DIR:
         {
             IsoNode *pos;
             IsoDir *dir = (IsoDir*)iso;
-            ret = create_node(t, iso, &node);
+            struct iso_tree_walk_dir walk;
+
+            ret = create_node(t, iso, up, &node);
             if (ret < 0) {
                 free(iso_name);
                 return ret;
             }
-            pos = dir->children;
+            walk.node = iso;
+            walk.up = up;
+            pos = iso_tree_cow_child(dir, NULL);
             while (pos) {
                 int cret;
                 Iso1999Node *child;
-                cret = create_tree(t, pos, &child, max_path);
+                cret = create_tree(t, pos, &walk, &child, max_path);
                 if (cret < 0) {
                     /* error */
+                    ecma119_tree_lock(t, 0);
                     iso1999_node_free(node);
+                    ecma119_tree_lock(t, 1);
                     ret = cret;
                     break;
                 } else if (cret == ISO_SUCCESS) {
@@ -237,13 +263,13 @@ int create_tree(Ecma119Image *t, IsoNode *iso, Iso1999Node **tree, int pathlen)
                     node->info.dir->children[nchildren] = child;
                     child->parent = node;
                 }
-                pos = pos->next;
+                pos = iso_tree_cow_child(dir, pos);
             }
         }
         break;
     case LIBISO_BOOT:
         if (t->eltorito) {
-            ret = create_node(t, iso, &node);
+            ret = create_node(t, iso, up, &node);
         } else {
             /* log and ignore */
             ret = iso_msg_submit(t->image->id, ISO_FILE_IGNORED, 0,
@@ -253,7 +279,7 @@ int create_tree(Ecma119Image *t, IsoNode *iso, Iso1999Node **tree, int pathlen)
     case LIBISO_SYMLINK:
     case LIBISO_SPECIAL:
         {
-            char *ipath = iso_tree_get_node_path(iso);
+            char *ipath = iso_tree_get_walk_path(up, iso);
             ret = iso_msg_submit(t->image->id, ISO_FILE_IGNORED, 0,
                      "Can't add %s to ISO 9660:1999 tree. This kind of files "
                      "can only be added to a Rock Ridget tree. Skipping.",
@@ -309,213 +335,100 @@ void sort_tree(Iso1999Node *root)
 }
 
 static
-int mangle_single_dir(Ecma119Image *img, Iso1999Node *dir)
+int mangle_is_dir(void *node)
 {
-    int ret;
-    int i, nchildren;
-    Iso1999Node **children;
-    IsoHTable *table = NULL;
-    int need_sort = 0;
-    char *full_name = NULL, *tmp = NULL;
-
-    nchildren = dir->info.dir->nchildren;
-    if (nchildren <= 0) {
-        ret = ISO_SUCCESS;
-        goto ex;
-    }
-    children = dir->info.dir->children;
-    LIBISO_ALLOC_MEM(full_name, char, 208);
-    LIBISO_ALLOC_MEM(tmp, char, 208);
+    return ((Iso1999Node *) node)->type == ISO1999_DIR;
+}
 
-    /* a hash table will temporary hold the names, for fast searching */
-    ret = iso_htable_create((nchildren * 100) / 80, iso_str_hash,
-                            (compare_function_t)strcmp, &table);
-    if (ret < 0) {
-        goto ex;
-    }
-    for (i = 0; i < nchildren; ++i) {
-        char *name = children[i]->name;
-        ret = iso_htable_add(table, name, name);
-        if (ret < 0) {
-            goto ex;
-        }
-    }
+static
+void **mangle_get_children(void *dir, int *nchildren)
+{
+    *nchildren = ((Iso1999Node *) dir)->info.dir->nchildren;
+    return (void **) ((Iso1999Node *) dir)->info.dir->children;
+}
 
-    for (i = 0; i < nchildren; ++i) {
-        char *name, *ext;
-        int max; /* computed max len for name, without extension */
-        int j = i;
-        int digits = 1; /* characters to change per name */
+static
+void *mangle_get_name(void *node)
+{
+    return ((Iso1999Node *) node)->name;
+}
 
-        /* first, find all child with same name */
-        while (j + 1 < nchildren &&
-               !cmp_node(children + i, children + j + 1)) {
-            ++j;
-        }
-        if (j == i) {
-            /* name is unique */
-            continue;
-        }
+static
+void mangle_set_name(void *node, void *name)
+{
+    free(((Iso1999Node *) node)->name);
+    ((Iso1999Node *) node)->name = name;
+}
+
+static
+int mangle_split(void *handle, void *node, int digits,
+                 struct iso_mangle_parts *parts)
+{
+    Iso1999Node *n = node;
+    char *dot;
+    int max, len, extlen;
 
+    len = strlen(n->name);
+    dot = strrchr(n->name, '.');
+    if (dot != NULL && n->type != ISO1999_DIR) {
         /*
-         * A max of 7 characters is good enough, it allows handling up to
-         * 9,999,999 files with same name.
+         * File (not dir) with extension.
          */
-        while (digits < 8) {
-            int ok, k;
-            char *dot;
-            int change = 0; /* number to be written */
-
-            /* copy name to buffer */
-            strcpy(full_name, children[i]->name);
-
-            /* compute name and extension */
-            dot = strrchr(full_name, '.');
-            if (dot != NULL && children[i]->type != ISO1999_DIR) {
-
+        parts->has_dot = 1;
+        parts->ext_start = dot - n->name + 1;
+        parts->ext_len = len - parts->ext_start;
+        extlen = parts->ext_len;
+        max = 207 - extlen - 1 - digits;
+        if (max <= 0) {
+            /* this can happen if extension is too long */
+            if (extlen + max > 3) {
                 /*
-                 * File (not dir) with extension.
+                 * reduce extension len, to give name an extra char
+                 * note that max is negative or 0
                  */
-                int extlen;
-                full_name[dot - full_name] = '\0';
-                name = full_name;
-                ext = dot + 1;
-
-                extlen = strlen(ext);
+                extlen = extlen + max - 1;
+                parts->ext_len = extlen;
                 max = 207 - extlen - 1 - digits;
-                if (max <= 0) {
-                    /* this can happen if extension is too long */
-                    if (extlen + max > 3) {
-                        /*
-                         * reduce extension len, to give name an extra char
-                         * note that max is negative or 0
-                         */
-                        extlen = extlen + max - 1;
-                        ext[extlen] = '\0';
-                        max = 207 - extlen - 1 - digits;
-                    } else {
-                        /*
-                         * error, we don't support extensions < 3
-                         * This can't happen with current limit of digits.
-                         */
-                        ret = ISO_ERROR;
-                        goto ex;
-                    }
-                }
-                /* ok, reduce name by digits */
-                if (name + max < dot) {
-                    name[max] = '\0';
-                }
             } else {
-                /* Directory, or file without extension */
-                if (children[i]->type == ISO1999_DIR) {
-                    dot = NULL; /* dots have no meaning in dirs */
-                }
-                max = 207 - digits;
-                name = full_name;
-                if ((size_t) max < strlen(name)) {
-                    name[max] = '\0';
-                }
-                /* let ext be an empty string */
-                ext = name + strlen(name);
-            }
-
-            ok = 1;
-            /* change name of each file */
-            for (k = i; k <= j; ++k) {
-                char fmt[16];
-                if (dot != NULL) {
-                    sprintf(fmt, "%%s%%0%dd.%%s", digits);
-                } else {
-                    sprintf(fmt, "%%s%%0%dd%%s", digits);
-                }
-                while (1) {
-                    sprintf(tmp, fmt, name, change, ext);
-                    ++change;
-                    if (change > int_pow(10, digits)) {
-                        ok = 0;
-                        break;
-                    }
-                    if (!iso_htable_get(table, tmp, NULL)) {
-                        /* the name is unique, so it can be used */
-                        break;
-                    }
-                }
-                if (ok) {
-                    char *new = strdup(tmp);
-                    if (new == NULL) {
-                        ret = ISO_OUT_OF_MEM;
-                        goto ex;
-                    }
-                    iso_msg_debug(img->image->id, "\"%s\" renamed to \"%s\"",
-                                  children[k]->name, new);
-
-                    iso_htable_remove_ptr(table, children[k]->name, NULL);
-                    free(children[k]->name);
-                    children[k]->name = new;
-                    iso_htable_add(table, new, new);
-
-                    /*
-                     * if we change a name we need to sort again children
-                     * at the end
-                     */
-                    need_sort = 1;
-                } else {
-                    /* we need to increment digits */
-                    break;
-                }
-            }
-            if (ok) {
-                break;
-            } else {
-                ++digits;
+                /*
+                 * error, we don't support extensions < 3
+                 * This can't happen with current limit of digits.
+                 */
+                return ISO_ERROR;
             }
         }
-        if (digits == 8) {
-            ret = ISO_MANGLE_TOO_MUCH_FILES;
-            goto ex;
-        }
-        i = j;
-    }
-
-    /*
-     * If needed, sort again the files inside dir
-     */
-    if (need_sort) {
-        qsort(children, nchildren, sizeof(void*), cmp_node);
-    }
-
-    ret = ISO_SUCCESS;
-
-ex:;
-    iso_htable_destroy(table, NULL);
-    LIBISO_FREE_MEM(tmp);
-    LIBISO_FREE_MEM(full_name);
-    return ret;
+        /* ok, reduce name by digits */
+        parts->stem_len = dot - n->name;
+        if (max < parts->stem_len)
+            parts->stem_len = max;
+    } else {
+        /* Directory, or file without extension */
+        max = 207 - digits;
+        parts->stem_len = len;
+        if (max < len)
+            parts->stem_len = max;
+        parts->has_dot = 0;
+        parts->ext_start = 0;
+        parts->ext_len = 0;
+    }
+    return 1;
 }
 
+static struct iso_mangle_ops iso1999_mangle_ops = {
+    1, 207, 1,
+    mangle_is_dir,
+    mangle_get_children,
+    mangle_get_name,
+    mangle_set_name,
+    cmp_node,
+    mangle_split,
+    NULL
+};
+
 static
 int mangle_tree(Ecma119Image *t, Iso1999Node *dir)
 {
-    int ret;
-    size_t i;
-
-    ret = mangle_single_dir(t, dir);
-    if (ret < 0) {
-        return ret;
-    }
-
-    /* recurse */
-    for (i = 0; i < dir->info.dir->nchildren; ++i) {
-        if (dir->info.dir->children[i]->type == ISO1999_DIR) {
-            ret = mangle_tree(t, dir->info.dir->children[i]);
-            if (ret < 0) {
-                /* error */
-                return ret;
-            }
-        }
-    }
-    return ISO_SUCCESS;
+    return iso_mangle_tree(t, &iso1999_mangle_ops, t, dir, 1);
 }
 
 static
@@ -528,7 +441,7 @@ int iso1999_tree_create(Ecma119Image *t)
         return ISO_NULL_POINTER;
     }
 
-    ret = create_tree(t, (IsoNode*)t->image->root, &root, 0);
+    ret = create_tree(t, (IsoNode*)t->image->root, NULL, &root, 0);
     if (ret <= 0) {
         if (ret == 0) {
             /* unexpected error, root ignored!! This can't happen */
@@ -830,7 +743,8 @@ int iso1999_writer_write_vol_desc(IsoImageWriter *writer)
 }
 
 static
-int write_one_dir(Ecma119Image *t, Iso1999Node *dir)
+int write_one_dir(Ecma119Image *t, Iso1999Node *dir,
+                  struct iso_dir_out *out)
 {
     int ret;
     uint8_t *buffer = NULL;
@@ -861,7 +775,7 @@ int write_one_dir(Ecma119Image *t, Iso1999Node *dir)
         for (section = 0; section < nsections; ++section) {
             if ( (buf + len - buffer) > BLOCK_SIZE) {
                 /* dir doesn't fit in current block */
-                ret = iso_write(t, buffer, BLOCK_SIZE);
+                ret = iso_dir_out_write(t, out, buffer, BLOCK_SIZE);
                 if (ret < 0) {
                     goto ex;
                 }
@@ -875,37 +789,25 @@ int write_one_dir(Ecma119Image *t, Iso1999Node *dir)
     }
 
     /* write the last block */
-    ret = iso_write(t, buffer, BLOCK_SIZE);
+    ret = iso_dir_out_write(t, out, buffer, BLOCK_SIZE);
 ex:;
     LIBISO_FREE_MEM(buffer);
     return ret;
 }
 
 static
-int write_dirs(Ecma119Image *t, Iso1999Node *root)
+int write_dir_one(Ecma119Image *t, void *dir, void *parent,
+                  struct iso_dir_out *out)
 {
-    int ret;
-    size_t i;
-
-    /* write all directory entries for this dir */
-    ret = write_one_dir(t, root);
-    if (ret < 0) {
-        return ret;
-    }
-
-    /* recurse */
-    for (i = 0; i < root->info.dir->nchildren; i++) {
-        Iso1999Node *child = root->info.dir->children[i];
-        if (child->type == ISO1999_DIR) {
-            ret = write_dirs(t, child);
-            if (ret < 0) {
-                return ret;
-            }
-        }
-    }
-    return ISO_SUCCESS;
+    return write_one_dir(t, (Iso1999Node *) dir, out);
 }
 
+static struct iso_dir_write_ops iso1999_dir_write_ops = {
+    mangle_is_dir,
+    mangle_get_children,
+    write_dir_one
+};
+
 static
 int write_path_table(Ecma119Image *t, Iso1999Node **pathlist, int l_type)
 {
@@ -1019,7 +921,7 @@ int iso1999_writer_write_data(IsoImageWriter *writer)
     t = writer->target;
 
     /* first of all, we write the directory structure */
-    ret = write_dirs(t, t->iso1999_root);
+    ret = iso_write_dir_tree(t, &iso1999_dir_write_ops, t->iso1999_root);
     if (ret < 0) {
         return ret;
     }
@@ -1039,7 +941,7 @@ int iso1999_writer_free_data(IsoImageWriter *writer)
     return ISO_SUCCESS;
 }
 
-int iso1999_writer_create(Ecma119Image *target)
+int iso1999_writer_prepare(Ecma119Image *target, IsoImageWriter **writer_ret)
 {
     int ret;
     IsoImageWriter *writer;
@@ -1063,6 +965,24 @@ int iso1999_writer_create(Ecma119Image *target)
         free((char *) writer);
         return ret;
     }
+    *writer_ret = writer;
+    return ISO_SUCCESS;
+}
+
+int iso1999_writer_create(Ecma119Image *target)
+{
+    int ret;
+    IsoImageWriter *writer;
+
+    writer = target->tree_writers[ISO_LOW_TREE_ISO1999];
+    if (writer != NULL) {
+        /* The tree was built by a thread of ecma119_image_new() */
+        target->tree_writers[ISO_LOW_TREE_ISO1999] = NULL;
+    } else {
+        ret = iso1999_writer_prepare(target, &writer);
+        if (ret < 0)
+            return ret;
+    }
 
     /* add this writer to image */
     target->writers[target->nwriters++] = writer;
@@ -57,4 +57,13 @@ struct iso1999_node
  */
 int iso1999_writer_create(Ecma119Image *target);
 
+/**
+ * Create the IsoWriter for ISO 9660:1999 and its tree, but do not add the
+ * writer to target. See joliet_writer_prepare().
+ *
+ * @return
+ *      1 on success, < 0 on error
+ */
+int iso1999_writer_prepare(Ecma119Image *target, IsoImageWriter **writer);
+
 #endif /* LIBISO_ISO1999_H */
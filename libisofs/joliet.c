@@ -22,6 +22,9 @@
 #include "libisofs.h"
 #include "util.h"
 #include "ecma119.h"
+#include "mangle.h"
+#include "dirwrite.h"
+#include "tree.h"
 
 
 #include <stdlib.h>
@@ -141,7 +144,8 @@ void joliet_node_free(JolietNode *node)
  *      1 success, 0 ignored, < 0 error
  */
 static
-int create_node(Ecma119Image *t, IsoNode *iso, JolietNode **node)
+int create_node(Ecma119Image *t, IsoNode *iso, struct iso_tree_walk_dir *up,
+                JolietNode **node)
 {
     int ret;
     JolietNode *joliet;
@@ -153,14 +157,17 @@ int create_node(Ecma119Image *t, IsoNode *iso, JolietNode **node)
 
     if (iso->type == LIBISO_DIR) {
         IsoDir *dir = (IsoDir*) iso;
+        size_t nchildren;
+
         joliet->info.dir = calloc(1, sizeof(struct joliet_dir_info));
         if (joliet->info.dir == NULL) {
             free(joliet);
             return ISO_OUT_OF_MEM;
         }
         joliet->info.dir->children = NULL;
-        if (dir->nchildren > 0) {
-            joliet->info.dir->children = calloc(sizeof(void*), dir->nchildren);
+        nchildren = iso_tree_cow_count(dir);
+        if (nchildren > 0) {
+            joliet->info.dir->children = calloc(sizeof(void*), nchildren);
             if (joliet->info.dir->children == NULL) {
                 free(joliet->info.dir);
                 free(joliet);
@@ -177,7 +184,7 @@ int create_node(Ecma119Image *t, IsoNode *iso, JolietNode **node)
         size = iso_stream_get_size(file->stream);
         if (size > (off_t)MAX_ISO_FILE_SECTION_SIZE &&
             t->opts->iso_level != 3) {
-            char *ipath = iso_tree_get_node_path(iso);
+            char *ipath = iso_tree_get_walk_path(up, iso);
             free(joliet);
             ret = iso_msg_submit(t->image->id, ISO_FILE_TOO_BIG, 0,
                          "File \"%s\" can't be added to image because is "
@@ -186,7 +193,8 @@ int create_node(Ecma119Image *t, IsoNode *iso, JolietNode **node)
             return ret;
         }
 
-        ret = iso_file_src_create(t, file, &src);
+        ret = iso_file_src_create_in_tree(t, file, &src,
+                                          ISO_LOW_TREE_JOLIET);
         if (ret < 0) {
             free(joliet);
             return ret;
@@ -212,20 +220,46 @@ int create_node(Ecma119Image *t, IsoNode *iso, JolietNode **node)
 
     /* take a ref to the IsoNode */
     joliet->node = iso;
+    ecma119_tree_lock(t, 0);
     iso_node_ref(iso);
+    ecma119_tree_lock(t, 1);
 
     *node = joliet;
     return ISO_SUCCESS;
 }
 
+/* Compute .cmp_key and .cmp_len from .name.
+   This has to be done whenever the name changes.
+*/
+static
+void joliet_set_cmp_key(JolietNode *node)
+{
+    uint8_t *name;
+    uint32_t i;
+
+    node->cmp_key = 0;
+    node->cmp_len = 0;
+    if (node->name == NULL)
+        return;
+    node->cmp_len = ucslen(node->name);
+    name = (uint8_t *) node->name;
+    for (i = 0; i < 4 && i < node->cmp_len; i++)
+        node->cmp_key |= ((uint64_t) ((name[2 * i] << 8) | name[2 * i + 1]))
+                         << (48 - 16 * i);
+}
+
 /**
  * Create the low level Joliet tree from the high level ISO tree.
  *
+ * @param up
+ *      The directory by which iso was reached, NULL for the root.
+ *      See iso_tree_get_walk_path().
  * @return
  *      1 success, 0 file ignored, < 0 error
  */
 static
-int create_tree(Ecma119Image *t, IsoNode *iso, JolietNode **tree, int pathlen)
+int create_tree(Ecma119Image *t, IsoNode *iso, struct iso_tree_walk_dir *up,
+                JolietNode **tree, int pathlen)
 {
     int ret, max_path;
     JolietNode *node = NULL;
@@ -245,7 +279,7 @@ int create_tree(Ecma119Image *t, IsoNode *iso, JolietNode **tree, int pathlen)
     }
     max_path = pathlen + 1 + (jname ? ucslen(jname) * 2 : 0);
     if (!t->opts->joliet_longer_paths && max_path > 240) {
-        char *ipath = iso_tree_get_node_path(iso);
+        char *ipath = iso_tree_get_walk_path(up, iso);
         /*
          * Wow!! Joliet is even more restrictive than plain ISO-9660,
          * that allows up to 255 bytes!!
@@ -260,25 +294,31 @@ int create_tree(Ecma119Image *t, IsoNode *iso, JolietNode **tree, int pathlen)
 
     switch (iso->type) {
     case LIBISO_FILE:
-        ret = create_node(t, iso, &node);
+        ret = create_node(t, iso, up, &node);
         break;
     case LIBISO_DIR:
         {
             IsoNode *pos;
             IsoDir *dir = (IsoDir*)iso;
-            ret = create_node(t, iso, &node);
+            struct iso_tree_walk_dir walk;
+
+            ret = create_node(t, iso, up, &node);
             if (ret < 0) {
                 free(jname);
                 return ret;
             }
-            pos = dir->children;
+            walk.node = iso;
+            walk.up = up;
+            pos = iso_tree_cow_child(dir, NULL);
             while (pos) {
                 int cret;
                 JolietNode *child;
-                cret = create_tree(t, pos, &child, max_path);
+                cret = create_tree(t, pos, &walk, &child, max_path);
                 if (cret < 0) {
                     /* error */
+                    ecma119_tree_lock(t, 0);
                     joliet_node_free(node);
+                    ecma119_tree_lock(t, 1);
                     ret = cret;
                     break;
                 } else if (cret == ISO_SUCCESS) {
@@ -287,13 +327,13 @@ int create_tree(Ecma119Image *t, IsoNode *iso, JolietNode **tree, int pathlen)
                     node->info.dir->children[nchildren] = child;
                     child->parent = node;
                 }
-                pos = pos->next;
+                pos = iso_tree_cow_child(dir, pos);
             }
         }
         break;
     case LIBISO_BOOT:
         if (t->eltorito) {
-            ret = create_node(t, iso, &node);
+            ret = create_node(t, iso, up, &node);
         } else {
             /* log and ignore */
             ret = iso_msg_submit(t->image->id, ISO_FILE_IGNORED, 0,
@@ -303,7 +343,7 @@ int create_tree(Ecma119Image *t, IsoNode *iso, JolietNode **tree, int pathlen)
     case LIBISO_SYMLINK:
     case LIBISO_SPECIAL:
         {
-            char *ipath = iso_tree_get_node_path(iso);
+            char *ipath = iso_tree_get_walk_path(up, iso);
             ret = iso_msg_submit(t->image->id, ISO_FILE_IGNORED, 0,
                  "Cannot add %s to Joliet tree. %s can only be added to a "
                  "Rock Ridge tree.", ipath, (iso->type == LIBISO_SYMLINK ?
@@ -320,16 +360,35 @@ int create_tree(Ecma119Image *t, IsoNode *iso, JolietNode **tree, int pathlen)
         return ret;
     }
     node->name = jname;
+    joliet_set_cmp_key(node);
     *tree = node;
     return ISO_SUCCESS;
 }
 
+/* Order like ucscmp() does. The keys of joliet_set_cmp_key() decide most
+   comparisons without looking at the names.
+*/
 static int
 cmp_node(const void *f1, const void *f2)
 {
     JolietNode *f = *((JolietNode**)f1);
     JolietNode *g = *((JolietNode**)f2);
-    return ucscmp(f->name, g->name);
+    uint32_t len;
+    int ret;
+
+    if (f->cmp_key != g->cmp_key)
+        return (f->cmp_key > g->cmp_key) ? +1 : -1;
+    len = MIN(f->cmp_len, g->cmp_len);
+    if (len > 4) {
+        ret = memcmp(f->name + 4, g->name + 4, (len - 4) * 2);
+        if (ret != 0)
+            return (ret > 0) ? +1 : -1;
+    }
+    if (f->cmp_len > g->cmp_len)
+        return +1;
+    if (f->cmp_len < g->cmp_len)
+        return -1;
+    return 0;
 }
 
 static
@@ -351,54 +410,34 @@ void sort_tree(JolietNode *root)
 static
 int cmp_node_name(const void *f1, const void *f2)
 {
-    JolietNode *f = *((JolietNode**)f1);
-    JolietNode *g = *((JolietNode**)f2);
-    return ucscmp(f->name, g->name);
+    return cmp_node(f1, f2);
 }
 
 static
-int joliet_create_mangled_name(uint16_t *dest, uint16_t *src, int digits,
-                                int number, uint16_t *ext)
+int mangle_is_dir(void *node)
 {
-    int ret, pos;
-    uint16_t *ucsnumber;
-    char fmt[16];
-    char nstr[72];
-              /* was: The only caller of this function allocates dest
-                      with 66 elements and limits digits to < 8
-                 But this does not match the usage of nstr which has to take
-                 the decimal representation of an int.
-              */
-
-    if (digits >= 8)
-        return ISO_ASSERT_FAILURE;
-
-    sprintf(fmt, "%%0%dd", digits);
-    sprintf(nstr, fmt, number);
-
-    ret = str2ucs("ASCII", nstr, &ucsnumber);
-    if (ret < 0) {
-        return ret;
-    }
+    return ((JolietNode *) node)->type == JOLIET_DIR;
+}
 
-    /* copy name */
-    pos = ucslen(src);
-    ucsncpy(dest, src, pos);
+static
+void **mangle_get_children(void *dir, int *nchildren)
+{
+    *nchildren = ((JolietNode *) dir)->info.dir->nchildren;
+    return (void **) ((JolietNode *) dir)->info.dir->children;
+}
 
-    /* copy number */
-    ucsncpy(dest + pos, ucsnumber, digits);
-    pos += digits;
+static
+void *mangle_get_name(void *node)
+{
+    return ((JolietNode *) node)->name;
+}
 
-    if (ext[0] != (uint16_t)0) {
-        size_t extlen = ucslen(ext);
-        iso_msb((uint8_t *) (dest + pos), 0x002E, 2); /* '.' in UCS */ 
-        pos++;
-        ucsncpy(dest + pos, ext, extlen);
-        pos += extlen;
-    }
-    iso_msb((uint8_t *) (dest + pos), 0, 2);
-    free(ucsnumber);
-    return ISO_SUCCESS;
+static
+void mangle_set_name(void *node, void *name)
+{
+    free(((JolietNode *) node)->name);
+    ((JolietNode *) node)->name = name;
+    joliet_set_cmp_key((JolietNode *) node);
 }
 
 /*
@@ -416,219 +455,80 @@ int joliet_create_mangled_name(uint16_t *dest, uint16_t *src, int digits,
  *  maximum to fit into an ISO 9660 directory record.)
  */
 static
-int mangle_single_dir(Ecma119Image *t, JolietNode *dir)
+int mangle_split(void *handle, void *node, int digits,
+                 struct iso_mangle_parts *parts)
 {
-    int ret;
-    int i, nchildren, maxchar = 64;
-    JolietNode **children;
-    IsoHTable *table = NULL;
-    int need_sort = 0;
-    uint16_t *full_name = NULL;
-    uint16_t *tmp = NULL;
-
-    nchildren = dir->info.dir->nchildren;
-    if (nchildren <= 0) {
-        ret = ISO_SUCCESS;
-        goto ex;
-    }
-    children = dir->info.dir->children;
-    LIBISO_ALLOC_MEM(full_name, uint16_t, LIBISO_JOLIET_NAME_MAX);
-    LIBISO_ALLOC_MEM(tmp, uint16_t, LIBISO_JOLIET_NAME_MAX);
+    Ecma119Image *t = handle;
+    JolietNode *n = node;
+    uint16_t *dot;
+    int max, len, extlen, maxchar = 64;
 
     if (t->opts->joliet_long_names)
         maxchar = 103;
-
-    /* a hash table will temporary hold the names, for fast searching */
-    ret = iso_htable_create((nchildren * 100) / 80, iso_str_hash,
-                            (compare_function_t)ucscmp, &table);
-    if (ret < 0) {
-        goto ex;
-    }
-    for (i = 0; i < nchildren; ++i) {
-        uint16_t *name = children[i]->name;
-        ret = iso_htable_add(table, name, name);
-        if (ret < 0) {
-            goto mangle_cleanup;
-        }
-    }
-
-    for (i = 0; i < nchildren; ++i) {
-        uint16_t *name, *ext;
-        int max; /* computed max len for name, without extension */
-        int j = i;
-        int digits = 1; /* characters to change per name */
-
-        /* first, find all child with same name */
-        while (j + 1 < nchildren &&
-                !cmp_node_name(children + i, children + j + 1)) {
-            ++j;
-        }
-        if (j == i) {
-            /* name is unique */
-            continue;
-        }
-
+    len = ucslen(n->name);
+    dot = ucsrchr(n->name, '.');
+    if (dot != NULL && n->type != JOLIET_DIR) {
         /*
-         * A max of 7 characters is good enough, it allows handling up to
-         * 9,999,999 files with same name.
+         * File (not dir) with extension
          */
-         /* Important: joliet_create_mangled_name() relies on digits < 8 */
-
-        while (digits < 8) {
-            int ok, k;
-            uint16_t *dot;
-            int change = 0; /* number to be written */
-
-            /* copy name to buffer */
-            ucscpy(full_name, children[i]->name);
-
-            /* compute name and extension */
-            dot = ucsrchr(full_name, '.');
-            if (dot != NULL && children[i]->type != JOLIET_DIR) {
-
+        parts->ext_start = dot - n->name + 1;
+        parts->ext_len = len - parts->ext_start;
+        extlen = parts->ext_len;
+        max = maxchar - extlen - digits;
+        if (max <= 0) {
+            /*
+             * This can happen if the extension is too long.
+             * Reduce its length, to give name at least one
+             * original character, if it has any.
+             */
+            max = (dot > n->name);
+            extlen = maxchar - max - digits;
+            if (extlen < 3) {
                 /*
-                 * File (not dir) with extension
+                 * error, we do not reduce extensions to length < 3
+                 *
+                 * This cannot happen with current limit of digits
+                 * because maxchar is at least 64 and digits at most 7.
                  */
-                int extlen;
-                full_name[dot - full_name] = 0;
-                name = full_name;
-                ext = dot + 1;
-
-                extlen = ucslen(ext);
-                max = maxchar - extlen - digits;
-                if (max <= 0) {
-                    /*
-                     * This can happen if the extension is too long.
-                     * Reduce its length, to give name at least one
-                     * original character, if it has any.
-                     */
-                    max = (dot > full_name);
-                    extlen = maxchar - max - digits;
-                    if (extlen < 3) {
-                        /*
-                         * error, we do not reduce extensions to length < 3
-                         *
-                         * This cannot happen with current limit of digits
-                         * because maxchar is at least 64 and digits at most 7.
-                         */
-                        ret = ISO_ERROR;
-                        goto mangle_cleanup;
-                    }
-                    ext[extlen] = 0;
-                }
-                /* ok, reduce name by digits */
-                if (name + max < dot) {
-                    name[max] = 0;
-                }
-            } else {
-                /* Directory, or file without extension */
-                if (children[i]->type == JOLIET_DIR) {
-                    max = maxchar - digits;
-                    dot = NULL; /* dots have no meaning in dirs */
-                } else {
-                    max = maxchar - digits;
-                }
-                name = full_name;
-                if ((size_t) max < ucslen(name)) {
-                    name[max] = 0;
-                }
-                /* let ext be an empty string */
-                ext = name + ucslen(name);
-            }
-
-            ok = 1;
-            /* change name of each file */
-            for (k = i; k <= j; ++k) {
-                while (1) {
-                    ret = joliet_create_mangled_name(tmp, name, digits,
-                                                     change, ext);
-                    if (ret < 0) {
-                        goto mangle_cleanup;
-                    }
-                    ++change;
-                    if (change > int_pow(10, digits)) {
-                        ok = 0;
-                        break;
-                    }
-                    if (!iso_htable_get(table, tmp, NULL)) {
-                        /* the name is unique, so it can be used */
-                        break;
-                    }
-                }
-                if (ok) {
-                    uint16_t *new = ucsdup(tmp);
-                    if (new == NULL) {
-                        ret = ISO_OUT_OF_MEM;
-                        goto mangle_cleanup;
-                    }
-
-                    iso_htable_remove_ptr(table, children[k]->name, NULL);
-                    free(children[k]->name);
-                    children[k]->name = new;
-                    iso_htable_add(table, new, new);
-
-                    /*
-                     * if we change a name we need to sort again children
-                     * at the end
-                     */
-                    need_sort = 1;
-                } else {
-                    /* we need to increment digits */
-                    break;
-                }
-            }
-            if (ok) {
-                break;
-            } else {
-                ++digits;
+                return ISO_ERROR;
             }
+            if (extlen < parts->ext_len)
+                parts->ext_len = extlen;
         }
-        if (digits == 8) {
-            ret = ISO_MANGLE_TOO_MUCH_FILES;
-            goto mangle_cleanup;
-        }
-        i = j;
-    }
-
-    /*
-     * If needed, sort again the files inside dir
-     */
-    if (need_sort) {
-        qsort(children, nchildren, sizeof(void*), cmp_node_name);
+        /* A dot gets only written if there is an extension */
+        parts->has_dot = (parts->ext_len > 0);
+        /* ok, reduce name by digits */
+        parts->stem_len = dot - n->name;
+        if (max < parts->stem_len)
+            parts->stem_len = max;
+    } else {
+        /* Directory, or file without extension */
+        max = maxchar - digits;
+        parts->stem_len = len;
+        if (max < len)
+            parts->stem_len = max;
+        parts->has_dot = 0;
+        parts->ext_start = 0;
+        parts->ext_len = 0;
     }
-
-    ret = ISO_SUCCESS;
-
-mangle_cleanup : ;
-ex:;
-    iso_htable_destroy(table, NULL);
-    LIBISO_FREE_MEM(tmp);
-    LIBISO_FREE_MEM(full_name);
-    return ret;
+    return 1;
 }
 
+static struct iso_mangle_ops joliet_mangle_ops = {
+    2, LIBISO_JOLIET_NAME_MAX - 1, 0,
+    mangle_is_dir,
+    mangle_get_children,
+    mangle_get_name,
+    mangle_set_name,
+    cmp_node_name,
+    mangle_split,
+    NULL
+};
+
 static
 int mangle_tree(Ecma119Image *t, JolietNode *dir)
 {
-    int ret;
-    size_t i;
-
-    ret = mangle_single_dir(t, dir);
-    if (ret < 0) {
-        return ret;
-    }
-
-    /* recurse */
-    for (i = 0; i < dir->info.dir->nchildren; ++i) {
-        if (dir->info.dir->children[i]->type == JOLIET_DIR) {
-            ret = mangle_tree(t, dir->info.dir->children[i]);
-            if (ret < 0) {
-                /* error */
-                return ret;
-            }
-        }
-    }
-    return ISO_SUCCESS;
+    return iso_mangle_tree(t, &joliet_mangle_ops, t, dir, 1);
 }
 
 static
@@ -641,7 +541,7 @@ int joliet_tree_create(Ecma119Image *t)
         return ISO_NULL_POINTER;
     }
 
-    ret = create_tree(t, (IsoNode*)t->image->root, &root, 0);
+    ret = create_tree(t, (IsoNode*)t->image->root, NULL, &root, 0);
     if (ret <= 0) {
         if (ret == 0) {
             /* unexpected error, root ignored!! This can't happen */
@@ -1012,7 +912,8 @@ int joliet_writer_write_vol_desc(IsoImageWriter *writer)
 }
 
 static
-int write_one_dir(Ecma119Image *t, JolietNode *dir)
+int write_one_dir(Ecma119Image *t, JolietNode *dir,
+                  struct iso_dir_out *out)
 {
     int ret;
     uint8_t *buffer = NULL;
@@ -1050,7 +951,7 @@ int write_one_dir(Ecma119Image *t, JolietNode *dir)
 
             if ( (buf + len - buffer) > BLOCK_SIZE) {
                 /* dir doesn't fit in current block */
-                ret = iso_write(t, buffer, BLOCK_SIZE);
+                ret = iso_dir_out_write(t, out, buffer, BLOCK_SIZE);
                 if (ret < 0) {
                     goto ex;
                 }
@@ -1064,37 +965,25 @@ int write_one_dir(Ecma119Image *t, JolietNode *dir)
     }
 
     /* write the last block */
-    ret = iso_write(t, buffer, BLOCK_SIZE);
+    ret = iso_dir_out_write(t, out, buffer, BLOCK_SIZE);
 ex:;
     LIBISO_FREE_MEM(buffer);
     return ret;
 }
 
 static
-int write_dirs(Ecma119Image *t, JolietNode *root)
+int write_dir_one(Ecma119Image *t, void *dir, void *parent,
+                  struct iso_dir_out *out)
 {
-    int ret;
-    size_t i;
-
-    /* write all directory entries for this dir */
-    ret = write_one_dir(t, root);
-    if (ret < 0) {
-        return ret;
-    }
-
-    /* recurse */
-    for (i = 0; i < root->info.dir->nchildren; i++) {
-        JolietNode *child = root->info.dir->children[i];
-        if (child->type == JOLIET_DIR) {
-            ret = write_dirs(t, child);
-            if (ret < 0) {
-                return ret;
-            }
-        }
-    }
-    return ISO_SUCCESS;
+    return write_one_dir(t, (JolietNode *) dir, out);
 }
 
+static struct iso_dir_write_ops joliet_dir_write_ops = {
+    mangle_is_dir,
+    mangle_get_children,
+    write_dir_one
+};
+
 static
 int write_path_table(Ecma119Image *t, JolietNode **pathlist, int l_type)
 {
@@ -1216,7 +1105,7 @@ int joliet_writer_write_dirs(IsoImageWriter *writer)
     } else {
         root = t->joliet_root;
     }
-    ret = write_dirs(t, root);
+    ret = iso_write_dir_tree(t, &joliet_dir_write_ops, root);
     if (ret < 0) {
         return ret;
     }
@@ -1264,7 +1153,7 @@ int joliet_writer_free_data(IsoImageWriter *writer)
     return ISO_SUCCESS;
 }
 
-int joliet_writer_create(Ecma119Image *target)
+int joliet_writer_prepare(Ecma119Image *target, IsoImageWriter **writer_ret)
 {
     int ret;
     IsoImageWriter *writer;
@@ -1287,6 +1176,24 @@ int joliet_writer_create(Ecma119Image *target)
         free((char *) writer);
         return ret;
     }
+    *writer_ret = writer;
+    return ISO_SUCCESS;
+}
+
+int joliet_writer_create(Ecma119Image *target)
+{
+    int ret;
+    IsoImageWriter *writer;
+
+    writer = target->tree_writers[ISO_LOW_TREE_JOLIET];
+    if (writer != NULL) {
+        /* The tree was built by a thread of ecma119_image_new() */
+        target->tree_writers[ISO_LOW_TREE_JOLIET] = NULL;
+    } else {
+        ret = joliet_writer_prepare(target, &writer);
+        if (ret < 0)
+            return ret;
+    }
 
     /* add this writer to image */
     target->writers[target->nwriters++] = writer;
@@ -47,6 +47,13 @@ struct joliet_node
 	    IsoFileSrc *file;
 		struct joliet_dir_info *dir;
 	} info;
+
+    /* Sort key for cmp_node(), set by joliet_set_cmp_key():
+       the first four UCS-2 characters of .name, zero padded.
+       Number of characters in .name.
+    */
+    uint64_t cmp_key;
+    uint32_t cmp_len;
 };
 
 /**
@@ -58,6 +65,17 @@ struct joliet_node
  */
 int joliet_writer_create(Ecma119Image *target);
 
+/**
+ * Create the IsoWriter for Joliet and the Joliet tree, but do not add the
+ * writer to target. This may run concurrently to the building of the other
+ * low level trees. joliet_writer_create() adds the writer if it finds it in
+ * target->tree_writers.
+ *
+ * @return
+ *      1 on success, < 0 on error
+ */
+int joliet_writer_prepare(Ecma119Image *target, IsoImageWriter **writer);
+
 
 /* Not to be called but only for comparison with target->writers[i]
 */
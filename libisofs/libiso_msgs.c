@@ -246,6 +246,18 @@ int libiso_msgs_set_severities(struct libiso_msgs *m, int queue_severity,
 }
 
 
+int libiso_msgs_get_min_severity(struct libiso_msgs *m, int *severity,
+                                 int flag)
+{
+ if(libiso_msgs_lock(m,0)<=0)
+   return(0);
+ *severity= m->queue_severity < m->print_severity ?
+            m->queue_severity : m->print_severity;
+ libiso_msgs_unlock(m,0);
+ return(1);
+}
+
+
 int libiso_msgs__text_to_sev(char *severity_name, int *severity,
                              int flag)
 {
@@ -349,6 +349,18 @@ int libiso_msgs_set_severities(struct libiso_msgs *m, int queue_severity,
                                int print_severity, char *print_id, int flag);
 
 
+/** Obtain the lowest severity which currently gets queued or printed.
+    Messages of lower severity get discarded by libiso_msgs_submit().
+    The severities may have been set by any user of a shared messenger,
+    e.g. by libburn after burn_set_messenger().
+    @param severity Will return the minimum of queue and print severity
+    @param flag Bitfield for control purposes (unused yet, submit 0)
+    @return 1 on success, <=0 on error
+*/
+int libiso_msgs_get_min_severity(struct libiso_msgs *m, int *severity,
+                                 int flag);
+
+
 /** Obtain a message item that has at least the given severity and priority.
     Usually all older messages of lower severity are discarded then. If no
     item of sufficient severity was found, all others are discarded from the
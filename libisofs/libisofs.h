@@ -407,12 +407,23 @@ typedef struct iso_data_source IsoDataSource;
  * it with regular .iso images, and also with block devices that represent a
  * drive.
  *
+ * Thread safety:
+ * libisofs calls read_block() and read_blocks() from several threads at
+ * the same time if iso_read_opts_set_import_threads() enables parallel
+ * reading of directories. Sources which are used with this setting must
+ * allow concurrent reads between open() and close(). The data sources made
+ * by iso_data_source_new_from_file(), iso_data_source_new_from_file_mmap(),
+ * and iso_data_source_new_cached() are safe in this respect.
+ * Calls of open(), close(), and free_data() are never concurrent.
+ *
  * @since 0.6.2
  */
 struct iso_data_source
 {
 
-    /* reserved for future usage, set to 0 */
+    /* Version of the structure. Set to 0 or 1.
+     * Version 1 adds the member .read_blocks(). @since 1.5.6
+     */
     int version;
 
     /**
@@ -467,6 +478,30 @@ struct iso_data_source
 
     /** Source specific data */
     void *data;
+
+    /* -------------------------- End of version 0 -------------------------- */
+
+    /**
+     * Read several consecutive blocks of 2048 bytes from the source.
+     * This is supposed to be faster than repeated calls of read_block().
+     * Do not call this directly but rather use iso_data_source_read_blocks()
+     * which falls back to read_block() with data sources of version 0.
+     *
+     * @param lba
+     *     First block to be read.
+     * @param count
+     *     Number of blocks to be read.
+     * @param buffer
+     *     Buffer where the data will be written. It should have at least
+     *     count * 2048 bytes.
+     * @return
+     *      1 if success, i.e. all blocks were read,
+     *    < 0 if error. See read_block() for the error codes.
+     *
+     * @since 1.5.6
+     */
+    int (*read_blocks)(IsoDataSource *src, uint32_t lba, uint32_t count,
+                       uint8_t *buffer);
 };
 
 /**
@@ -2684,6 +2719,57 @@ int iso_write_opts_set_gpt_guid(IsoWriteOpts *opts, uint8_t guid[16],
  */
 void iso_generate_gpt_guid(uint8_t guid[16]);
 
+/**
+ * Set the number of threads which may be used to prepare the directory trees
+ * of the image before the first byte gets produced. Currently the names in
+ * the directories of the ECMA-119, Joliet, and ISO 9660:1999 trees get
+ * mangled by these threads.
+ * Further the Joliet, ISO 9660:1999, and HFS+ trees get built concurrently
+ * with the ECMA-119 tree, unless a partition offset is set by
+ * iso_write_opts_set_part_offset() or MD5 checksums of data files are
+ * recorded by iso_write_opts_set_record_md5().
+ * When the image gets written, these threads render the directory records
+ * of the ECMA-119, Joliet, and ISO 9660:1999 trees into memory ahead of
+ * the thread which produces the output stream.
+ * The resulting image does not depend on this setting. Only the order of
+ * messages may differ.
+ *
+ * @param opts
+ *       The option set to be manipulated
+ * @param num_threads
+ *       Number of threads. 0 or 1 means to do all work in the thread which
+ *       starts image production. Maximum is 64. Default is 0.
+ * @return
+ *       ISO_SUCCESS if num_threads was accepted
+ *       0           if the value was out of range
+ *       < 0         if other error
+ *
+ * @since 1.5.6
+ */
+int iso_write_opts_set_tree_threads(IsoWriteOpts *opts, int num_threads);
+
+/**
+ * Set the amount of memory which may be used to remember the results of the
+ * Rock Ridge size computation for each directory entry, so that they do not
+ * have to be computed again when the directory records get written.
+ * Remembered are the file names and symbolic link targets after conversion
+ * to the output character set, and the predicted sizes of the NM, SL, and
+ * AL fields.
+ * When the memory is used up, the remaining entries get computed twice,
+ * as without cache. The resulting image does not depend on this setting.
+ *
+ * @param opts
+ *       The option set to be manipulated
+ * @param cache_bytes
+ *       Maximum number of bytes to use. 0 disables the cache. Default is 0.
+ *       A few hundred bytes per directory entry of the image are enough.
+ * @return
+ *       ISO_SUCCESS or < 0 error
+ *
+ * @since 1.5.6
+ */
+int iso_write_opts_set_rr_cache(IsoWriteOpts *opts, size_t cache_bytes);
+
 /**
  * Cause an arbitrary data file to be appended to the ISO image and to be
  * described by a partition table entry in an MBR or SUN Disk Label at the
@@ -3207,6 +3293,97 @@ int iso_read_opts_load_system_area(IsoReadOpts *opts, int mode);
  */
 int iso_read_opts_keep_import_src(IsoReadOpts *opts, int mode);
 
+/**
+ * Set the number of threads which read directories of the imported ISO
+ * filesystem in advance. While iso_image_import() builds the tree, these
+ * threads read the directory records and Rock Ridge information of the
+ * subdirectories which will be visited next.
+ * The resulting tree does not depend on this setting. Only the order of
+ * messages about problems with the image may differ.
+ * The IsoDataSource given to iso_image_import() has to allow concurrent
+ * reading. See struct iso_data_source.
+ *
+ * @param opts
+ *       The option set to be manipulated
+ * @param num_threads
+ *       Number of threads. 0 or 1 means to read all directories in the
+ *       thread which called iso_image_import(). Maximum is 64.
+ *       Default is 0.
+ * @return
+ *       ISO_SUCCESS if num_threads was accepted
+ *       0           if the value was out of range
+ *       < 0         if other error
+ *
+ * @since 1.5.6
+ */
+int iso_read_opts_set_import_threads(IsoReadOpts *opts, int num_threads);
+
+/**
+ * Enable or disable lazy loading of the directory tree by iso_image_import().
+ * With lazy loading, only the root directory gets read by the import.
+ * Each imported subdirectory remembers its location in the imported ISO
+ * filesystem and reads its children when they get inquired or changed first,
+ * e.g. by iso_dir_get_children(), iso_dir_get_node(), iso_dir_add_node(),
+ * or iso_tree_path_to_node(). Its subdirectories are then lazy in turn.
+ * Production of a new image loads all directories which were not loaded yet.
+ *
+ * The IsoDataSource of the import has to stay readable as long as there are
+ * lazy directories. The settings of the IsoImage for exclusion, hiding,
+ * and reporting of files get applied when a directory gets loaded.
+ * Loading fails with error ISO_LAZY_DIR_LOST if the IsoImage was disposed
+ * or got another tree imported.
+ * If loading of a directory fails, then it is not tried again. Every further
+ * inquiry or change of that directory, and image production, return the
+ * error of the failed load.
+ * If the imported filesystem lacks inode numbers in some Rock Ridge PX
+ * entries, then numbers which get assigned to loaded files might collide
+ * with numbers of files which get loaded later. Combine with
+ * iso_read_opts_set_new_inos() to avoid this.
+ *
+ * @param opts
+ *       The option set to be manipulated
+ * @param mode
+ *       Bitfield for control purposes:
+ *       bit0= Load directories lazily
+ *       Submit any other bits with value 0.
+ * @return
+ *       ISO_SUCCESS or < 0 if error
+ *
+ * @since 1.5.6
+ */
+int iso_read_opts_set_lazy_tree(IsoReadOpts *opts, int mode);
+
+/**
+ * Set the path of a sidecar index file for iso_image_import().
+ * Such a file gets written by iso_image_save_index(). It records the
+ * attributes, names, extent lists, and AAIP strings of all files in the
+ * directory tree, and the MD5 checksum array of the session. If the file
+ * matches the volume descriptors of the imported session and the reading
+ * options, and if its content MD5 is intact, then iso_image_import() reads
+ * it into memory and takes this information from there instead of reading
+ * and parsing the directory records.
+ * Else the index gets ignored with a NOTE message ISO_IMPORT_INDEX_IGNORED.
+ * A damaged record of a directory which is found later causes that
+ * directory to be read from the ISO filesystem.
+ * The resulting tree is the same in both cases.
+ *
+ * Setting a path also causes the IsoImage to keep the imported filesystem,
+ * so that iso_image_save_index() can be used. The file does not need to
+ * exist before the import.
+ *
+ * @param opts
+ *       The option set to be manipulated
+ * @param path
+ *       The file address. NULL disables the use of an index file.
+ * @param flag
+ *       Bitfield for control purposes. Submit 0 for now.
+ * @return
+ *       ISO_SUCCESS or < 0 if error
+ *
+ * @since 1.5.6
+ */
+int iso_read_opts_set_index_file(IsoReadOpts *opts, char *path, int flag);
+
 /**
  * Import a previous session or image, for growing or modify.
  *
@@ -3234,6 +3411,31 @@ int iso_read_opts_keep_import_src(IsoReadOpts *opts, int mode);
 int iso_image_import(IsoImage *image, IsoDataSource *src, IsoReadOpts *opts,
                      IsoReadImageFeatures **features);
 
+/**
+ * Write a sidecar index file for the ISO filesystem which was imported by
+ * the most recent iso_image_import(), as needed by
+ * iso_read_opts_set_index_file(). That import had to be done with an index
+ * file path set. The IsoDataSource of the import has to be still readable.
+ * The index describes the imported directory tree, not changes which were
+ * made to the tree of the IsoImage afterwards.
+ * The file gets written under the name path + ".tmp" and then renamed to
+ * path. So an index which is still in use by the import gets replaced safely.
+ *
+ * @param image
+ *     The image which holds the imported filesystem
+ * @param path
+ *     The address of the index file
+ * @param flag
+ *     Bitfield for control purposes:
+ *     bit0= Do nothing if the import used a matching index file.
+ * @return
+ *     1 on success, 2 if nothing was done because of bit0,
+ *     < 0 on error, e.g. ISO_INDEX_NO_IMPORT
+ *
+ * @since 1.5.6
+ */
+int iso_image_save_index(IsoImage *image, char *path, int flag);
+
 /**
  * Destroy an IsoReadImageFeatures object obtained with iso_image_import.
  *
@@ -6413,6 +6615,23 @@ int iso_tree_add_new_cut_out_node(IsoImage *image, IsoDir *parent,
  *            This will not allow to overwrite any existing node.
  *            Attributes of existing directories will not be overwritten.
  *      bit1= issue warning in case of new_name truncation
+ *      bit2= Copy-on-write cloning of directories. @since 1.5.6
+ *            A new directory clone does not get its content at once.
+ *            Its children get cloned when the child list gets iterated
+ *            or searched. Subdirectories become copy-on-write clones in the
+ *            same way. Changes of the original tree or of the clone cause
+ *            the affected clone directories to get their content before
+ *            the change happens. So both trees stay independent.
+ *            Image production reads the content of pending clones from the
+ *            original tree, unless MD5 checksums get recorded. So the
+ *            original tree must not be changed while such an image is
+ *            being written.
+ *            The original tree and its pending clones share nodes and
+ *            bookkeeping. So they must not be used or changed by different
+ *            threads at the same time, even if they belong to different
+ *            IsoImage objects.
+ *            Errors of delayed cloning, like non-clonable xinfo, get
+ *            reported as messages when they happen.
  * @return
  *      <0 means error, 1 = new node created,
  *      2 = if flag bit0 is set: new_node is a directory which already existed.
@@ -6443,6 +6662,13 @@ int iso_image_tree_clone(IsoImage *image, IsoNode *node, IsoDir *new_parent,
  *      bit0= Merge directories rather than returning ISO_NODE_NAME_NOT_UNIQUE.
  *            This will not allow to overwrite any existing node.
  *            Attributes of existing directories will not be overwritten.
+ *      bit2= Copy-on-write cloning of directories. @since 1.5.6
+ *            The clone shares the nodes of the original tree until either
+ *            of them gets changed. The original tree must not be changed
+ *            while an image with pending clones is being written, unless
+ *            MD5 checksums get recorded. Both trees must not be used by
+ *            different threads at the same time.
+ *            See iso_image_tree_clone() for details.
  * @return
  *      <0 means error, 1 = new node created,
  *      2 = if flag bit0 is set: new_node is a directory which already existed.
@@ -6475,6 +6701,47 @@ int iso_tree_clone(IsoNode *node,
  */
 int iso_tree_add_dir_rec(IsoImage *image, IsoDir *parent, const char *dir);
 
+/**
+ * Bring the content of a directory of the iso tree in sync with a directory
+ * in the filesystem. This is like iso_tree_add_dir_rec() but keeps nodes
+ * which already represent the current state of their source file.
+ * A node is considered unchanged if file type, mtime, ctime, and size match.
+ * If the node stems from the same filesystem as the source file, then also
+ * device and inode number have to match. For symbolic links the link target
+ * and for device files the device number are compared.
+ * Unchanged IsoFile nodes which were imported from an old session keep
+ * their reference to the data in that session. So with appendable writing
+ * only the data of new or changed files gets written.
+ * Changed nodes get replaced. The subtrees of changed directories are
+ * compared and not rebuilt.
+ *
+ * The options of iso_tree_set_* functions apply as with
+ * iso_tree_add_dir_rec().
+ *
+ * @param image
+ *      The image to which the directory belongs.
+ * @param parent
+ *      Directory on the image tree which shall mirror the dir.
+ * @param dir
+ *      Path to a dir in the filesystem
+ * @param flag
+ *      Bitfield for control purposes. Submit any undefined bits as 0.
+ *      bit0= Do not remove nodes which have no counterpart in the filesystem
+ *            directory. By default such nodes get removed, except the
+ *            El Torito boot catalog node.
+ *      bit1= Skip the subtree of a directory without further inspection if
+ *            the directory has unchanged mtime and ctime.
+ *            This is fast but will only notice the addition, removal, or
+ *            renaming of directory entries. Files which were changed in
+ *            place will go unnoticed.
+ * @return
+ *     1 on success, < 0 on error
+ *
+ * @since 1.5.6
+ */
+int iso_tree_sync_dir(IsoImage *image, IsoDir *parent, const char *dir,
+                      int flag);
+
 /**
  * Inquire whether some local filesystem xattr namespace could not be explored
  * during node building.This may happen due to lack of administrator privileges
@@ -6603,9 +6870,33 @@ void iso_data_source_ref(IsoDataSource *src);
  */
 void iso_data_source_unref(IsoDataSource *src);
 
+/**
+ * Read several consecutive blocks of 2048 bytes from an IsoDataSource.
+ * This uses the method .read_blocks() if the data source is of version 1
+ * or higher. Else it calls .read_block() for each block.
+ * The data source has to be opened.
+ *
+ * @param src
+ *     The data source to read from.
+ * @param lba
+ *     First block to be read.
+ * @param count
+ *     Number of blocks to be read.
+ * @param buffer
+ *     Buffer for count * 2048 bytes.
+ * @return
+ *    1 on success, < 0 on error.
+ *
+ * @since 1.5.6
+ */
+int iso_data_source_read_blocks(IsoDataSource *src, uint32_t lba,
+                                uint32_t count, uint8_t *buffer);
+
 /**
  * Create a new IsoDataSource from a local file. This is suitable for
  * accessing regular files or block devices with ISO images.
+ * Blocks get read by pread(2), which does not change the file offset.
+ * So the data source may be read by several threads at the same time.
  *
  * @param path
  *     The absolute path of the file
@@ -6618,6 +6909,66 @@ void iso_data_source_unref(IsoDataSource *src);
  */
 int iso_data_source_new_from_file(const char *path, IsoDataSource **src);
 
+/**
+ * Create a new IsoDataSource from a local file which gets mapped into memory
+ * when the data source is opened. Reading blocks then copies from the memory
+ * mapping. The ISO image reader parses directory records and Continuation
+ * Areas of Rock Ridge information directly in the mapping.
+ * Reading of large ranges is announced to the operating system, so that
+ * it can read ahead.
+ *
+ * The file must not shrink while the data source is open. Reading from a
+ * truncated memory mapping causes signal SIGBUS. Opening fails if the file
+ * cannot be mapped, e.g. because it is too large for the address space or
+ * because the operating system does not allow to map a block device.
+ *
+ * @param path
+ *     The absolute path of the file
+ * @param src
+ *     Will be filled with the pointer to the newly created data source.
+ * @return
+ *    1 on success, < 0 on error.
+ *
+ * @since 1.5.6
+ */
+int iso_data_source_new_from_file_mmap(const char *path, IsoDataSource **src);
+
+/**
+ * Create a new IsoDataSource which caches the blocks read from another
+ * IsoDataSource. The blocks are kept in chunks of 16 blocks which get
+ * replaced in the order of least recent use. If a block is missing in the
+ * cache, its whole chunk gets read. If the block immediately follows the
+ * previously read one, then also the next readahead_blocks get read in
+ * advance.
+ * Each such load is done by a single call of iso_data_source_read_blocks()
+ * on the cached data source.
+ *
+ * The cache gets emptied when the new data source gets opened or closed.
+ * It is not suitable for media which change their content while being open.
+ * Concurrent reads are serialized by a mutex. The wrapped source does not
+ * need to be safe for concurrent reading.
+ *
+ * @param src
+ *     The data source to be cached. It gets referenced by the new data
+ *     source. So you may iso_data_source_unref() it after this call.
+ * @param cache_bytes
+ *     Memory size to be used for the cache. 0 means the default of 4 MiB.
+ *     At least one chunk of 32 KiB gets allocated.
+ * @param readahead_blocks
+ *     Number of blocks to read in advance when sequential reading is
+ *     detected. It gets rounded up to full chunks and is limited to half
+ *     of the cache size. 0 disables readahead beyond the chunk.
+ * @param cached
+ *     Will be filled with the pointer to the newly created data source.
+ * @return
+ *    1 on success, < 0 on error.
+ *
+ * @since 1.5.6
+ */
+int iso_data_source_new_cached(IsoDataSource *src, size_t cache_bytes,
+                               uint32_t readahead_blocks,
+                               IsoDataSource **cached);
+
 /**
  * Get the status of the buffer used by a burn_source.
  *
@@ -7791,6 +8142,47 @@ int iso_local_set_attrs(char *disk_path, size_t num_attrs, char **names,
                         size_t *value_lengths, char **values, int flag);
 
 
+/**
+ * Copy a directory tree or a single node from an IsoImage into the local
+ * filesystem. Ownership, permissions, timestamps, ACLs, and xattr of the
+ * nodes get applied to the created files.
+ *
+ * If the data source of the imported ISO image was kept by
+ * iso_read_opts_keep_import_src(), then the content of files which still
+ * refer to the imported image gets read in the order of block addresses by
+ * large read operations. Other files get copied from their IsoStream.
+ * Hard links get extracted as separate files.
+ *
+ * @param image
+ *      The image which holds the tree.
+ * @param iso_path
+ *      Absolute path of the node in the image.
+ * @param disk_path
+ *      Path of the file in the local filesystem which shall represent the
+ *      node. If the node is a directory, then disk_path may already exist
+ *      as directory.
+ * @param threads
+ *      Number of threads which write the content of files from the imported
+ *      image. 0 means that the calling thread writes. At most 64 threads
+ *      will be used.
+ * @param flag
+ *      Bitfield for control purposes
+ *      bit0= do not restore ACLs and xattr
+ *      bit1= restore owner and group
+ *      bit2= replace existing non-directory files
+ *      bit3= restore xattr of namespaces other than "user."
+ * @return
+ *      1 = all nodes were extracted,
+ *      0 = some nodes could not be extracted. Messages with error code
+ *          ISO_EXTRACT_FILE_FAIL were issued.
+ *      < 0 = error
+ *
+ * @since 1.5.6
+ */
+int iso_image_extract_tree(IsoImage *image, char *iso_path, char *disk_path,
+                           int threads, int flag);
+
+
 /* Default in case that the compile environment has no macro PATH_MAX.
 */
 #define Libisofs_default_path_maX 4096
@@ -8044,6 +8436,33 @@ int iso_stream_get_zisofs_par(IsoStream *stream, int *stream_type,
  */
 int iso_stream_zisofs_discard_bpt(IsoStream *stream, int flag);
 
+/**
+ * Set the read position of an opened zisofs uncompression stream, i.e. a
+ * stream of class->type "osiz". The next iso_stream_read() delivers the
+ * uncompressed content from that position on. Only the zisofs block which
+ * contains the new position gets read and uncompressed. The stream keeps
+ * a few recently used uncompressed blocks, so that jumping back and forth
+ * within a small range does not uncompress them again.
+ * @param stream
+ *      The opened stream to be positioned.
+ * @param offset
+ *      The offset in bytes of uncompressed content, relative to the
+ *      position given by flag.
+ * @param flag
+ *      0 The offset is set to offset bytes (SEEK_SET)
+ *      1 The offset is set to its current location plus offset bytes
+ *        (SEEK_CUR)
+ *      2 The offset is set to the size of the uncompressed content plus
+ *        offset bytes (SEEK_END).
+ * @return
+ *      The new position counted from the start of the uncompressed content,
+ *      or <0 on error. ISO_WRONG_ARG_VALUE if the stream is not of type
+ *      "osiz", ISO_FILE_SEEK_ERROR if the new position would be outside of
+ *      the uncompressed content.
+ * @since 1.5.6
+ */
+off_t iso_stream_zisofs_lseek(IsoStream *stream, off_t offset, int flag);
+
 /**
  * Discard all buffered zisofs compression block pointers of streams in the
  * given image, which are zisofs compression streams and not currently opened.
@@ -8082,10 +8501,12 @@ int iso_zisofs_get_refcounts(off_t *ziso_count, off_t *osiz_count, int flag);
  */
 struct iso_zisofs_ctrl {
 
-    /* Set to 0 or 1 for this version of the structure
+    /* Set to 0, 1, or 2 for this version of the structure
      * 0 = only members up to .block_size_log2 are valid
      * 1 = members up to .bpt_discard_free_ratio are valid
      *     @since 1.5.4
+     * 2 = members up to .uncompress_batch_blocks are valid
+     *     @since 1.5.6
      */
     int version;
 
@@ -8180,6 +8601,31 @@ struct iso_zisofs_ctrl {
      */
     double bpt_discard_free_ratio;
 
+    /* ------------------- Only valid with .version >= 2 ------------------- */
+
+    /*
+     * Number of threads which help to uncompress zisofs blocks while a
+     * zisofs uncompression stream (class->type "osiz") gets read
+     * sequentially. The compressed data of several blocks get read by a
+     * single read of the input stream and then get uncompressed in parallel
+     * before they are requested. The delivered bytes and the reaction on
+     * errors stay the same as without threads.
+     * 0 keeps the current setting.
+     * < 0 disables these threads. This is the default.
+     * @since 1.5.6
+     */
+    int uncompress_threads;
+
+    /*
+     * Number of blocks which get read and uncompressed together if
+     * .uncompress_threads is enabled. The uncompressed size of these
+     * blocks is limited to 8 MiB.
+     * 0 keeps the current setting.
+     * < 0 restores the default of 16.
+     * @since 1.5.6
+     */
+    int uncompress_batch_blocks;
+
 };
 
 /**
@@ -8385,6 +8831,49 @@ int iso_file_get_md5(IsoImage *image, IsoFile *file, char md5[16], int flag);
  */
 int iso_file_make_md5(IsoFile *file, int flag);
 
+/**
+ * Verify the recorded MD5 checksums of all data files in the image tree and
+ * the recorded checksum of the imported session.
+ * If the data source of the imported ISO image was kept by
+ * iso_read_opts_keep_import_src(), then the content of the imported files
+ * and the session range get read in the order of block addresses by large
+ * read operations. So the whole check is a single sequential pass over the
+ * medium. The checksums of the files get computed by a pool of threads.
+ * Files which are not from the imported image, or in case that the data
+ * source is not kept, get read via their IsoStream by the calling thread.
+ * The checksum array needs to be loaded. See iso_read_opts_set_no_md5().
+ * @param image
+ *      The image to verify.
+ * @param threads
+ *      Number of threads which compute checksums of files. 0 means that the
+ *      calling thread does it. At most 64 threads will be used.
+ * @param result
+ *      Function to be called for each verified file and for the session,
+ *      as soon as its result is known. It is called by the thread which
+ *      called iso_image_verify_files().
+ *      file is NULL for the result of the session check, which covers the
+ *      MD5 of iso_image_get_session_md5() and the session checksum tag.
+ *      match is 1 if the MD5 matches, 0 if it does not match, and < 0 if the
+ *      data could not be read.
+ *      A return value < 0 aborts the verification.
+ *      NULL is allowed if only the return value is of interest.
+ * @param handle
+ *      Submitted to result() as is.
+ * @param flag
+ *      Bitfield for control purposes
+ *      bit0= do not check the session
+ * @return
+ *      1 = all checksums match,
+ *      0 = mismatch or unreadable data were encountered,
+ *      < 0 = error, ISO_CANCELED if result() returned < 0
+ *
+ * @since 1.5.6
+ */
+int iso_image_verify_files(IsoImage *image, int threads,
+                           int (*result)(IsoImage *image, IsoFile *file,
+                                         int match, void *handle),
+                           void *handle, int flag);
+
 /**
  * Check a data block whether it is a libisofs session checksum tag and
  * eventually obtain its recorded parameters. These tags get written after
@@ -8444,6 +8933,165 @@ int iso_util_decode_md5_tag(char data[2048], int *tag_type, uint32_t *pos,
                             uint32_t *range_start, uint32_t *range_size,
                             uint32_t *next_tag, char md5[16], int flag);
 
+/**
+ * Opaque object which verifies the checksum tags of ISO image sessions
+ * from data blocks which get read for other purposes anyway, e.g. by
+ * loading the image tree or by extracting files.
+ * See iso_image_verifier_new().
+ *
+ * @since 1.5.6
+ */
+typedef struct iso_image_verifier IsoImageVerifier;
+
+/**
+ * Create a verifier which computes the MD5 of an ISO image session from
+ * blocks which get fed to it in order of ascending addresses, and which
+ * evaluates the superblock tag, the tree tag, and the session tag as soon as
+ * the range of each tag is complete. A relocated superblock tag at LBA 0
+ * and a copied superblock (growing without emulated TOC) are followed as
+ * does iso_image_import(). After a session tag, the verifier looks for a
+ * superblock tag of a subsequent session at the next block address which
+ * is a multiple of 32. See doc/checksum.txt .
+ * The blocks may be fed by iso_image_verifier_feed() or by reading through
+ * the data source of iso_image_verifier_get_data_source(). That data
+ * source may be wrapped by iso_data_source_new_cached(), so that its
+ * readahead feeds large chunks in sequence.
+ * Blocks which would leave a gap in the sequence get ignored, unless flag
+ * bit0 is set.
+ *
+ * @param src
+ *      The data source of the ISO image. It gets a reference by the verifier.
+ *      NULL is allowed if blocks only get fed by iso_image_verifier_feed()
+ *      without flag bit0.
+ * @param start_lba
+ *      The block address where the session starts. 0 for the first session
+ *      or for overwritable media with relocated superblock.
+ * @param verifier
+ *      Returns the new verifier with a reference count of 1.
+ *      Dispose it by iso_image_verifier_unref().
+ * @param flag
+ *      Bitfield for control purposes
+ *      bit0= if fed blocks would leave a gap in the sequence, read the
+ *            missing blocks from src. src has to be open while blocks get
+ *            fed. This is the case with the data source of
+ *            iso_image_verifier_get_data_source().
+ * @return
+ *      ISO_SUCCESS or < 0 error
+ *
+ * @since 1.5.6
+ */
+int iso_image_verifier_new(IsoDataSource *src, uint32_t start_lba,
+                           IsoImageVerifier **verifier, int flag);
+
+/**
+ * Increment the reference count of a verifier.
+ *
+ * @since 1.5.6
+ */
+void iso_image_verifier_ref(IsoImageVerifier *verifier);
+
+/**
+ * Decrement the reference count of a verifier and free it if the count
+ * reaches 0.
+ *
+ * @since 1.5.6
+ */
+void iso_image_verifier_unref(IsoImageVerifier *verifier);
+
+/**
+ * Set the function which gets called each time a checksum tag was evaluated.
+ * @param verifier
+ *      The verifier to configure.
+ * @param report
+ *      Called by the thread which fed the tag block. The verifier is locked
+ *      during the call, so report() must not call iso_image_verifier_*()
+ *      functions or read from the data source of the verifier.
+ *      tag_type is 1 for session tag, 2 for superblock tag, 3 for tree tag,
+ *      4 for relocated superblock tag.
+ *      range_start and range_size tell the blocks which are covered by the
+ *      checksum. range_start + range_size is the address of the tag block.
+ *      result is 1 if the checksum matches, 0 if it does not match,
+ *      and < 0 if the tag is corrupted, misplaced, or missing. E.g.
+ *      ISO_MD5_AREA_CORRUPTED, ISO_MD5_TAG_MISPLACED, ISO_MD5_TAG_MISSING.
+ *      A return value < 0 ends the verification.
+ *      NULL disables reporting.
+ * @param handle
+ *      Submitted to report() as is.
+ * @return
+ *      ISO_SUCCESS or < 0 error
+ *
+ * @since 1.5.6
+ */
+int iso_image_verifier_set_report(IsoImageVerifier *verifier,
+                                  int (*report)(IsoImageVerifier *verifier,
+                                                int tag_type,
+                                                uint32_t range_start,
+                                                uint32_t range_size,
+                                                int result, void *handle),
+                                  void *handle);
+
+/**
+ * Submit data blocks to the verifier. Blocks which were already processed
+ * get skipped. May be called by several threads.
+ * @param verifier
+ *      The verifier which shall process the blocks.
+ * @param lba
+ *      The block address of the first block in buffer.
+ * @param count
+ *      The number of blocks in buffer.
+ * @param buffer
+ *      The data of count * 2048 bytes.
+ * @param flag
+ *      Bitfield for control purposes. Submit 0.
+ * @return
+ *      1 = blocks were processed,
+ *      0 = blocks were not used because they were already processed or
+ *          because they would leave a gap,
+ *      2 = the verification has ended,
+ *      < 0 = error
+ *
+ * @since 1.5.6
+ */
+int iso_image_verifier_feed(IsoImageVerifier *verifier, uint32_t lba,
+                            uint32_t count, uint8_t *buffer, int flag);
+
+/**
+ * Inquire the overall result of a verifier and optionally complete the
+ * verification by reading the blocks which were not fed yet.
+ * @param verifier
+ *      The verifier to inquire.
+ * @param flag
+ *      Bitfield for control purposes
+ *      bit0= read the remaining blocks of the sessions from the data source
+ *            which was given to iso_image_verifier_new()
+ * @return
+ *      1 = all evaluated tags match and at least one session tag was found,
+ *      0 = mismatch or tag problems were encountered,
+ *      2 = verification not completed or no checksum tags found,
+ *      < 0 = error, ISO_CANCELED if report() returned < 0
+ *
+ * @since 1.5.6
+ */
+int iso_image_verifier_finish(IsoImageVerifier *verifier, int flag);
+
+/**
+ * Obtain a data source which reads from the data source of the verifier and
+ * feeds all read blocks to the verifier. It can be used with
+ * iso_image_import(), iso_data_source_new_cached(), or
+ * iso_image_extract_tree() via a kept import source.
+ * @param verifier
+ *      The verifier which shall get the blocks. It must have a data source.
+ *      The new data source holds a reference to the verifier.
+ * @param src
+ *      Returns the new data source with a reference count of 1.
+ * @return
+ *      ISO_SUCCESS or < 0 error
+ *
+ * @since 1.5.6
+ */
+int iso_image_verifier_get_data_source(IsoImageVerifier *verifier,
+                                       IsoDataSource **src);
+
 
 /* The following functions allow to do own MD5 computations. E.g for
    comparing the result with a recorded checksum.
@@ -9254,6 +9902,22 @@ int iso_conv_name_chars(IsoWriteOpts *opts, char *name, size_t name_len,
 /** Cannot obtain size of zisofs compressed stream    (FAILURE, HIGH, -425) */
 #define ISO_ZISOFS_UNKNOWN_SIZE     0xE830FE57
 
+/** Lazily imported directory cannot be loaded any more
+                                                       (FAILURE, HIGH, -426) */
+#define ISO_LAZY_DIR_LOST           0xE830FE56
+
+/** Image index file ignored                             (NOTE, HIGH, -427) */
+#define ISO_IMPORT_INDEX_IGNORED    0xB030FE55
+
+/** No imported ISO filesystem available for index    (FAILURE, HIGH, -428) */
+#define ISO_INDEX_NO_IMPORT         0xE830FE54
+
+/** Cannot extract file to local filesystem         (SORRY, HIGH, -429) */
+#define ISO_EXTRACT_FILE_FAIL       0xE030FE53
+
+/** Expected MD5 checksum tag not found             (SORRY, HIGH, -430) */
+#define ISO_MD5_TAG_MISSING         0xE030FE52
+
 
 /* Internal developer note: 
    Place new error codes directly above this comment. 
@@ -0,0 +1,474 @@
+/*
+ * Copyright (c) 2007 Vreixo Formoso
+ * Copyright (c) 2009 - 2026 Thomas Schmitt
+ *
+ * This file is part of the libisofs project; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * or later as published by the Free Software Foundation.
+ * See COPYING file for details.
+ */
+
+/* Name mangling which is shared by the ECMA-119, Joliet, and ISO 9660:1999
+   trees.
+   The colliding names of a directory form groups of equal names. Each
+   member of a group gets a name which is composed of a stem, a decimal
+   number, and the extension of the original name. The next number to try
+   is remembered per stem, extension, and number of digits. So groups which
+   get truncated to the same stem do not probe all numbers which were
+   already handed out.
+   Directories are independent of each other. So they may be mangled by
+   several threads without changing the result.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "../config.h"
+#endif
+
+#include "libisofs.h"
+#include "mangle.h"
+#include "messages.h"
+#include "image.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+
+
+/* The next number to try for a combination of stem, extension, and digits.
+   key holds: digits, has_dot, stem characters, a 0-character,
+   extension characters.
+*/
+struct iso_mangle_counter {
+    unsigned char *key;
+    size_t key_len;
+    int next;
+};
+
+struct iso_mangle_job {
+    Ecma119Image *t;
+    struct iso_mangle_ops *ops;
+    void *handle;
+
+    void **dirs;
+    int num_dirs;
+    int dirs_size;
+
+    pthread_mutex_t mutex;
+    int next_dir;
+
+    /* Lowest index of a directory which failed, and its error */
+    int err_dir;
+    int err;
+
+    /* Number of renamed nodes with ops->flag bit0 */
+    int renamed;
+};
+
+
+static
+size_t iso_mangle_len(struct iso_mangle_ops *ops, void *name)
+{
+    if (ops->char_size == 2)
+        return ucslen((uint16_t *) name);
+    return strlen((char *) name);
+}
+
+/* Hash function for big endian UCS-2 names */
+static
+unsigned int iso_mangle_ucs_hash(const void *key)
+{
+    const uint16_t *p = key;
+    const unsigned char *b;
+    unsigned int h = 2166136261u;
+
+    for (; *p != 0; p++) {
+        b = (const unsigned char *) p;
+        h = (h * 16777619) ^ b[0];
+        h = (h * 16777619) ^ b[1];
+    }
+    return h;
+}
+
+static
+unsigned int iso_mangle_counter_hash(const void *key)
+{
+    const struct iso_mangle_counter *c = key;
+    size_t i;
+    unsigned int h = 2166136261u;
+
+    for (i = 0; i < c->key_len; i++)
+        h = (h * 16777619) ^ c->key[i];
+    return h;
+}
+
+static
+int iso_mangle_counter_cmp(const void *a, const void *b)
+{
+    const struct iso_mangle_counter *c1 = a, *c2 = b;
+
+    if (c1->key_len != c2->key_len)
+        return c1->key_len < c2->key_len ? -1 : 1;
+    return memcmp(c1->key, c2->key, c1->key_len);
+}
+
+static
+void iso_mangle_counter_free(void *key, void *data)
+{
+    struct iso_mangle_counter *c = key;
+
+    free(c->key);
+    free(c);
+}
+
+/* Look up or create the counter of the given parts */
+static
+int iso_mangle_get_counter(IsoHTable *counters, struct iso_mangle_ops *ops,
+                           unsigned char *name, int digits,
+                           struct iso_mangle_parts *parts,
+                           struct iso_mangle_counter **counter)
+{
+    int ret, cs;
+    size_t stem_bytes, ext_bytes;
+    unsigned char *key;
+    struct iso_mangle_counter probe, *c;
+
+    cs = ops->char_size;
+    stem_bytes = parts->stem_len * cs;
+    ext_bytes = parts->ext_len * cs;
+    probe.key_len = 2 + stem_bytes + cs + ext_bytes;
+    key = calloc(1, probe.key_len);
+    if (key == NULL)
+        return ISO_OUT_OF_MEM;
+    key[0] = digits;
+    key[1] = parts->has_dot;
+    memcpy(key + 2, name, stem_bytes);
+    memcpy(key + 2 + stem_bytes + cs, name + parts->ext_start * cs,
+           ext_bytes);
+    probe.key = key;
+
+    if (iso_htable_get(counters, &probe, (void **) counter) == 1) {
+        free(key);
+        return ISO_SUCCESS;
+    }
+    c = calloc(1, sizeof(struct iso_mangle_counter));
+    if (c == NULL) {
+        free(key);
+        return ISO_OUT_OF_MEM;
+    }
+    c->key = key;
+    c->key_len = probe.key_len;
+    c->next = 0;
+    ret = iso_htable_add(counters, c, c);
+    if (ret < 0) {
+        iso_mangle_counter_free(c, NULL);
+        return ret;
+    }
+    *counter = c;
+    return ISO_SUCCESS;
+}
+
+/* Compose a mangled name into buf, which must be able to take
+   ops->max_chars + 1 characters.
+*/
+static
+void iso_mangle_compose(struct iso_mangle_ops *ops, unsigned char *name,
+                        struct iso_mangle_parts *parts, int digits,
+                        int number, unsigned char *buf)
+{
+    int cs, i, pos;
+    char nstr[16];
+
+    cs = ops->char_size;
+    sprintf(nstr, "%0*d", digits, number);
+    memcpy(buf, name, parts->stem_len * cs);
+    pos = parts->stem_len;
+    for (i = 0; i < digits; i++) {
+        if (cs == 2) {
+            buf[pos * 2] = 0;
+            buf[pos * 2 + 1] = nstr[i];
+        } else {
+            buf[pos] = nstr[i];
+        }
+        pos++;
+    }
+    if (parts->has_dot) {
+        if (cs == 2) {
+            buf[pos * 2] = 0;
+            buf[pos * 2 + 1] = '.';
+        } else {
+            buf[pos] = '.';
+        }
+        pos++;
+    }
+    memcpy(buf + pos * cs, name + parts->ext_start * cs, parts->ext_len * cs);
+    pos += parts->ext_len;
+    memset(buf + pos * cs, 0, cs);
+}
+
+static
+int iso_mangle_single_dir(struct iso_mangle_job *job, void *dir)
+{
+    int ret, i, j, k, nchildren, digits, ok, limit, need_sort = 0, renamed;
+    size_t name_bytes, len;
+    void **children, **new_names = NULL;
+    unsigned char *name, *tmp = NULL;
+    IsoHTable *table = NULL, *counters = NULL;
+    struct iso_mangle_ops *ops;
+    struct iso_mangle_parts parts;
+    struct iso_mangle_counter *counter;
+
+    ops = job->ops;
+    children = ops->get_children(dir, &nchildren);
+    if (nchildren <= 0)
+        return ISO_SUCCESS; /* nothing to do */
+
+    /* Find out whether there are collisions at all */
+    for (i = 0; i + 1 < nchildren; i++)
+        if (!ops->cmp_node(children + i, children + i + 1))
+    break;
+    if (i + 1 >= nchildren)
+        return ISO_SUCCESS;
+
+    name_bytes = (ops->max_chars + 1) * ops->char_size;
+    LIBISO_ALLOC_MEM(tmp, unsigned char, name_bytes);
+    LIBISO_ALLOC_MEM(new_names, void *, nchildren);
+
+    /* a hash table will temporary hold the names, for fast searching */
+    if (ops->char_size == 2)
+        ret = iso_htable_create((nchildren * 100) / 80, iso_mangle_ucs_hash,
+                                (compare_function_t) ucscmp, &table);
+    else
+        ret = iso_htable_create((nchildren * 100) / 80, iso_str_hash,
+                                (compare_function_t) strcmp, &table);
+    if (ret < 0)
+        goto ex;
+    ret = iso_htable_create((nchildren * 100) / 80, iso_mangle_counter_hash,
+                            iso_mangle_counter_cmp, &counters);
+    if (ret < 0)
+        goto ex;
+    for (i = 0; i < nchildren; ++i) {
+        name = ops->get_name(children[i]);
+        ret = iso_htable_add(table, name, name);
+        if (ret < 0)
+            goto ex;
+    }
+
+    for (i = 0; i < nchildren; ++i) {
+        /* first, find all child with same name */
+        j = i;
+        while (j + 1 < nchildren &&
+               !ops->cmp_node(children + i, children + j + 1))
+            ++j;
+        if (j == i) {
+            /* name is unique */
+            continue;
+        }
+        if (ops->collision != NULL) {
+            ret = ops->collision(job->handle, children[i]);
+            if (ret < 0)
+                goto ex;
+        }
+
+        /*
+         * A max of 7 characters is good enough, it allows handling up to
+         * 9,999,999 files with same name.
+         */
+        name = ops->get_name(children[i]);
+        for (digits = 1; digits < 8; digits++) {
+            ret = ops->split(job->handle, children[i], digits, &parts);
+            if (ret < 0)
+                goto ex;
+            ret = iso_mangle_get_counter(counters, ops, name, digits, &parts,
+                                         &counter);
+            if (ret < 0)
+                goto ex;
+            limit = int_pow(10, digits);
+            ok = 1;
+            for (k = i; k <= j && ok; ++k) {
+                while (1) {
+                    if (counter->next >= limit) {
+                        ok = 0;
+                        break;
+                    }
+                    iso_mangle_compose(ops, name, &parts, digits,
+                                       counter->next, tmp);
+                    counter->next++;
+                    if (!iso_htable_get(table, tmp, NULL)) {
+                        /* the name is unique, so it can be used */
+                        break;
+                    }
+                }
+                if (!ok)
+                    break;
+                len = (iso_mangle_len(ops, tmp) + 1) * ops->char_size;
+                new_names[k - i] = malloc(len);
+                if (new_names[k - i] == NULL) {
+                    ok = 0;
+                    ret = ISO_OUT_OF_MEM;
+                    break;
+                }
+                memcpy(new_names[k - i], tmp, len);
+            }
+            if (ok)
+                break;
+
+            /* we need to increment digits */
+            for (k--; k >= i; k--)
+                free(new_names[k - i]);
+            if (ret == (int) ISO_OUT_OF_MEM)
+                goto ex;
+        }
+        if (digits == 8) {
+            ret = ISO_MANGLE_TOO_MUCH_FILES;
+            goto ex;
+        }
+
+        for (k = i; k <= j; ++k) {
+            name = ops->get_name(children[k]);
+            if ((ops->flag & 1) && ops->char_size == 1) {
+                pthread_mutex_lock(&job->mutex);
+                renamed = ++(job->renamed);
+                pthread_mutex_unlock(&job->mutex);
+                if (renamed <= ISO_COLLISION_MSG_MAX)
+                    iso_msg_debug(job->t->image->id,
+                                  "\"%s\" renamed to \"%s\"",
+                                  (char *) name, (char *) new_names[k - i]);
+            }
+            iso_htable_remove_ptr(table, name, NULL);
+            ops->set_name(children[k], new_names[k - i]);
+            iso_htable_add(table, new_names[k - i], new_names[k - i]);
+        }
+
+        /*
+         * if we change a name we need to sort again children
+         * at the end
+         */
+        need_sort = 1;
+        i = j;
+    }
+
+    /*
+     * If needed, sort again the files inside dir
+     */
+    if (need_sort)
+        qsort(children, nchildren, sizeof(void *), ops->cmp_node);
+
+    ret = ISO_SUCCESS;
+ex:;
+    iso_htable_destroy(table, NULL);
+    iso_htable_destroy(counters, iso_mangle_counter_free);
+    LIBISO_FREE_MEM(new_names);
+    LIBISO_FREE_MEM(tmp);
+    return ret;
+}
+
+static
+int iso_mangle_collect_dirs(struct iso_mangle_job *job, void *dir)
+{
+    int ret, i, nchildren;
+    void **children, **new_dirs;
+
+    if (job->num_dirs >= job->dirs_size) {
+        job->dirs_size = job->dirs_size * 2 + 64;
+        new_dirs = realloc(job->dirs, job->dirs_size * sizeof(void *));
+        if (new_dirs == NULL)
+            return ISO_OUT_OF_MEM;
+        job->dirs = new_dirs;
+    }
+    job->dirs[job->num_dirs++] = dir;
+    children = job->ops->get_children(dir, &nchildren);
+    for (i = 0; i < nchildren; i++) {
+        if (job->ops->is_dir(children[i])) {
+            ret = iso_mangle_collect_dirs(job, children[i]);
+            if (ret < 0)
+                return ret;
+        }
+    }
+    return ISO_SUCCESS;
+}
+
+static
+void *iso_mangle_worker(void *arg)
+{
+    int ret, idx;
+    struct iso_mangle_job *job = arg;
+
+    while (1) {
+        pthread_mutex_lock(&job->mutex);
+        idx = job->next_dir;
+        if (idx >= job->num_dirs || idx > job->err_dir) {
+            pthread_mutex_unlock(&job->mutex);
+    break;
+        }
+        job->next_dir++;
+        pthread_mutex_unlock(&job->mutex);
+
+        ret = iso_mangle_single_dir(job, job->dirs[idx]);
+        if (ret < 0) {
+            /* The directories before idx are all dispatched. So the error
+               of the lowest failing index is the same as with a single
+               thread.
+            */
+            pthread_mutex_lock(&job->mutex);
+            if (idx < job->err_dir) {
+                job->err_dir = idx;
+                job->err = ret;
+            }
+            pthread_mutex_unlock(&job->mutex);
+        }
+    }
+    return NULL;
+}
+
+int iso_mangle_tree(Ecma119Image *t, struct iso_mangle_ops *ops,
+                    void *handle, void *dir, int recurse)
+{
+    int ret, i, num_threads = 0, threads;
+    pthread_t *thread_ids = NULL;
+    struct iso_mangle_job job;
+
+    memset(&job, 0, sizeof(job));
+    job.t = t;
+    job.ops = ops;
+    job.handle = handle;
+    job.err_dir = 0x7fffffff;
+    job.err = ISO_SUCCESS;
+    pthread_mutex_init(&job.mutex, NULL);
+
+    if (!recurse) {
+        ret = iso_mangle_single_dir(&job, dir);
+        goto ex;
+    }
+    ret = iso_mangle_collect_dirs(&job, dir);
+    if (ret < 0)
+        goto ex;
+
+    threads = t->opts->tree_threads;
+    if (threads > job.num_dirs)
+        threads = job.num_dirs;
+    if (threads > 1) {
+        LIBISO_ALLOC_MEM(thread_ids, pthread_t, threads - 1);
+        for (i = 0; i < threads - 1; i++) {
+            /* If thread creation fails, then fewer threads do the work */
+            if (pthread_create(&(thread_ids[i]), NULL, iso_mangle_worker,
+                               &job) != 0)
+        break;
+            num_threads++;
+        }
+    }
+    /* The calling thread works too */
+    iso_mangle_worker(&job);
+    for (i = 0; i < num_threads; i++)
+        pthread_join(thread_ids[i], NULL);
+    ret = job.err;
+ex:;
+    if (job.renamed > ISO_COLLISION_MSG_MAX)
+        iso_msg_debug(t->image->id, "Sum of renamed files: %d", job.renamed);
+    LIBISO_FREE_MEM(thread_ids);
+    if (job.dirs != NULL)
+        free(job.dirs);
+    pthread_mutex_destroy(&job.mutex);
+    return ret;
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2007 Vreixo Formoso
+ * Copyright (c) 2009 - 2026 Thomas Schmitt
+ *
+ * This file is part of the libisofs project; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * or later as published by the Free Software Foundation.
+ * See COPYING file for details.
+ */
+
+/* Name mangling which is shared by the ECMA-119, Joliet, and ISO 9660:1999
+   trees. It makes the names in each directory unique by appending decimal
+   numbers to colliding names.
+*/
+
+#ifndef LIBISO_MANGLE_H_
+#define LIBISO_MANGLE_H_
+
+#include "ecma119.h"
+
+
+/**
+ * The parts of a name from which the mangled names get composed:
+ *   name[0 .. stem_len) + number with the given digits +
+ *   (has_dot ? "." : "") + name[ext_start .. ext_start + ext_len)
+ * Offsets and lengths count characters, not bytes.
+ */
+struct iso_mangle_parts {
+    int stem_len;
+    int has_dot;
+    int ext_start;
+    int ext_len;
+};
+
+/**
+ * Description of a tree type for iso_mangle_tree().
+ */
+struct iso_mangle_ops {
+
+    /* Bytes per name character: 1 = char, 2 = big endian UCS-2 in uint16_t
+     */
+    int char_size;
+
+    /* Maximum number of characters of a mangled name */
+    int max_chars;
+
+    /* bit0= submit a debug message for each renamed node */
+    int flag;
+
+    int (*is_dir)(void *node);
+
+    /* Returns the children array of a directory node */
+    void **(*get_children)(void *dir, int *nchildren);
+
+    void *(*get_name)(void *node);
+
+    /* Replaces the name of node by the given one, which was allocated by
+       malloc(), and frees the old name.
+    */
+    void (*set_name)(void *node, void *name);
+
+    /* Comparison function for qsort() of the children array */
+    int (*cmp_node)(const void *a, const void *b);
+
+    /* Determines the parts of the name of node when digits characters shall
+       be used for the number.
+       @return 1 = success, < 0 = error
+    */
+    int (*split)(void *handle, void *node, int digits,
+                 struct iso_mangle_parts *parts);
+
+    /* Optional. Gets called with the first node of a group of colliding
+       names before mangling begins. A return value < 0 aborts mangling.
+    */
+    int (*collision)(void *handle, void *node);
+};
+
+
+/**
+ * Ensure that the names of the children of each directory are unique.
+ * The children arrays have to be sorted by ops->cmp_node. They get sorted
+ * again if names were changed.
+ * If t->opts->tree_threads is larger than 1, then the directories of the
+ * tree get mangled in parallel. The result does not depend on the number
+ * of threads.
+ *
+ * @param t
+ *      The image being written. Used for messages and options.
+ * @param ops
+ *      Description of the tree type.
+ * @param handle
+ *      Submitted to ops->split() and ops->collision() as is.
+ * @param dir
+ *      The directory where to start.
+ * @param recurse
+ *      1 = mangle all directories in the tree of dir, 0 = only dir itself
+ * @return
+ *      ISO_SUCCESS or < 0 error
+ */
+int iso_mangle_tree(Ecma119Image *t, struct iso_mangle_ops *ops,
+                    void *handle, void *dir, int recurse);
+
+#endif /* LIBISO_MANGLE_H_ */
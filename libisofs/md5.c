@@ -23,12 +23,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
 
 #include "writer.h"
 #include "messages.h"
 #include "ecma119.h"
 #include "image.h"
+#include "node.h"
+#include "tree.h"
+#include "stream.h"
 #include "util.h"
+#include "read_pool.h"
 
 #include "md5.h"
 
@@ -878,3 +883,909 @@ ex:;
 }
 
 
+
+
+/* ----------------------------------------------------------------------- */
+
+/* Verification of the recorded MD5 of imported files and session */
+
+
+struct iso_vfy_file {
+    IsoFile *file;
+
+    /* The recorded MD5 */
+    char md5[16];
+
+    /* 1 = content gets read from the blocks of the imported ISO image */
+    int direct;
+
+    void *ctx;
+
+    /* Number of bytes not yet computed */
+    off_t pending;
+
+    /* 1 = match , 0 = mismatch , < 0 = error */
+    int result;
+};
+
+struct iso_vfy {
+    IsoImage *image;
+    int (*result)(IsoImage *image, IsoFile *file, int match, void *handle);
+    void *handle;
+
+    struct iso_vfy_file *files;
+    int num_files;
+    int files_size;
+
+    /* Reads the content and lets the files be computed by its threads.
+       Extents with owner -1 are session payload, -2 is the session tag.
+    */
+    struct iso_rpool *pool;
+
+    /* Session check */
+    int session;
+    uint32_t start_lba;
+    uint32_t end_lba;
+    uint32_t tag_lba;
+    void *session_ctx;
+    int session_result;
+    int session_done;
+
+    /* The mutex protects the pending and result members of the files,
+       and the list of finished files.
+    */
+    pthread_mutex_t mutex;
+
+    /* Indice of files which are finished but not reported yet */
+    int *done;
+    int num_done;
+
+    int failures;
+    int aborted;
+};
+
+
+/* To be called with the mutex locked */
+static
+void iso_vfy_file_done(struct iso_vfy *v, int idx)
+{
+    char md5[16];
+    struct iso_vfy_file *f;
+
+    f = v->files + idx;
+    if (f->ctx != NULL)
+        iso_md5_end(&f->ctx, md5);
+    if (f->result > 0)
+        f->result = iso_md5_match(md5, f->md5);
+    v->done[v->num_done++] = idx;
+}
+
+
+/* Pass a result to the application. To be called by the calling thread of
+   iso_image_verify_files().
+*/
+static
+void iso_vfy_report(struct iso_vfy *v, IsoFile *file, int result)
+{
+    int ret;
+
+    if (result != 1)
+        v->failures++;
+    if (v->result == NULL)
+        return;
+    ret = v->result(v->image, file, result, v->handle);
+    if (ret < 0)
+        v->aborted = 1;
+}
+
+
+static
+void iso_vfy_report_done(struct iso_vfy *v)
+{
+    int i, num_done, *done = NULL;
+
+    /* Take over the list so that the callback runs without the mutex */
+    pthread_mutex_lock(&v->mutex);
+    num_done = v->num_done;
+    if (num_done > 0) {
+        done = calloc(num_done, sizeof(int));
+        if (done != NULL) {
+            memcpy(done, v->done, num_done * sizeof(int));
+            v->num_done = 0;
+        }
+    }
+    pthread_mutex_unlock(&v->mutex);
+    if (done == NULL)
+        return;
+    for (i = 0; i < num_done && !v->aborted; i++)
+        iso_vfy_report(v, v->files[done[i]].file, v->files[done[i]].result);
+    free(done);
+}
+
+
+static
+int iso_vfy_add_file(struct iso_vfy *v, IsoFile *file, char md5[16])
+{
+    int ret, i, section_count = 0;
+    uint32_t nblocks, next_block = 0;
+    off_t offset = 0;
+    struct iso_file_section *sections = NULL;
+    struct iso_vfy_file *f;
+
+    ret = iso_rpool_grow_list((void **) &v->files, v->num_files,
+                              &v->files_size, sizeof(struct iso_vfy_file));
+    if (ret < 0)
+        return ret;
+    f = v->files + v->num_files;
+    f->file = file;
+    memcpy(f->md5, md5, 16);
+    f->direct = 0;
+    f->ctx = NULL;
+    f->pending = 0;
+    f->result = 1;
+    v->num_files++;
+
+    if (v->image->import_src == NULL || !file->from_old_session)
+        return ISO_SUCCESS;
+    ret = iso_file_get_old_image_sections(file, &section_count, &sections,
+                                          0);
+    if (ret != 1)
+        return ISO_SUCCESS;
+
+    /* The content has to be in ascending block order */
+    for (i = 0; i < section_count; i++) {
+        if (i > 0 && sections[i].block < next_block)
+            {ret = ISO_SUCCESS; goto ex;}
+        next_block = sections[i].block + DIV_UP(sections[i].size, 2048);
+        f->pending += sections[i].size;
+    }
+    ret = iso_md5_start(&f->ctx);
+    if (ret < 0)
+        goto ex;
+    f->direct = 1;
+    for (i = 0; i < section_count; i++) {
+        nblocks = DIV_UP(sections[i].size, 2048);
+        ret = iso_rpool_add_extent(v->pool, sections[i].block, nblocks,
+                                   sections[i].size, offset,
+                                   v->num_files - 1);
+        if (ret < 0)
+            goto ex;
+        offset += sections[i].size;
+    }
+    ret = ISO_SUCCESS;
+ex:;
+    if (sections != NULL)
+        free(sections);
+    return ret;
+}
+
+
+static
+int iso_vfy_collect(struct iso_vfy *v, IsoNode *node)
+{
+    int ret;
+    char md5[16];
+    IsoNode *pos;
+
+    if (node->type == LIBISO_FILE) {
+        ret = iso_file_get_md5(v->image, (IsoFile *) node, md5, 0);
+        if (ret <= 0)
+            return ISO_SUCCESS;
+        return iso_vfy_add_file(v, (IsoFile *) node, md5);
+    }
+    if (node->type != LIBISO_DIR)
+        return ISO_SUCCESS;
+    ret = iso_tree_cow_load((IsoDir *) node, 0);
+    if (ret < 0)
+        return ret;
+    for (pos = iso_tree_cow_child((IsoDir *) node, NULL); pos != NULL;
+         pos = iso_tree_cow_child((IsoDir *) node, pos)) {
+        ret = iso_vfy_collect(v, pos);
+        if (ret < 0)
+            return ret;
+    }
+    return ISO_SUCCESS;
+}
+
+
+/* Compute session payload or evaluate the session tag.
+   Runs in the calling thread, in ascending block order.
+*/
+static
+void iso_vfy_session_piece(struct iso_vfy *v, struct iso_rpool_extent *e,
+                           uint8_t *data, int err)
+{
+    int ret, tag_type;
+    uint32_t next_tag;
+    char md5[16];
+    void *cloned_ctx = NULL;
+
+    if (v->session_done)
+        return;
+    if (err != 0) {
+        v->session_result = err;
+        v->session_done = 1;
+        return;
+    }
+    if (e->lba == v->end_lba) {
+        /* Array element 0 covers the blocks before the checksum array */
+        ret = iso_md5_clone(v->session_ctx, &cloned_ctx);
+        if (ret < 0) {
+            v->session_result = ret;
+            v->session_done = 1;
+            return;
+        }
+        iso_md5_end(&cloned_ctx, md5);
+        if (!iso_md5_match(md5, v->image->checksum_array)) {
+            v->session_result = 0;
+            v->session_done = 1;
+            return;
+        }
+    }
+    if (e->owner == -2) {
+        /* If there is no tag then the match of array element 0 counts */
+        ret = iso_util_eval_md5_tag((char *) data, 1 << 1, e->lba,
+                                    v->session_ctx, v->start_lba,
+                                    &tag_type, &next_tag, 0);
+        if (ret < 0)
+            v->session_result = 0;
+        v->session_done = 1;
+        return;
+    }
+    iso_md5_compute(v->session_ctx, (char *) data, e->nblocks * 2048);
+}
+
+
+/* Compute a piece of a file or of the session. Called by the threads of
+   v->pool, one at a time per file, and by the reading thread for the
+   session.
+*/
+static
+void iso_vfy_piece(void *handle, struct iso_rpool_extent *e, uint8_t *data)
+{
+    struct iso_vfy *v = handle;
+    struct iso_vfy_file *f;
+
+    if (e->owner < 0) {
+        iso_vfy_session_piece(v, e, data, e->err);
+        return;
+    }
+    f = v->files + e->owner;
+    if (e->err != 0) {
+        if (f->result > 0)
+            f->result = e->err;
+    } else if (f->result > 0) {
+        iso_md5_compute(f->ctx, (char *) data, (int) e->size);
+    }
+    pthread_mutex_lock(&v->mutex);
+    f->pending -= e->size;
+    if (f->pending <= 0)
+        iso_vfy_file_done(v, e->owner);
+    pthread_mutex_unlock(&v->mutex);
+}
+
+
+/* Called by v->pool before each read operation and after the last one */
+static
+int iso_vfy_progress(void *handle)
+{
+    struct iso_vfy *v = handle;
+
+    if (v->session_done == 1) {
+        iso_vfy_report(v, NULL, v->session_result);
+        v->session_done = 2;
+    }
+    iso_vfy_report_done(v);
+    if (v->aborted)
+        return ISO_CANCELED;
+    return ISO_SUCCESS;
+}
+
+
+/* API */
+int iso_image_verify_files(IsoImage *image, int threads,
+                           int (*result)(IsoImage *image, IsoFile *file,
+                                         int match, void *handle),
+                           void *handle, int flag)
+{
+    int ret, i, src_is_open = 0, dig;
+    uint32_t array_blocks;
+    char md5[16];
+    IsoDataSource *src;
+    IsoStream *stream;
+    struct iso_vfy vd, *v = &vd;
+
+    if (image == NULL)
+        return ISO_NULL_POINTER;
+    if (threads < 0)
+        return ISO_WRONG_ARG_VALUE;
+    if (threads > ISO_RPOOL_MAX_THREADS)
+        threads = ISO_RPOOL_MAX_THREADS;
+
+    memset(v, 0, sizeof(struct iso_vfy));
+    v->image = image;
+    v->result = result;
+    v->handle = handle;
+    v->session_result = 1;
+    pthread_mutex_init(&v->mutex, NULL);
+    src = image->import_src;
+    ret = iso_rpool_new(&v->pool, iso_vfy_piece, iso_vfy_progress, v, 1);
+    if (ret < 0)
+        goto ex;
+
+    ret = iso_vfy_collect(v, (IsoNode *) image->root);
+    if (ret < 0)
+        goto ex;
+    if (v->num_files > 0)
+        LIBISO_ALLOC_MEM(v->done, int, v->num_files);
+
+    if (src != NULL && !(flag & 1) && image->checksum_array != NULL &&
+        image->checksum_idx_count >= 1 &&
+        image->checksum_start_lba < image->checksum_end_lba) {
+        /* The session range, the checksum array, and the session tag */
+        array_blocks = DIV_UP(image->checksum_idx_count, 128);
+        v->start_lba = image->checksum_start_lba;
+        v->end_lba = image->checksum_end_lba;
+        v->tag_lba = v->end_lba + array_blocks;
+        ret = iso_md5_start(&v->session_ctx);
+        if (ret < 0)
+            goto ex;
+        v->session = 1;
+        ret = iso_rpool_add_extent(v->pool, v->start_lba,
+                                   v->end_lba - v->start_lba,
+                                   (v->end_lba - v->start_lba) * 2048,
+                                   (off_t) 0, -1);
+        if (ret < 0)
+            goto ex;
+        ret = iso_rpool_add_extent(v->pool, v->end_lba, array_blocks,
+                                   array_blocks * 2048, (off_t) 0, -1);
+        if (ret < 0)
+            goto ex;
+        ret = iso_rpool_add_extent(v->pool, v->tag_lba, 1, 2048, (off_t) 0,
+                                   -2);
+        if (ret < 0)
+            goto ex;
+    }
+
+    if (v->pool->num_extents > 0) {
+        /* Opened only now because the tree walk might have loaded
+           directories via the IsoFilesystem which opens src too.
+        */
+        ret = src->open(src);
+        if (ret >= 0) {
+            src_is_open = 1;
+        } else if (ret != (int) ISO_FILE_ALREADY_OPENED) {
+            /* Read the files via their IsoStream. No session check. */
+            for (i = 0; i < v->num_files; i++)
+                v->files[i].direct = 0;
+            v->pool->num_extents = 0;
+            v->session = 0;
+        }
+    }
+
+    /* Files with empty content */
+    pthread_mutex_lock(&v->mutex);
+    for (i = 0; i < v->num_files; i++)
+        if (v->files[i].direct && v->files[i].pending == 0)
+            iso_vfy_file_done(v, i);
+    pthread_mutex_unlock(&v->mutex);
+    iso_vfy_report_done(v);
+
+    /* The extents of the session payload do not overlap each other.
+       So they get processed in ascending order, regardless of ties with
+       the extents of files.
+    */
+    ret = iso_rpool_run(v->pool, src, threads);
+    if (ret < 0)
+        goto ex;
+    iso_vfy_report_done(v);
+    if (src_is_open)
+        src->close(src);
+    src_is_open = 0;
+    if (v->session && v->session_done < 2 && !v->aborted) {
+        /* The session range was not completely read */
+        iso_vfy_report(v, NULL, v->session_result > 0 ?
+                                (int) ISO_DATA_SOURCE_SORRY :
+                                v->session_result);
+    }
+
+    /* Files which are not read directly from the imported image */
+    for (i = 0; i < v->num_files && !v->aborted; i++) {
+        if (v->files[i].direct)
+    continue;
+        stream = v->files[i].file->stream;
+        dig = v->files[i].file->from_old_session;
+        ret = iso_stream_make_md5(stream, md5, dig);
+        if (ret < 0)
+            goto ex;
+        if (ret == 0)
+            iso_vfy_report(v, v->files[i].file, ISO_FILE_READ_ERROR);
+        else
+            iso_vfy_report(v, v->files[i].file, iso_md5_match(md5,
+                                                          v->files[i].md5));
+    }
+    ret = ISO_SUCCESS;
+ex:;
+    if (src_is_open)
+        src->close(src);
+    for (i = 0; i < v->num_files; i++)
+        if (v->files[i].ctx != NULL)
+            iso_md5_end(&(v->files[i].ctx), md5);
+    if (v->session_ctx != NULL)
+        iso_md5_end(&v->session_ctx, md5);
+    LIBISO_FREE_MEM(v->files);
+    iso_rpool_destroy(&v->pool);
+    LIBISO_FREE_MEM(v->done);
+    pthread_mutex_destroy(&v->mutex);
+    if (ret < 0)
+        return ret;
+    if (v->aborted)
+        return ISO_CANCELED;
+    return v->failures == 0;
+}
+
+
+/* ----------------------------------------------------------------------- */
+
+/* Verification of the checksum tags of a session from blocks which get
+   read for other purposes anyway
+*/
+
+/* Number of blocks read at once when filling gaps or finishing */
+#define ISO_VERIFIER_READ_BLOCKS 32
+
+#define ISO_VERIFIER_WAIT    0
+#define ISO_VERIFIER_SB      1
+#define ISO_VERIFIER_TREE    2
+#define ISO_VERIFIER_SESSION 3
+#define ISO_VERIFIER_DONE    4
+
+struct iso_image_verifier {
+    int refcount;
+
+    IsoDataSource *src;
+    int flag;
+
+    int (*report)(IsoImageVerifier *verifier, int tag_type,
+                  uint32_t range_start, uint32_t range_size, int result,
+                  void *handle);
+    void *handle;
+
+    /* Protects all following members */
+    pthread_mutex_t mutex;
+
+    int state;
+
+    /* The next block to be processed */
+    uint32_t next_lba;
+
+    /* Start of the range which is covered by ctx */
+    uint32_t session_start;
+
+    /* Address of the next expected tag with states TREE and SESSION */
+    uint32_t tag_lba;
+
+    void *ctx;
+
+    /* Number of session tags which were evaluated and which matched */
+    int sessions_seen;
+    int session_tags;
+    int problems;
+
+    /* 1 = report() returned < 0 */
+    int aborted;
+
+    uint8_t *read_buf;
+};
+
+
+static
+int iso_verifier_report(IsoImageVerifier *v, int tag_type, uint32_t lba,
+                        int result)
+{
+    int ret;
+
+    if (result <= 0)
+        v->problems++;
+    if (v->report == NULL)
+        return 1;
+    ret = v->report(v, tag_type, v->session_start, lba - v->session_start,
+                    result, v->handle);
+    if (ret < 0) {
+        v->aborted = 1;
+        v->state = ISO_VERIFIER_DONE;
+    }
+    return ret;
+}
+
+static
+int iso_verifier_restart(IsoImageVerifier *v, uint32_t session_start)
+{
+    int ret;
+    char md5[16];
+
+    if (v->ctx != NULL)
+        iso_md5_end(&v->ctx, md5);
+    ret = iso_md5_start(&v->ctx);
+    if (ret < 0) {
+        v->state = ISO_VERIFIER_DONE;
+        return ret;
+    }
+    v->session_start = session_start;
+    v->state = ISO_VERIFIER_WAIT;
+    return 1;
+}
+
+/* Process the block at v->next_lba */
+static
+int iso_verifier_process(IsoImageVerifier *v, uint8_t *block)
+{
+    int ret, tag_type = 0, desired, result;
+    uint32_t lba, rel, next_tag = 0;
+
+    lba = v->next_lba;
+    v->next_lba++;
+    if (v->state == ISO_VERIFIER_WAIT) {
+        if (lba != v->session_start)
+            return 1;
+        v->state = ISO_VERIFIER_SB;
+    }
+    rel = lba - v->session_start;
+
+    if (v->state == ISO_VERIFIER_SB && rel >= 16) {
+        desired = (1 << 2);
+        if (v->session_start == 0)
+            desired |= (1 << 4);
+        ret = iso_util_eval_md5_tag((char *) block, desired, lba, v->ctx,
+                                    v->session_start, &tag_type, &next_tag, 0);
+        if (ret == (int) ISO_MD5_TAG_COPIED) {
+            /* Growing without emulated TOC. The session starts at 32. */
+            return iso_verifier_restart(v, 32);
+        } else if (ret == 1 || ret == (int) ISO_MD5_TAG_MISMATCH) {
+            result = (ret == 1);
+            if (tag_type == 4) {
+                /* Relocated superblock: go on at the real session start */
+                ret = iso_verifier_report(v, tag_type, lba, result);
+                if (ret < 0)
+                    return ret;
+                if (next_tag < 32) {
+                    iso_msg_submit(-1, ISO_SB_TREE_CORRUPTED, 0, NULL);
+                    iso_verifier_report(v, tag_type, lba,
+                                        ISO_SB_TREE_CORRUPTED);
+                    v->state = ISO_VERIFIER_DONE;
+                    return 0;
+                }
+                return iso_verifier_restart(v, next_tag);
+            }
+            ret = iso_verifier_report(v, tag_type, lba, result);
+            if (ret < 0)
+                return ret;
+            v->tag_lba = next_tag;
+            v->state = ISO_VERIFIER_TREE;
+        } else if (ret < 0) {
+            iso_verifier_report(v, tag_type, lba, ret);
+            v->state = ISO_VERIFIER_DONE;
+            return 0;
+        } else if (rel >= 31) {
+            /* No superblock tag. Possibly the end of the sessions. */
+            v->state = ISO_VERIFIER_DONE;
+            return 0;
+        }
+
+    } else if ((v->state == ISO_VERIFIER_TREE ||
+                v->state == ISO_VERIFIER_SESSION) && lba == v->tag_lba) {
+        desired = v->state == ISO_VERIFIER_TREE ? (1 << 3) : (1 << 1);
+        ret = iso_util_eval_md5_tag((char *) block, desired, lba, v->ctx,
+                                    v->session_start, &tag_type, &next_tag, 0);
+        if (ret == 0) {
+            tag_type = v->state == ISO_VERIFIER_TREE ? 3 : 1;
+            iso_msg_submit(-1, ISO_MD5_TAG_MISSING, 0, NULL);
+            iso_verifier_report(v, tag_type, lba, ISO_MD5_TAG_MISSING);
+            v->state = ISO_VERIFIER_DONE;
+            return 0;
+        } else if (ret < 0 && ret != (int) ISO_MD5_TAG_MISMATCH) {
+            iso_verifier_report(v, tag_type, lba, ret);
+            v->state = ISO_VERIFIER_DONE;
+            return 0;
+        }
+        result = (ret == 1);
+        if (v->state == ISO_VERIFIER_SESSION) {
+            v->sessions_seen++;
+            if (result)
+                v->session_tags++;
+        }
+        ret = iso_verifier_report(v, tag_type, lba, result);
+        if (ret < 0)
+            return ret;
+        if (v->state == ISO_VERIFIER_TREE) {
+            v->tag_lba = next_tag;
+            v->state = ISO_VERIFIER_SESSION;
+        } else {
+            /* Look for a superblock tag of a subsequent session */
+            return iso_verifier_restart(v, ROUND_UP(lba + 1, 32));
+        }
+    }
+    if (v->state != ISO_VERIFIER_DONE)
+        iso_md5_compute(v->ctx, (char *) block, 2048);
+    return 1;
+}
+
+/* To be called with the mutex locked.
+   Read and process the blocks from v->next_lba up to end_lba or until the
+   verification is done.
+*/
+static
+int iso_verifier_read_up_to(IsoImageVerifier *v, uint32_t end_lba)
+{
+    int ret;
+    uint32_t i, n;
+
+    if (v->read_buf == NULL) {
+        v->read_buf = calloc(ISO_VERIFIER_READ_BLOCKS, 2048);
+        if (v->read_buf == NULL)
+            return ISO_OUT_OF_MEM;
+    }
+    while (v->next_lba < end_lba && v->state != ISO_VERIFIER_DONE) {
+        if (v->state == ISO_VERIFIER_WAIT &&
+            v->next_lba < v->session_start) {
+            v->next_lba = v->session_start;
+    continue;
+        }
+        n = end_lba - v->next_lba;
+        if (n > ISO_VERIFIER_READ_BLOCKS)
+            n = ISO_VERIFIER_READ_BLOCKS;
+        ret = iso_data_source_read_blocks(v->src, v->next_lba, n,
+                                          v->read_buf);
+        if (ret < 0 && n > 1) {
+            /* Maybe the end of the data source. Go on block by block. */
+            n = 1;
+            ret = iso_data_source_read_blocks(v->src, v->next_lba, n,
+                                              v->read_buf);
+        }
+        if (ret < 0)
+            return ret;
+        for (i = 0; i < n && v->state != ISO_VERIFIER_DONE; i++) {
+            ret = iso_verifier_process(v, v->read_buf + i * 2048);
+            if (ret < 0)
+                return ret;
+        }
+    }
+    return 1;
+}
+
+
+/* API */
+int iso_image_verifier_new(IsoDataSource *src, uint32_t start_lba,
+                           IsoImageVerifier **verifier, int flag)
+{
+    int ret;
+    IsoImageVerifier *v = NULL;
+
+    if (verifier == NULL)
+        return ISO_NULL_POINTER;
+    v = calloc(1, sizeof(IsoImageVerifier));
+    if (v == NULL)
+        return ISO_OUT_OF_MEM;
+    v->refcount = 1;
+    v->flag = flag;
+    if (pthread_mutex_init(&v->mutex, NULL) != 0) {
+        free(v);
+        return ISO_OUT_OF_MEM;
+    }
+    v->next_lba = start_lba;
+    ret = iso_verifier_restart(v, start_lba);
+    if (ret < 0) {
+        pthread_mutex_destroy(&v->mutex);
+        free(v);
+        return ret;
+    }
+    if (src != NULL)
+        iso_data_source_ref(src);
+    v->src = src;
+    *verifier = v;
+    return ISO_SUCCESS;
+}
+
+
+/* API */
+void iso_image_verifier_ref(IsoImageVerifier *verifier)
+{
+    verifier->refcount++;
+}
+
+
+/* API */
+void iso_image_verifier_unref(IsoImageVerifier *verifier)
+{
+    char md5[16];
+
+    if (--verifier->refcount > 0)
+        return;
+    if (verifier->ctx != NULL)
+        iso_md5_end(&verifier->ctx, md5);
+    if (verifier->src != NULL)
+        iso_data_source_unref(verifier->src);
+    if (verifier->read_buf != NULL)
+        free(verifier->read_buf);
+    pthread_mutex_destroy(&verifier->mutex);
+    free(verifier);
+}
+
+
+/* API */
+int iso_image_verifier_set_report(IsoImageVerifier *verifier,
+                                  int (*report)(IsoImageVerifier *verifier,
+                                                int tag_type,
+                                                uint32_t range_start,
+                                                uint32_t range_size,
+                                                int result, void *handle),
+                                  void *handle)
+{
+    if (verifier == NULL)
+        return ISO_NULL_POINTER;
+    pthread_mutex_lock(&verifier->mutex);
+    verifier->report = report;
+    verifier->handle = handle;
+    pthread_mutex_unlock(&verifier->mutex);
+    return ISO_SUCCESS;
+}
+
+
+/* API */
+int iso_image_verifier_feed(IsoImageVerifier *verifier, uint32_t lba,
+                            uint32_t count, uint8_t *buffer, int flag)
+{
+    int ret = 1;
+    uint32_t i;
+    IsoImageVerifier *v = verifier;
+
+    if (v == NULL || (buffer == NULL && count > 0))
+        return ISO_NULL_POINTER;
+    pthread_mutex_lock(&v->mutex);
+    if (v->state == ISO_VERIFIER_WAIT && v->next_lba < v->session_start)
+        v->next_lba = v->session_start;
+    if (v->state == ISO_VERIFIER_DONE) {
+        ret = 2; goto ex;
+    }
+    if (lba + count <= v->next_lba) {
+        ret = 0; goto ex;
+    }
+    if (lba > v->next_lba) {
+        if (!(v->flag & 1) || v->src == NULL) {
+            ret = 0; goto ex;
+        }
+        ret = iso_verifier_read_up_to(v, lba);
+        if (ret < 0) {
+            /* The gap stays unverified. Maybe it gets fed later. */
+            ret = 0; goto ex;
+        }
+        if (v->state == ISO_VERIFIER_DONE) {
+            ret = 2; goto ex;
+        }
+    }
+    for (i = v->next_lba - lba; i < count; i++) {
+        ret = iso_verifier_process(v, buffer + ((size_t) i) * 2048);
+        if (ret < 0)
+            goto ex;
+        if (v->state == ISO_VERIFIER_DONE)
+    break;
+    }
+    ret = (v->state == ISO_VERIFIER_DONE) ? 2 : 1;
+ex:;
+    pthread_mutex_unlock(&v->mutex);
+    return ret;
+}
+
+
+/* API */
+int iso_image_verifier_finish(IsoImageVerifier *verifier, int flag)
+{
+    int ret = 1, src_is_open = 0;
+    IsoImageVerifier *v = verifier;
+
+    if (v == NULL)
+        return ISO_NULL_POINTER;
+    pthread_mutex_lock(&v->mutex);
+    if ((flag & 1) && v->state != ISO_VERIFIER_DONE && v->src != NULL) {
+        ret = v->src->open(v->src);
+        if (ret >= 0)
+            src_is_open = 1;
+        else if (ret != (int) ISO_FILE_ALREADY_OPENED)
+            goto ex;
+        ret = iso_verifier_read_up_to(v, 0xffffffff);
+        if (ret < 0 && v->sessions_seen > 0 &&
+            (v->state == ISO_VERIFIER_WAIT || v->state == ISO_VERIFIER_SB)) {
+            /* No subsequent session after the end of the last one */
+            v->state = ISO_VERIFIER_DONE;
+            ret = 1;
+        }
+        if (ret < 0)
+            goto ex;
+    }
+    if (v->aborted)
+        ret = ISO_CANCELED;
+    else if (v->problems > 0)
+        ret = 0;
+    else if (v->session_tags > 0 && (v->state == ISO_VERIFIER_DONE ||
+                                      v->state == ISO_VERIFIER_WAIT ||
+                                      v->state == ISO_VERIFIER_SB))
+        ret = 1;
+    else
+        ret = 2;
+ex:;
+    if (src_is_open)
+        v->src->close(v->src);
+    pthread_mutex_unlock(&v->mutex);
+    return ret;
+}
+
+
+static
+int vds_open(IsoDataSource *src)
+{
+    IsoImageVerifier *v = (IsoImageVerifier *) src->data;
+
+    return v->src->open(v->src);
+}
+
+static
+int vds_close(IsoDataSource *src)
+{
+    IsoImageVerifier *v = (IsoImageVerifier *) src->data;
+
+    return v->src->close(v->src);
+}
+
+static
+int vds_read_blocks(IsoDataSource *src, uint32_t lba, uint32_t count,
+                    uint8_t *buffer)
+{
+    int ret;
+    IsoImageVerifier *v = (IsoImageVerifier *) src->data;
+
+    ret = iso_data_source_read_blocks(v->src, lba, count, buffer);
+    if (ret < 0)
+        return ret;
+    /* Verification problems do not affect reading */
+    iso_image_verifier_feed(v, lba, count, buffer, 0);
+    return ret;
+}
+
+static
+int vds_read_block(IsoDataSource *src, uint32_t lba, uint8_t *buffer)
+{
+    return vds_read_blocks(src, lba, 1, buffer);
+}
+
+static
+void vds_free_data(IsoDataSource *src)
+{
+    iso_image_verifier_unref((IsoImageVerifier *) src->data);
+}
+
+
+/* API */
+int iso_image_verifier_get_data_source(IsoImageVerifier *verifier,
+                                       IsoDataSource **src)
+{
+    IsoDataSource *ds;
+
+    if (verifier == NULL || src == NULL)
+        return ISO_NULL_POINTER;
+    if (verifier->src == NULL)
+        return ISO_WRONG_ARG_VALUE;
+    ds = calloc(1, sizeof(IsoDataSource));
+    if (ds == NULL)
+        return ISO_OUT_OF_MEM;
+    ds->version = 1;
+    ds->refcount = 1;
+    ds->data = verifier;
+    ds->open = vds_open;
+    ds->close = vds_close;
+    ds->read_block = vds_read_block;
+    ds->free_data = vds_free_data;
+    ds->read_blocks = vds_read_blocks;
+    iso_image_verifier_ref(verifier);
+    *src = ds;
+    return ISO_SUCCESS;
+}
@@ -81,6 +81,25 @@ int abort_threshold = LIBISO_MSGS_SEV_FAILURE;
 
 struct libiso_msgs *libiso_msgr = NULL;
 
+/* The lowest severity which gets queued or printed by libiso_msgr.
+   Messages of lower severity get discarded by libiso_msgs_submit(). So they
+   need not be formatted and submitted at all.
+   The threshold is read from libiso_msgr itself, because the severities may
+   also be set by other users of the messenger, e.g. libburn after
+   iso_get_messenger() and burn_set_messenger().
+*/
+static int iso_msgs_min_severity(void)
+{
+    int ret, sevno;
+
+    if (libiso_msgr == NULL)
+        return LIBISO_MSGS_SEV_NEVER;
+    ret = libiso_msgs_get_min_severity(libiso_msgr, &sevno, 0);
+    if (ret <= 0)
+        return LIBISO_MSGS_SEV_ALL;
+    return sevno;
+}
+
 
 /* ------------- List of xinfo clone functions ----------- */
 
@@ -234,6 +253,7 @@ void iso_finish()
     libiso_msgs_destroy(&libiso_msgr, 0);
     iso_node_xinfo_dispose_cloners(0);
     iso_stream_destroy_cmpranks(0);
+    iso_iconv_cache_destroy(0);
 }
 
 int iso_set_abort_severity(char *severity)
@@ -255,6 +275,8 @@ void iso_msg_debug(int imgid, const char *fmt, ...)
     char *msg = NULL;
     va_list ap;
 
+    if (LIBISO_MSGS_SEV_DEBUG < iso_msgs_min_severity())
+        return;
     LIBISO_ALLOC_MEM_VOID(msg, char, MAX_MSG_LEN);
     va_start(ap, fmt);
     vsnprintf(msg, MAX_MSG_LEN, fmt, ap);
@@ -563,6 +585,16 @@ const char *iso_error_to_msg(int errcode)
         return "Prevented zisofs block pointer counter underrun";
     case ISO_ZISOFS_UNKNOWN_SIZE:
         return "Cannot obtain size of zisofs compressed stream";
+    case ISO_LAZY_DIR_LOST:
+        return "Lazily imported directory cannot be loaded any more";
+    case ISO_IMPORT_INDEX_IGNORED:
+        return "Image index file ignored";
+    case ISO_INDEX_NO_IMPORT:
+        return "No imported ISO filesystem available for index";
+    case ISO_EXTRACT_FILE_FAIL:
+        return "Cannot extract file to local filesystem";
+    case ISO_MD5_TAG_MISSING:
+        return "Expected MD5 checksum tag not found";
     default:
         return "Unknown error";
     }
@@ -586,22 +618,26 @@ int iso_msg_submit(int imgid, int errcode, int causedby, const char *fmt, ...)
         return ISO_CANCELED;
     }
 
-    if (fmt) {
-        va_start(ap, fmt);
-        vsnprintf(msg, MAX_MSG_LEN, fmt, ap);
-        va_end(ap);
-    } else {
-        strncpy(msg, iso_error_to_msg(errcode), MAX_MSG_LEN - 1);
-        msg[MAX_MSG_LEN - 1] = 0;
+    /* Messages which would be discarded do not get formatted */
+    if ((int) ISO_ERR_SEV(errcode) >= iso_msgs_min_severity()) {
+        if (fmt) {
+            va_start(ap, fmt);
+            vsnprintf(msg, MAX_MSG_LEN, fmt, ap);
+            va_end(ap);
+        } else {
+            strncpy(msg, iso_error_to_msg(errcode), MAX_MSG_LEN - 1);
+            msg[MAX_MSG_LEN - 1] = 0;
+        }
+        libiso_msgs_submit(libiso_msgr, imgid, ISO_ERR_CODE(errcode),
+                        ISO_ERR_SEV(errcode), ISO_ERR_PRIO(errcode), msg, 0, 0);
     }
-
-    libiso_msgs_submit(libiso_msgr, imgid, ISO_ERR_CODE(errcode),
-                       ISO_ERR_SEV(errcode), ISO_ERR_PRIO(errcode), msg, 0, 0);
     if (causedby != 0) {
-        snprintf(msg, MAX_MSG_LEN, " > Caused by: %s",
-                 iso_error_to_msg(causedby));
-        libiso_msgs_submit(libiso_msgr, imgid, ISO_ERR_CODE(causedby),
-                 LIBISO_MSGS_SEV_NOTE, LIBISO_MSGS_PRIO_LOW, msg, 0, 0);
+        if (LIBISO_MSGS_SEV_NOTE >= iso_msgs_min_severity()) {
+            snprintf(msg, MAX_MSG_LEN, " > Caused by: %s",
+                     iso_error_to_msg(causedby));
+            libiso_msgs_submit(libiso_msgr, imgid, ISO_ERR_CODE(causedby),
+                     LIBISO_MSGS_SEV_NOTE, LIBISO_MSGS_PRIO_LOW, msg, 0, 0);
+        }
         if (ISO_ERR_SEV(causedby) == LIBISO_MSGS_SEV_FATAL) {
             return ISO_CANCELED;
         }
@@ -20,6 +20,7 @@
 #include "messages.h"
 #include "util.h"
 #include "eltorito.h"
+#include "tree.h"
 
 
 #include <stdlib.h>
@@ -62,6 +63,8 @@ void iso_node_unref(IsoNode *node)
         case LIBISO_DIR:
             {
                 IsoNode *child = ((IsoDir*)node)->children;
+                iso_tree_cow_release((IsoDir *) node);
+                iso_tree_lazy_release((IsoDir *) node);
                 while (child != NULL) {
                     IsoNode *tmp = child->next;
                     child->parent = NULL;
@@ -149,6 +152,7 @@ int iso_node_add_xinfo(IsoNode *node, iso_node_xinfo_func proc, void *data)
         }
         pos = pos->next;
     }
+    iso_tree_cow_detach(node);
 
     info = malloc(sizeof(IsoExtendedInfo));
     if (info == NULL) {
@@ -182,6 +186,7 @@ int iso_node_remove_xinfo(IsoNode *node, iso_node_xinfo_func proc)
     while (pos != NULL) {
         if (pos->process == proc) {
             /* this is the extended info we want to remove */
+            iso_tree_cow_detach(node);
             pos->process(pos->data, 1);
 
             if (prev != NULL) {
@@ -259,6 +264,8 @@ int iso_node_remove_all_xinfo(IsoNode *node, int flag)
 {
     IsoExtendedInfo *pos, *next;
 
+    if (node->xinfo != NULL)
+        iso_tree_cow_detach(node);
     for (pos = node->xinfo; pos != NULL; pos = next) {
         next = pos->next;
         pos->process(pos->data, 1);
@@ -361,7 +368,10 @@ int iso_node_set_name_trunc(IsoNode *node, const char *in_name,
 
     if (node->parent != NULL) {
         /* check if parent already has a node with same name */
-        if (iso_dir_get_node(node->parent, name, NULL) == 1) {
+        ret = iso_dir_get_node(node->parent, name, NULL);
+        if (ret < 0)
+            goto ex;
+        if (ret == 1) {
             ret = ISO_NODE_NAME_NOT_UNIQUE;
             goto ex;
         }
@@ -372,6 +382,7 @@ int iso_node_set_name_trunc(IsoNode *node, const char *in_name,
         ret = ISO_OUT_OF_MEM;
         goto ex;
     }
+    iso_tree_cow_detach(node);
     free(node->name);
     node->name = new;
     if (node->parent != NULL) {
@@ -431,6 +442,7 @@ int iso_node_set_perms_internal(IsoNode *node, mode_t mode, int flag)
 {
     int ret;
 
+    iso_tree_cow_detach(node);
     node->mode = (node->mode & S_IFMT) | (mode & ~S_IFMT);
 
     /* If the node has ACL info : update ACL */
@@ -479,6 +491,7 @@ mode_t iso_node_get_mode(const IsoNode *node)
  */
 void iso_node_set_uid(IsoNode *node, uid_t uid)
 {
+    iso_tree_cow_detach(node);
     node->uid = uid;
 }
 
@@ -496,6 +509,7 @@ uid_t iso_node_get_uid(const IsoNode *node)
  */
 void iso_node_set_gid(IsoNode *node, gid_t gid)
 {
+    iso_tree_cow_detach(node);
     node->gid = gid;
 }
 
@@ -512,6 +526,7 @@ gid_t iso_node_get_gid(const IsoNode *node)
  */
 void iso_node_set_mtime(IsoNode *node, time_t time)
 {
+    iso_tree_cow_detach(node);
     node->mtime = time;
 }
 
@@ -528,6 +543,7 @@ time_t iso_node_get_mtime(const IsoNode *node)
  */
 void iso_node_set_atime(IsoNode *node, time_t time)
 {
+    iso_tree_cow_detach(node);
     node->atime = time;
 }
 
@@ -544,6 +560,7 @@ time_t iso_node_get_atime(const IsoNode *node)
  */
 void iso_node_set_ctime(IsoNode *node, time_t time)
 {
+    iso_tree_cow_detach(node);
     node->ctime = time;
 }
 
@@ -559,6 +576,7 @@ void iso_node_set_hidden(IsoNode *node, int hide_attrs)
 {
     /* you can't hide root node */
     if ((IsoNode*)node->parent != node) {
+        iso_tree_cow_detach(node);
         node->hidden = hide_attrs;
     }
 }
@@ -591,6 +609,7 @@ int iso_node_get_hidden(IsoNode *node)
 int iso_dir_add_node(IsoDir *dir, IsoNode *child,
                      enum iso_replace_mode replace)
 {
+    int ret;
     IsoNode **pos;
 
     if (dir == NULL || child == NULL) {
@@ -608,7 +627,9 @@ int iso_dir_add_node(IsoDir *dir, IsoNode *child,
         return ISO_NODE_ALREADY_ADDED;
     }
 
-    iso_dir_find(dir, child->name, &pos);
+    ret = iso_dir_find(dir, child->name, &pos);
+    if (ret < 0)
+        return ret;
     return iso_dir_insert(dir, child, pos, replace);
 }
 
@@ -638,6 +659,8 @@ int iso_dir_get_node(IsoDir *dir, const char *name, IsoNode **node)
     }
 
     ret = iso_dir_exists(dir, name, &pos);
+    if (ret < 0)
+        return ret;
     if (ret == 0) {
         if (node) {
             *node = NULL;
@@ -698,10 +721,15 @@ int iso_image_dir_get_node(IsoImage *image, IsoDir *dir,
  */
 int iso_dir_get_children_count(IsoDir *dir)
 {
+    int ret;
+
     if (dir == NULL) {
         return ISO_NULL_POINTER;
     }
-    return dir->nchildren;
+    ret = iso_tree_cow_load(dir, 0);
+    if (ret < 0)
+        return ret;
+    return (int) iso_tree_cow_count(dir);
 }
 
 static
@@ -822,6 +850,7 @@ int iso_node_take(IsoNode *node)
 
     /* >>> Do not take root directory ! (dir == node) ? */;
 
+    iso_tree_cow_detach(node);
     pos = iso_dir_find_node(dir, node);
     if (pos == NULL) {
         /* should never occur */
@@ -1000,12 +1029,16 @@ struct iso_dir_iter_iface iter_class = {
 
 int iso_dir_get_children(const IsoDir *dir, IsoDirIter **iter)
 {
+    int ret;
     IsoDirIter *it;
     struct dir_iter_data *data;
 
     if (dir == NULL || iter == NULL) {
         return ISO_NULL_POINTER;
     }
+    ret = iso_tree_cow_materialize((IsoDir *) dir, 0);
+    if (ret < 0)
+        return ret;
     it = malloc(sizeof(IsoDirIter));
     if (it == NULL) {
         return ISO_OUT_OF_MEM;
@@ -1099,6 +1132,7 @@ int iso_symlink_set_dest(IsoSymlink *link, const char *dest)
     if (d == NULL) {
         return ISO_OUT_OF_MEM;
     }
+    iso_tree_cow_detach((IsoNode *) link);
     free(link->dest);
     link->dest = d;
     return ISO_SUCCESS;
@@ -1118,8 +1152,12 @@ int iso_symlink_set_dest(IsoSymlink *link, const char *dest)
  */
 void iso_node_set_sort_weight(IsoNode *node, int w)
 {
+    iso_tree_cow_detach(node);
     if (node->type == LIBISO_DIR) {
-        IsoNode *child = ((IsoDir*)node)->children;
+        IsoNode *child;
+
+        iso_tree_cow_materialize((IsoDir *) node, 0);
+        child = ((IsoDir*)node)->children;
         while (child) {
             iso_node_set_sort_weight(child, w);
             child = child->next;
@@ -1327,19 +1365,28 @@ int iso_node_is_valid_link_dest(const char *dest)
     return ret;
 }
 
-void iso_dir_find(IsoDir *dir, const char *name, IsoNode ***pos)
+int iso_dir_find(IsoDir *dir, const char *name, IsoNode ***pos)
 {
+    int ret;
+
+    ret = iso_tree_cow_materialize(dir, 0);
+    if (ret < 0)
+        return ret;
     *pos = &(dir->children);
     while (**pos != NULL && strcmp((**pos)->name, name) < 0) {
         *pos = &((**pos)->next);
     }
+    return ISO_SUCCESS;
 }
 
 int iso_dir_exists(IsoDir *dir, const char *name, IsoNode ***pos)
 {
+    int ret;
     IsoNode **node;
 
-    iso_dir_find(dir, name, &node);
+    ret = iso_dir_find(dir, name, &node);
+    if (ret < 0)
+        return ret;
     if (pos) {
         *pos = node;
     }
@@ -1349,6 +1396,7 @@ int iso_dir_exists(IsoDir *dir, const char *name, IsoNode ***pos)
 int iso_dir_insert(IsoDir *dir, IsoNode *node, IsoNode **pos,
                    enum iso_replace_mode replace)
 {
+    iso_tree_cow_detach((IsoNode *) dir);
     if (*pos != NULL && !strcmp((*pos)->name, node->name)) {
         /* a node with same name already exists */
         switch(replace) {
@@ -2518,6 +2566,9 @@ int iso_node_zf_by_magic(IsoNode *node, int flag)
         return 0;
 
     dir = (IsoDir *) node;
+    ret = iso_tree_cow_materialize(dir, 0);
+    if (ret < 0)
+        return ret;
     pos = dir->children;
     while (pos) {
         ret = 1;
@@ -2696,6 +2747,7 @@ int iso_node_set_ino(IsoNode *node, ino_t ino, int flag)
     } else if (node->type == LIBISO_SYMLINK) {
         symlink = (IsoSymlink *) node;
         if (symlink->fs_id == ISO_IMAGE_FS_ID) {
+            iso_tree_cow_detach(node);
             symlink->st_ino = ino;
             return 1;
         }
@@ -2703,6 +2755,7 @@ int iso_node_set_ino(IsoNode *node, ino_t ino, int flag)
     } else if (node->type == LIBISO_SPECIAL) {
         special = (IsoSpecial *) node;
         if (special->fs_id == ISO_IMAGE_FS_ID) {
+            iso_tree_cow_detach(node);
             special->st_ino = ino;
             return 1;
         }
@@ -2725,6 +2778,31 @@ int iso_node_set_unique_id(IsoNode *node, IsoImage *image, int flag)
     return ret;
 }
 
+static
+void iso_node_cmp_fill_id(IsoNode *node, struct iso_node_cmp_cache *c)
+{
+    unsigned int fs_id;
+    dev_t dev_id;
+
+    if (c->valid & 1)
+        return;
+    c->img_id = (iso_node_get_id(node, &fs_id, &dev_id, &(c->img_ino), 1) > 0);
+    c->valid |= 1;
+}
+
+static
+void iso_node_cmp_fill_aa(IsoNode *node, struct iso_node_cmp_cache *c)
+{
+    if (c->valid & 2)
+        return;
+    c->aa_ret = iso_node_get_xinfo(node, aaip_xinfo_func, &(c->aa_string));
+    if (c->aa_ret == 1)
+        c->aa_len = aaip_count_bytes((unsigned char *) c->aa_string, 0);
+    else
+        c->aa_len = 0;
+    c->valid |= 2;
+}
+
 /*
  * Note to programmers: It is crucial not to break the following constraints.
  * Anti-symmetry: cmp(X,Y) == - cmp(Y,X)
@@ -2740,7 +2818,8 @@ int iso_node_set_unique_id(IsoNode *node, IsoImage *image, int flag)
  *     bit0= compare stat properties and attributes 
  *     bit1= treat all nodes with image ino == 0 as unique
  */
-int iso_node_cmp_flag(IsoNode *n1, IsoNode *n2, int flag)
+int iso_node_cmp_cached(IsoNode *n1, struct iso_node_cmp_cache *c1,
+                        IsoNode *n2, struct iso_node_cmp_cache *c2, int flag)
 {
     int ret1, ret2;
     unsigned int fs_id1, fs_id2;
@@ -2749,7 +2828,6 @@ int iso_node_cmp_flag(IsoNode *n1, IsoNode *n2, int flag)
     IsoFile *f1 = NULL, *f2 = NULL;
     IsoSymlink *l1 = NULL, *l2 = NULL;
     IsoSpecial *s1 = NULL, *s2 = NULL;
-    void *x1, *x2;
 
     if (n1 == n2)
         return 0;
@@ -2757,14 +2835,18 @@ int iso_node_cmp_flag(IsoNode *n1, IsoNode *n2, int flag)
         return (n1->type < n2->type ? -1 : 1);
 
     /* Imported or explicit ISO image node id has priority */
-    ret1 = (iso_node_get_id(n1, &fs_id1, &dev_id1, &ino_id1, 1) > 0);
-    ret2 = (iso_node_get_id(n2, &fs_id2, &dev_id2, &ino_id2, 1) > 0);
+    iso_node_cmp_fill_id(n1, c1);
+    iso_node_cmp_fill_id(n2, c2);
+    ret1 = c1->img_id;
+    ret2 = c2->img_id;
     if (ret1 != ret2)
         return (ret1 < ret2 ? -1 : 1);
     if (ret1) {
         /* fs_id and dev_id do not matter here.
            Both nodes have explicit inode numbers of the emerging image.
          */
+        ino_id1 = c1->img_ino;
+        ino_id2 = c2->img_ino;
         if (ino_id1 != ino_id2)
             return (ino_id1 < ino_id2 ? -1 : 1);
         if (ino_id1 == 0) /* Image ino 0 is always unique */
@@ -2858,16 +2940,14 @@ image_inode_match:;
     /* :( cannot compare general xinfo because data length is not known :( */
 
     /* compare aa_string */
-    ret1 = iso_node_get_xinfo(n1, aaip_xinfo_func, &x1);
-    ret2 = iso_node_get_xinfo(n2, aaip_xinfo_func, &x2);
-    if (ret1 != ret2)
-        return (ret1 < ret2 ? -1 : 1);
-    if (ret1 == 1) {
-        ret1 = aaip_count_bytes((unsigned char *) x1, 0);
-        ret2 = aaip_count_bytes((unsigned char *) x2, 0);
-        if (ret1 != ret2)
-            return (ret1 < ret2 ? -1 : 1);
-        ret1 = memcmp(x1, x2, ret1);
+    iso_node_cmp_fill_aa(n1, c1);
+    iso_node_cmp_fill_aa(n2, c2);
+    if (c1->aa_ret != c2->aa_ret)
+        return (c1->aa_ret < c2->aa_ret ? -1 : 1);
+    if (c1->aa_ret == 1) {
+        if (c1->aa_len != c2->aa_len)
+            return (c1->aa_len < c2->aa_len ? -1 : 1);
+        ret1 = memcmp(c1->aa_string, c2->aa_string, c1->aa_len);
         if (ret1)
             return ret1;
     }
@@ -2875,6 +2955,16 @@ image_inode_match:;
     return 0;
 }
 
+int iso_node_cmp_flag(IsoNode *n1, IsoNode *n2, int flag)
+{
+    struct iso_node_cmp_cache c1, c2;
+
+    if (n1 == n2)
+        return 0;
+    c1.valid = c2.valid = 0;
+    return iso_node_cmp_cached(n1, &c1, n2, &c2, flag);
+}
+
 /* API */
 int iso_node_cmp_ino(IsoNode *n1, IsoNode *n2, int flag)
 {
@@ -142,6 +142,27 @@ struct Iso_Dir
 
     size_t nchildren; /**< The number of children of this directory. */
     IsoNode *children; /**< list of children. ptr to first child */
+
+    /* Copy-on-write cloning as of iso_tree_clone() flag bit2.
+       If not NULL, the children of cow_origin shall be cloned into this
+       directory on first access. A reference to cow_origin is held.
+       cow_dependents is the list of pending clones which have this directory
+       as cow_origin. They are chained by cow_next.
+     */
+    IsoDir *cow_origin;
+    IsoDir *cow_dependents;
+    IsoDir *cow_next;
+
+    /* Lazy import as of iso_read_opts_set_lazy_tree().
+       If not NULL, the children shall be read from lazy_src on first access.
+       This happens together with copy-on-write materialization.
+       A reference to lazy_src and to lazy_import is held.
+       lazy_error is < 0 if loading failed. The children are then missing or
+       incomplete, and every further access returns this error.
+     */
+    IsoFileSource *lazy_src;
+    struct iso_lazy_import *lazy_import;
+    int lazy_error;
 };
 
 /* IMPORTANT: Any change must be reflected by iso_tree_clone_file. */
@@ -337,8 +358,11 @@ int iso_node_is_valid_link_dest(const char *dest);
  *      The node name to search for. It can't be NULL
  * @param pos
  *      Will be filled with the position where to insert. It can't be NULL
+ * @return
+ *      1 on success, < 0 if a pending copy-on-write clone cannot get its
+ *      children
  */
-void iso_dir_find(IsoDir *dir, const char *name, IsoNode ***pos);
+int iso_dir_find(IsoDir *dir, const char *name, IsoNode ***pos);
 
 /**
  * Check if a node with the given name exists in a dir.
@@ -351,7 +375,7 @@ void iso_dir_find(IsoDir *dir, const char *name, IsoNode ***pos);
  *      If not NULL, will be filled with the position where to insert. If the
  *      node exists, (**pos) will refer to the given node.
  * @return
- *      1 if node exists, 0 if not
+ *      1 if node exists, 0 if not, < 0 on error
  */
 int iso_dir_exists(IsoDir *dir, const char *name, IsoNode ***pos);
 
@@ -486,6 +510,28 @@ int iso_node_set_ino(IsoNode *node, ino_t ino, int flag);
  */
 int iso_node_cmp_flag(IsoNode *n1, IsoNode *n2, int flag);
 
+/* Per-node results of the lookups which iso_node_cmp_flag() would do on
+ * each comparison. Set .valid to 0 before first use. The cache gets filled
+ * on demand by iso_node_cmp_cached(). It stays valid as long as the node
+ * does not change its inode number or its AAIP string.
+ */
+struct iso_node_cmp_cache {
+    int valid;         /* bit0= img_id, img_ino are set
+                          bit1= aa_ret, aa_string, aa_len are set */
+    int img_id;        /* 1 = node has an inode number of the image */
+    ino_t img_ino;
+    int aa_ret;        /* result of iso_node_get_xinfo(aaip_xinfo_func) */
+    void *aa_string;
+    size_t aa_len;
+};
+
+/* Like iso_node_cmp_flag() but with caches for both nodes.
+ * The caches are supposed to be kept between several comparisons,
+ * e.g. while sorting an array of nodes.
+ */
+int iso_node_cmp_cached(IsoNode *n1, struct iso_node_cmp_cache *c1,
+                        IsoNode *n2, struct iso_node_cmp_cache *c2, int flag);
+
 
 /**
  * Set the checksum index (typically coming from IsoFileSrc.checksum_index)
@@ -0,0 +1,392 @@
+/*
+ * Copyright (c) 2026 Thomas Schmitt
+ *
+ * This file is part of the libisofs project; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * or later as published by the Free Software Foundation.
+ * See COPYING file for details.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "../config.h"
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#else
+#ifdef HAVE_INTTYPES_H
+#include <inttypes.h>
+#endif
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "libisofs.h"
+#include "libiso_msgs.h"
+#include "messages.h"
+#include "util.h"
+#include "ecma119.h"
+#include "read_pool.h"
+
+
+/* The result of a single read operation */
+struct iso_rpool_chunk {
+    uint32_t lba;
+    uint8_t *buf;
+    int refs;
+};
+
+/* An extent waiting for a thread */
+struct iso_rpool_item {
+    struct iso_rpool_chunk *chunk;
+    struct iso_rpool_extent *extent;
+    struct iso_rpool_item *next;
+};
+
+
+int iso_rpool_grow_list(void **list, int num, int *size, size_t item_size)
+{
+    void *new_list;
+    int new_size;
+
+    if (num < *size)
+        return ISO_SUCCESS;
+    new_size = 2 * *size + 64;
+    new_list = realloc(*list, new_size * item_size);
+    if (new_list == NULL)
+        return ISO_OUT_OF_MEM;
+    *list = new_list;
+    *size = new_size;
+    return ISO_SUCCESS;
+}
+
+
+int iso_rpool_new(struct iso_rpool **pool,
+                  void (*piece)(void *handle, struct iso_rpool_extent *e,
+                                uint8_t *data),
+                  int (*progress)(void *handle), void *handle, int flag)
+{
+    struct iso_rpool *p;
+
+    p = calloc(1, sizeof(struct iso_rpool));
+    if (p == NULL)
+        return ISO_OUT_OF_MEM;
+    p->piece = piece;
+    p->progress = progress;
+    p->handle = handle;
+    p->flag = flag;
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->room, NULL);
+    *pool = p;
+    return ISO_SUCCESS;
+}
+
+
+int iso_rpool_add_extent(struct iso_rpool *pool, uint32_t lba,
+                         uint32_t nblocks, uint32_t size, off_t offset,
+                         int owner)
+{
+    int ret;
+    uint32_t n, part;
+    struct iso_rpool_extent *e;
+
+    while (nblocks > 0) {
+        n = ISO_RPOOL_CHUNK_BLOCKS - lba % ISO_RPOOL_CHUNK_BLOCKS;
+        if (n > nblocks)
+            n = nblocks;
+        part = size < n * BLOCK_SIZE ? size : n * BLOCK_SIZE;
+        ret = iso_rpool_grow_list((void **) &pool->extents, pool->num_extents,
+                                  &pool->extents_size,
+                                  sizeof(struct iso_rpool_extent));
+        if (ret < 0)
+            return ret;
+        e = pool->extents + pool->num_extents;
+        e->lba = lba;
+        e->nblocks = n;
+        e->size = part;
+        e->offset = offset;
+        e->owner = owner;
+        e->err = 0;
+        pool->num_extents++;
+        lba += n;
+        nblocks -= n;
+        size -= part;
+        offset += part;
+    }
+    return ISO_SUCCESS;
+}
+
+
+/* To be called with the mutex locked */
+static
+void iso_rpool_chunk_unref(struct iso_rpool *pool, struct iso_rpool_chunk *c)
+{
+    c->refs--;
+    if (c->refs > 0)
+        return;
+    LIBISO_FREE_MEM(c->buf);
+    free((char *) c);
+    pool->chunks--;
+    pthread_cond_signal(&pool->room);
+}
+
+
+/* Process an item. To be called with the mutex locked and the busy mark of
+   the owner set. The mutex gets unlocked during processing.
+*/
+static
+void iso_rpool_process_item(struct iso_rpool *pool,
+                            struct iso_rpool_item *item)
+{
+    struct iso_rpool_chunk *c;
+    struct iso_rpool_extent *e;
+
+    c = item->chunk;
+    e = item->extent;
+    pthread_mutex_unlock(&pool->mutex);
+    pool->piece(pool->handle, e, e->err != 0 ? NULL :
+                c->buf + ((size_t) (e->lba - c->lba)) * BLOCK_SIZE);
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->flag & 1)
+        pool->busy[e->owner] = 0;
+    iso_rpool_chunk_unref(pool, c);
+    free((char *) item);
+    pthread_cond_broadcast(&pool->work);
+}
+
+
+static
+void *iso_rpool_worker(void *arg)
+{
+    struct iso_rpool *pool = arg;
+    struct iso_rpool_item *item, *prev;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+        /* With flag bit0, the first item of an owner which is not busy is
+           the next piece of that owner in the order of block addresses.
+        */
+        prev = NULL;
+        for (item = pool->queue_head; item != NULL; item = item->next) {
+            if (!(pool->flag & 1) || !pool->busy[item->extent->owner])
+        break;
+            prev = item;
+        }
+        if (item != NULL) {
+            if (prev == NULL)
+                pool->queue_head = item->next;
+            else
+                prev->next = item->next;
+            if (pool->queue_tail == item)
+                pool->queue_tail = prev;
+            if (pool->flag & 1)
+                pool->busy[item->extent->owner] = 1;
+            iso_rpool_process_item(pool, item);
+    continue;
+        }
+        if (pool->shutdown && pool->queue_head == NULL)
+    break;
+        pthread_cond_wait(&pool->work, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+
+static
+int iso_rpool_cmp_extents(const void *a, const void *b)
+{
+    const struct iso_rpool_extent *e1 = a, *e2 = b;
+
+    if (e1->lba < e2->lba)
+        return -1;
+    if (e1->lba > e2->lba)
+        return 1;
+    return 0;
+}
+
+
+/* Read the extents in ascending block order and dispatch them */
+static
+int iso_rpool_read(struct iso_rpool *pool, IsoDataSource *src)
+{
+    int ret, i, j, k, read_ret, retry;
+    uint32_t c_lba, c_end, e_end;
+    struct iso_rpool_chunk *c = NULL;
+    struct iso_rpool_item *item;
+    struct iso_rpool_extent *e;
+
+    for (i = 0; i < pool->num_extents; i = j) {
+        if (pool->progress != NULL) {
+            ret = pool->progress(pool->handle);
+            if (ret < 0)
+                goto ex;
+        }
+
+        /* Coalesce the extents of the same window which are near enough */
+        c_lba = pool->extents[i].lba;
+        c_end = c_lba + pool->extents[i].nblocks;
+        for (j = i + 1; j < pool->num_extents; j++) {
+            e = pool->extents + j;
+            if (e->lba / ISO_RPOOL_CHUNK_BLOCKS !=
+                c_lba / ISO_RPOOL_CHUNK_BLOCKS ||
+                e->lba > c_end + ISO_RPOOL_GAP_BLOCKS)
+        break;
+            e_end = e->lba + e->nblocks;
+            if (e_end > c_end)
+                c_end = e_end;
+        }
+
+        /* Limit the memory consumption */
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->num_threads > 0 &&
+               pool->chunks >= 2 * pool->num_threads + 1)
+            pthread_cond_wait(&pool->room, &pool->mutex);
+        pool->chunks++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        LIBISO_ALLOC_MEM(c, struct iso_rpool_chunk, 1);
+        c->lba = c_lba;
+        c->buf = NULL;
+        c->refs = 1;
+        LIBISO_ALLOC_MEM(c->buf, uint8_t, (c_end - c_lba) * BLOCK_SIZE);
+        read_ret = iso_data_source_read_blocks(src, c_lba, c_end - c_lba,
+                                               c->buf);
+        if (read_ret > 0)
+            read_ret = 0;
+        /* After a failed read, find out which extents are affected */
+        retry = (read_ret < 0 && j - i > 1 &&
+                 iso_error_get_severity(read_ret) <= LIBISO_MSGS_SEV_FAILURE);
+
+        for (k = i; k < j; k++) {
+            e = pool->extents + k;
+            e->err = read_ret;
+            if (retry) {
+                e->err = iso_data_source_read_blocks(src, e->lba, e->nblocks,
+                                   c->buf + (e->lba - c_lba) * BLOCK_SIZE);
+                if (e->err > 0)
+                    e->err = 0;
+            }
+        }
+
+        for (k = i; k < j; k++) {
+            e = pool->extents + k;
+            if (e->owner < 0) {
+                pool->piece(pool->handle, e, e->err != 0 ? NULL :
+                            c->buf + (e->lba - c_lba) * BLOCK_SIZE);
+        continue;
+            }
+            item = calloc(1, sizeof(struct iso_rpool_item));
+            if (item == NULL) {
+                /* Queued items of this chunk still refer to it */
+                read_ret = ISO_OUT_OF_MEM;
+        break;
+            }
+            item->chunk = c;
+            item->extent = e;
+            item->next = NULL;
+            pthread_mutex_lock(&pool->mutex);
+            c->refs++;
+            if (pool->num_threads > 0) {
+                if (pool->queue_tail == NULL)
+                    pool->queue_head = item;
+                else
+                    pool->queue_tail->next = item;
+                pool->queue_tail = item;
+                pthread_cond_signal(&pool->work);
+            } else {
+                iso_rpool_process_item(pool, item);
+            }
+            pthread_mutex_unlock(&pool->mutex);
+        }
+
+        /* Drop the reference of the reading thread */
+        pthread_mutex_lock(&pool->mutex);
+        iso_rpool_chunk_unref(pool, c);
+        pthread_mutex_unlock(&pool->mutex);
+        c = NULL;
+
+        if (read_ret < 0 &&
+            iso_error_get_severity(read_ret) > LIBISO_MSGS_SEV_FAILURE)
+            {ret = read_ret; goto ex;} /* e.g. ISO_OUT_OF_MEM */
+    }
+    ret = ISO_SUCCESS;
+    if (pool->progress != NULL)
+        ret = pool->progress(pool->handle);
+ex:;
+    if (c != NULL) {
+        LIBISO_FREE_MEM(c->buf);
+        free((char *) c);
+        pool->chunks--;
+    }
+    return ret;
+}
+
+
+int iso_rpool_run(struct iso_rpool *pool, IsoDataSource *src, int threads)
+{
+    int ret, i, num_owners = 0;
+
+    if (threads > ISO_RPOOL_MAX_THREADS)
+        threads = ISO_RPOOL_MAX_THREADS;
+    if (pool->num_extents > 0) {
+        qsort(pool->extents, pool->num_extents,
+              sizeof(struct iso_rpool_extent), iso_rpool_cmp_extents);
+        if (pool->flag & 1) {
+            for (i = 0; i < pool->num_extents; i++)
+                if (pool->extents[i].owner >= num_owners)
+                    num_owners = pool->extents[i].owner + 1;
+            LIBISO_FREE_MEM(pool->busy);
+            pool->busy = NULL;
+            if (num_owners > 0) {
+                pool->busy = calloc(num_owners, 1);
+                if (pool->busy == NULL)
+                    return ISO_OUT_OF_MEM;
+            }
+        }
+        if (threads > 0) {
+            LIBISO_FREE_MEM(pool->threads);
+            LIBISO_ALLOC_MEM(pool->threads, pthread_t, threads);
+            for (i = 0; i < threads; i++) {
+                /* If thread creation fails, then fewer threads do the work */
+                if (pthread_create(&(pool->threads[i]), NULL,
+                                   iso_rpool_worker, pool) != 0)
+            break;
+                pool->num_threads++;
+            }
+        }
+    }
+    ret = iso_rpool_read(pool, src);
+ex:;
+    if (pool->num_threads > 0) {
+        pthread_mutex_lock(&pool->mutex);
+        pool->shutdown = 1;
+        pthread_cond_broadcast(&pool->work);
+        pthread_mutex_unlock(&pool->mutex);
+        for (i = 0; i < pool->num_threads; i++)
+            pthread_join(pool->threads[i], NULL);
+        pool->num_threads = 0;
+        pool->shutdown = 0;
+    }
+    return ret;
+}
+
+
+void iso_rpool_destroy(struct iso_rpool **pool)
+{
+    struct iso_rpool *p = *pool;
+
+    if (p == NULL)
+        return;
+    LIBISO_FREE_MEM(p->extents);
+    LIBISO_FREE_MEM(p->threads);
+    LIBISO_FREE_MEM(p->busy);
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->work);
+    pthread_cond_destroy(&p->room);
+    free((char *) p);
+    *pool = NULL;
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2026 Thomas Schmitt
+ *
+ * This file is part of the libisofs project; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version 2
+ * or later as published by the Free Software Foundation.
+ * See COPYING file for details.
+ */
+
+#ifndef LIBISO_READ_POOL_H_
+#define LIBISO_READ_POOL_H_
+
+/* Reading of many block ranges of an IsoDataSource in ascending block order
+   by few large read operations, and processing of the content by a pool of
+   threads.
+   Used by iso_image_extract_tree() and iso_image_verify_files().
+*/
+
+#include "libisofs.h"
+
+#include <pthread.h>
+#include <sys/types.h>
+
+
+/* Maximum number of blocks to be read by a single read operation.
+   Reads do not cross block addresses which are multiples of this number.
+*/
+#define ISO_RPOOL_CHUNK_BLOCKS 512
+
+/* Gaps between extents up to this number of blocks get read rather than
+   starting a new read operation.
+*/
+#define ISO_RPOOL_GAP_BLOCKS 8
+
+/* Upper limit for the number of threads */
+#define ISO_RPOOL_MAX_THREADS 64
+
+
+/* A block range within an aligned window of ISO_RPOOL_CHUNK_BLOCKS */
+struct iso_rpool_extent {
+    uint32_t lba;
+    uint32_t nblocks;
+
+    /* Number of content bytes from the start of lba */
+    uint32_t size;
+
+    /* Byte position of the content in its owner */
+    off_t offset;
+
+    /* Index of the owner as chosen by the user of the pool.
+       Extents with owner < 0 get processed by the reading thread.
+    */
+    int owner;
+
+    /* 0 = content was read , < 0 = libisofs error of reading */
+    int err;
+};
+
+struct iso_rpool_chunk;
+struct iso_rpool_item;
+
+struct iso_rpool {
+
+    /* Processes the content of an extent. Gets called without the pool
+       mutex locked, by one of the threads, or by the reading thread if
+       there are no threads or if e->owner < 0.
+       data is NULL if e->err is not 0.
+    */
+    void (*piece)(void *handle, struct iso_rpool_extent *e, uint8_t *data);
+
+    /* Gets called by the reading thread before each read operation and
+       after the last one. A negative return value ends the reading.
+       May be NULL.
+    */
+    int (*progress)(void *handle);
+
+    void *handle;
+
+    /* bit0= process the extents of the same owner one at a time and
+             in the order of their block addresses
+    */
+    int flag;
+
+    struct iso_rpool_extent *extents;
+    int num_extents;
+    int extents_size;
+
+    /* The mutex protects the queue, the chunk references, the busy marks,
+       and the counters below.
+    */
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t room;
+    struct iso_rpool_item *queue_head;
+    struct iso_rpool_item *queue_tail;
+    int chunks;
+    pthread_t *threads;
+    int num_threads;
+    int shutdown;
+
+    /* Busy marks of the owners with flag bit0 */
+    char *busy;
+};
+
+
+/**
+ * Make room for at least one more item in a list which gets grown by
+ * realloc().
+ * @param list       Pointer to the list pointer. *list may be NULL.
+ * @param num        Number of items in use
+ * @param size       Number of allocated items. Gets updated.
+ * @param item_size  sizeof() of an item
+ */
+int iso_rpool_grow_list(void **list, int num, int *size, size_t item_size);
+
+/**
+ * Create a pool.
+ * @param flag  bit0= process the extents of the same owner one at a time
+ *                    and in the order of their block addresses
+ */
+int iso_rpool_new(struct iso_rpool **pool,
+                  void (*piece)(void *handle, struct iso_rpool_extent *e,
+                                uint8_t *data),
+                  int (*progress)(void *handle), void *handle, int flag);
+
+/**
+ * Register a block range for reading. It gets split at the boundaries of
+ * the ISO_RPOOL_CHUNK_BLOCKS windows.
+ * @param size    Number of content bytes in the range
+ * @param offset  Byte position of the content in its owner
+ * @param owner   Index of the owner. < 0 = to be processed by the
+ *                reading thread.
+ */
+int iso_rpool_add_extent(struct iso_rpool *pool, uint32_t lba,
+                         uint32_t nblocks, uint32_t size, off_t offset,
+                         int owner);
+
+/**
+ * Read all registered extents from src in ascending block order and let
+ * them be processed. src has to be opened.
+ * Extents of the same block address keep no particular order among each
+ * other.
+ * @param threads  Number of threads. 0 = process by the calling thread.
+ * @return  ISO_SUCCESS, or < 0 if reading failed with a severity above
+ *          FAILURE or if the progress function returned < 0.
+ *          The extents which were read before are processed completely
+ *          when this function returns.
+ */
+int iso_rpool_run(struct iso_rpool *pool, IsoDataSource *src, int threads);
+
+void iso_rpool_destroy(struct iso_rpool **pool);
+
+
+#endif /* ! LIBISO_READ_POOL_H_ */
@@ -23,6 +23,7 @@
 #include "messages.h"
 #include "image.h"
 #include "aaip_0_2.h"
+#include "dirwrite.h"
 #include "libisofs.h"
 
 
@@ -363,6 +364,8 @@ int rrip_add_CL(Ecma119Image *t, Ecma119Node *n, struct susp_info *susp)
  * Convert a RR filename to the requested charset. On any conversion error, 
  * the original name will be used.
  * @param flag   bit0= do not issue error messages
+ *               bit1= return the error code of the conversion rather than
+ *                     ISO_FILENAME_WRONG_CHARSET
  */
 int iso_get_rr_name(IsoWriteOpts *opts, char *input_charset,
                     char *output_charset, int imgid,
@@ -384,6 +387,8 @@ int iso_get_rr_name(IsoWriteOpts *opts, char *input_charset,
                    "Charset conversion error. Cannot convert %s from %s to %s",
                    str, input_charset, output_charset);
         *name = NULL;
+        if (flag & 2)
+            return ret;
         return ISO_FILENAME_WRONG_CHARSET;
     }
 
@@ -397,12 +402,86 @@ char *get_rr_fname(Ecma119Image *t, char *str)
     char *name = NULL;
 
     ret = iso_get_rr_name(t->opts, t->input_charset, t->output_charset,
-                          t->image->id, str, &name, 0);
+                          t->image->id, str, &name, 1 | 2);
+    if (ret < 0 && ret != (int) ISO_OUT_OF_MEM &&
+        ecma119_count_charset_failure(t))
+        iso_msg_submit(t->image->id, ISO_FILENAME_WRONG_CHARSET, ret,
+                   "Charset conversion error. Cannot convert %s from %s to %s",
+                   str, t->input_charset, t->output_charset);
     if (ret < 0)
         return NULL;
     return name;
 }
 
+/* Obtain the cache of node n if there is budget left.
+   @param add   Number of bytes which the caller wants to add to the cache
+   @return      NULL if caching is disabled or the budget is exhausted
+*/
+static
+struct rrip_node_cache *rrip_node_cache_get(Ecma119Image *t, Ecma119Node *n,
+                                            size_t add)
+{
+    size_t need;
+
+    if (t->opts->rr_cache_size == 0)
+        return NULL;
+    if (add == 0 && n->rr_cache != NULL)
+        return n->rr_cache;
+    if (t->dirs_concurrent) {
+        /* t->rr_cache_used is shared by the directory writing threads */
+        return NULL;
+    }
+    need = add;
+    if (n->rr_cache == NULL)
+        need += sizeof(struct rrip_node_cache);
+    if (t->rr_cache_used + need > t->opts->rr_cache_size)
+        return NULL;
+    if (n->rr_cache == NULL) {
+        n->rr_cache = calloc(1, sizeof(struct rrip_node_cache));
+        if (n->rr_cache == NULL)
+            return NULL;
+    }
+    t->rr_cache_used += need;
+    return n->rr_cache;
+}
+
+/* Like get_rr_fname() with the name or the symlink target of n, but
+   remembers the result in n->rr_cache if enabled.
+   @param flag  bit0= convert the target of the symlink n
+   @return      A copy of the converted name, to be disposed by free(),
+                or NULL
+*/
+static
+char *get_rr_node_fname(Ecma119Image *t, Ecma119Node *n, int flag)
+{
+    char *str, *name, **cached = NULL;
+    struct rrip_node_cache *cache;
+
+    cache = n->rr_cache;
+    if (cache != NULL) {
+        cached = (flag & 1) ? &(cache->dest) : &(cache->name);
+        if (*cached != NULL)
+            return strdup(*cached);
+    }
+    if (flag & 1)
+        str = ((IsoSymlink *) n->node)->dest;
+    else
+        str = n->node->name;
+    name = get_rr_fname(t, str);
+    if (name == NULL)
+        return NULL;
+    cache = rrip_node_cache_get(t, n, strlen(name) + 1);
+    if (cache == NULL)
+        return name;
+    cached = (flag & 1) ? &(cache->dest) : &(cache->name);
+    if (*cached != NULL)
+        return name;
+    *cached = strdup(name);
+    if (*cached == NULL)
+        t->rr_cache_used -= strlen(name) + 1;
+    return name;
+}
+
 /**
  * Add a NM System Use Entry to the given tree node. The purpose of this
  * System Use Entry is to store the content of an Alternate Name to support 
@@ -1202,7 +1281,7 @@ int susp_calc_nm_sl_al(Ecma119Image *t, Ecma119Node *n, size_t space,
     }
 
     namelen = 0;
-    name = get_rr_fname(t, n->node->name);
+    name = get_rr_node_fname(t, n, 0);
     if (name != NULL) {
         namelen = strlen(name);
         free(name);
@@ -1243,7 +1322,7 @@ int susp_calc_nm_sl_al(Ecma119Image *t, Ecma119Node *n, size_t space,
         size_t sl_len = 5;
         int cew = (*ce != 0); /* are we writing to CA ? */
 
-        dest = get_rr_fname(t, ((IsoSymlink*)n->node)->dest);
+        dest = get_rr_node_fname(t, n, 1);
         if (dest == NULL) {
             *ce += ce_prepad;
             return -2;
@@ -1421,6 +1500,65 @@ unannounced_ca:;
     return 0;
 }
 
+/**
+ * Predict the sizes of NM, SL, AL by up to three runs of susp_calc_nm_sl_al():
+ * without CA, with CA but without block crossing, with aligned CA.
+ * The outcome gets remembered in n->rr_cache if enabled, so that
+ * rrip_get_susp_fields() does not have to repeat the runs of
+ * rrip_calc_len().
+ *
+ * @param with_ce   Returns 1 if the first run failed and thus a CE entry
+ *                  is needed
+ * @return          See susp_calc_nm_sl_al()
+ */
+static
+int susp_predict_nm_sl_al(Ecma119Image *t, Ecma119Node *n, size_t space,
+                          size_t *su_size, size_t *ce, size_t base_ce,
+                          int *with_ce)
+{
+    int ret;
+    size_t su_in, ce_in;
+    struct rrip_node_cache *cache;
+
+    cache = n->rr_cache;
+    if (cache != NULL && cache->pd_valid && cache->pd_space == space &&
+        cache->pd_su_in == *su_size && cache->pd_ce_in == *ce &&
+        cache->pd_base_ce == base_ce) {
+        *su_size = cache->pd_su_out;
+        *ce = cache->pd_ce_out;
+        *with_ce = cache->pd_with_ce;
+        return cache->pd_ret;
+    }
+
+    su_in = *su_size;
+    ce_in = *ce;
+    *with_ce = 0;
+    ret = susp_calc_nm_sl_al(t, n, space, su_size, ce, base_ce, 0);
+    if (ret == 0) {
+        *with_ce = 1;
+        ret = susp_calc_nm_sl_al(t, n, space, su_size, ce, base_ce, 1);
+        if (ret == 0)
+            ret = susp_calc_nm_sl_al(t, n, space, su_size, ce, base_ce,
+                                     1 | 2);
+    }
+    if (ret == -2)
+        return ret;
+
+    cache = rrip_node_cache_get(t, n, 0);
+    if (cache != NULL) {
+        cache->pd_valid = 1;
+        cache->pd_space = space;
+        cache->pd_su_in = su_in;
+        cache->pd_ce_in = ce_in;
+        cache->pd_base_ce = base_ce;
+        cache->pd_ret = ret;
+        cache->pd_with_ce = *with_ce;
+        cache->pd_su_out = *su_size;
+        cache->pd_ce_out = *ce;
+    }
+    return ret;
+}
+
 
 /* @param flag bit0= Do not add data but only count sua_free and ce_len
                      param info may be NULL in this case
@@ -1484,7 +1622,7 @@ size_t rrip_calc_len(Ecma119Image *t, Ecma119Node *n, int type, size_t used_up,
                      size_t *ce, size_t base_ce)
 {
     size_t su_size, space;
-    int ret;
+    int ret, with_ce;
     size_t aaip_sua_free= 0, aaip_len= 0;
 
     /* Directory record length must be even (ECMA-119, 9.1.13). Maximum is 254.
@@ -1543,12 +1681,9 @@ size_t rrip_calc_len(Ecma119Image *t, Ecma119Node *n, int type, size_t used_up,
 
     if (type == 0) {
 
-        /* Try without CE */
-        ret = susp_calc_nm_sl_al(t, n, space, &su_size, ce, base_ce, 0);
-        if (ret == 0) /* Retry with CE but no block crossing */
-            ret = susp_calc_nm_sl_al(t, n, space, &su_size, ce, base_ce, 1);
-        if (ret == 0) /* Retry with aligned CE and block hopping */
-            ret = susp_calc_nm_sl_al(t, n, space, &su_size, ce, base_ce, 1 | 2);
+        /* Try without CE, with CE, with aligned CE and block hopping */
+        ret = susp_predict_nm_sl_al(t, n, space, &su_size, ce, base_ce,
+                                    &with_ce);
         if (ret == -2)
            return ISO_OUT_OF_MEM;
 
@@ -1775,7 +1910,7 @@ int rrip_get_susp_fields(Ecma119Image *t, Ecma119Node *n, int type,
         size_t n_comp = 0; /* number of components */
 
         namelen = 0;
-        name = get_rr_fname(t, n->node->name);
+        name = get_rr_node_fname(t, n, 0);
         if (name == NULL)
             name = strdup("");
         if (name == NULL) {
@@ -1788,17 +1923,12 @@ int rrip_get_susp_fields(Ecma119Image *t, Ecma119Node *n, int type,
         /* Try whether NM, SL, AL will fit into SUA */
         su_size_pd = info->suf_len;
         ce_len_pd = ce_len;
-        ret = susp_calc_nm_sl_al(t, n, (size_t) space,
-                                 &su_size_pd, &ce_len_pd, info->ce_len, 0);
-        if (ret == 0) { /* Have to use CA. 28 bytes of CE are necessary */
-            ret = susp_calc_nm_sl_al(t, n, (size_t) space,
-                                     &su_size_pd, &ce_len_pd, info->ce_len, 1);
-            if (ret == 0) /* Retry with aligned CE and block hopping */
-                ret = susp_calc_nm_sl_al(t, n, (size_t) space,
-                                         &su_size_pd, &ce_len_pd, info->ce_len,
-                                         1 | 2);
+        ret = susp_predict_nm_sl_al(t, n, (size_t) space,
+                                    &su_size_pd, &ce_len_pd, info->ce_len,
+                                    &ce_is_predicted);
+        if (ce_is_predicted) {
+            /* Have to use CA. 28 bytes of CE are necessary */
             sua_free -= 28;
-            ce_is_predicted = 1;
         }
         if (ret == -2) {
            ret = ISO_OUT_OF_MEM;
@@ -1825,7 +1955,7 @@ int rrip_get_susp_fields(Ecma119Image *t, Ecma119Node *n, int type,
             size_t sl_len = 5;
             int cew = (nm_type == 1); /* are we writing to CE? */
 
-            dest = get_rr_fname(t, ((IsoSymlink*)n->node)->dest);
+            dest = get_rr_node_fname(t, n, 1);
             if (dest == NULL)
                 dest = strdup("");
             if (dest == NULL) {
@@ -2267,7 +2397,8 @@ void rrip_write_susp_fields(Ecma119Image *t, struct susp_info *info,
  * the iso_write() function.
  * After written, the ce_susp_fields array will be freed.
  */
-int rrip_write_ce_fields(Ecma119Image *t, struct susp_info *info)
+int rrip_write_ce_fields(Ecma119Image *t, struct susp_info *info,
+                         struct iso_dir_out *out)
 {
     size_t i;
     uint8_t *padding = NULL;
@@ -2286,14 +2417,14 @@ int rrip_write_ce_fields(Ecma119Image *t, struct susp_info *info)
             if (pad_size == BLOCK_SIZE)
     continue;
             memset(padding, 0, pad_size);
-            ret = iso_write(t, padding, pad_size);
+            ret = iso_dir_out_write(t, out, padding, pad_size);
             if (ret < 0)
                 goto write_ce_field_cleanup;
             written += pad_size;
     continue;
         }
-        ret = iso_write(t, info->ce_susp_fields[i], 
-                        info->ce_susp_fields[i][2]);
+        ret = iso_dir_out_write(t, out, info->ce_susp_fields[i],
+                                info->ce_susp_fields[i][2]);
         if (ret < 0) {
             goto write_ce_field_cleanup;
         }
@@ -2304,7 +2435,7 @@ int rrip_write_ce_fields(Ecma119Image *t, struct susp_info *info)
     i = BLOCK_SIZE - (info->ce_len % BLOCK_SIZE);
     if (i > 0 && i < BLOCK_SIZE) {
         memset(padding, 0, i);
-        ret = iso_write(t, padding, i);
+        ret = iso_dir_out_write(t, out, padding, i);
         if (ret < 0)
             goto write_ce_field_cleanup;
         written += i;
@@ -2325,3 +2456,14 @@ ex:;
     return ret;
 }
 
+
+void rrip_node_cache_free(struct rrip_node_cache *cache)
+{
+    if (cache == NULL)
+        return;
+    if (cache->name != NULL)
+        free(cache->name);
+    if (cache->dest != NULL)
+        free(cache->dest);
+    free(cache);
+}
@@ -78,6 +78,33 @@ struct susp_info
 /* Step to increase allocated size of susp_info.ce_susp_fields */
 #define ISO_SUSP_CE_ALLOC_STEP 16
 
+/**
+ * Results of rrip_calc_len() which get remembered at an Ecma119Node for
+ * re-use by rrip_get_susp_fields(). The SUSP fields themselves cannot be
+ * kept, because CE, CL, and PL depend on block addresses which are not yet
+ * known when the sizes get computed.
+ * See API call iso_write_opts_set_rr_cache().
+ */
+struct rrip_node_cache
+{
+    /* Name and symlink target in the output charset, or NULL if not yet
+       converted */
+    char *name;
+    char *dest;
+
+    /* The outcome of the size prediction by susp_calc_nm_sl_al() for the
+       given input parameters */
+    int pd_valid;
+    size_t pd_space;
+    size_t pd_su_in;
+    size_t pd_ce_in;
+    size_t pd_base_ce;
+    int pd_ret;
+    int pd_with_ce;
+    size_t pd_su_out;
+    size_t pd_ce_out;
+};
+
 
 /* SUSP 5.1 */
 struct susp_CE {
@@ -236,12 +263,21 @@ int rrip_get_susp_fields(Ecma119Image *t, Ecma119Node *n, int type,
 void rrip_write_susp_fields(Ecma119Image *t, struct susp_info *info,
                             uint8_t *buf);
 
+struct iso_dir_out;
+
 /**
  * Write the Continuation Area entries for the given struct susp_info, using
- * the iso_write() function.
+ * the iso_dir_out_write() function with the given out.
  * After written, the ce_susp_fields array will be freed.
  */
-int rrip_write_ce_fields(Ecma119Image *t, struct susp_info *info);
+int rrip_write_ce_fields(Ecma119Image *t, struct susp_info *info,
+                         struct iso_dir_out *out);
+
+/**
+ * Dispose the cache which rrip_calc_len() and rrip_get_susp_fields() may
+ * have attached to an Ecma119Node.
+ */
+void rrip_node_cache_free(struct rrip_node_cache *cache);
 
 /**
  * The SUSP iterator is used to iterate over the System User Entries
@@ -252,9 +288,31 @@ int rrip_write_ce_fields(Ecma119Image *t, struct susp_info *info);
  */
 typedef struct susp_iterator SuspIterator;
 
+/**
+ * A cache for the blocks of SUSP Continuation Areas which is shared by the
+ * iterators of an imported filesystem. Several files usually have their
+ * Continuation Areas in the same block. The cache may be used by several
+ * threads at the same time.
+ */
+typedef struct susp_ce_cache SuspCECache;
+
+/**
+ * @param ce_cache
+ *      Cache for the blocks of Continuation Areas. NULL means to read
+ *      each Continuation Area from src.
+ */
 SuspIterator *
 susp_iter_new(IsoDataSource *src, struct ecma119_dir_record *record, 
-              uint32_t fs_blocks, uint8_t len_skp, int msgid);
+              uint32_t fs_blocks, uint8_t len_skp, int msgid,
+              SuspCECache *ce_cache);
+
+/**
+ * Restart a given iterator at the System Use field of another directory
+ * record of the same filesystem. The buffer for Continuation Areas is kept
+ * and reused, so that a directory can be scanned with a single iterator.
+ */
+void susp_iter_reuse(SuspIterator *iter, struct ecma119_dir_record *record,
+                     uint8_t len_skp);
 
 /**
  * Get the next SUSP System User Entry using given iterator.
@@ -274,6 +332,42 @@ int susp_iter_next(SuspIterator *iter, struct susp_sys_user_entry **sue,
  */
 void susp_iter_free(SuspIterator *iter);
 
+/**
+ * Create a cache for the blocks of Continuation Areas.
+ *
+ * @param fs_blocks
+ *      Number of blocks in the ISO 9660 filesystem, as given to
+ *      susp_iter_new()
+ * @return
+ *      1 on success, < 0 error
+ */
+int susp_ce_cache_new(IsoDataSource *src, uint32_t fs_blocks,
+                      SuspCECache **cache);
+
+/**
+ * Forget all cached blocks. To be used when the data source gets closed.
+ */
+void susp_ce_cache_clear(SuspCECache *cache);
+
+void susp_ce_cache_free(SuspCECache *cache);
+
+/**
+ * Look for CE entries in the directory records of the given directory
+ * blocks and read the blocks of their Continuation Areas into the cache.
+ * Distinct blocks get read once, in ascending order, by multi-block reads.
+ *
+ * @param buffer
+ *      The directory blocks
+ * @param nblocks
+ *      Number of blocks in buffer
+ * @param len_skp
+ *      Bytes to skip at the start of each System Use field
+ * @return
+ *      1 on success, < 0 error
+ */
+int susp_ce_cache_prefetch(SuspCECache *cache, uint8_t *buffer,
+                           uint32_t nblocks, uint8_t len_skp, int flag);
+
 
 /**
  * Fills a struct stat with the values of a Rock Ridge PX entry (RRIP, 4.1.1).
@@ -364,6 +458,8 @@ int read_zisofs_ZF(struct susp_sys_user_entry *zf, uint8_t algorithm[2],
 /**
  * Convert a RR filename to the requested charset.
  * @param flag   bit0= do not issue error messages
+ *               bit1= return the error code of the conversion rather than
+ *                     ISO_FILENAME_WRONG_CHARSET
  */
 int iso_get_rr_name(IsoWriteOpts *opts, char *input_charset,
                     char *output_charset, int imgid,
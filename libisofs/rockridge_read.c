@@ -22,10 +22,12 @@
 #include "util.h"
 #include "rockridge.h"
 #include "messages.h"
+#include "data_source.h"
 
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 struct susp_iterator
 {
@@ -46,35 +48,324 @@ struct susp_iterator
     uint32_t ce_len; 
 
     uint8_t *buffer; /*< If there are continuation areas */
+
+    SuspCECache *ce_cache;
+};
+
+/* Number of blocks in a SuspCECache. Block lba gets stored in slot
+   lba % ISO_SUSP_CE_CACHE_BLOCKS, so that the Continuation Areas of a
+   directory, which are usually stored in consecutive blocks, do not push
+   each other out.
+*/
+#define ISO_SUSP_CE_CACHE_BLOCKS 256
+
+/* Maximum number of blocks per read by susp_ce_cache_prefetch() */
+#define ISO_SUSP_CE_READ_BLOCKS 32
+
+struct susp_ce_cache
+{
+    IsoDataSource *src;
+    uint32_t fs_blocks;
+
+    pthread_mutex_t mutex;
+
+    /* Allocated on first use */
+    uint8_t *blocks;
+    uint32_t lba[ISO_SUSP_CE_CACHE_BLOCKS];
+    uint8_t valid[ISO_SUSP_CE_CACHE_BLOCKS];
 };
 
 SuspIterator*
 susp_iter_new(IsoDataSource *src, struct ecma119_dir_record *record,
-              uint32_t fs_blocks, uint8_t len_skp, int msgid)
+              uint32_t fs_blocks, uint8_t len_skp, int msgid,
+              SuspCECache *ce_cache)
 {
-    int pad = (record->len_fi[0] + 1) % 2;
     struct susp_iterator *iter = malloc(sizeof(struct susp_iterator));
     if (iter == NULL) {
         return NULL;
     }
 
-    iter->base = record->file_id + record->len_fi[0] + pad;
-    iter->pos = len_skp; /* 0 in most cases */
-    iter->size = record->len_dr[0] - record->len_fi[0] - 33 - pad;
     iter->src = src;
     iter->msgid = msgid;
     iter->fs_blocks = fs_blocks;
-
-    iter->ce_len = 0;
     iter->buffer = NULL;
+    iter->ce_cache = ce_cache;
+    susp_iter_reuse(iter, record, len_skp);
 
     return iter;
 }
 
+void susp_iter_reuse(SuspIterator *iter, struct ecma119_dir_record *record,
+                     uint8_t len_skp)
+{
+    int pad = (record->len_fi[0] + 1) % 2;
+
+    iter->base = record->file_id + record->len_fi[0] + pad;
+    iter->pos = len_skp; /* 0 in most cases */
+    iter->size = record->len_dr[0] - record->len_fi[0] - 33 - pad;
+    iter->ce_len = 0;
+}
+
 /* More than 1 MiB in a single file's CE area is suspicious */
 #define ISO_SUSP_MAX_CE_BYTES (1024 * 1024)
 
 
+int susp_ce_cache_new(IsoDataSource *src, uint32_t fs_blocks,
+                      SuspCECache **cache)
+{
+    struct susp_ce_cache *o;
+
+    o = calloc(1, sizeof(struct susp_ce_cache));
+    if (o == NULL)
+        return ISO_OUT_OF_MEM;
+    o->src = src;
+    o->fs_blocks = fs_blocks;
+    o->blocks = NULL;
+    if (pthread_mutex_init(&o->mutex, NULL) != 0) {
+        free(o);
+        return ISO_OUT_OF_MEM;
+    }
+    *cache = o;
+    return ISO_SUCCESS;
+}
+
+void susp_ce_cache_clear(SuspCECache *cache)
+{
+    if (cache == NULL)
+        return;
+    pthread_mutex_lock(&cache->mutex);
+    if (cache->blocks != NULL)
+        free(cache->blocks);
+    cache->blocks = NULL;
+    memset(cache->valid, 0, ISO_SUSP_CE_CACHE_BLOCKS);
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+void susp_ce_cache_free(SuspCECache *cache)
+{
+    if (cache == NULL)
+        return;
+    if (cache->blocks != NULL)
+        free(cache->blocks);
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache);
+}
+
+/* Copy blocks from the cache to buffer.
+   @return 1 = all blocks were cached , 0 = some block is missing
+*/
+static
+int susp_ce_cache_get(SuspCECache *cache, uint32_t lba, uint32_t nblocks,
+                      uint8_t *buffer)
+{
+    uint32_t i, slot;
+    int ret = 1;
+
+    if (nblocks > ISO_SUSP_CE_CACHE_BLOCKS)
+        return 0;
+    pthread_mutex_lock(&cache->mutex);
+    if (cache->blocks == NULL) {
+        ret = 0; goto ex;
+    }
+    for (i = 0; i < nblocks; i++) {
+        slot = (lba + i) % ISO_SUSP_CE_CACHE_BLOCKS;
+        if (!cache->valid[slot] || cache->lba[slot] != lba + i) {
+            ret = 0; goto ex;
+        }
+    }
+    for (i = 0; i < nblocks; i++) {
+        slot = (lba + i) % ISO_SUSP_CE_CACHE_BLOCKS;
+        memcpy(buffer + i * BLOCK_SIZE, cache->blocks + slot * BLOCK_SIZE,
+               BLOCK_SIZE);
+    }
+ex:;
+    pthread_mutex_unlock(&cache->mutex);
+    return ret;
+}
+
+static
+int susp_ce_cache_put(SuspCECache *cache, uint32_t lba, uint32_t nblocks,
+                      uint8_t *buffer)
+{
+    uint32_t i, slot;
+    int ret = ISO_SUCCESS;
+
+    if (nblocks > ISO_SUSP_CE_CACHE_BLOCKS)
+        return ISO_SUCCESS;
+    pthread_mutex_lock(&cache->mutex);
+    if (cache->blocks == NULL) {
+        cache->blocks = malloc(ISO_SUSP_CE_CACHE_BLOCKS * BLOCK_SIZE);
+        if (cache->blocks == NULL) {
+            ret = ISO_OUT_OF_MEM; goto ex;
+        }
+    }
+    for (i = 0; i < nblocks; i++) {
+        slot = (lba + i) % ISO_SUSP_CE_CACHE_BLOCKS;
+        memcpy(cache->blocks + slot * BLOCK_SIZE, buffer + i * BLOCK_SIZE,
+               BLOCK_SIZE);
+        cache->lba[slot] = lba + i;
+        cache->valid[slot] = 1;
+    }
+ex:;
+    pthread_mutex_unlock(&cache->mutex);
+    return ret;
+}
+
+static
+int susp_ce_cache_has(SuspCECache *cache, uint32_t lba)
+{
+    uint32_t slot;
+    int ret;
+
+    slot = lba % ISO_SUSP_CE_CACHE_BLOCKS;
+    pthread_mutex_lock(&cache->mutex);
+    ret = (cache->blocks != NULL && cache->valid[slot] &&
+           cache->lba[slot] == lba);
+    pthread_mutex_unlock(&cache->mutex);
+    return ret;
+}
+
+struct susp_ce_range
+{
+    uint32_t block;
+    uint32_t nblocks;
+};
+
+static
+int susp_ce_range_cmp(const void *a, const void *b)
+{
+    const struct susp_ce_range *ra = a, *rb = b;
+
+    if (ra->block < rb->block)
+        return -1;
+    if (ra->block > rb->block)
+        return 1;
+    return 0;
+}
+
+/* Phase one of the directory parsing: collect the CE references of all
+   directory records and read their blocks in ascending order.
+   CE entries in Continuation Areas are not followed. Their areas get read
+   by the iterator.
+*/
+int susp_ce_cache_prefetch(SuspCECache *cache, uint8_t *buffer,
+                           uint32_t nblocks, uint8_t len_skp, int flag)
+{
+    int ret, num_ranges = 0, max_ranges, i, j, pad;
+    uint32_t b, pos, epos, end, sua_pos, sua_size, ce_block, ce_off, ce_len;
+    uint32_t skipped_blocks, n, start, run, total = 0;
+    uint8_t *block_buf, *read_buf = NULL, *mapped;
+    struct ecma119_dir_record *record;
+    struct susp_sys_user_entry *entry;
+    struct susp_ce_range *ranges = NULL;
+
+    if (cache == NULL)
+        return ISO_SUCCESS;
+
+    /* A directory record has at least 34 bytes */
+    max_ranges = nblocks * (BLOCK_SIZE / 34);
+    ranges = calloc(max_ranges, sizeof(struct susp_ce_range));
+    if (ranges == NULL)
+        {ret = ISO_OUT_OF_MEM; goto ex;}
+
+    for (b = 0; b < nblocks; b++) {
+        block_buf = buffer + b * BLOCK_SIZE;
+        for (pos = 0; pos + 34 <= BLOCK_SIZE; pos += record->len_dr[0]) {
+            record = (struct ecma119_dir_record *) (block_buf + pos);
+            if (record->len_dr[0] < 34 ||
+                pos + record->len_dr[0] > BLOCK_SIZE)
+        break;
+            pad = (record->len_fi[0] + 1) % 2;
+            sua_pos = 33 + record->len_fi[0] + pad + len_skp;
+            if (sua_pos >= record->len_dr[0])
+        continue;
+            sua_size = record->len_dr[0] - sua_pos;
+            for (epos = 0; epos + 4 <= sua_size;
+                 epos += entry->len_sue[0]) {
+                entry = (struct susp_sys_user_entry *)
+                                        (((uint8_t *) record) + sua_pos + epos);
+                if (entry->len_sue[0] == 0 || SUSP_SIG(entry, 'S', 'T'))
+            break;
+                if (!SUSP_SIG(entry, 'C', 'E') || entry->len_sue[0] < 28 ||
+                    epos + 28 > sua_size)
+            continue;
+                ce_block = iso_read_bb(entry->data.CE.block, 4, NULL);
+                ce_off = iso_read_bb(entry->data.CE.offset, 4, NULL);
+                ce_len = iso_read_bb(entry->data.CE.len, 4, NULL);
+                if (ce_len == 0 || ce_len > ISO_SUSP_MAX_CE_BYTES)
+            break;
+                skipped_blocks = ce_off / BLOCK_SIZE;
+                n = DIV_UP(ce_off - skipped_blocks * BLOCK_SIZE + ce_len,
+                           BLOCK_SIZE);
+                if (((uint64_t) ce_block) + skipped_blocks + n >
+                    (uint64_t) cache->fs_blocks)
+            break;
+                if (num_ranges < max_ranges) {
+                    ranges[num_ranges].block = ce_block + skipped_blocks;
+                    ranges[num_ranges].nblocks = n;
+                    num_ranges++;
+                }
+                /* Only one CE per System Use field is supported */
+                break;
+            }
+        }
+    }
+    if (num_ranges == 0)
+        {ret = ISO_SUCCESS; goto ex;}
+
+    /* Merge overlapping and adjacent ranges */
+    qsort(ranges, num_ranges, sizeof(struct susp_ce_range), susp_ce_range_cmp);
+    for (i = 1, j = 0; i < num_ranges; i++) {
+        if (ranges[i].block <= ranges[j].block + ranges[j].nblocks) {
+            end = ranges[i].block + ranges[i].nblocks;
+            if (end > ranges[j].block + ranges[j].nblocks)
+                ranges[j].nblocks = end - ranges[j].block;
+        } else {
+            ranges[++j] = ranges[i];
+        }
+    }
+    num_ranges = j + 1;
+
+    read_buf = malloc(ISO_SUSP_CE_READ_BLOCKS * BLOCK_SIZE);
+    if (read_buf == NULL)
+        {ret = ISO_OUT_OF_MEM; goto ex;}
+    for (i = 0; i < num_ranges && total < ISO_SUSP_CE_CACHE_BLOCKS; i++) {
+        if (iso_data_source_get_mapped(cache->src, ranges[i].block,
+                                       ranges[i].nblocks, &mapped))
+    continue; /* The iterator will parse in place */
+        end = ranges[i].block + ranges[i].nblocks;
+        for (start = ranges[i].block; start < end; start += run) {
+            if (susp_ce_cache_has(cache, start)) {
+                run = 1;
+        continue;
+            }
+            /* Read a run of missing blocks */
+            for (run = 1; start + run < end && run < ISO_SUSP_CE_READ_BLOCKS;
+                 run++)
+                if (susp_ce_cache_has(cache, start + run))
+            break;
+            ret = iso_data_source_read_blocks(cache->src, start, run,
+                                              read_buf);
+            if (ret < 0)
+                goto ex;
+            ret = susp_ce_cache_put(cache, start, run, read_buf);
+            if (ret < 0)
+                goto ex;
+            total += run;
+            if (total >= ISO_SUSP_CE_CACHE_BLOCKS)
+        break;
+        }
+    }
+    ret = ISO_SUCCESS;
+ex:;
+    if (ranges != NULL)
+        free(ranges);
+    if (read_buf != NULL)
+        free(read_buf);
+    return ret;
+}
+
+
 /* @param flag bit0 = First call on root:
                       Not yet clear whether this is SUSP at all
 */
@@ -104,6 +395,7 @@ int susp_iter_next(SuspIterator *iter, struct susp_sys_user_entry **sue,
          */
         if (iter->ce_len) {
             uint32_t block, nblocks, skipped_blocks, skipped_bytes;
+            uint8_t *mapped;
 
             /* A CE was found, there is another continuation area */
             skipped_blocks = iter->ce_off / BLOCK_SIZE;
@@ -115,30 +407,56 @@ int susp_iter_next(SuspIterator *iter, struct susp_sys_user_entry **sue,
             if (((uint64_t) iter->ce_block) + skipped_blocks + nblocks >
                 (uint64_t) iter->fs_blocks)
                 return ISO_SUSP_WRONG_CE_SIZE;
-            iter->buffer = realloc(iter->buffer, nblocks * BLOCK_SIZE);
-
-            /* Read blocks needed to cache the given CE area range */
-            for (block = 0; block < nblocks; ++block) {
+            block = iter->ce_block + skipped_blocks;
+            if (iso_data_source_get_mapped(iter->src, block, nblocks,
+                                           &mapped)) {
+                /* Parse the CE area in place */
+                iter->base = mapped + (iter->ce_off - skipped_bytes);
+            } else {
                 int ret;
-                ret = iter->src->read_block(iter->src,
-                                       iter->ce_block + skipped_blocks + block,
-                                       iter->buffer + block * BLOCK_SIZE);
-                if (ret < 0) {
-                    return ret;
+                uint8_t *new_buffer;
+
+                new_buffer = realloc(iter->buffer, nblocks * BLOCK_SIZE);
+                if (new_buffer == NULL)
+                    return ISO_OUT_OF_MEM;
+                iter->buffer = new_buffer;
+
+                /* Read blocks needed to cache the given CE area range */
+                if (iter->ce_cache == NULL ||
+                    !susp_ce_cache_get(iter->ce_cache, block, nblocks,
+                                       iter->buffer)) {
+                    ret = iso_data_source_read_blocks(iter->src, block,
+                                                      nblocks, iter->buffer);
+                    if (ret < 0) {
+                        return ret;
+                    }
+                    if (iter->ce_cache != NULL) {
+                        ret = susp_ce_cache_put(iter->ce_cache, block,
+                                                nblocks, iter->buffer);
+                        if (ret < 0)
+                            return ret;
+                    }
                 }
+                iter->base = iter->buffer + (iter->ce_off - skipped_bytes);
             }
-            iter->base = iter->buffer + (iter->ce_off - skipped_bytes);
             iter->pos = 0;
             iter->size = iter->ce_len;
             iter->ce_len = 0;
-            entry = (struct susp_sys_user_entry*)iter->base;
+
+            /* The area may be too short for an entry or begin with ST */
+            return susp_iter_next(iter, sue, 0);
         } else {
             return 0;
         }
     }
 
-    if (entry->len_sue[0] == 0) {
-        /* a wrong image with this lead us to a infinity loop */
+    if (entry->len_sue[0] == 0 ||
+        iter->pos + entry->len_sue[0] > iter->size) {
+        /* A wrong image with len 0 would lead to an endless loop.
+           An entry which exceeds the System Use Area or the Continuation
+           Area would be read beyond the end of the directory record or
+           of the buffer, which may be a memory mapped image.
+        */
         iso_msg_submit(iter->msgid, ISO_WRONG_RR, 0,
                       "Damaged RR/SUSP information.");
         return ISO_WRONG_RR;
@@ -1219,6 +1219,47 @@ int iso_stream_read_buffer(IsoStream *stream, char *buf, size_t count,
     return 1;
 }
 
+off_t iso_stream_set_read_pos(IsoStream *stream, off_t pos, off_t cur,
+                              int flag)
+{
+    int ret;
+    off_t todo;
+    char *buffer = NULL;
+
+    if (stream->class == &fsrc_stream_class)
+        return iso_file_source_lseek(((FSrcStreamData *) stream->data)->src,
+                                     pos, 0);
+
+    /* Read up to pos, from the start if pos is already passed */
+    if (pos < cur || cur < 0) {
+        iso_stream_close(stream);
+        ret = iso_stream_open(stream);
+        if (ret < 0)
+            return (off_t) ret;
+        cur = 0;
+    }
+    LIBISO_ALLOC_MEM(buffer, char, 2048);
+    while (cur < pos) {
+        todo = pos - cur;
+        if (todo > 2048)
+            todo = 2048;
+        ret = iso_stream_read(stream, buffer, (size_t) todo);
+        if (ret < 0)
+            goto ex;
+        if (ret == 0) {
+            ret = ISO_FILE_SEEK_ERROR;
+            goto ex;
+        }
+        cur += ret;
+    }
+    ret = 1;
+ex:;
+    LIBISO_FREE_MEM(buffer);
+    if (ret < 0)
+        return (off_t) ret;
+    return pos;
+}
+
 /* @param flag bit0= dig out most original stream (e.g. because from old image)
    @return 1=ok, md5 is valid,
            0= not ok, 
@@ -88,6 +88,19 @@ int iso_stream_set_image_ino(IsoStream *stream, ino_t ino, int flag);
 int iso_stream_read_buffer(IsoStream *stream, char *buf, size_t count,
                            size_t *got);
 
+/**
+ * Set the read position of an opened stream. Streams of IsoFileSource get
+ * positioned by iso_file_source_lseek(). Other streams get read up to pos,
+ * after reopening if pos lies before the current position.
+ * @param pos     The desired read position
+ * @param cur     The current read position, as known by the caller.
+ *                < 0 means that it is unknown.
+ * @param flag    Submit 0 for now.
+ * @return        pos on success, < 0 error
+ */
+off_t iso_stream_set_read_pos(IsoStream *stream, off_t pos, off_t cur,
+                              int flag);
+
 /**
  * @return 1=ok, md5 is valid,
  *        0= not ok
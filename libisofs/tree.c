@@ -68,7 +68,10 @@ int iso_tree_add_new_dir(IsoDir *parent, const char *name, IsoDir **dir)
     }
 
     /* find place where to insert and check if it exists */
-    if (iso_dir_exists(parent, name, &pos)) {
+    ret = iso_dir_exists(parent, name, &pos);
+    if (ret < 0)
+        return ret;
+    if (ret) {
         /* a node with same name already exists */
         return ISO_NODE_NAME_NOT_UNIQUE;
     }
@@ -154,7 +157,10 @@ int iso_tree_add_new_symlink(IsoDir *parent, const char *name,
     }
 
     /* find place where to insert */
-    if (iso_dir_exists(parent, name, &pos)) {
+    ret = iso_dir_exists(parent, name, &pos);
+    if (ret < 0)
+        return ret;
+    if (ret) {
         /* a node with same name already exists */
         return ISO_NODE_NAME_NOT_UNIQUE;
     }
@@ -260,7 +266,10 @@ int iso_tree_add_new_special(IsoDir *parent, const char *name, mode_t mode,
     }
 
     /* find place where to insert */
-    if (iso_dir_exists(parent, name, &pos)) {
+    ret = iso_dir_exists(parent, name, &pos);
+    if (ret < 0)
+        return ret;
+    if (ret) {
         /* a node with same name already exists */
         return ISO_NODE_NAME_NOT_UNIQUE;
     }
@@ -348,7 +357,10 @@ int iso_tree_add_new_file(IsoDir *parent, const char *name, IsoStream *stream,
     }
 
     /* find place where to insert */
-    if (iso_dir_exists(parent, name, &pos)) {
+    ret = iso_dir_exists(parent, name, &pos);
+    if (ret < 0)
+        return ret;
+    if (ret) {
         /* a node with same name already exists */
         return ISO_NODE_NAME_NOT_UNIQUE;
     }
@@ -574,6 +586,8 @@ int iso_tree_add_node_builder(IsoImage *image, IsoDir *parent,
 
     /* find place where to insert */
     result = iso_dir_exists(parent, namept, &pos);
+    if (result < 0)
+        goto ex;
     if (result) {
         /* a node with same name already exists */
         result = ISO_NODE_NAME_NOT_UNIQUE; goto ex;
@@ -642,6 +656,8 @@ int iso_tree_add_new_node(IsoImage *image, IsoDir *parent, const char *name,
 
     /* find place where to insert */
     result = iso_dir_exists(parent, namept, &pos);
+    if (result < 0)
+        return result;
     if (result) {
         /* a node with same name already exists */
         return ISO_NODE_NAME_NOT_UNIQUE;
@@ -699,6 +715,8 @@ int iso_tree_add_new_cut_out_node(IsoImage *image, IsoDir *parent,
 
     /* find place where to insert */
     result = iso_dir_exists(parent, namept, &pos);
+    if (result < 0)
+        return result;
     if (result) {
         /* a node with same name already exists */
         return ISO_NODE_NAME_NOT_UNIQUE;
@@ -981,12 +999,20 @@ ex:;
 /**
  * Recursively add a given directory to the image tree.
  * 
+ * @param lazy
+ *      If not NULL, do not recurse but prepare subdirectories for lazy
+ *      loading.
+ * @param flag
+ *      bit0= return the error if dir cannot be opened or read, rather than
+ *            only reporting it
  * @return
  *      1 continue, < 0 error (ISO_CANCELED stop)
  */
-int iso_add_dir_src_rec(IsoImage *image, IsoDir *parent, IsoFileSource *dir)
+static
+int iso_add_dir_src(IsoImage *image, IsoDir *parent, IsoFileSource *dir,
+                    struct iso_lazy_import *lazy, int flag)
 {
-    int ret, dir_is_open = 0;
+    int ret, dir_ret, dir_is_open = 0;
     IsoNodeBuilder *builder;
     IsoFileSource *file;
     IsoNode **pos;
@@ -997,6 +1023,7 @@ int iso_add_dir_src_rec(IsoImage *image, IsoDir *parent, IsoFileSource *dir)
 
     ret = iso_file_source_open(dir);
     if (ret < 0) {
+        dir_ret = ret;
         path = iso_file_source_get_path(dir);
         /* instead of the probable error, we throw a sorry event */
 	if (path != NULL) {
@@ -1007,6 +1034,8 @@ int iso_add_dir_src_rec(IsoImage *image, IsoDir *parent, IsoFileSource *dir)
             ret = iso_msg_submit(image->id, ISO_NULL_POINTER, ret,
                            "Can't open dir. NULL pointer caught as dir name");
         }
+        if (flag & 1)
+            ret = dir_ret;
         goto ex;
     }
     dir_is_open = 1;
@@ -1021,7 +1050,10 @@ int iso_add_dir_src_rec(IsoImage *image, IsoDir *parent, IsoFileSource *dir)
         if (ret <= 0) {
             if (ret < 0) {
                 /* error reading dir */
+                dir_ret = ret;
                 ret = iso_msg_submit(image->id, ret, ret, "Error reading dir");
+                if (flag & 1)
+                    ret = dir_ret;
                 goto ex;
             }
     break; /* End of directory */
@@ -1065,6 +1097,8 @@ int iso_add_dir_src_rec(IsoImage *image, IsoDir *parent, IsoFileSource *dir)
 
         /* find place where to insert */
         ret = iso_dir_exists(parent, name, &pos);
+        if (ret < 0)
+            goto ex;
         if (ret) {
             /* Resolve name collision
                e.g. caused by fs_image.c:make_hopefully_unique_name() 
@@ -1118,7 +1152,14 @@ int iso_add_dir_src_rec(IsoImage *image, IsoDir *parent, IsoFileSource *dir)
 
         /* finally, if the node is a directory we need to recurse */
         if (new->type == LIBISO_DIR && S_ISDIR(info.st_mode)) {
-            ret = iso_add_dir_src_rec(image, (IsoDir*)new, file);
+            if (lazy != NULL) {
+                iso_file_source_ref(file);
+                ((IsoDir *) new)->lazy_src = file;
+                lazy->refcount++;
+                ((IsoDir *) new)->lazy_import = lazy;
+            } else {
+                ret = iso_add_dir_src(image, (IsoDir*)new, file, NULL, 0);
+            }
         }
 
 dir_rec_continue:;
@@ -1141,6 +1182,99 @@ ex:;
     return ret;
 }
 
+int iso_add_dir_src_rec(IsoImage *image, IsoDir *parent, IsoFileSource *dir)
+{
+    return iso_add_dir_src(image, parent, dir, NULL, 0);
+}
+
+int iso_add_dir_src_lazy(IsoImage *image, IsoDir *parent, IsoFileSource *dir,
+                         struct iso_lazy_import *lazy)
+{
+    return iso_add_dir_src(image, parent, dir, lazy, 0);
+}
+
+int iso_lazy_import_new(IsoImage *image, IsoNodeBuilder *builder,
+                        IsoFilesystem *fs, struct iso_lazy_import **lazy)
+{
+    struct iso_lazy_import *o;
+
+    o = calloc(1, sizeof(struct iso_lazy_import));
+    if (o == NULL)
+        return ISO_OUT_OF_MEM;
+    o->refcount = 1;
+    o->image = image;
+    o->builder = builder;
+    iso_node_builder_ref(builder);
+    o->fs = fs;
+    iso_filesystem_ref(fs);
+    o->loaded = NULL;
+    *lazy = o;
+    return ISO_SUCCESS;
+}
+
+void iso_lazy_import_unref(struct iso_lazy_import *lazy)
+{
+    if (--lazy->refcount > 0)
+        return;
+    iso_node_builder_unref(lazy->builder);
+    iso_filesystem_unref(lazy->fs);
+    free(lazy);
+}
+
+void iso_tree_lazy_release(IsoDir *dir)
+{
+    if (dir->lazy_import == NULL)
+        return;
+    iso_file_source_unref(dir->lazy_src);
+    iso_lazy_import_unref(dir->lazy_import);
+    dir->lazy_src = NULL;
+    dir->lazy_import = NULL;
+}
+
+/* Read the children of a lazily imported directory into the tree.
+   Their subdirectories get prepared for lazy loading in turn.
+   A failed load cannot be repeated, because some children may already be
+   in the tree. So its error gets recorded and returned on each later call.
+*/
+static
+int iso_tree_lazy_load(IsoDir *dir)
+{
+    int ret;
+    IsoFileSource *src;
+    struct iso_lazy_import *lazy;
+    IsoImage *image;
+    IsoNodeBuilder *builder;
+
+    if (dir->lazy_error < 0)
+        return dir->lazy_error;
+    lazy = dir->lazy_import;
+    src = dir->lazy_src;
+    if (lazy == NULL)
+        return ISO_SUCCESS;
+
+    /* Detach first. Inserting the children might cause recursion. */
+    dir->lazy_import = NULL;
+    dir->lazy_src = NULL;
+
+    image = lazy->image;
+    if (image == NULL) {
+        ret = ISO_LAZY_DIR_LOST;
+        goto ex;
+    }
+    builder = image->builder;
+    image->builder = lazy->builder;
+    ret = iso_add_dir_src(image, dir, src, lazy, 1);
+    image->builder = builder;
+    if (ret >= 0 && lazy->loaded != NULL)
+        ret = lazy->loaded(lazy, dir);
+ex:;
+    if (ret < 0)
+        dir->lazy_error = ret;
+    iso_file_source_unref(src);
+    iso_lazy_import_unref(lazy);
+    return ret;
+}
+
 int iso_tree_add_dir_rec(IsoImage *image, IsoDir *parent, const char *dir)
 {
     int result;
@@ -1174,6 +1308,373 @@ int iso_tree_add_dir_rec(IsoImage *image, IsoDir *parent, const char *dir)
     return result;
 }
 
+
+/* ------------------------- incremental sync ------------------------------ */
+
+/* Determine the size of the content which the file node represented when it
+   was created from its source. This is the uncompressed size of imported
+   zisofs files and the size of the most original stream of filtered files.
+*/
+static
+off_t iso_tree_sync_src_size(IsoFile *file)
+{
+    int ret, header_size_div4 = 0, block_size_log2 = 0;
+    uint8_t algo[2];
+    uint64_t uncompressed_size = 0;
+    IsoStream *stream, *input_stream;
+
+    stream = file->stream;
+    input_stream = iso_stream_get_input_stream(stream, 1);
+    if (input_stream != NULL)
+        stream = input_stream;
+    ret = iso_stream_get_src_zf(stream, algo, &header_size_div4,
+                                &block_size_log2, &uncompressed_size, 0);
+    if (ret == 1 && header_size_div4 > 0)
+        return (off_t) uncompressed_size;
+    return iso_stream_get_size(stream);
+}
+
+/* Compare a node in the image tree with the stat(2) information of the file
+   which would replace it. Permissions and ownership are not compared,
+   because their change is reflected by ctime.
+   The inode identity is only compared if the node stems from the same
+   filesystem as the source file. Nodes from an imported ISO image bear
+   image inode numbers, which cannot be related to local ones.
+   @return 1= node is up to date , 0= node needs to be replaced
+*/
+static
+int iso_tree_sync_node_is_current(IsoImage *image, IsoNode *node,
+                                  IsoFileSource *src, struct stat *info)
+{
+    int ret;
+    unsigned int fs_id;
+    dev_t dev_id;
+    ino_t ino_id;
+    IsoFilesystem *fs;
+    char *dest = NULL;
+
+    if (node->type == LIBISO_BOOT)
+        return 1; /* The boot catalog does not stem from the source */
+    if ((node->mode & S_IFMT) != (info->st_mode & S_IFMT))
+        return 0;
+    if (node->mtime != info->st_mtime || node->ctime != info->st_ctime)
+        return 0;
+
+    fs = iso_file_source_get_filesystem(src);
+    ret = iso_node_get_id(node, &fs_id, &dev_id, &ino_id, 0);
+    if (ret > 0 && fs != NULL && fs_id == fs->get_id(fs) &&
+        fs_id != ISO_IMAGE_FS_ID) {
+        if (dev_id != info->st_dev || ino_id != info->st_ino)
+            return 0;
+    }
+
+    switch (node->type) {
+    case LIBISO_FILE:
+        if (iso_tree_sync_src_size((IsoFile *) node) != info->st_size)
+            return 0;
+        break;
+    case LIBISO_SYMLINK:
+        LIBISO_ALLOC_MEM_VOID(dest, char, LIBISOFS_NODE_PATH_MAX);
+        ret = iso_file_source_readlink(src, dest, LIBISOFS_NODE_PATH_MAX);
+        if (ret < 0 || strcmp(dest, ((IsoSymlink *) node)->dest) != 0)
+            ret = 0;
+        else
+            ret = 1;
+        LIBISO_FREE_MEM(dest);
+        return ret;
+    case LIBISO_SPECIAL:
+        if (((IsoSpecial *) node)->dev != info->st_rdev)
+            return 0;
+        break;
+    default:
+        break;
+    }
+    return 1;
+ex:;
+    return 0;
+}
+
+/* Hand over all children of old_dir to new_dir, which must be empty.
+*/
+static
+void iso_tree_sync_move_children(IsoDir *old_dir, IsoDir *new_dir)
+{
+    IsoNode *pos;
+
+    new_dir->children = old_dir->children;
+    new_dir->nchildren = old_dir->nchildren;
+    for (pos = new_dir->children; pos != NULL; pos = pos->next)
+        pos->parent = new_dir;
+    old_dir->children = NULL;
+    old_dir->nchildren = 0;
+}
+
+static
+int iso_tree_sync_name_cmp(const void *a, const void *b)
+{
+    return strcmp((*(IsoNode **) a)->name, (*(IsoNode **) b)->name);
+}
+
+/**
+ * Bring the children of parent in sync with the content of the source
+ * directory dir. Unchanged nodes are kept as they are.
+ *
+ * @param flag bit0= do not remove nodes which have no counterpart in dir
+ *             bit1= skip subdirectories with unchanged mtime and ctime
+ * @return
+ *      1 continue, < 0 error (ISO_CANCELED stop)
+ */
+static
+int iso_sync_dir_src_rec(IsoImage *image, IsoDir *parent, IsoFileSource *dir,
+                         int flag)
+{
+    int ret, dir_is_open = 0, is_current, recurse;
+    IsoNodeBuilder *builder;
+    IsoFileSource *file;
+    IsoNode **pos, *pos_node, *old, *new, **olds = NULL, key_node;
+    IsoNode *key = &key_node;
+    struct stat info;
+    char *name, *namept, *path, *allocated_name = NULL, *seen = NULL;
+    size_t nolds = 0, i;
+    IsoNode **found;
+
+    ret = iso_file_source_open(dir);
+    if (ret < 0) {
+        path = iso_file_source_get_path(dir);
+        if (path != NULL) {
+            ret = iso_msg_submit(image->id, ISO_FILE_CANT_ADD, ret, 
+                                 "Can't open dir %s", path);
+            free(path);
+        } else {
+            ret = iso_msg_submit(image->id, ISO_NULL_POINTER, ret,
+                           "Can't open dir. NULL pointer caught as dir name");
+        }
+        goto ex;
+    }
+    dir_is_open = 1;
+
+    builder = image->builder;
+
+    ret = iso_tree_cow_materialize(parent, 0);
+    if (ret < 0)
+        goto ex;
+
+    /* Snapshot of the present children, sorted by name like the list.
+       The references keep replaced nodes valid for the name search.
+    */
+    if (parent->nchildren > 0) {
+        LIBISO_ALLOC_MEM(olds, IsoNode *, parent->nchildren);
+        LIBISO_ALLOC_MEM(seen, char, parent->nchildren);
+        for (pos_node = parent->children; pos_node != NULL;
+             pos_node = pos_node->next) {
+            iso_node_ref(pos_node);
+            olds[nolds++] = pos_node;
+        }
+    }
+
+    while (1) {
+        ret = iso_file_source_readdir(dir, &file);
+        if (ret <= 0) {
+            if (ret < 0) {
+                ret = iso_msg_submit(image->id, ret, ret, "Error reading dir");
+                goto ex;
+            }
+    break; /* End of directory */
+        }
+
+        path = iso_file_source_get_path(file);
+        if (path == NULL) {
+            iso_file_source_unref(file);
+            ret = iso_msg_submit(image->id, ISO_NULL_POINTER, ret, 
+                                 "NULL pointer caught as file path");
+            goto ex;
+        }
+        name = strrchr(path, '/') + 1;
+        new = NULL;
+        recurse = 0;
+
+        if (image->follow_symlinks) {
+            ret = iso_file_source_stat(file, &info);
+        } else {
+            ret = iso_file_source_lstat(file, &info);
+        }
+        if (ret < 0) {
+            ret = iso_msg_submit(image->id, ISO_FILE_CANT_ADD, ret,
+                                 "Error when adding file %s", path);
+            goto dir_sync_continue;
+        }
+
+        if (check_excludes(image, path)) {
+            iso_msg_debug(image->id, "Skipping excluded file %s", path);
+            goto dir_sync_continue;
+        } else if (check_hidden(image, name)) {
+            iso_msg_debug(image->id, "Skipping hidden file %s", path);
+            goto dir_sync_continue;
+        } else if (check_special(image, info.st_mode)) {
+            iso_msg_debug(image->id, "Skipping special file %s", path);
+            goto dir_sync_continue;
+        }
+
+        ret = iso_image_truncate_name(image, name, &namept, 0);
+        if (ret < 0)
+            goto dir_sync_continue;
+
+        old = NULL;
+        found = NULL;
+        if (nolds > 0) {
+            key_node.name = namept;
+            found = bsearch(&key, olds, nolds, sizeof(IsoNode *),
+                            iso_tree_sync_name_cmp);
+        }
+        if (found != NULL && !seen[found - olds]) {
+            seen[found - olds] = 1;
+            old = *found;
+            is_current = iso_tree_sync_node_is_current(image, old, file,
+                                                       &info);
+            if (is_current) {
+                if (old->type == LIBISO_DIR) {
+                    if (!(flag & 2))
+                        recurse = 1;
+                    else
+                        iso_msg_debug(image->id,
+                                      "Skipping unchanged directory %s", path);
+                }
+                new = old;
+                ret = ISO_SUCCESS;
+                goto dir_sync_recurse;
+            }
+        }
+
+        ret = iso_dir_exists(parent, namept, &pos);
+        if (ret < 0)
+            goto ex;
+        if (ret && old == NULL) {
+            /* Two source names lead to the same truncated node name */
+            LIBISO_FREE_MEM(allocated_name); allocated_name = NULL;
+            ret = make_really_unique_name(parent, &namept, &allocated_name,
+                                          &pos, 0);
+            if (ret < 0)
+                goto ex;
+            image->collision_warnings++;
+            if (image->collision_warnings < ISO_IMPORT_COLL_WARN_MAX) {
+                ret = iso_msg_submit(image->id, ISO_IMPORT_COLLISION, 0, 
+                         "File name collision resolved with %s . Now: %s",
+                         path, namept);
+                if (ret < 0)
+                    goto ex;
+            }
+        }
+
+        if (image->report) {
+            int r = image->report(image, file);
+            if (r <= 0) {
+                ret = (r < 0 ? ISO_CANCELED : ISO_SUCCESS);
+                goto dir_sync_continue;
+            }
+        }
+        ret = builder->create_node(builder, image, file, namept, &new);
+        if (ret < 0) {
+            ret = iso_msg_submit(image->id, ISO_FILE_CANT_ADD, ret,
+                         "Error when adding file %s", path);
+            goto dir_sync_continue;
+        }
+        if (old != NULL && old->type == LIBISO_DIR &&
+            new->type == LIBISO_DIR) {
+            /* Keep the subtree for comparison with the new directory */
+            iso_tree_sync_move_children((IsoDir *) old, (IsoDir *) new);
+            recurse = 1;
+        }
+        ret = iso_dir_insert(parent, new, pos, ISO_REPLACE_ALWAYS);
+        if (ret < 0) {
+            iso_node_unref(new);
+            goto dir_sync_continue;
+        }
+        if (old != NULL)
+            iso_msg_debug(image->id, "Replaced changed file %s", path);
+        else
+            iso_msg_debug(image->id, "Added file %s", path);
+
+        if (new->type == LIBISO_DIR && S_ISDIR(info.st_mode) && !recurse) {
+            /* A new directory gets filled without comparison */
+            ret = iso_add_dir_src_rec(image, (IsoDir *) new, file);
+            goto dir_sync_continue;
+        }
+
+dir_sync_recurse:;
+        if (recurse && S_ISDIR(info.st_mode))
+            ret = iso_sync_dir_src_rec(image, (IsoDir *) new, file, flag);
+
+dir_sync_continue:;
+        free(path);
+        iso_file_source_unref(file);
+
+        if (ret < 0) {
+            ret = iso_msg_submit(image->id, ret, 0, NULL);
+            if (ret < 0)
+                goto ex;
+        }
+    } /* while */
+
+    if (!(flag & 1)) {
+        /* Remove nodes which have no counterpart in the source directory */
+        for (i = 0; i < nolds; i++) {
+            if (seen[i] || olds[i]->type == LIBISO_BOOT)
+        continue;
+            iso_msg_debug(image->id, "Removing vanished file %s",
+                          olds[i]->name);
+            ret = iso_node_remove(olds[i]);
+            if (ret < 0)
+                goto ex;
+        }
+    }
+
+    ret = ISO_SUCCESS;
+ex:;
+    if (dir_is_open)
+        iso_file_source_close(dir);
+    LIBISO_FREE_MEM(allocated_name);
+    for (i = 0; i < nolds; i++)
+        iso_node_unref(olds[i]);
+    LIBISO_FREE_MEM(olds);
+    LIBISO_FREE_MEM(seen);
+    return ret;
+}
+
+/* API */
+int iso_tree_sync_dir(IsoImage *image, IsoDir *parent, const char *dir,
+                      int flag)
+{
+    int result;
+    struct stat info;
+    IsoFilesystem *fs;
+    IsoFileSource *file;
+
+    if (image == NULL || parent == NULL || dir == NULL) {
+        return ISO_NULL_POINTER;
+    }
+
+    fs = image->fs;
+    result = fs->get_by_path(fs, dir, &file);
+    if (result < 0) {
+        return result;
+    }
+
+    /* we also allow dir path to be a symlink to a dir */
+    result = iso_file_source_stat(file, &info);
+    if (result < 0) {
+        iso_file_source_unref(file);
+        return result;
+    }
+
+    if (!S_ISDIR(info.st_mode)) {
+        iso_file_source_unref(file);
+        return ISO_FILE_IS_NOT_DIR;
+    }
+    result = iso_sync_dir_src_rec(image, parent, file, flag & 3);
+    iso_file_source_unref(file);
+    return result;
+}
+
 /* @param flag bit0= truncate according to image truncate mode and length
 */
 int iso_tree_path_to_node_flag(IsoImage *image, const char *path,
@@ -1354,8 +1855,355 @@ int iso_tree_copy_node_attr(IsoNode *old_node, IsoNode *new_node, int flag)
     return ISO_SUCCESS;
 }
 
+
+/* ------------------------ copy-on-write cloning ------------------------ */
+
+static
+void iso_tree_cow_set_origin(IsoDir *dir, IsoDir *origin)
+{
+    iso_node_ref((IsoNode *) origin);
+    dir->cow_origin = origin;
+    dir->cow_next = origin->cow_dependents;
+    origin->cow_dependents = dir;
+}
+
+void iso_tree_cow_release(IsoDir *dir)
+{
+    IsoDir **pos, *origin;
+
+    origin = dir->cow_origin;
+    if (origin == NULL)
+        return;
+    for (pos = &(origin->cow_dependents); *pos != NULL;
+         pos = &((*pos)->cow_next)) {
+        if (*pos == dir) {
+            *pos = dir->cow_next;
+    break;
+        }
+    }
+    dir->cow_origin = NULL;
+    dir->cow_next = NULL;
+    iso_node_unref((IsoNode *) origin);
+}
+
+/* Create an unattached clone of node. Directories get created as pending
+   copy-on-write clones of node.
+   @return 1= *new_node is valid , 0= node type is not to be cloned ,
+           <0 = error
+*/
+static
+int iso_tree_cow_clone_node(IsoNode *node, IsoNode **new_node)
+{
+    int ret;
+    char *name = NULL, *dest = NULL;
+    IsoStream *new_stream = NULL;
+    IsoDir *new_dir;
+    IsoFile *new_file;
+    IsoSymlink *new_sym;
+    IsoSpecial *new_spec;
+    IsoNode *new = NULL;
+
+    *new_node = NULL;
+    if (node->type == LIBISO_BOOT)
+        return 0; /* Like with iso_tree_clone() */
+    name = strdup(node->name);
+    if (name == NULL)
+        return ISO_OUT_OF_MEM;
+
+    if (node->type == LIBISO_DIR) {
+        ret = iso_node_new_dir(name, &new_dir);
+        if (ret < 0)
+            goto ex;
+        new = (IsoNode *) new_dir;
+        iso_tree_cow_set_origin(new_dir, (IsoDir *) node);
+
+    } else if (node->type == LIBISO_FILE) {
+        ret = iso_stream_clone(((IsoFile *) node)->stream, &new_stream, 0);
+        if (ret < 0)
+            goto ex;
+        ret = iso_node_new_file(name, new_stream, &new_file);
+        if (ret < 0)
+            goto ex;
+        new_stream = NULL;
+        new_file->sort_weight = ((IsoFile *) node)->sort_weight;
+        new = (IsoNode *) new_file;
+
+    } else if (node->type == LIBISO_SYMLINK) {
+        dest = strdup(((IsoSymlink *) node)->dest);
+        if (dest == NULL) {
+            ret = ISO_OUT_OF_MEM;
+            goto ex;
+        }
+        ret = iso_node_new_symlink(name, dest, &new_sym);
+        if (ret < 0)
+            goto ex;
+        dest = NULL;
+        new_sym->fs_id = ((IsoSymlink *) node)->fs_id;
+        new_sym->st_dev = ((IsoSymlink *) node)->st_dev;
+        new_sym->st_ino = ((IsoSymlink *) node)->st_ino;
+        new = (IsoNode *) new_sym;
+
+    } else if (node->type == LIBISO_SPECIAL) {
+        ret = iso_node_new_special(name, node->mode,
+                                   ((IsoSpecial *) node)->dev, &new_spec);
+        if (ret < 0)
+            goto ex;
+        new_spec->fs_id = ((IsoSpecial *) node)->fs_id;
+        new_spec->st_dev = ((IsoSpecial *) node)->st_dev;
+        new_spec->st_ino = ((IsoSpecial *) node)->st_ino;
+        new = (IsoNode *) new_spec;
+
+    } else {
+        ret = ISO_ASSERT_FAILURE;
+        goto ex;
+    }
+    name = NULL; /* now owned by new */
+
+    ret = iso_tree_copy_node_attr(node, new, 0);
+    if (ret < 0)
+        goto ex;
+    *new_node = new;
+    new = NULL;
+    ret = ISO_SUCCESS;
+ex:;
+    if (new != NULL)
+        iso_node_unref(new);
+    if (new_stream != NULL)
+        iso_stream_unref(new_stream);
+    LIBISO_FREE_MEM(name);
+    LIBISO_FREE_MEM(dest);
+    return ret;
+}
+
+int iso_tree_cow_materialize(IsoDir *dir, int flag)
+{
+    int ret;
+    size_t count = 0;
+    IsoDir *origin;
+    IsoNode *pos, *new_node, *list = NULL, **tail;
+
+    ret = iso_tree_lazy_load(dir);
+    if (ret < 0)
+        return ret;
+    origin = dir->cow_origin;
+    if (origin != NULL) {
+        ret = iso_tree_cow_materialize(origin, 0);
+        if (ret < 0)
+            return ret;
+
+        /* The child list is sorted by name. So its order can be kept. */
+        tail = &list;
+        for (pos = origin->children; pos != NULL; pos = pos->next) {
+            ret = iso_tree_cow_clone_node(pos, &new_node);
+            if (ret < 0)
+                goto ex;
+            if (ret == 0)
+        continue;
+            new_node->parent = dir;
+            *tail = new_node;
+            tail = &(new_node->next);
+            count++;
+        }
+        *tail = dir->children;
+        dir->children = list;
+        dir->nchildren += count;
+        list = NULL;
+        iso_tree_cow_release(dir);
+    }
+    if (flag & 1) {
+        for (pos = dir->children; pos != NULL; pos = pos->next) {
+            if (pos->type != LIBISO_DIR)
+        continue;
+            ret = iso_tree_cow_materialize((IsoDir *) pos, flag & 1);
+            if (ret < 0)
+                return ret;
+        }
+    }
+    ret = ISO_SUCCESS;
+ex:;
+    while (list != NULL) {
+        pos = list->next;
+        list->parent = NULL;
+        iso_node_unref(list);
+        list = pos;
+    }
+    return ret;
+}
+
+/* Materialize the pending clones of dir and of all its ancestors, beginning
+   at the root. Materializing the clones of a directory creates new pending
+   clones of its subdirectories, which are handled on the next lower level.
+   The clone relations are recorded only in the directories of the trees
+   involved. So there is no state which would be shared among images, but
+   every change has to look at all ancestors.
+*/
+static
+int iso_tree_cow_detach_dir(IsoDir *dir)
+{
+    int ret;
+    IsoDir *parent;
+
+    parent = dir->node.parent;
+    if (parent != NULL && parent != dir) {
+        ret = iso_tree_cow_detach_dir(parent);
+        if (ret < 0)
+            return ret;
+    }
+    while (dir->cow_dependents != NULL) {
+        ret = iso_tree_cow_materialize(dir->cow_dependents, 0);
+        if (ret < 0)
+            return ret;
+    }
+    return ISO_SUCCESS;
+}
+
+int iso_tree_cow_detach(IsoNode *node)
+{
+    int ret;
+
+    if (node == NULL)
+        return ISO_SUCCESS;
+    if (node->type == LIBISO_DIR)
+        ret = iso_tree_cow_detach_dir((IsoDir *) node);
+    else if (node->parent != NULL)
+        ret = iso_tree_cow_detach_dir(node->parent);
+    else
+        ret = ISO_SUCCESS;
+    if (ret < 0)
+        iso_msg_submit(-1, ret, 0,
+                       "Cannot materialize copy-on-write clone of directory");
+    return ret;
+}
+
+int iso_tree_cow_load(IsoDir *dir, int flag)
+{
+    int ret;
+    IsoDir *content;
+    IsoNode *pos;
+
+    if (flag & 2) {
+        ret = iso_tree_cow_materialize(dir, 0);
+        if (ret < 0)
+            return ret;
+        while (dir->cow_dependents != NULL) {
+            ret = iso_tree_cow_materialize(dir->cow_dependents, 0);
+            if (ret < 0)
+                return ret;
+        }
+    } else {
+        for (content = dir; content != NULL; content = content->cow_origin) {
+            ret = iso_tree_lazy_load(content);
+            if (ret < 0)
+                return ret;
+        }
+    }
+    if (flag & 1) {
+        for (pos = iso_tree_cow_child(dir, NULL); pos != NULL;
+             pos = iso_tree_cow_child(dir, pos)) {
+            if (pos->type != LIBISO_DIR)
+        continue;
+            ret = iso_tree_cow_load((IsoDir *) pos, flag & 3);
+            if (ret < 0)
+                return ret;
+        }
+    }
+    return ISO_SUCCESS;
+}
+
+/* A pending clone has no children of its own. Its content is the child list
+   of the last directory in its chain of origins, except the boot catalog
+   which does not get cloned.
+*/
+IsoNode *iso_tree_cow_child(IsoDir *dir, IsoNode *pos)
+{
+    IsoDir *content;
+
+    if (pos == NULL) {
+        for (content = dir; content->cow_origin != NULL;
+             content = content->cow_origin);
+        pos = content->children;
+    } else {
+        pos = pos->next;
+    }
+    if (dir->cow_origin != NULL)
+        while (pos != NULL && pos->type == LIBISO_BOOT)
+            pos = pos->next;
+    return pos;
+}
+
+size_t iso_tree_cow_count(IsoDir *dir)
+{
+    size_t count = 0;
+    IsoNode *pos;
+
+    if (dir->cow_origin == NULL)
+        return dir->nchildren;
+    for (pos = iso_tree_cow_child(dir, NULL); pos != NULL;
+         pos = iso_tree_cow_child(dir, pos))
+        count++;
+    return count;
+}
+
+char *iso_tree_get_walk_path(struct iso_tree_walk_dir *up, IsoNode *node)
+{
+    char *path = NULL, *parent_path = NULL;
+
+    if (up == NULL)
+        return iso_tree_get_node_path(node);
+    if (node == NULL)
+        return NULL;
+    parent_path = iso_tree_get_walk_path(up->up, up->node);
+    if (parent_path == NULL)
+        goto ex;
+    path = calloc(1, strlen(parent_path) + strlen(node->name) + 2);
+    if (path == NULL)
+        goto ex;
+    if (strlen(parent_path) == 1)
+        sprintf(path, "/%s", node->name);
+    else
+        sprintf(path, "%s/%s", parent_path, node->name);
+ex:;
+    if (parent_path != NULL)
+        free(parent_path);
+    return path;
+}
+
+/* Create a copy-on-write clone of old_dir. It gets attached to new_parent
+   only after its origin is set, so that it does not become part of its own
+   cloned content if new_parent is inside the subtree of old_dir.
+*/
+static
+int iso_tree_clone_dir_cow(IsoDir *old_dir,
+                           IsoDir *new_parent, char *new_name,
+                           IsoNode **new_node, int flag)
+{
+    IsoDir *new_dir = NULL;
+    char *name;
+    int ret;
+
+    *new_node = NULL;
+    name = strdup(new_name);
+    if (name == NULL)
+        return ISO_OUT_OF_MEM;
+    ret = iso_node_new_dir(name, &new_dir);
+    if (ret < 0) {
+        free(name);
+        return ret;
+    }
+    iso_tree_cow_set_origin(new_dir, old_dir);
+    ret = iso_dir_add_node(new_parent, (IsoNode *) new_dir, ISO_REPLACE_NEVER);
+    if (ret < 0) {
+        iso_node_unref((IsoNode *) new_dir);
+        return ret;
+    }
+    *new_node = (IsoNode *) new_dir;
+    return ISO_SUCCESS;
+}
+
+
 /*
   @param flag bit0= merge directory with *new_node
+              bit2= create copy-on-write clones of subdirectories
 */
 static
 int iso_tree_clone_dir(IsoDir *old_dir,
@@ -1388,7 +2236,7 @@ int iso_tree_clone_dir(IsoDir *old_dir,
         if (ret == 0)
     break;
         ret = iso_tree_clone(sub_node, new_dir, sub_node->name, &new_sub_node,
-                             flag & 1);
+                             flag & 5);
         if (ret < 0)
             goto ex;
     }
@@ -1488,6 +2336,7 @@ int iso_tree_clone_special(IsoSpecial *node,
 
 /* @param flag bit0= Merge directories rather than ISO_NODE_NAME_NOT_UNIQUE.
                bit1= issue warning in case of truncation
+               bit2= copy-on-write cloning of directories
 */
 int iso_tree_clone_trunc(IsoNode *node, IsoDir *new_parent, 
                          char *new_name_in, IsoNode **new_node, 
@@ -1509,7 +2358,10 @@ int iso_tree_clone_trunc(IsoNode *node, IsoDir *new_parent,
             goto ex;
         new_name = trunc;
     }
-    if (iso_dir_get_node(new_parent, new_name, new_node) == 1) {
+    ret = iso_dir_get_node(new_parent, new_name, new_node);
+    if (ret < 0)
+        goto ex;
+    if (ret == 1) {
         if (! (node->type == LIBISO_DIR && (*new_node)->type == LIBISO_DIR &&
                (flag & 1))) {
             *new_node = NULL;
@@ -1519,9 +2371,12 @@ int iso_tree_clone_trunc(IsoNode *node, IsoDir *new_parent,
     } else
         flag &= ~1;
 
-    if (node->type == LIBISO_DIR) {
+    if (node->type == LIBISO_DIR && (flag & 4) && !(flag & 1)) {
+        ret = iso_tree_clone_dir_cow((IsoDir *) node, new_parent, new_name,
+                                     new_node, 0);
+    } else if (node->type == LIBISO_DIR) {
         ret = iso_tree_clone_dir((IsoDir *) node, new_parent, new_name,
-                                 new_node, flag & 1);
+                                 new_node, flag & 5);
     } else if (node->type == LIBISO_FILE) {
         ret = iso_tree_clone_file((IsoFile *) node, new_parent, new_name, 
                                   new_node, 0);
@@ -1555,7 +2410,7 @@ int iso_tree_clone(IsoNode *node,
                    int flag)
 {
     return iso_tree_clone_trunc(node, new_parent, new_name, new_node, 0,
-                                flag & 1); 
+                                flag & 5); 
 }
 
 
@@ -1570,7 +2425,7 @@ int iso_image_tree_clone(IsoImage *image, IsoNode *node, IsoDir *new_parent,
     else
         length = image->truncate_length;
     ret = iso_tree_clone_trunc(node, new_parent, new_name, new_node, length,
-                               flag & 3);
+                               flag & 7);
     return ret;
 }
 
@@ -1621,6 +2476,9 @@ int iso_tree_resolve_symlink(IsoImage *img, IsoSymlink *sym, IsoNode **res,
         }
 
         /* Search node in cur_dir */
+        ret = iso_tree_cow_materialize(cur_dir, 0);
+        if (ret < 0)
+            return ret;
         for (n = cur_dir->children; n != NULL; n = n->next)
             if (strncmp(dest_start, n->name, comp_len) == 0 &&
                 strlen(n->name) == comp_len)
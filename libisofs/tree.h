@@ -19,9 +19,138 @@
  */
 int iso_add_dir_src_rec(IsoImage *image, IsoDir *parent, IsoFileSource *dir);
 
+/**
+ * Shared state of the directories which were created by a lazy image
+ * import. See iso_read_opts_set_lazy_tree().
+ */
+struct iso_lazy_import
+{
+    int refcount;
+
+    /* The image which got the imported tree. NULL after it was disposed
+       or after another import replaced its tree.
+     */
+    IsoImage *image;
+
+    /* The node builder of the import. A reference is held. */
+    IsoNodeBuilder *builder;
+
+    /* The filesystem of the import. A reference is held. */
+    IsoFilesystem *fs;
+
+    /* Called after the children of dir were added to the tree */
+    int (*loaded)(struct iso_lazy_import *lazy, IsoDir *dir);
+};
+
+int iso_lazy_import_new(IsoImage *image, IsoNodeBuilder *builder,
+                        IsoFilesystem *fs, struct iso_lazy_import **lazy);
+
+void iso_lazy_import_unref(struct iso_lazy_import *lazy);
+
+/**
+ * Add the children of dir to parent like iso_add_dir_src_rec(), but do not
+ * recurse into subdirectories. They get equipped with their file source
+ * for loading on first access.
+ */
+int iso_add_dir_src_lazy(IsoImage *image, IsoDir *parent, IsoFileSource *dir,
+                         struct iso_lazy_import *lazy);
+
+/**
+ * Give up the file source of a lazily imported directory which gets
+ * disposed.
+ */
+void iso_tree_lazy_release(IsoDir *dir);
+
 
 int iso_tree_get_node_of_block(IsoImage *image, IsoDir *dir, uint32_t block,
                               IsoNode **found, uint32_t *next_above, int flag);
+
+
+/**
+ * Clone the children of the origin of a copy-on-write directory clone into
+ * the directory. Subdirectories become copy-on-write clones themselves.
+ * A lazily imported directory gets its children loaded.
+ * Nothing happens if the directory is neither a pending copy-on-write clone
+ * nor waiting for lazy loading.
+ *
+ * @param flag bit0= recursively materialize the whole subtree
+ * @return
+ *      1 on success, < 0 on error
+ */
+int iso_tree_cow_materialize(IsoDir *dir, int flag);
+
+/**
+ * To be called before a node or the child list of a directory gets changed.
+ * Materializes all pending copy-on-write clones which would see the change.
+ *
+ * @return
+ *      1 on success, < 0 on error
+ */
+int iso_tree_cow_detach(IsoNode *node);
+
+/**
+ * Give up the origin of a pending copy-on-write clone which gets disposed.
+ */
+void iso_tree_cow_release(IsoDir *dir);
+
+/**
+ * Make the content of a directory available for iso_tree_cow_child()
+ * without cloning. Lazily imported directories get loaded, including the
+ * origins of pending copy-on-write clones.
+ *
+ * @param flag bit0= do this for the whole subtree
+ *             bit1= the subtree is going to be changed: materialize the
+ *                   pending clones in it and let the pending clones of its
+ *                   directories get their content first
+ * @return
+ *      1 on success, < 0 on error
+ */
+int iso_tree_cow_load(IsoDir *dir, int flag);
+
+/**
+ * Iterate over the children of a directory as iso_tree_cow_materialize()
+ * would create them, but without cloning. A pending copy-on-write clone
+ * shows the nodes of its origin. They must not be changed, and their parent
+ * pointers lead into the origin tree.
+ * iso_tree_cow_load() has to be called before.
+ *
+ * @param pos
+ *      NULL for getting the first child, else the previously returned child
+ * @return
+ *      The next child, NULL if there is none
+ */
+IsoNode *iso_tree_cow_child(IsoDir *dir, IsoNode *pos);
+
+/**
+ * Number of children which iso_tree_cow_child() delivers.
+ */
+size_t iso_tree_cow_count(IsoDir *dir);
+
+/**
+ * A directory on the way of a tree walk by iso_tree_cow_child(). The chain
+ * of these records gives the path by which a node was reached, even if the
+ * node belongs to the origin of a pending copy-on-write clone.
+ */
+struct iso_tree_walk_dir {
+    IsoNode *node;
+
+    /* The directory by which node was reached, NULL if node was reached
+       by its own parent pointers.
+    */
+    struct iso_tree_walk_dir *up;
+};
+
+/**
+ * Get the path of a node as reached by a tree walk with
+ * iso_tree_cow_child(), rather than the path in the tree of the origin.
+ *
+ * @param up
+ *      The directory by which node was reached. NULL means to follow the
+ *      parent pointers of node, like iso_tree_get_node_path().
+ * @return
+ *      The path as newly allocated string, or NULL on error
+ */
+char *iso_tree_get_walk_path(struct iso_tree_walk_dir *up, IsoNode *node);
  
 
 #endif /*LIBISO_IMAGE_TREE_H_*/
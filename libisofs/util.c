@@ -22,11 +22,13 @@
 #include <stdlib.h>
 #include <wchar.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <limits.h>
 #include <iconv.h>
+#include <pthread.h>
 #include <locale.h>
 #include <langinfo.h>
 
@@ -44,12 +46,158 @@
 static int iso_iconv_debug = 0;
 
 
+/* Number of iconv descriptors which each thread keeps open */
+#define ISO_ICONV_CACHE_SIZE 8
+
+/* iconv_open() is expensive. So the descriptors get kept per thread and
+   per pair of character set names for reuse by the next conversion.
+   Failed iconv_open() calls are remembered too, with descr (iconv_t) -1.
+*/
+struct iso_iconv_cache_entry {
+    char *tocode;
+    char *fromcode;
+    iconv_t descr;
+    int in_use;
+};
+
+struct iso_iconv_cache {
+    struct iso_iconv_cache_entry entries[ISO_ICONV_CACHE_SIZE];
+    int num_entries;
+
+    /* Where to start looking for an entry to be replaced */
+    int next_victim;
+};
+
+static pthread_key_t iso_iconv_cache_key;
+static pthread_once_t iso_iconv_cache_once = PTHREAD_ONCE_INIT;
+static int iso_iconv_cache_key_ok = 0;
+
+
 struct iso_iconv_handle {
-    int status;  /* bit0= open , bit1= identical mapping */
+    int status;  /* bit0= open , bit1= identical mapping ,
+                    bit2= descr belongs to cache_entry */
     iconv_t descr;
+    struct iso_iconv_cache_entry *cache_entry;
 };
 
 
+static
+void iso_iconv_cache_free(void *arg)
+{
+    struct iso_iconv_cache *cache = arg;
+    struct iso_iconv_cache_entry *entry;
+    int i;
+
+    if (cache == NULL)
+        return;
+    for (i = 0; i < cache->num_entries; i++) {
+        entry = &(cache->entries[i]);
+        if (entry->descr != (iconv_t) -1)
+            iconv_close(entry->descr);
+        free(entry->tocode);
+        free(entry->fromcode);
+    }
+    free(cache);
+}
+
+static
+void iso_iconv_cache_make_key(void)
+{
+    if (pthread_key_create(&iso_iconv_cache_key, iso_iconv_cache_free) == 0)
+        iso_iconv_cache_key_ok = 1;
+}
+
+/* @return  The cache of the calling thread or NULL if none is available
+*/
+static
+struct iso_iconv_cache *iso_iconv_cache_get(void)
+{
+    struct iso_iconv_cache *cache;
+
+    pthread_once(&iso_iconv_cache_once, iso_iconv_cache_make_key);
+    if (!iso_iconv_cache_key_ok)
+        return NULL;
+    cache = pthread_getspecific(iso_iconv_cache_key);
+    if (cache != NULL)
+        return cache;
+    cache = calloc(1, sizeof(struct iso_iconv_cache));
+    if (cache == NULL)
+        return NULL;
+    if (pthread_setspecific(iso_iconv_cache_key, cache) != 0) {
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+/* Obtain an entry for a new descriptor. An unused entry gets closed and
+   reused if the cache is full.
+   @return  The entry or NULL if none is available
+*/
+static
+struct iso_iconv_cache_entry *iso_iconv_cache_add(struct iso_iconv_cache *cache,
+                                                  char *tocode, char *fromcode,
+                                                  iconv_t descr)
+{
+    struct iso_iconv_cache_entry *entry = NULL;
+    char *to = NULL, *from = NULL;
+    int i, idx;
+
+    to = strdup(tocode);
+    from = strdup(fromcode);
+    if (to == NULL || from == NULL)
+        goto fail;
+    if (cache->num_entries < ISO_ICONV_CACHE_SIZE) {
+        entry = &(cache->entries[cache->num_entries++]);
+    } else {
+        for (i = 0; i < ISO_ICONV_CACHE_SIZE; i++) {
+            idx = (cache->next_victim + i) % ISO_ICONV_CACHE_SIZE;
+            if (!cache->entries[idx].in_use) {
+                entry = &(cache->entries[idx]);
+                cache->next_victim = (idx + 1) % ISO_ICONV_CACHE_SIZE;
+        break;
+            }
+        }
+        if (entry == NULL)
+            goto fail;
+        if (entry->descr != (iconv_t) -1)
+            iconv_close(entry->descr);
+        free(entry->tocode);
+        free(entry->fromcode);
+    }
+    entry->tocode = to;
+    entry->fromcode = from;
+    entry->descr = descr;
+    entry->in_use = 0;
+    return entry;
+fail:;
+    if (to != NULL)
+        free(to);
+    if (from != NULL)
+        free(from);
+    return NULL;
+}
+
+/* Close the iconv descriptors which were kept for the calling thread.
+   The descriptors of other threads get closed when these threads end.
+   This function is supposed to be called by iso_finish() only.
+*/
+int iso_iconv_cache_destroy(int flag)
+{
+    struct iso_iconv_cache *cache;
+
+    pthread_once(&iso_iconv_cache_once, iso_iconv_cache_make_key);
+    if (!iso_iconv_cache_key_ok)
+        return 0;
+    cache = pthread_getspecific(iso_iconv_cache_key);
+    if (cache == NULL)
+        return 0;
+    pthread_setspecific(iso_iconv_cache_key, NULL);
+    iso_iconv_cache_free(cache);
+    return 1;
+}
+
+
 /*
    @param flag    bit0= shortcut by identical mapping is not allowed
 */
@@ -57,22 +205,60 @@ static
 int iso_iconv_open(struct iso_iconv_handle *handle,
                    char *tocode, char *fromcode, int flag)
 {
+    struct iso_iconv_cache *cache;
+    struct iso_iconv_cache_entry *entry = NULL;
+    int i;
+
     handle->status = 0;
     handle->descr = (iconv_t) -1;
+    handle->cache_entry = NULL;
 
     if (strcmp(tocode, fromcode) == 0 && !(flag & 1)) {
         handle->status = 1 | 2;
         return 1;
     }
+
+    cache = iso_iconv_cache_get();
+    if (cache != NULL) {
+        for (i = 0; i < cache->num_entries; i++) {
+            entry = &(cache->entries[i]);
+            if (strcmp(entry->tocode, tocode) == 0 &&
+                strcmp(entry->fromcode, fromcode) == 0) {
+                if (entry->descr == (iconv_t) -1)
+                    return 0;
+                if (!entry->in_use) {
+                    entry->in_use = 1;
+                    handle->descr = entry->descr;
+                    handle->cache_entry = entry;
+                    handle->status = 1 | 4;
+                    return 1;
+                }
+                /* In use by an outer conversion. Get an own descriptor. */
+                cache = NULL;
+        break;
+            }
+        }
+    }
+
     handle->descr = iconv_open(tocode, fromcode);
     if (handle->descr == (iconv_t) -1) {
         if (strlen(tocode) + strlen(fromcode) <= 160 && iso_iconv_debug)
             fprintf(stderr, 
            "libisofs_DEBUG: iconv_open(\"%s\", \"%s\") failed: errno= %d %s\n",
                     tocode, fromcode, errno, strerror(errno));
+        if (cache != NULL)
+            iso_iconv_cache_add(cache, tocode, fromcode, (iconv_t) -1);
         return 0;
     }
     handle->status = 1;
+    if (cache != NULL) {
+        entry = iso_iconv_cache_add(cache, tocode, fromcode, handle->descr);
+        if (entry != NULL) {
+            entry->in_use = 1;
+            handle->cache_entry = entry;
+            handle->status |= 4;
+        }
+    }
     return 1;
 }
 
@@ -143,6 +329,12 @@ int iso_iconv_close(struct iso_iconv_handle *handle, int flag)
     handle->status &= ~1;
     if (handle->status & 2)
         return 0;
+    if (handle->status & 4) {
+        /* Reset the shift state and leave the descriptor to the cache */
+        iconv(handle->descr, NULL, NULL, NULL, NULL);
+        handle->cache_entry->in_use = 0;
+        return 0;
+    }
 
     ret = iconv_close(handle->descr);
     if (ret == -1) {
@@ -189,6 +381,130 @@ char *iso_get_local_charset(int flag)
    return nl_langinfo(CODESET);
 }
 
+/* Classify a character set name for the conversions which do not need
+   iconv().
+   @return  bit0= UTF-8 , bit1= ASCII is a subset of the character set
+*/
+static
+int iso_charset_class(const char *name)
+{
+    static char *ascii_names[] = {
+        "ASCII", "US-ASCII", "ANSI_X3.4-1968", "646"
+    };
+    static char *ascii_prefixes[] = {
+        "ISO-8859-", "ISO8859-", "ISO_8859-", "CP125", "WINDOWS-125"
+    };
+    size_t i, l;
+
+    if (strcasecmp(name, "UTF-8") == 0 || strcasecmp(name, "UTF8") == 0)
+        return 1 | 2;
+    for (i = 0; i < sizeof(ascii_names) / sizeof(char *); i++)
+        if (strcasecmp(name, ascii_names[i]) == 0)
+            return 2;
+    for (i = 0; i < sizeof(ascii_prefixes) / sizeof(char *); i++) {
+        l = strlen(ascii_prefixes[i]);
+        if (strncasecmp(name, ascii_prefixes[i], l) == 0 &&
+            name[l] >= '0' && name[l] <= '9')
+            return 2;
+    }
+    return 0;
+}
+
+static
+int iso_str_is_ascii(const char *str, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        if (((unsigned char *) str)[i] >= 0x80)
+            return 0;
+    return 1;
+}
+
+/* Convert UTF-8 to UTF-16BE without iconv(). Input which iconv() would not
+   convert completely is left to iconv() and its error handling.
+   @param flag    bit0= produce UCS-2BE, i.e. only characters up to 0xFFFF
+   @return        1 = done , 0 = not applicable , < 0 = error
+*/
+static
+int iso_utf8_to_utf16be(const char *input, uint16_t **output, int flag)
+{
+    const unsigned char *src;
+    uint16_t *wpt;
+    uint32_t c;
+    size_t len = 0;
+    int n, i;
+
+    /* The number of UTF-16 words does not exceed the number of bytes */
+    for (src = (unsigned char *) input; *src; src++)
+        len++;
+    *output = malloc((len + 1) * sizeof(uint16_t));
+    if (*output == NULL)
+        return ISO_OUT_OF_MEM;
+    wpt = *output;
+    for (src = (unsigned char *) input; *src; ) {
+        c = *src;
+        if (c < 0x80) {
+            *(wpt++) = iso_htons(c);
+            src++;
+    continue;
+        } else if (c >= 0xc2 && c <= 0xdf) {
+            n = 1;
+            c &= 0x1f;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            n = 2;
+            c &= 0x0f;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            n = 3;
+            c &= 0x07;
+        } else {
+            goto not_applicable;
+        }
+        for (i = 1; i <= n; i++) {
+            if ((src[i] & 0xc0) != 0x80)
+                goto not_applicable;
+            c = (c << 6) | (src[i] & 0x3f);
+        }
+        /* Overlong sequences, surrogates, and beyond Unicode */
+        if ((n == 2 && c < 0x800) || (n == 3 && c < 0x10000) ||
+            (c >= 0xd800 && c <= 0xdfff) || c > 0x10ffff)
+            goto not_applicable;
+        if (c >= 0x10000) {
+            if (flag & 1)
+                goto not_applicable;
+            c -= 0x10000;
+            *(wpt++) = iso_htons(0xd800 | (c >> 10));
+            *(wpt++) = iso_htons(0xdc00 | (c & 0x3ff));
+        } else {
+            *(wpt++) = iso_htons(c);
+        }
+        src += n + 1;
+    }
+    *wpt = 0;
+    return 1;
+
+not_applicable:;
+    free(*output);
+    *output = NULL;
+    return 0;
+}
+
+/* Convert ASCII to UCS-2BE or UTF-16BE without iconv().
+*/
+static
+int iso_ascii_to_utf16be(const char *input, uint16_t **output)
+{
+    size_t len, i;
+
+    len = strlen(input);
+    *output = malloc((len + 1) * sizeof(uint16_t));
+    if (*output == NULL)
+        return ISO_OUT_OF_MEM;
+    for (i = 0; i <= len; i++)
+        (*output)[i] = iso_htons(((unsigned char *) input)[i]);
+    return ISO_SUCCESS;
+}
+
 int strconv(const char *str, const char *icharset, const char *ocharset,
             char **output)
 {
@@ -204,6 +520,13 @@ int strconv(const char *str, const char *icharset, const char *ocharset,
     int retval;
 
     inbytes = strlen(str);
+    if ((iso_charset_class(icharset) & 2) &&
+        (iso_charset_class(ocharset) & 2) && iso_str_is_ascii(str, inbytes)) {
+        *output = strdup(str);
+        if (*output == NULL)
+            return ISO_OUT_OF_MEM;
+        return ISO_SUCCESS;
+    }
     outbytes = (inbytes + 1) * MB_LEN_MAX;
     out = calloc(outbytes, 1);
     if (out == NULL) {
@@ -255,6 +578,16 @@ int strnconvl(const char *str, const char *icharset, const char *ocharset,
     int retval;
 
     inbytes = len;
+    if ((iso_charset_class(icharset) & 2) &&
+        (iso_charset_class(ocharset) & 2) && iso_str_is_ascii(str, len)) {
+        *output = malloc(len + 1);
+        if (*output == NULL)
+            return ISO_OUT_OF_MEM;
+        memcpy(*output, str, len);
+        (*output)[len] = 0;
+        *out_len = len;
+        return ISO_SUCCESS;
+    }
     outbytes = (inbytes + 1) * MB_LEN_MAX;
     out = calloc(outbytes, 1);
     if (out == NULL) {
@@ -416,6 +749,14 @@ int str2ascii(const char *icharset, const char *input, char **output)
         return ISO_NULL_POINTER;
     }
 
+    if ((iso_charset_class(icharset) & 2) &&
+        iso_str_is_ascii(input, strlen(input))) {
+        *output = strdup(input);
+        if (*output == NULL)
+            return ISO_OUT_OF_MEM;
+        return ISO_SUCCESS;
+    }
+
     /* First try the traditional way via intermediate character set WCHAR_T.
      * Up to August 2011 this was the only way. But it will not work if
      * there is no character set "WCHAR_T". E.g. on Solaris.
@@ -557,7 +898,7 @@ int cmp_ucsbe(const uint16_t *ucs, char c)
 
 int str2ucs(const char *icharset, const char *input, uint16_t **output)
 {
-    int result;
+    int result, cls;
     wchar_t *wsrc_ = NULL;
     char *src;
     char *ret = NULL;
@@ -578,6 +919,15 @@ int str2ucs(const char *icharset, const char *input, uint16_t **output)
         return ISO_NULL_POINTER;
     }
 
+    cls = iso_charset_class(icharset);
+    if ((cls & 2) && iso_str_is_ascii(input, strlen(input)))
+        return iso_ascii_to_utf16be(input, output);
+    if (cls & 1) {
+        result = iso_utf8_to_utf16be(input, output, 1);
+        if (result != 0)
+            return result;
+    }
+
     /* convert the string to a wide character string. Note: outbytes
      * is in fact the number of characters in the string and doesn't
      * include the last NULL character.
@@ -686,7 +1036,7 @@ int str2ucs(const char *icharset, const char *input, uint16_t **output)
 
 int str2utf16be(const char *icharset, const char *input, uint16_t **output)
 {
-    int result;
+    int result, cls;
     wchar_t *wsrc_ = NULL;
     char *src;
     char *ret = NULL;
@@ -704,6 +1054,15 @@ int str2utf16be(const char *icharset, const char *input, uint16_t **output)
         return ISO_NULL_POINTER;
     }
 
+    cls = iso_charset_class(icharset);
+    if ((cls & 2) && iso_str_is_ascii(input, strlen(input)))
+        return iso_ascii_to_utf16be(input, output);
+    if (cls & 1) {
+        result = iso_utf8_to_utf16be(input, output, 0);
+        if (result != 0)
+            return result;
+    }
+
     /* 
       Try the direct conversion.
     */ 
@@ -1372,23 +1731,19 @@ int ucscmp(const uint16_t *s1, const uint16_t *s2)
 {
     const uint8_t *s = (const uint8_t*)s1;
     const uint8_t *t = (const uint8_t*)s2;
-    size_t len1 = ucslen(s1);
-    size_t len2 = ucslen(s2);
-    size_t i, len = MIN(len1, len2) * 2;
+    unsigned int c1, c2;
 
-    for (i = 0; i < len; i++) {
-        if (s[i] < t[i]) {
-            return -1;
-        } else if (s[i] > t[i]) {
-            return 1;
-        }
+    /* A single pass. The shorter string meets its 0-terminator first and
+       sorts lower if all characters before were equal.
+    */
+    for (;; s += 2, t += 2) {
+        c1 = (s[0] << 8) | s[1];
+        c2 = (t[0] << 8) | t[1];
+        if (c1 != c2)
+            return (c1 < c2) ? -1 : 1;
+        if (c1 == 0)
+            return 0;
     }
-
-    if (len1 < len2)
-        return -1;
-    else if (len1 > len2)
-        return 1;
-    return 0;
 }
 
 uint16_t *ucscpy(uint16_t *dest, const uint16_t *src)
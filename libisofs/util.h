@@ -117,6 +117,12 @@ int str2ucs(const char *icharset, const char *input, uint16_t **output);
  */
 int str2utf16be(const char *icharset, const char *input, uint16_t **output);
 
+/**
+ * Close the iconv descriptors which the calling thread keeps for reuse.
+ * This function is supposed to be called by iso_finish() only.
+ */
+int iso_iconv_cache_destroy(int flag);
+
 /**
  * Create a level 1 directory identifier.
  * 
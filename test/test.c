@@ -1,5 +1,108 @@
 #include "test.h"
 
+#include <stdlib.h>
+#include <string.h>
+
+
+static int test_mem_src_open(IsoDataSource *src)
+{
+    return ISO_SUCCESS;
+}
+
+static int test_mem_src_close(IsoDataSource *src)
+{
+    return ISO_SUCCESS;
+}
+
+static int test_mem_src_read_block(IsoDataSource *src, uint32_t lba,
+                                   uint8_t *buffer)
+{
+    struct test_mem_src *mem = src->data;
+
+    if (mem->fail || ((size_t) lba + 1) * 2048 > mem->size)
+        return ISO_DATA_SOURCE_FAILURE;
+    memcpy(buffer, mem->data + (size_t) lba * 2048, 2048);
+    return ISO_SUCCESS;
+}
+
+static void test_mem_src_free(IsoDataSource *src)
+{
+    return;
+}
+
+int test_mem_src_new(struct test_mem_src *mem, IsoDataSource **src)
+{
+    IsoDataSource *ds;
+
+    ds = calloc(1, sizeof(IsoDataSource));
+    if (ds == NULL)
+        return ISO_OUT_OF_MEM;
+    ds->version = 0;
+    ds->refcount = 1;
+    ds->open = test_mem_src_open;
+    ds->close = test_mem_src_close;
+    ds->read_block = test_mem_src_read_block;
+    ds->free_data = test_mem_src_free;
+    ds->data = mem;
+    *src = ds;
+    return ISO_SUCCESS;
+}
+
+int test_write_image(IsoImage *image, IsoWriteOpts *opts,
+                     uint8_t **data, size_t *size)
+{
+    int ret;
+    struct burn_source *burn_src;
+    uint8_t *buf;
+
+    *data = NULL;
+    *size = 0;
+    ret = iso_image_create_burn_source(image, opts, &burn_src);
+    if (ret < 0)
+        return ret;
+    while (1) {
+        buf = realloc(*data, *size + 2048);
+        if (buf == NULL) {
+            ret = ISO_OUT_OF_MEM;
+            break;
+        }
+        *data = buf;
+        if (burn_src->read_xt(burn_src, *data + *size, 2048) != 2048)
+            break;
+        *size += 2048;
+    }
+    burn_src->free_data(burn_src);
+    free(burn_src);
+    return ret;
+}
+
+int test_import_image(struct test_mem_src *mem, IsoReadOpts *opts,
+                      IsoImage **image)
+{
+    int ret;
+    IsoDataSource *src;
+    IsoReadImageFeatures *features = NULL;
+
+    ret = iso_image_new("volume_id", image);
+    if (ret < 0)
+        return ret;
+    ret = test_mem_src_new(mem, &src);
+    if (ret < 0) {
+        iso_image_unref(*image);
+        *image = NULL;
+        return ret;
+    }
+    ret = iso_image_import(*image, src, opts, &features);
+    iso_data_source_unref(src);
+    if (features != NULL)
+        iso_read_image_features_destroy(features);
+    if (ret < 0) {
+        iso_image_unref(*image);
+        *image = NULL;
+    }
+    return ret;
+}
+
 static void create_test_suite()
 {
 	add_node_suite();
@@ -12,6 +115,9 @@ static void create_test_suite()
 
 int main(int argc, char **argv)
 {
+	if (iso_init() < 0)
+		return 1;
+
 	/* initialize the CUnit test registry */
 	if (CUE_SUCCESS != CU_initialize_registry())
 		return CU_get_error();
@@ -22,5 +128,6 @@ int main(int argc, char **argv)
 	CU_basic_set_mode(CU_BRM_VERBOSE);
 	CU_basic_run_tests();
 	CU_cleanup_registry();
+	iso_finish();
 	return CU_get_error();
 }
@@ -11,4 +11,22 @@ void add_util_suite();
 void add_rockridge_suite();
 void add_stream_suite();
 
+/* An IsoDataSource which reads from a memory buffer. Reading fails while
+   fail is not 0. */
+struct test_mem_src {
+    uint8_t *data;
+    size_t size;
+    int fail;
+};
+
+int test_mem_src_new(struct test_mem_src *mem, IsoDataSource **src);
+
+/* Write the image into a newly allocated buffer */
+int test_write_image(IsoImage *image, IsoWriteOpts *opts,
+                     uint8_t **data, size_t *size);
+
+/* Import the image from the buffer of mem */
+int test_import_image(struct test_mem_src *mem, IsoReadOpts *opts,
+                      IsoImage **image);
+
 #endif /*TEST_H_*/
@@ -9,10 +9,12 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
+#include <dirent.h>
 
  
 static void test_iso_image_new()
@@ -330,6 +332,505 @@ static void test_iso_image_get_biblio_file_id()
 	iso_image_unref(image);
 }
 
+
+/* Content of the files of test_make_tree() */
+static
+size_t test_file_content(int i, unsigned char **buf)
+{
+    size_t len, j;
+
+    len = 100 + (i * 37) % 5000;
+    *buf = malloc(len);
+    if (*buf == NULL)
+        return 0;
+    for (j = 0; j < len; j++)
+        (*buf)[j] = (i * 7 + j) & 0xff;
+    return len;
+}
+
+static
+void test_fix_times(IsoNode *node)
+{
+    iso_node_set_atime(node, 1000000);
+    iso_node_set_mtime(node, 1000000);
+    iso_node_set_ctime(node, 1000000);
+}
+
+static
+char *test_file_name(int i, char *name)
+{
+    /* Most of these names collide when mangled to 8.3 */
+    switch (i % 4) {
+    case 0: sprintf(name, "longfilename_%d.txt", i); break;
+    case 1: sprintf(name, "longfilename_%d.other_extension", i); break;
+    case 2: sprintf(name, "LONGFI%d.TXT", i / 4); break;
+    case 3: sprintf(name, "x%040d", i); break;
+    }
+    return name;
+}
+
+/* Directories d0, d1, d2 with n files each. Only d2 has a symlink. */
+static
+void test_make_tree(IsoDir *root, int n)
+{
+    int ret, i, k;
+    size_t len;
+    char name[80];
+    unsigned char *buf;
+    IsoDir *dir;
+    IsoFile *file;
+    IsoSymlink *link;
+    IsoStream *stream;
+
+    test_fix_times((IsoNode*)root);
+    for (k = 0; k < 3; k++) {
+        sprintf(name, "d%d", k);
+        ret = iso_tree_add_new_dir(root, name, &dir);
+        CU_ASSERT(ret > 0);
+        test_fix_times((IsoNode*)dir);
+        for (i = 0; i < n; i++) {
+            len = test_file_content(i + k * 1000, &buf);
+            ret = iso_memory_stream_new(buf, len, &stream);
+            CU_ASSERT_EQUAL(ret, 1);
+            ret = iso_tree_add_new_file(dir, test_file_name(i, name), stream,
+                                        &file);
+            CU_ASSERT(ret > 0);
+            test_fix_times((IsoNode*)file);
+        }
+    }
+    ret = iso_tree_add_new_symlink(dir, "link", "../d0", &link);
+    CU_ASSERT(ret > 0);
+    test_fix_times((IsoNode*)link);
+}
+
+static
+void test_set_write_opts(IsoWriteOpts **opts)
+{
+    int ret;
+
+    ret = iso_write_opts_new(opts, 1);
+    CU_ASSERT_EQUAL(ret, 1);
+    iso_write_opts_set_joliet(*opts, 1);
+    iso_write_opts_set_iso1999(*opts, 1);
+    iso_write_opts_set_hfsplus(*opts, 1);
+    iso_write_opts_set_pvd_times(*opts, 1000000, 1000000, 1000000, 1000000,
+                                 "2020010100000000");
+    iso_write_opts_set_hfsp_serial_number(*opts, (uint8_t *) "12345678");
+
+    /* RRIP 1.10 has no inode numbers. Those of directories depend on the
+       memory addresses of the nodes, so that two IsoImage objects of the
+       same process would not produce the same bytes. */
+    iso_write_opts_set_rrip_version_1_10(*opts, 1);
+}
+
+static
+void test_remove_tree(char *path)
+{
+    DIR *dir;
+    struct dirent *entry;
+    struct stat stbuf;
+    char sub[4096];
+
+    if (lstat(path, &stbuf) == -1)
+        return;
+    if (!S_ISDIR(stbuf.st_mode)) {
+        unlink(path);
+        return;
+    }
+    dir = opendir(path);
+    if (dir != NULL) {
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 ||
+                strcmp(entry->d_name, "..") == 0)
+                continue;
+            snprintf(sub, sizeof(sub), "%s/%s", path, entry->d_name);
+            test_remove_tree(sub);
+        }
+        closedir(dir);
+    }
+    rmdir(path);
+}
+
+static void test_iso_image_tree_threads()
+{
+    int ret, i;
+    IsoImage *image;
+    IsoWriteOpts *opts;
+    uint8_t *data[2];
+    size_t size[2];
+
+    /* The image must not depend on the number of threads */
+    for (i = 0; i < 2; i++) {
+        ret = iso_image_new("volume_id", &image);
+        CU_ASSERT_EQUAL(ret, 1);
+        test_make_tree(iso_image_get_root(image), 300);
+        test_set_write_opts(&opts);
+        iso_write_opts_set_tree_threads(opts, i * 4);
+        ret = test_write_image(image, opts, &data[i], &size[i]);
+        CU_ASSERT_EQUAL(ret, 1);
+        iso_write_opts_free(opts);
+        iso_image_unref(image);
+    }
+    CU_ASSERT(size[0] > 0);
+    CU_ASSERT_EQUAL(size[0], size[1]);
+    if (size[0] == size[1])
+        CU_ASSERT(memcmp(data[0], data[1], size[0]) == 0);
+
+    free(data[0]);
+    free(data[1]);
+}
+
+static void test_iso_image_mangled_names()
+{
+    int ret, i, j, count = 0;
+    IsoImage *image;
+    IsoWriteOpts *wopts;
+    IsoReadOpts *ropts;
+    IsoNode *node;
+    IsoDirIter *iter;
+    struct test_mem_src mem;
+    const char *names[100];
+
+    memset(&mem, 0, sizeof(mem));
+    ret = iso_image_new("volume_id", &image);
+    CU_ASSERT_EQUAL(ret, 1);
+    test_make_tree(iso_image_get_root(image), 100);
+
+    /* Plain ISO level 1 without Rock Ridge and Joliet */
+    ret = iso_write_opts_new(&wopts, 0);
+    CU_ASSERT_EQUAL(ret, 1);
+    iso_write_opts_set_iso_level(wopts, 1);
+    iso_write_opts_set_tree_threads(wopts, 4);
+    ret = test_write_image(image, wopts, &mem.data, &mem.size);
+    CU_ASSERT_EQUAL(ret, 1);
+    iso_write_opts_free(wopts);
+    iso_image_unref(image);
+
+    ret = iso_read_opts_new(&ropts, 0);
+    CU_ASSERT_EQUAL(ret, 1);
+    iso_read_opts_set_no_rockridge(ropts, 1);
+    iso_read_opts_set_no_joliet(ropts, 1);
+    iso_read_opts_set_no_iso1999(ropts, 1);
+    ret = test_import_image(&mem, ropts, &image);
+    CU_ASSERT_EQUAL(ret, 1);
+    iso_read_opts_free(ropts);
+    if (ret < 0)
+        goto ex;
+
+    ret = iso_tree_path_to_node(image, "/D0", &node);
+    CU_ASSERT_EQUAL(ret, 1);
+    if (ret != 1)
+        goto ex;
+    ret = iso_dir_get_children((IsoDir*)node, &iter);
+    CU_ASSERT_EQUAL(ret, 1);
+    while (iso_dir_iter_next(iter, &node) == 1 && count < 100) {
+        names[count] = iso_node_get_name(node);
+        CU_ASSERT(strlen(names[count]) <= 12);
+        for (j = 0; j < count; j++)
+            CU_ASSERT_STRING_NOT_EQUAL(names[j], names[count]);
+        count++;
+    }
+    iso_dir_iter_free(iter);
+    CU_ASSERT_EQUAL(count, 100);
+    for (i = 0; i < count; i++)
+        CU_ASSERT_PTR_NULL(strchr(names[i], ';'));
+
+ex:;
+    if (image != NULL)
+        iso_image_unref(image);
+    free(mem.data);
+}
+
+static void test_iso_image_clone_cow()
+{
+    int ret, i;
+    IsoImage *image[2];
+    IsoWriteOpts *opts;
+    IsoNode *node;
+    IsoDir *dir;
+    IsoFile *file;
+    IsoStream *stream;
+    unsigned char *buf;
+    uint8_t *data[2];
+    size_t len, size[2];
+
+    /* A copy-on-write clone has to produce the same image as a deep clone,
+       even if the original gets changed after cloning. */
+    for (i = 0; i < 2; i++) {
+        ret = iso_image_new("volume_id", &image[i]);
+        CU_ASSERT_EQUAL(ret, 1);
+        test_make_tree(iso_image_get_root(image[i]), 50);
+        ret = iso_tree_path_to_node(image[i], "/d2", &node);
+        CU_ASSERT_EQUAL(ret, 1);
+        ret = iso_tree_clone(node, iso_image_get_root(image[i]), "copy",
+                             &node, i * 4);
+        CU_ASSERT_EQUAL(ret, 1);
+
+        ret = iso_tree_path_to_node(image[i], "/d2", &node);
+        CU_ASSERT_EQUAL(ret, 1);
+        ret = iso_tree_add_new_dir((IsoDir*)node, "added", &dir);
+        CU_ASSERT(ret > 0);
+        test_fix_times((IsoNode*)dir);
+        len = test_file_content(4711, &buf);
+        ret = iso_memory_stream_new(buf, len, &stream);
+        CU_ASSERT_EQUAL(ret, 1);
+        ret = iso_tree_add_new_file(dir, "file", stream, &file);
+        CU_ASSERT(ret > 0);
+        test_fix_times((IsoNode*)file);
+        ret = iso_tree_path_to_node(image[i], "/d2/longfilename_4.txt", &node);
+        CU_ASSERT_EQUAL(ret, 1);
+        ret = iso_node_remove(node);
+        CU_ASSERT_EQUAL(ret, 1);
+        ret = iso_tree_path_to_node(image[i], "/d2/link", &node);
+        CU_ASSERT_EQUAL(ret, 1);
+        ret = iso_symlink_set_dest((IsoSymlink*)node, "../d1");
+        CU_ASSERT_EQUAL(ret, 1);
+
+        test_set_write_opts(&opts);
+        ret = test_write_image(image[i], opts, &data[i], &size[i]);
+        CU_ASSERT_EQUAL(ret, 1);
+        iso_write_opts_free(opts);
+    }
+    CU_ASSERT(size[0] > 0);
+    CU_ASSERT_EQUAL(size[0], size[1]);
+    if (size[0] == size[1])
+        CU_ASSERT(memcmp(data[0], data[1], size[0]) == 0);
+
+    for (i = 0; i < 2; i++) {
+        free(data[i]);
+        iso_image_unref(image[i]);
+    }
+}
+
+static void test_iso_image_clone_cow_msgs()
+{
+    int ret, code, imgid, found_src = 0, found_copy = 0;
+    IsoImage *image;
+    IsoWriteOpts *opts;
+    IsoNode *node;
+    uint8_t *data;
+    size_t size;
+    char text[4096], severity[80];
+
+    ret = iso_image_new("volume_id", &image);
+    CU_ASSERT_EQUAL(ret, 1);
+    test_make_tree(iso_image_get_root(image), 5);
+    ret = iso_tree_path_to_node(image, "/d2", &node);
+    CU_ASSERT_EQUAL(ret, 1);
+    ret = iso_tree_clone(node, iso_image_get_root(image), "copy", &node, 4);
+    CU_ASSERT_EQUAL(ret, 1);
+
+    /* Without Rock Ridge the symlinks get reported with their path in the
+       written tree, not with the path of the node in the original tree */
+    while (iso_obtain_msgs("ALL", &code, &imgid, text, severity) == 1);
+    iso_set_msgs_severities("WARNING", "FATAL", "libisofs: ");
+    ret = iso_write_opts_new(&opts, 0);
+    CU_ASSERT_EQUAL(ret, 1);
+    iso_write_opts_set_joliet(opts, 1);
+    ret = test_write_image(image, opts, &data, &size);
+    CU_ASSERT_EQUAL(ret, 1);
+    iso_write_opts_free(opts);
+    free(data);
+    while (iso_obtain_msgs("ALL", &code, &imgid, text, severity) == 1) {
+        if (strstr(text, "/d2/link") != NULL)
+            found_src++;
+        if (strstr(text, "/copy/link") != NULL)
+            found_copy++;
+    }
+    iso_set_msgs_severities("NEVER", "FATAL", "libisofs: ");
+    CU_ASSERT_EQUAL(found_src, 2);
+    CU_ASSERT_EQUAL(found_copy, 2);
+
+    iso_image_unref(image);
+}
+
+static void test_iso_image_index_damaged()
+{
+    int ret, i;
+    IsoImage *image;
+    IsoWriteOpts *wopts;
+    IsoReadOpts *ropts;
+    IsoNode *node;
+    FILE *fp;
+    long size = 0;
+    struct test_mem_src mem;
+    char tmpdir[80], path[120];
+
+    memset(&mem, 0, sizeof(mem));
+    strcpy(tmpdir, "/tmp/libisofs_test_XXXXXX");
+    CU_ASSERT_PTR_NOT_NULL(mkdtemp(tmpdir));
+    sprintf(path, "%s/image.idx", tmpdir);
+
+    ret = iso_image_new("volume_id", &image);
+    CU_ASSERT_EQUAL(ret, 1);
+    test_make_tree(iso_image_get_root(image), 20);
+    test_set_write_opts(&wopts);
+    ret = test_write_image(image, wopts, &mem.data, &mem.size);
+    CU_ASSERT_EQUAL(ret, 1);
+    iso_write_opts_free(wopts);
+    iso_image_unref(image);
+
+    ret = iso_read_opts_new(&ropts, 0);
+    CU_ASSERT_EQUAL(ret, 1);
+    ret = iso_read_opts_set_index_file(ropts, path, 0);
+    CU_ASSERT_EQUAL(ret, 1);
+
+    /* i == 0: create the index, 1: intact index, 2: one byte flipped,
+       3: truncated. A damaged index must be ignored, with the same tree as
+       result. */
+    for (i = 0; i < 4; i++) {
+        if (i == 2) {
+            fp = fopen(path, "r+b");
+            CU_ASSERT_PTR_NOT_NULL(fp);
+            fseek(fp, 0, SEEK_END);
+            size = ftell(fp);
+            fseek(fp, size / 2, SEEK_SET);
+            ret = fgetc(fp);
+            fseek(fp, size / 2, SEEK_SET);
+            fputc(ret ^ 1, fp);
+            fclose(fp);
+        } else if (i == 3) {
+            CU_ASSERT_EQUAL(truncate(path, size - 100), 0);
+        }
+        ret = test_import_image(&mem, ropts, &image);
+        CU_ASSERT_EQUAL(ret, 1);
+        if (ret < 0)
+            continue;
+        ret = iso_tree_path_to_node(image, "/d2/link", &node);
+        CU_ASSERT_EQUAL(ret, 1);
+        ret = iso_tree_path_to_node(image, "/d1/longfilename_16.txt", &node);
+        CU_ASSERT_EQUAL(ret, 1);
+
+        /* Returns 2 only if the import used the index */
+        ret = iso_image_save_index(image, path, 1);
+        CU_ASSERT_EQUAL(ret, i == 1 ? 2 : 1);
+        iso_image_unref(image);
+    }
+    iso_read_opts_free(ropts);
+
+    unlink(path);
+    rmdir(tmpdir);
+    free(mem.data);
+}
+
+struct test_verify_count {
+    int files;
+    int mismatch;
+    int session;
+};
+
+static int test_verify_result(IsoImage *image, IsoFile *file, int match,
+                              void *handle)
+{
+    struct test_verify_count *count = handle;
+
+    if (file == NULL) {
+        count->session = match;
+        return 1;
+    }
+    count->files++;
+    if (match != 1)
+        count->mismatch++;
+    return 1;
+}
+
+static void test_iso_image_extract_verify()
+{
+    int ret, i, k;
+    IsoImage *image;
+    IsoWriteOpts *wopts;
+    IsoReadOpts *ropts;
+    IsoNode *node;
+    FILE *fp;
+    uint32_t lba;
+    size_t len;
+    unsigned char *buf, *disk_buf;
+    struct test_mem_src mem;
+    struct test_verify_count count;
+    char tmpdir[80], path[200], name[80];
+
+    memset(&mem, 0, sizeof(mem));
+    strcpy(tmpdir, "/tmp/libisofs_test_XXXXXX");
+    CU_ASSERT_PTR_NOT_NULL(mkdtemp(tmpdir));
+
+    ret = iso_image_new("volume_id", &image);
+    CU_ASSERT_EQUAL(ret, 1);
+    test_make_tree(iso_image_get_root(image), 40);
+    test_set_write_opts(&wopts);
+    iso_write_opts_set_record_md5(wopts, 1, 1);
+    iso_write_opts_set_aaip(wopts, 1);
+    ret = test_write_image(image, wopts, &mem.data, &mem.size);
+    CU_ASSERT_EQUAL(ret, 1);
+    iso_write_opts_free(wopts);
+    iso_image_unref(image);
+
+    ret = iso_read_opts_new(&ropts, 0);
+    CU_ASSERT_EQUAL(ret, 1);
+    iso_read_opts_keep_import_src(ropts, 1);
+    /* The position of the MD5 array is recorded as xattr. The tags get
+       checked by iso_image_verify_files(), not by the import. */
+    iso_read_opts_set_no_aaip(ropts, 0);
+    iso_read_opts_set_no_md5(ropts, 2);
+    ret = test_import_image(&mem, ropts, &image);
+    CU_ASSERT_EQUAL(ret, 1);
+    if (ret < 0)
+        goto ex;
+
+    /* Extraction has to reproduce the content of all files */
+    sprintf(path, "%s/out", tmpdir);
+    ret = iso_image_extract_tree(image, "/", path, 4, 1);
+    CU_ASSERT_EQUAL(ret, 1);
+    for (k = 0; k < 3; k++) {
+        for (i = 0; i < 40; i++) {
+            sprintf(path, "%s/out/d%d/%s", tmpdir, k, test_file_name(i, name));
+            len = test_file_content(i + k * 1000, &buf);
+            disk_buf = calloc(1, len + 1);
+            fp = fopen(path, "rb");
+            CU_ASSERT_PTR_NOT_NULL(fp);
+            if (fp != NULL) {
+                CU_ASSERT_EQUAL(fread(disk_buf, 1, len + 1, fp), len);
+                fclose(fp);
+            }
+            CU_ASSERT(memcmp(buf, disk_buf, len) == 0);
+            free(buf);
+            free(disk_buf);
+        }
+    }
+
+    /* Verification of the intact image */
+    memset(&count, 0, sizeof(count));
+    ret = iso_image_verify_files(image, 4, test_verify_result, &count, 0);
+    CU_ASSERT_EQUAL(ret, 1);
+    CU_ASSERT_EQUAL(count.files, 120);
+    CU_ASSERT_EQUAL(count.mismatch, 0);
+    CU_ASSERT_EQUAL(count.session, 1);
+
+    /* Damage the content of one file */
+    ret = iso_tree_path_to_node(image, "/d1/longfilename_8.txt", &node);
+    CU_ASSERT_EQUAL(ret, 1);
+    ret = iso_file_get_old_image_lba((IsoFile*)node, &lba, 0);
+    CU_ASSERT_EQUAL(ret, 1);
+    iso_image_unref(image);
+    mem.data[(size_t) lba * 2048 + 10] ^= 1;
+    ret = test_import_image(&mem, ropts, &image);
+    CU_ASSERT_EQUAL(ret, 1);
+    if (ret < 0)
+        goto ex;
+    memset(&count, 0, sizeof(count));
+    ret = iso_image_verify_files(image, 4, test_verify_result, &count, 1);
+    CU_ASSERT_EQUAL(ret, 0);
+    CU_ASSERT_EQUAL(count.files, 120);
+    CU_ASSERT_EQUAL(count.mismatch, 1);
+    iso_image_unref(image);
+
+ex:;
+    iso_read_opts_free(ropts);
+    sprintf(path, "%s/out", tmpdir);
+    test_remove_tree(path);
+    rmdir(tmpdir);
+    free(mem.data);
+}
+
 void add_image_suite()
 {
 	CU_pSuite pSuite = CU_add_suite("imageSuite", NULL, NULL);
@@ -351,4 +852,10 @@ void add_image_suite()
 	CU_add_test(pSuite, "iso_image_get_abstract_file_id()", test_iso_image_get_abstract_file_id);
 	CU_add_test(pSuite, "iso_image_set_biblio_file_id()", test_iso_image_set_biblio_file_id);
 	CU_add_test(pSuite, "iso_image_get_biblio_file_id()", test_iso_image_get_biblio_file_id);
+	CU_add_test(pSuite, "iso_write_opts_set_tree_threads()", test_iso_image_tree_threads);
+	CU_add_test(pSuite, "mangled names [ISO level 1]", test_iso_image_mangled_names);
+	CU_add_test(pSuite, "iso_tree_clone() [copy-on-write image]", test_iso_image_clone_cow);
+	CU_add_test(pSuite, "iso_tree_clone() [copy-on-write messages]", test_iso_image_clone_cow_msgs);
+	CU_add_test(pSuite, "iso_read_opts_set_index_file() [damaged index]", test_iso_image_index_damaged);
+	CU_add_test(pSuite, "iso_image_extract_tree() and iso_image_verify_files()", test_iso_image_extract_verify);
 }
@@ -10,6 +10,7 @@
 #include "mocked_fsrc.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 static
 void test_iso_tree_add_new_dir()
@@ -552,6 +553,127 @@ void test_iso_tree_path_to_node()
     iso_image_unref(image);
 }
 
+static
+void test_iso_tree_clone_cow()
+{
+    int result;
+    IsoDir *root, *dir, *sub, *clone;
+    IsoNode *node;
+    IsoSymlink *link;
+    IsoImage *image;
+
+    result = iso_image_new("volume_id", &image);
+    CU_ASSERT_EQUAL(result, 1);
+    root = iso_image_get_root(image);
+    result = iso_tree_add_new_dir(root, "src", &dir);
+    CU_ASSERT_EQUAL(result, 1);
+    result = iso_tree_add_new_dir(dir, "sub", &sub);
+    CU_ASSERT_EQUAL(result, 1);
+    result = iso_tree_add_new_symlink(sub, "link", "/etc", &link);
+    CU_ASSERT_EQUAL(result, 1);
+
+    result = iso_tree_clone((IsoNode*)dir, root, "deep", &node, 0);
+    CU_ASSERT_EQUAL(result, 1);
+    result = iso_tree_clone((IsoNode*)dir, root, "cow", &node, 4);
+    CU_ASSERT_EQUAL(result, 1);
+    clone = (IsoDir*)node;
+
+    /* changes of the original must not be seen by the pending clone */
+    result = iso_tree_add_new_symlink(sub, "added", "/usr", NULL);
+    CU_ASSERT_EQUAL(result, 2);
+    result = iso_symlink_set_dest(link, "/var");
+    CU_ASSERT_EQUAL(result, 1);
+
+    result = iso_tree_path_to_node(image, "/deep/sub/added", &node);
+    CU_ASSERT_EQUAL(result, 0);
+    result = iso_tree_path_to_node(image, "/cow/sub/added", &node);
+    CU_ASSERT_EQUAL(result, 0);
+    result = iso_tree_path_to_node(image, "/deep/sub/link", &node);
+    CU_ASSERT_EQUAL(result, 1);
+    CU_ASSERT_STRING_EQUAL(iso_symlink_get_dest((IsoSymlink*)node), "/etc");
+    result = iso_tree_path_to_node(image, "/cow/sub/link", &node);
+    CU_ASSERT_EQUAL(result, 1);
+    CU_ASSERT_PTR_NOT_EQUAL(node, link);
+    CU_ASSERT_PTR_EQUAL(node->parent->node.parent, clone);
+    CU_ASSERT_STRING_EQUAL(iso_symlink_get_dest((IsoSymlink*)node), "/etc");
+
+    /* changes of the clone must not be seen by the original */
+    result = iso_tree_add_new_dir(clone, "extra", NULL);
+    CU_ASSERT_EQUAL(result, 2);
+    result = iso_tree_path_to_node(image, "/src/extra", &node);
+    CU_ASSERT_EQUAL(result, 0);
+    CU_ASSERT_EQUAL(iso_dir_get_children_count(dir), 1);
+    CU_ASSERT_EQUAL(iso_dir_get_children_count(sub), 2);
+
+    /* a clone of a clone gets the content of the first clone */
+    result = iso_tree_clone((IsoNode*)clone, root, "cow2", &node, 4);
+    CU_ASSERT_EQUAL(result, 1);
+    result = iso_tree_path_to_node(image, "/cow2/extra", &node);
+    CU_ASSERT_EQUAL(result, 1);
+    result = iso_tree_path_to_node(image, "/cow2/sub/link", &node);
+    CU_ASSERT_EQUAL(result, 1);
+    CU_ASSERT_STRING_EQUAL(iso_symlink_get_dest((IsoSymlink*)node), "/etc");
+
+    iso_image_unref(image);
+}
+
+static
+void test_iso_tree_lazy_load_failure()
+{
+    int result, result2;
+    IsoDir *root, *dir;
+    IsoNode *node;
+    IsoImage *image;
+    IsoWriteOpts *wopts;
+    IsoReadOpts *ropts;
+    IsoDirIter *iter;
+    struct test_mem_src mem;
+
+    memset(&mem, 0, sizeof(mem));
+    result = iso_image_new("volume_id", &image);
+    CU_ASSERT_EQUAL(result, 1);
+    root = iso_image_get_root(image);
+    result = iso_tree_add_new_dir(root, "dir", &dir);
+    CU_ASSERT_EQUAL(result, 1);
+    result = iso_tree_add_new_dir(dir, "sub", NULL);
+    CU_ASSERT_EQUAL(result, 1);
+    result = iso_tree_add_new_symlink(dir, "link", "/etc", NULL);
+    CU_ASSERT_EQUAL(result, 2);
+    result = iso_write_opts_new(&wopts, 1);
+    CU_ASSERT_EQUAL(result, 1);
+    result = test_write_image(image, wopts, &mem.data, &mem.size);
+    CU_ASSERT_EQUAL(result, 1);
+    iso_write_opts_free(wopts);
+    iso_image_unref(image);
+
+    result = iso_read_opts_new(&ropts, 0);
+    CU_ASSERT_EQUAL(result, 1);
+    result = iso_read_opts_set_lazy_tree(ropts, 1);
+    CU_ASSERT_EQUAL(result, 1);
+    result = test_import_image(&mem, ropts, &image);
+    CU_ASSERT_EQUAL(result, 1);
+    iso_read_opts_free(ropts);
+    result = iso_tree_path_to_node(image, "/dir", &node);
+    CU_ASSERT_EQUAL(result, 1);
+    dir = (IsoDir*)node;
+
+    /* the directory gets loaded on first access, which fails */
+    mem.fail = 1;
+    result = iso_dir_get_children(dir, &iter);
+    CU_ASSERT(result < 0);
+
+    /* the error stays, rather than an empty directory appearing */
+    mem.fail = 0;
+    result2 = iso_dir_get_children(dir, &iter);
+    CU_ASSERT_EQUAL(result2, result);
+    result2 = iso_tree_path_to_node(image, "/dir/link", &node);
+    CU_ASSERT(result2 < 0);
+    CU_ASSERT_EQUAL(iso_dir_get_children_count(dir), result);
+
+    iso_image_unref(image);
+    free(mem.data);
+}
+
 void add_tree_suite()
 {
 	CU_pSuite pSuite = CU_add_suite("Iso Tree Suite", NULL, NULL);
@@ -562,5 +684,7 @@ void add_tree_suite()
     CU_add_test(pSuite, "iso_tree_add_node() [1. dir]", test_iso_tree_add_node_dir);
     CU_add_test(pSuite, "iso_tree_add_node() [2. symlink]", test_iso_tree_add_node_link);
     CU_add_test(pSuite, "iso_tree_path_to_node()", test_iso_tree_path_to_node);
+    CU_add_test(pSuite, "iso_tree_clone() [copy-on-write]", test_iso_tree_clone_cow);
+    CU_add_test(pSuite, "iso_read_opts_set_lazy_tree() [read error]", test_iso_tree_lazy_load_failure);
     
 }
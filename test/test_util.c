@@ -5,6 +5,8 @@
  */
 #include "test.h"
 #include "util.h"
+#include "messages.h"
+#include "libiso_msgs.h"
 
 #include <string.h>
 #include <stdlib.h>
@@ -1049,6 +1051,48 @@ void test_iso_htable_put_get()
     iso_htable_destroy(table, NULL);
 }
 
+static void test_iso_msgs_shared_severities()
+{
+    int ret, code, imgid, severity, count;
+    char text[4096], sev_name[80];
+    struct libiso_msgs *msgs;
+
+    msgs = iso_get_messenger();
+    CU_ASSERT_PTR_NOT_NULL(msgs);
+    while (iso_obtain_msgs("ALL", &code, &imgid, text, sev_name) == 1);
+
+    /* Thresholds set directly at the messenger, as libburn does when it
+       shares the messenger, have to be obeyed by libisofs */
+    ret = libiso_msgs_set_severities(msgs, LIBISO_MSGS_SEV_DEBUG,
+                                     LIBISO_MSGS_SEV_NEVER, "libisofs: ", 0);
+    CU_ASSERT_EQUAL(ret, 1);
+    ret = libiso_msgs_get_min_severity(msgs, &severity, 0);
+    CU_ASSERT_EQUAL(ret, 1);
+    CU_ASSERT_EQUAL(severity, LIBISO_MSGS_SEV_DEBUG);
+    iso_msg_submit(0, ISO_FILE_IGNORED, 0, "test warning %d", 1);
+    iso_msg_debug(0, "test debug %d", 2);
+    count = 0;
+    while (iso_obtain_msgs("ALL", &code, &imgid, text, sev_name) == 1) {
+        if (count == 0)
+            CU_ASSERT_STRING_EQUAL(text, "test warning 1");
+        if (count == 1)
+            CU_ASSERT_STRING_EQUAL(text, "test debug 2");
+        count++;
+    }
+    CU_ASSERT_EQUAL(count, 2);
+
+    /* Messages below the thresholds get discarded */
+    ret = libiso_msgs_set_severities(msgs, LIBISO_MSGS_SEV_SORRY,
+                                     LIBISO_MSGS_SEV_NEVER, "libisofs: ", 0);
+    CU_ASSERT_EQUAL(ret, 1);
+    iso_msg_submit(0, ISO_FILE_IGNORED, 0, "test warning %d", 3);
+    iso_msg_debug(0, "test debug %d", 4);
+    ret = iso_obtain_msgs("ALL", &code, &imgid, text, sev_name);
+    CU_ASSERT_EQUAL(ret, 0);
+
+    iso_set_msgs_severities("NEVER", "FATAL", "libisofs: ");
+}
+
 void add_util_suite()
 {
     CU_pSuite pSuite = CU_add_suite("UtilSuite", NULL, NULL);
@@ -1069,4 +1113,5 @@ void add_util_suite()
     CU_add_test(pSuite, "iso_r_fileid()", test_iso_r_fileid);
     CU_add_test(pSuite, "iso_rbtree_insert()", test_iso_rbtree_insert);
     CU_add_test(pSuite, "iso_htable_put/get()", test_iso_htable_put_get);
+    CU_add_test(pSuite, "libiso_msgs_set_severities() [shared messenger]", test_iso_msgs_shared_severities);
 }